@@ -53,6 +53,12 @@ void aabb_extend(AABB* aabb, const Vector3<float>* p)
     aabb->bmax = cwise_max(&aabb->bmax, p);
 }
 
+void aabb_extend(AABB* aabb, const AABB* other)
+{
+    aabb->bmin = cwise_min(&aabb->bmin, &other->bmin);
+    aabb->bmax = cwise_max(&aabb->bmax, &other->bmax);
+}
+
 bool aabb_degenerate(const AABB& x)
 {
     return !cwise_less(x.bmin, x.bmax);
@@ -67,8 +73,9 @@ float aabb_volume(const AABB& x)
 //
 // Instanced AABBs
 //
-void construct_instanced_aabbs(
-    AABB256* aabbs, uint32_t n_aabbs256,
+template<typename AABBBlock>
+static void construct_instanced_aabb_blocks(
+    AABBBlock* aabbs, uint32_t n_blocks,
     const float* inputvertices,
     const uint32_t n_input_vertices,
     const uint32_t input_vertex_format_stride,
@@ -81,11 +88,11 @@ void construct_instanced_aabbs(
         input_vertex_format_stride
     );
 
-    for (int j = 0; j < n_aabbs256; ++j)
+    for (uint32_t j = 0; j < n_blocks; ++j)
     {
-        for (int k = 0; k < 8; ++k)
+        for (uint32_t k = 0; k < AABBBlock::width; ++k)
         {
-            int i = j * 8 + k;
+            uint32_t i = j * AABBBlock::width + k;
             const Vector3<float>* displacement =
                 (Vector3<float>*)((uint8_t*)instance_data + (i * instance_data_stride));
             aabbs[j].bmin_x[k] = os_aabb.bmin.x + displacement->x;
@@ -98,4 +105,34 @@ void construct_instanced_aabbs(
     }
 }
 
+void construct_instanced_aabbs(
+    AABB256* aabbs, uint32_t n_aabbs256,
+    const float* inputvertices,
+    const uint32_t n_input_vertices,
+    const uint32_t input_vertex_format_stride,
+    const float* instance_data,
+    const uint32_t instance_data_stride)
+{
+    construct_instanced_aabb_blocks(
+        aabbs, n_aabbs256,
+        inputvertices, n_input_vertices, input_vertex_format_stride,
+        instance_data, instance_data_stride
+    );
+}
+
+void construct_instanced_aabbs(
+    AABB512* aabbs, uint32_t n_aabbs512,
+    const float* inputvertices,
+    const uint32_t n_input_vertices,
+    const uint32_t input_vertex_format_stride,
+    const float* instance_data,
+    const uint32_t instance_data_stride)
+{
+    construct_instanced_aabb_blocks(
+        aabbs, n_aabbs512,
+        inputvertices, n_input_vertices, input_vertex_format_stride,
+        instance_data, instance_data_stride
+    );
+}
+
 }
\ No newline at end of file
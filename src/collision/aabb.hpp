@@ -27,6 +27,8 @@ Vector3<float> aabb_center(const AABB& aabb);
 
 void aabb_extend(AABB* aabb, const Vector3<float>* p);
 
+void aabb_extend(AABB* aabb, const AABB* other);
+
 bool aabb_empty(const AABB& x);
 
 bool aabb_degenerate(const AABB& x);
@@ -35,6 +37,8 @@ float aabb_volume(const AABB& x);
 
 struct alignas(32) AABB256
 {
+    static constexpr uint32_t width = 8;
+
     float bmin_x[8];
     float bmax_x[8];
     float bmin_y[8];
@@ -52,4 +56,27 @@ void construct_instanced_aabbs(
     const uint32_t instance_data_stride
 );
 
+// 16 boxes in SoA form, the block of the AVX-512 culling kernel. Also culled on
+// hosts without AVX-512, in steps of 8 or 4 boxes.
+struct alignas(64) AABB512
+{
+    static constexpr uint32_t width = 16;
+
+    float bmin_x[16];
+    float bmax_x[16];
+    float bmin_y[16];
+    float bmax_y[16];
+    float bmin_z[16];
+    float bmax_z[16];
+};
+
+void construct_instanced_aabbs(
+    AABB512* aabbs, uint32_t n_aabbs512,
+    const float* inputvertices,
+    const uint32_t n_input_vertices,
+    const uint32_t input_vertex_format_stride,
+    const float* instance_data,
+    const uint32_t instance_data_stride
+);
+
 }
\ No newline at end of file
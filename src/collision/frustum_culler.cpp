@@ -0,0 +1,296 @@
+#include "frustum_culler.hpp"
+#include <algorithm>
+#include <bit>
+
+#include "tbb/parallel_for.h"
+
+namespace moonlight
+{
+
+using simd::float4;
+using simd::float8;
+using simd::float16;
+using simd::int4;
+using simd::int8;
+using simd::int16;
+
+// Blocks of 16 boxes per parallel task, 4096 boxes
+constexpr uint32_t CULL_CHUNK_BLOCKS = 256;
+
+// Lanes of the block starting at box @first that hold one of the @n_aabbs boxes
+static uint32_t valid_lanes(uint32_t first, uint32_t n_aabbs)
+{
+    const uint32_t n = n_aabbs - first;
+    return n >= AABB512::width ? (1u << AABB512::width) - 1 : (1u << n) - 1;
+}
+
+template<typename F>
+ML_SIMD_INLINE uint32_t block_mask(
+    const FrustumSIMD* frustum,
+    const FrustumSIMD* abs_frustum,
+    const AABB512& block,
+    const float* d)
+{
+    uint32_t mask = 0;
+    for (uint32_t lane = 0; lane < AABB512::width; lane += F::width)
+    {
+        mask |= frustum_contains_aabb_lanes<F>(frustum, abs_frustum, block, d, lane) << lane;
+    }
+    return mask;
+}
+
+// Appends the ids of the boxes set in @mask, the block starting at box @first,
+// to @out, which holds @n_out ids and has room for @capacity. Full register
+// stores are used as long as their garbage lanes stay inside @capacity.
+template<typename I>
+ML_SIMD_INLINE uint32_t compact_block(
+    uint32_t mask,
+    uint32_t first,
+    uint32_t* out,
+    uint32_t n_out,
+    uint32_t capacity)
+{
+    for (uint32_t lane = 0; lane < AABB512::width; lane += I::width)
+    {
+        const uint32_t bits = (mask >> lane) & ((1u << I::width) - 1);
+        if (n_out + I::width <= capacity)
+        {
+            n_out += compress_store(&out[n_out], bits, I::ramp(first + lane));
+        }
+        else
+        {
+            for (uint32_t m = bits; m; m &= m - 1)
+            {
+                out[n_out++] = first + lane + std::countr_zero(m);
+            }
+        }
+    }
+    return n_out;
+}
+
+// Tests and compacts the blocks [first_block, last_block) in one go
+template<typename F, typename I>
+ML_SIMD_INLINE uint32_t cull_blocks(
+    const FrustumSIMD* frustum,
+    const FrustumSIMD* abs_frustum,
+    const AABB512* aabbs,
+    uint32_t first_block,
+    uint32_t last_block,
+    uint32_t n_aabbs,
+    const float* d,
+    uint32_t* out,
+    uint32_t capacity)
+{
+    uint32_t n_out = 0;
+    for (uint32_t b = first_block; b < last_block; ++b)
+    {
+        const uint32_t first = b * AABB512::width;
+        const uint32_t mask = block_mask<F>(frustum, abs_frustum, aabbs[b], d) & valid_lanes(first, n_aabbs);
+        if (mask)
+        {
+            n_out = compact_block<I>(mask, first, out, n_out, capacity);
+        }
+    }
+    return n_out;
+}
+
+// First parallel pass, stores the masks of the blocks and returns their
+// visible count
+template<typename F>
+ML_SIMD_INLINE uint32_t mask_blocks(
+    const FrustumSIMD* frustum,
+    const FrustumSIMD* abs_frustum,
+    const AABB512* aabbs,
+    uint32_t first_block,
+    uint32_t last_block,
+    uint32_t n_aabbs,
+    const float* d,
+    uint16_t* masks)
+{
+    uint32_t count = 0;
+    for (uint32_t b = first_block; b < last_block; ++b)
+    {
+        const uint32_t mask = block_mask<F>(frustum, abs_frustum, aabbs[b], d) & valid_lanes(b * AABB512::width, n_aabbs);
+        masks[b] = (uint16_t)mask;
+        count += std::popcount(mask);
+    }
+    return count;
+}
+
+// Second parallel pass, @out has room for exactly the ids of these blocks
+template<typename I>
+ML_SIMD_INLINE void compact_blocks(
+    const uint16_t* masks,
+    uint32_t first_block,
+    uint32_t last_block,
+    uint32_t* out,
+    uint32_t capacity)
+{
+    uint32_t n_out = 0;
+    for (uint32_t b = first_block; b < last_block; ++b)
+    {
+        if (masks[b])
+        {
+            n_out = compact_block<I>(masks[b], b * AABB512::width, out, n_out, capacity);
+        }
+    }
+}
+
+using CullBlocks = uint32_t(*)(
+    const FrustumSIMD*, const FrustumSIMD*, const AABB512*,
+    uint32_t, uint32_t, uint32_t, const float*, uint32_t*, uint32_t);
+using MaskBlocks = uint32_t(*)(
+    const FrustumSIMD*, const FrustumSIMD*, const AABB512*,
+    uint32_t, uint32_t, uint32_t, const float*, uint16_t*);
+using CompactBlocks = void(*)(const uint16_t*, uint32_t, uint32_t, uint32_t*, uint32_t);
+
+struct CullKernels
+{
+    CullBlocks cull;
+    MaskBlocks mask;
+    CompactBlocks compact;
+};
+
+static uint32_t cull_blocks_sse(
+    const FrustumSIMD* frustum, const FrustumSIMD* abs_frustum, const AABB512* aabbs,
+    uint32_t first_block, uint32_t last_block, uint32_t n_aabbs, const float* d,
+    uint32_t* out, uint32_t capacity)
+{
+    return cull_blocks<float4, int4>(frustum, abs_frustum, aabbs, first_block, last_block, n_aabbs, d, out, capacity);
+}
+
+static uint32_t mask_blocks_sse(
+    const FrustumSIMD* frustum, const FrustumSIMD* abs_frustum, const AABB512* aabbs,
+    uint32_t first_block, uint32_t last_block, uint32_t n_aabbs, const float* d,
+    uint16_t* masks)
+{
+    return mask_blocks<float4>(frustum, abs_frustum, aabbs, first_block, last_block, n_aabbs, d, masks);
+}
+
+static void compact_blocks_sse(
+    const uint16_t* masks, uint32_t first_block, uint32_t last_block,
+    uint32_t* out, uint32_t capacity)
+{
+    compact_blocks<int4>(masks, first_block, last_block, out, capacity);
+}
+
+ML_TARGET_AVX2 static uint32_t cull_blocks_avx2(
+    const FrustumSIMD* frustum, const FrustumSIMD* abs_frustum, const AABB512* aabbs,
+    uint32_t first_block, uint32_t last_block, uint32_t n_aabbs, const float* d,
+    uint32_t* out, uint32_t capacity)
+{
+    return cull_blocks<float8, int8>(frustum, abs_frustum, aabbs, first_block, last_block, n_aabbs, d, out, capacity);
+}
+
+ML_TARGET_AVX2 static uint32_t mask_blocks_avx2(
+    const FrustumSIMD* frustum, const FrustumSIMD* abs_frustum, const AABB512* aabbs,
+    uint32_t first_block, uint32_t last_block, uint32_t n_aabbs, const float* d,
+    uint16_t* masks)
+{
+    return mask_blocks<float8>(frustum, abs_frustum, aabbs, first_block, last_block, n_aabbs, d, masks);
+}
+
+ML_TARGET_AVX2 static void compact_blocks_avx2(
+    const uint16_t* masks, uint32_t first_block, uint32_t last_block,
+    uint32_t* out, uint32_t capacity)
+{
+    compact_blocks<int8>(masks, first_block, last_block, out, capacity);
+}
+
+ML_TARGET_AVX512 static uint32_t cull_blocks_avx512(
+    const FrustumSIMD* frustum, const FrustumSIMD* abs_frustum, const AABB512* aabbs,
+    uint32_t first_block, uint32_t last_block, uint32_t n_aabbs, const float* d,
+    uint32_t* out, uint32_t capacity)
+{
+    return cull_blocks<float16, int16>(frustum, abs_frustum, aabbs, first_block, last_block, n_aabbs, d, out, capacity);
+}
+
+ML_TARGET_AVX512 static uint32_t mask_blocks_avx512(
+    const FrustumSIMD* frustum, const FrustumSIMD* abs_frustum, const AABB512* aabbs,
+    uint32_t first_block, uint32_t last_block, uint32_t n_aabbs, const float* d,
+    uint16_t* masks)
+{
+    return mask_blocks<float16>(frustum, abs_frustum, aabbs, first_block, last_block, n_aabbs, d, masks);
+}
+
+ML_TARGET_AVX512 static void compact_blocks_avx512(
+    const uint16_t* masks, uint32_t first_block, uint32_t last_block,
+    uint32_t* out, uint32_t capacity)
+{
+    compact_blocks<int16>(masks, first_block, last_block, out, capacity);
+}
+
+static CullKernels select_cull_kernels()
+{
+    switch (simd_level())
+    {
+    case SimdLevel::AVX512:
+        return { cull_blocks_avx512, mask_blocks_avx512, compact_blocks_avx512 };
+    case SimdLevel::AVX2:
+        return { cull_blocks_avx2, mask_blocks_avx2, compact_blocks_avx2 };
+    default:
+        return { cull_blocks_sse, mask_blocks_sse, compact_blocks_sse };
+    }
+}
+
+static const CullKernels& cull_kernels()
+{
+    static const CullKernels kernels = select_cull_kernels();
+    return kernels;
+}
+
+uint32_t frustum_cull_aabbs(
+    const FrustumSIMD* frustum,
+    const FrustumSIMD* abs_frustum,
+    const AABB512* aabbs,
+    uint32_t n_aabbs,
+    const float* d,
+    uint32_t* visible_ids)
+{
+    const uint32_t n_blocks = (n_aabbs + AABB512::width - 1) / AABB512::width;
+    return cull_kernels().cull(frustum, abs_frustum, aabbs, 0, n_blocks, n_aabbs, d, visible_ids, n_aabbs);
+}
+
+uint32_t FrustumCuller::cull(
+    const FrustumSIMD* frustum,
+    const FrustumSIMD* abs_frustum,
+    const AABB512* aabbs,
+    uint32_t n_aabbs,
+    const float* d,
+    uint32_t* visible_ids)
+{
+    const CullKernels& kernels = cull_kernels();
+
+    const uint32_t n_blocks = (n_aabbs + AABB512::width - 1) / AABB512::width;
+    const uint32_t n_chunks = (n_blocks + CULL_CHUNK_BLOCKS - 1) / CULL_CHUNK_BLOCKS;
+    m_masks.resize(n_blocks);
+    m_chunk_offsets.resize(n_chunks + 1);
+
+    tbb::parallel_for(0u, n_chunks, [&](uint32_t chunk)
+    {
+        const uint32_t first_block = chunk * CULL_CHUNK_BLOCKS;
+        const uint32_t last_block = std::min(n_blocks, first_block + CULL_CHUNK_BLOCKS);
+        m_chunk_offsets[chunk + 1] = kernels.mask(
+            frustum, abs_frustum, aabbs, first_block, last_block, n_aabbs, d, m_masks.data());
+    });
+
+    m_chunk_offsets[0] = 0;
+    for (uint32_t chunk = 0; chunk < n_chunks; ++chunk)
+    {
+        m_chunk_offsets[chunk + 1] += m_chunk_offsets[chunk];
+    }
+
+    tbb::parallel_for(0u, n_chunks, [&](uint32_t chunk)
+    {
+        const uint32_t first_block = chunk * CULL_CHUNK_BLOCKS;
+        const uint32_t last_block = std::min(n_blocks, first_block + CULL_CHUNK_BLOCKS);
+        const uint32_t offset = m_chunk_offsets[chunk];
+        kernels.compact(
+            m_masks.data(), first_block, last_block,
+            &visible_ids[offset], m_chunk_offsets[chunk + 1] - offset);
+    });
+
+    return m_chunk_offsets[n_chunks];
+}
+
+}
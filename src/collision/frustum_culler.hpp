@@ -0,0 +1,51 @@
+#pragma once
+#include "primitive_tests.hpp"
+#include <vector>
+
+namespace moonlight
+{
+
+// Tests the first @n_aabbs boxes of @aabbs against @frustum and writes the
+// indices of those inside to @visible_ids, in ascending order. Returns their
+// count. @d holds the plane distances, 8 copies each, see
+// frustum_contains_aabb_avx2.
+// Runs on the calling thread with the widest kernel the host supports. The
+// visible indices are compacted with lookup table shuffles, on AVX-512 with
+// compress stores.
+uint32_t frustum_cull_aabbs(
+    const FrustumSIMD* frustum,
+    const FrustumSIMD* abs_frustum,
+    const AABB512* aabbs,
+    uint32_t n_aabbs,
+    const float* d,
+    uint32_t* visible_ids
+);
+
+// Culls boxes in parallel, with the same result as frustum_cull_aabbs.
+// The blocks are split into chunks. A first pass tests each chunk and counts
+// its visible boxes, an exclusive scan over the counts gives every chunk its
+// place in the output, and a second pass compacts the chunks into it. The ids
+// therefore come out in ascending order no matter how the chunks were
+// scheduled.
+// Keeps the per block masks between the passes, reuse one culler across frames
+// to avoid reallocating them.
+class FrustumCuller
+{
+public:
+
+    uint32_t cull(
+        const FrustumSIMD* frustum,
+        const FrustumSIMD* abs_frustum,
+        const AABB512* aabbs,
+        uint32_t n_aabbs,
+        const float* d,
+        uint32_t* visible_ids
+    );
+
+private:
+
+    std::vector<uint16_t> m_masks;
+    std::vector<uint32_t> m_chunk_offsets;
+};
+
+}
@@ -0,0 +1,234 @@
+#include "hierarchical_culler.hpp"
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <numeric>
+
+namespace moonlight
+{
+
+constexpr uint32_t HCULL_LEAF_SIZE = 8;
+constexpr uint32_t HCULL_ALL_PLANES = 0x3F;
+// Returned by classify for boxes outside one of the planes
+constexpr uint32_t HCULL_OUTSIDE = ~0u;
+// Median splits keep the depth at log2 of the leaf count
+constexpr uint32_t HCULL_STACK_SIZE = 64;
+
+using vec3f = Vector3<float>;
+
+struct CullPlane
+{
+    vec3f normal;
+    vec3f abs_normal;
+    float d;
+};
+
+// Tests the box against the planes in @mask, starting with @last_plane.
+// Returns the planes the box straddles, or HCULL_OUTSIDE, in which case
+// @last_plane is set to the rejecting plane.
+static uint32_t classify(
+    const vec3f& bmin,
+    const vec3f& bmax,
+    const CullPlane* planes,
+    uint32_t mask,
+    uint8_t& last_plane)
+{
+    const vec3f c = (bmax + bmin) * 0.5f;
+    const vec3f e = bmax - c;
+
+    uint32_t straddled = mask;
+    auto outside = [&](uint32_t i)
+    {
+        // Modified version of OBB/Plane test from "Real-time Collision Detection", Christer Ericson
+        const float s = dot(planes[i].normal, c) - planes[i].d;
+        const float r = dot(planes[i].abs_normal, e);
+        if (s > r)
+        {
+            last_plane = (uint8_t)i;
+            return true;
+        }
+        if (s < -r)
+        {
+            straddled &= ~(1u << i);
+        }
+        return false;
+    };
+
+    uint32_t to_test = mask;
+    if (to_test & (1u << last_plane))
+    {
+        if (outside(last_plane))
+        {
+            return HCULL_OUTSIDE;
+        }
+        to_test &= ~(1u << last_plane);
+    }
+
+    for (; to_test; to_test &= to_test - 1)
+    {
+        if (outside(std::countr_zero(to_test)))
+        {
+            return HCULL_OUTSIDE;
+        }
+    }
+
+    return straddled;
+}
+
+void HierarchicalFrustumCuller::build(const AABB* instance_bounds, uint32_t n_instances)
+{
+    m_nodes.clear();
+    m_instance_idx.resize(n_instances);
+    std::iota(m_instance_idx.begin(), m_instance_idx.end(), 0u);
+    m_num_tested_boxes = 0;
+
+    if (n_instances > 0)
+    {
+        std::vector<vec3f> centers(n_instances);
+        for (uint32_t i = 0; i < n_instances; ++i)
+        {
+            centers[i] = aabb_center(instance_bounds[i]);
+        }
+
+        InstanceCullNode root = {};
+        root.first = 0;
+        root.count = n_instances;
+        m_nodes.push_back(root);
+        sub_divide(0, instance_bounds, centers.data());
+    }
+
+    m_instance_bounds.resize(n_instances);
+    for (uint32_t i = 0; i < n_instances; ++i)
+    {
+        m_instance_bounds[i] = instance_bounds[m_instance_idx[i]];
+    }
+
+    m_node_last_plane.assign(m_nodes.size(), 0);
+    m_instance_last_plane.assign(n_instances, 0);
+}
+
+void HierarchicalFrustumCuller::sub_divide(
+    uint32_t node_idx,
+    const AABB* instance_bounds,
+    const vec3f* centers)
+{
+    const uint32_t first = m_nodes[node_idx].first;
+    const uint32_t count = m_nodes[node_idx].count;
+
+    AABB bounds;
+    AABB centroid_bounds;
+    for (uint32_t i = first; i < first + count; ++i)
+    {
+        aabb_extend(&bounds, &instance_bounds[m_instance_idx[i]]);
+        aabb_extend(&centroid_bounds, &centers[m_instance_idx[i]]);
+    }
+    m_nodes[node_idx].bmin = bounds.bmin;
+    m_nodes[node_idx].bmax = bounds.bmax;
+
+    if (count <= HCULL_LEAF_SIZE)
+    {
+        return;
+    }
+
+    // Median split along the axis with the largest spread of centers. The
+    // balanced tree bounds the depth, and the culler gains little from SAH.
+    const vec3f extent = centroid_bounds.bmax - centroid_bounds.bmin;
+    int axis = 0;
+    if (extent.y > extent[axis]) axis = 1;
+    if (extent.z > extent[axis]) axis = 2;
+
+    const uint32_t mid = first + count / 2;
+    std::nth_element(
+        m_instance_idx.begin() + first,
+        m_instance_idx.begin() + mid,
+        m_instance_idx.begin() + first + count,
+        [&](uint32_t a, uint32_t b) { return centers[a][axis] < centers[b][axis]; }
+    );
+
+    const uint32_t left_idx = m_nodes.size();
+    InstanceCullNode left = {};
+    left.first = first;
+    left.count = mid - first;
+    InstanceCullNode right = {};
+    right.first = mid;
+    right.count = first + count - mid;
+    m_nodes.push_back(left);
+    m_nodes.push_back(right);
+    m_nodes[node_idx].left = left_idx;
+
+    sub_divide(left_idx, instance_bounds, centers);
+    sub_divide(left_idx + 1, instance_bounds, centers);
+}
+
+uint32_t HierarchicalFrustumCuller::cull(const Frustum& frustum, uint32_t* visible_ids)
+{
+    m_num_tested_boxes = 0;
+    if (m_nodes.empty())
+    {
+        return 0;
+    }
+
+    CullPlane planes[6];
+    const Plane* frustum_planes = (const Plane*)&frustum;
+    for (int i = 0; i < 6; ++i)
+    {
+        const vec3f& n = frustum_planes[i].normal;
+        planes[i].normal = n;
+        planes[i].abs_normal = vec3f(std::abs(n.x), std::abs(n.y), std::abs(n.z));
+        planes[i].d = dot(n, frustum_planes[i].point);
+    }
+
+    struct StackEntry
+    {
+        uint32_t node_idx;
+        uint32_t mask;
+    };
+
+    StackEntry stack[HCULL_STACK_SIZE];
+    uint32_t stack_size = 0;
+    stack[stack_size++] = { 0, HCULL_ALL_PLANES };
+
+    uint32_t n_visible = 0;
+    uint32_t n_tested = 0;
+    while (stack_size > 0)
+    {
+        const StackEntry entry = stack[--stack_size];
+        const InstanceCullNode& node = m_nodes[entry.node_idx];
+
+        ++n_tested;
+        const uint32_t mask = classify(node.bmin, node.bmax, planes, entry.mask, m_node_last_plane[entry.node_idx]);
+        if (mask == HCULL_OUTSIDE)
+        {
+            continue;
+        }
+
+        if (mask == 0)
+        {
+            std::memcpy(&visible_ids[n_visible], &m_instance_idx[node.first], node.count * sizeof(uint32_t));
+            n_visible += node.count;
+            continue;
+        }
+
+        if (node.left == 0)
+        {
+            for (uint32_t i = node.first; i < node.first + node.count; ++i)
+            {
+                ++n_tested;
+                const AABB& bounds = m_instance_bounds[i];
+                if (classify(bounds.bmin, bounds.bmax, planes, mask, m_instance_last_plane[i]) != HCULL_OUTSIDE)
+                {
+                    visible_ids[n_visible++] = m_instance_idx[i];
+                }
+            }
+            continue;
+        }
+
+        stack[stack_size++] = { node.left + 1, mask };
+        stack[stack_size++] = { node.left, mask };
+    }
+
+    m_num_tested_boxes = n_tested;
+    return n_visible;
+}
+
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include "aabb.hpp"
+#include "frustum.hpp"
+#include <vector>
+
+namespace moonlight
+{
+
+// A node of the instance hierarchy. The instances of every subtree, not only
+// of the leaves, are a contiguous range of the culler's index array.
+struct InstanceCullNode
+{
+    Vector3<float> bmin;
+    uint32_t first;
+    Vector3<float> bmax;
+    uint32_t count;
+    // Index of the left child, the right one follows it. Zero for leaves, the
+    // root is the only node at index 0.
+    uint32_t left;
+};
+
+// Frustum culling over a BVH of instance bounds, after Assarsson and Moller,
+// "Optimized View Frustum Culling Algorithms for Bounding Boxes", 2000.
+// - Subtrees outside a plane are rejected, subtrees inside all planes are
+//   accepted as a whole by copying their index range.
+// - Every node passes the planes it straddles on to its children, which only
+//   test those.
+// - Every node and instance remembers the plane that rejected it last and
+//   tests it first, with a slowly moving camera it usually rejects again.
+// Boxes are only tested where the frustum boundary passes, so the cost follows
+// the visible set and the boundary rather than the instance count.
+// Instances are assumed static, build once and cull every frame.
+class HierarchicalFrustumCuller
+{
+public:
+
+    void build(const AABB* instance_bounds, uint32_t n_instances);
+
+    // Writes the indices of the instances inside @frustum to @visible_ids,
+    // which needs room for all of them, and returns their count. The order
+    // follows the hierarchy and is the same for the same frustum.
+    uint32_t cull(const Frustum& frustum, uint32_t* visible_ids);
+
+    // Nodes and instances tested by the last cull
+    uint32_t get_num_tested_boxes() const
+    {
+        return m_num_tested_boxes;
+    }
+
+    std::size_t get_num_nodes() const
+    {
+        return m_nodes.size();
+    }
+
+private:
+
+    void sub_divide(
+        uint32_t node_idx,
+        const AABB* instance_bounds,
+        const Vector3<float>* centers
+    );
+
+private:
+
+    std::vector<InstanceCullNode> m_nodes;
+    std::vector<uint32_t> m_instance_idx;
+    // Instance bounds in the order of m_instance_idx
+    std::vector<AABB> m_instance_bounds;
+
+    // Index of the plane that last rejected a node or an instance
+    std::vector<uint8_t> m_node_last_plane;
+    std::vector<uint8_t> m_instance_last_plane;
+
+    uint32_t m_num_tested_boxes = 0;
+};
+
+}
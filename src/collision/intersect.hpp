@@ -23,6 +23,8 @@ struct IntersectionParams
     float t = std::numeric_limits<float>::max();
     float u, v;
     uint32_t triangle_idx = 0;
+    // Instance that was hit when tracing a TLAS, zero otherwise
+    uint32_t instance_idx = 0;
     Vector3<float> normal;
     Vector3<float> point;
 };
@@ -0,0 +1,428 @@
+#include "light_clusters.hpp"
+#include "../utility/cpu_features.hpp"
+#include "../utility/simd.hpp"
+#include <algorithm>
+#include <cstring>
+
+#include "tbb/parallel_for.h"
+
+namespace moonlight
+{
+
+using simd::float4;
+using simd::float8;
+using simd::float16;
+using simd::int4;
+using simd::int8;
+using simd::int16;
+
+// Light arrays are padded to the widest register, padding lanes never touch
+constexpr uint32_t LIGHT_LANES = 16;
+constexpr float LIGHT_PADDING_RADIUS2 = -1.f;
+
+using vec3f = Vector3<float>;
+
+static uint32_t pad_lanes(uint32_t n)
+{
+    return (n + LIGHT_LANES - 1) / LIGHT_LANES * LIGHT_LANES;
+}
+
+// View space lights, SoA
+struct LightLanes
+{
+    const float* x;
+    const float* y;
+    const float* z;
+    const float* radius2;
+    const uint32_t* ids;
+};
+
+// Lanes of the lights [first, first + F::width) whose spheres touch @bounds,
+// Arvo's squared distance from the sphere center to the box
+template<typename F>
+ML_SIMD_INLINE uint32_t touching_lanes(const LightLanes& lights, uint32_t first, const AABB& bounds)
+{
+    const F x = F::loadu(&lights.x[first]);
+    const F y = F::loadu(&lights.y[first]);
+    const F z = F::loadu(&lights.z[first]);
+    const F zero = F::zero();
+
+    const F dx = max(max(F::set1(bounds.bmin.x) - x, x - F::set1(bounds.bmax.x)), zero);
+    const F dy = max(max(F::set1(bounds.bmin.y) - y, y - F::set1(bounds.bmax.y)), zero);
+    const F dz = max(max(F::set1(bounds.bmin.z) - z, z - F::set1(bounds.bmax.z)), zero);
+    const F distance2 = fmadd(dx, dx, fmadd(dy, dy, dz * dz));
+    return (distance2 <= F::loadu(&lights.radius2[first])).bits();
+}
+
+// Writes the positions of the first @n_lights of @lights touching @bounds to
+// @positions, which has room for @n_lights + LIGHT_LANES, and returns their count
+template<typename F, typename I>
+ML_SIMD_INLINE uint32_t filter_lights(
+    const LightLanes& lights,
+    uint32_t n_lights,
+    const AABB& bounds,
+    uint32_t* positions)
+{
+    uint32_t n_out = 0;
+    for (uint32_t i = 0; i < n_lights; i += F::width)
+    {
+        const uint32_t bits = touching_lanes<F>(lights, i, bounds);
+        if (bits)
+        {
+            n_out += compress_store(&positions[n_out], bits, I::ramp(i));
+        }
+    }
+    return n_out;
+}
+
+// Writes the ids of the lights touching each of the @n_clusters boxes to @out,
+// cluster after cluster, and their counts to @ranges. @out has room for
+// @n_clusters * @n_lights + LIGHT_LANES ids.
+template<typename F, typename I>
+ML_SIMD_INLINE uint32_t bin_clusters(
+    const LightLanes& lights,
+    uint32_t n_lights,
+    const AABB* cluster_bounds,
+    uint32_t n_clusters,
+    LightClusterRange* ranges,
+    uint32_t* out)
+{
+    uint32_t n_out = 0;
+    for (uint32_t c = 0; c < n_clusters; ++c)
+    {
+        const uint32_t first = n_out;
+        for (uint32_t i = 0; i < n_lights; i += F::width)
+        {
+            const uint32_t bits = touching_lanes<F>(lights, i, cluster_bounds[c]);
+            if (bits)
+            {
+                n_out += compress_store(&out[n_out], bits, I::loadu(&lights.ids[i]));
+            }
+        }
+        ranges[c].count = n_out - first;
+    }
+    return n_out;
+}
+
+using FilterLights = uint32_t(*)(const LightLanes&, uint32_t, const AABB&, uint32_t*);
+using BinClusters = uint32_t(*)(const LightLanes&, uint32_t, const AABB*, uint32_t, LightClusterRange*, uint32_t*);
+
+struct ClusterKernels
+{
+    FilterLights filter;
+    BinClusters bin;
+};
+
+static uint32_t filter_lights_sse(const LightLanes& lights, uint32_t n_lights, const AABB& bounds, uint32_t* positions)
+{
+    return filter_lights<float4, int4>(lights, n_lights, bounds, positions);
+}
+
+static uint32_t bin_clusters_sse(
+    const LightLanes& lights, uint32_t n_lights, const AABB* cluster_bounds, uint32_t n_clusters,
+    LightClusterRange* ranges, uint32_t* out)
+{
+    return bin_clusters<float4, int4>(lights, n_lights, cluster_bounds, n_clusters, ranges, out);
+}
+
+ML_TARGET_AVX2 static uint32_t filter_lights_avx2(const LightLanes& lights, uint32_t n_lights, const AABB& bounds, uint32_t* positions)
+{
+    return filter_lights<float8, int8>(lights, n_lights, bounds, positions);
+}
+
+ML_TARGET_AVX2 static uint32_t bin_clusters_avx2(
+    const LightLanes& lights, uint32_t n_lights, const AABB* cluster_bounds, uint32_t n_clusters,
+    LightClusterRange* ranges, uint32_t* out)
+{
+    return bin_clusters<float8, int8>(lights, n_lights, cluster_bounds, n_clusters, ranges, out);
+}
+
+ML_TARGET_AVX512 static uint32_t filter_lights_avx512(const LightLanes& lights, uint32_t n_lights, const AABB& bounds, uint32_t* positions)
+{
+    return filter_lights<float16, int16>(lights, n_lights, bounds, positions);
+}
+
+ML_TARGET_AVX512 static uint32_t bin_clusters_avx512(
+    const LightLanes& lights, uint32_t n_lights, const AABB* cluster_bounds, uint32_t n_clusters,
+    LightClusterRange* ranges, uint32_t* out)
+{
+    return bin_clusters<float16, int16>(lights, n_lights, cluster_bounds, n_clusters, ranges, out);
+}
+
+static ClusterKernels select_cluster_kernels()
+{
+    switch (simd_level())
+    {
+    case SimdLevel::AVX512:
+        return { filter_lights_avx512, bin_clusters_avx512 };
+    case SimdLevel::AVX2:
+        return { filter_lights_avx2, bin_clusters_avx2 };
+    default:
+        return { filter_lights_sse, bin_clusters_sse };
+    }
+}
+
+// The lights of a row, gathered from its slice. One per thread, reused by
+// every row the thread processes.
+struct RowLights
+{
+    std::vector<uint32_t> positions;
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> z;
+    std::vector<float> radius2;
+    std::vector<uint32_t> ids;
+};
+
+static vec3f to_view(const float m[4][4], const vec3f& p)
+{
+    return vec3f(
+        p.x * m[0][0] + p.y * m[1][0] + p.z * m[2][0] + m[3][0],
+        p.x * m[0][1] + p.y * m[1][1] + p.z * m[2][1] + m[3][1],
+        p.x * m[0][2] + p.y * m[1][2] + p.z * m[2][2] + m[3][2]
+    );
+}
+
+LightClusterGrid::LightClusterGrid(uint32_t n_x, uint32_t n_y, uint32_t n_z)
+    : m_n_x(n_x)
+    , m_n_y(n_y)
+    , m_n_z(n_z)
+{
+    m_cluster_bounds.resize(n_x * n_y * n_z);
+    m_row_bounds.resize(n_y * n_z);
+    m_rows.resize(n_y * n_z);
+    m_row_offsets.resize(n_y * n_z + 1, 0);
+    m_cluster_ranges.resize(n_x * n_y * n_z, { 0, 0 });
+    m_slice_offsets.resize(n_z + 1, 0);
+    std::memset(m_view, 0, sizeof(m_view));
+}
+
+void LightClusterGrid::set_projection(float vfov, float aspect_ratio, float near_distance, float far_distance)
+{
+    m_near = near_distance;
+    m_far = far_distance;
+    m_tan_half_vfov = std::tan(vfov * 0.5f);
+    m_aspect_ratio = aspect_ratio;
+    m_slice_scale = m_n_z / std::log(far_distance / near_distance);
+
+    const float scale_x = m_tan_half_vfov * aspect_ratio;
+    const float scale_y = m_tan_half_vfov;
+
+    for (uint32_t z = 0; z < m_n_z; ++z)
+    {
+        const float slice_near = near_distance * std::pow(far_distance / near_distance, (float)z / m_n_z);
+        const float slice_far = near_distance * std::pow(far_distance / near_distance, (float)(z + 1) / m_n_z);
+
+        for (uint32_t y = 0; y < m_n_y; ++y)
+        {
+            // Tiles count from the top of the screen, NDC y from the bottom
+            const float ndc_y0 = 1.f - 2.f * (y + 1) / m_n_y;
+            const float ndc_y1 = 1.f - 2.f * y / m_n_y;
+
+            AABB& row = m_row_bounds[z * m_n_y + y];
+            row = AABB();
+            for (uint32_t x = 0; x < m_n_x; ++x)
+            {
+                const float ndc_x0 = -1.f + 2.f * x / m_n_x;
+                const float ndc_x1 = -1.f + 2.f * (x + 1) / m_n_x;
+
+                // Both the near and the far face bound the froxel sideways,
+                // whichever is wider depends on the side of the view axis
+                AABB& cluster = m_cluster_bounds[(z * m_n_y + y) * m_n_x + x];
+                cluster.bmin = vec3f(
+                    std::min(ndc_x0 * slice_near, ndc_x0 * slice_far) * scale_x,
+                    std::min(ndc_y0 * slice_near, ndc_y0 * slice_far) * scale_y,
+                    slice_near
+                );
+                cluster.bmax = vec3f(
+                    std::max(ndc_x1 * slice_near, ndc_x1 * slice_far) * scale_x,
+                    std::max(ndc_y1 * slice_near, ndc_y1 * slice_far) * scale_y,
+                    slice_far
+                );
+                aabb_extend(&row, &cluster);
+            }
+        }
+    }
+}
+
+uint32_t LightClusterGrid::slice_of(float view_z) const
+{
+    if (view_z <= m_near)
+    {
+        return 0;
+    }
+    const uint32_t slice = (uint32_t)(std::log(view_z / m_near) * m_slice_scale);
+    return std::min(slice, m_n_z - 1);
+}
+
+void LightClusterGrid::assign(const float* view, const LightBounds* lights, uint32_t n_lights)
+{
+    static const ClusterKernels kernels = select_cluster_kernels();
+
+    for (int i = 0; i < 4; ++i)
+    {
+        for (int j = 0; j < 4; ++j)
+        {
+            m_view[i][j] = view[i * 4 + j];
+        }
+    }
+
+    // Bin the lights into the slices they span, a counting sort
+    m_view_lights.resize(n_lights);
+    std::vector<uint32_t> slice_counts(m_n_z, 0);
+    for (uint32_t i = 0; i < n_lights; ++i)
+    {
+        const vec3f p = to_view(m_view, lights[i].center);
+        const float r = lights[i].radius;
+
+        ViewLight& light = m_view_lights[i];
+        light = { p.x, p.y, p.z, r * r, 1, 0 };
+        if (p.z + r < m_near || p.z - r > m_far)
+        {
+            continue;
+        }
+        light.first_slice = slice_of(p.z - r);
+        light.last_slice = slice_of(p.z + r);
+        for (uint32_t z = light.first_slice; z <= light.last_slice; ++z)
+        {
+            ++slice_counts[z];
+        }
+    }
+
+    m_slice_offsets[0] = 0;
+    for (uint32_t z = 0; z < m_n_z; ++z)
+    {
+        m_slice_offsets[z + 1] = m_slice_offsets[z] + pad_lanes(slice_counts[z]);
+    }
+
+    const uint32_t n_slice_lights = m_slice_offsets[m_n_z];
+    m_light_x.assign(n_slice_lights, 0.f);
+    m_light_y.assign(n_slice_lights, 0.f);
+    m_light_z.assign(n_slice_lights, 0.f);
+    m_light_radius2.assign(n_slice_lights, LIGHT_PADDING_RADIUS2);
+    m_light_ids.assign(n_slice_lights, 0);
+
+    std::copy(m_slice_offsets.begin(), m_slice_offsets.end() - 1, slice_counts.begin());
+    for (uint32_t i = 0; i < n_lights; ++i)
+    {
+        const ViewLight& light = m_view_lights[i];
+        for (uint32_t z = light.first_slice; z <= light.last_slice; ++z)
+        {
+            const uint32_t k = slice_counts[z]++;
+            m_light_x[k] = light.x;
+            m_light_y[k] = light.y;
+            m_light_z[k] = light.z;
+            m_light_radius2[k] = light.radius2;
+            m_light_ids[k] = i;
+        }
+    }
+
+    // Every row of every slice filters the lights of its slice, then bins them
+    // into its clusters
+    tbb::parallel_for(0u, m_n_z * m_n_y, [&](uint32_t row_idx)
+    {
+        thread_local RowLights row_lights;
+
+        ClusterRow& row = m_rows[row_idx];
+        LightClusterRange* ranges = &m_cluster_ranges[row_idx * m_n_x];
+        const uint32_t slice = row_idx / m_n_y;
+        const uint32_t first = m_slice_offsets[slice];
+        const uint32_t n_candidates = m_slice_offsets[slice + 1] - first;
+
+        const LightLanes slice_lanes = {
+            &m_light_x[first], &m_light_y[first], &m_light_z[first],
+            &m_light_radius2[first], &m_light_ids[first]
+        };
+        row_lights.positions.resize(n_candidates + LIGHT_LANES);
+        const uint32_t n_row_lights = kernels.filter(
+            slice_lanes, n_candidates, m_row_bounds[row_idx], row_lights.positions.data());
+
+        const uint32_t n_padded = pad_lanes(n_row_lights);
+        row_lights.x.resize(n_padded);
+        row_lights.y.resize(n_padded);
+        row_lights.z.resize(n_padded);
+        row_lights.radius2.resize(n_padded);
+        row_lights.ids.resize(n_padded);
+        for (uint32_t i = 0; i < n_row_lights; ++i)
+        {
+            const uint32_t k = first + row_lights.positions[i];
+            row_lights.x[i] = m_light_x[k];
+            row_lights.y[i] = m_light_y[k];
+            row_lights.z[i] = m_light_z[k];
+            row_lights.radius2[i] = m_light_radius2[k];
+            row_lights.ids[i] = m_light_ids[k];
+        }
+        for (uint32_t i = n_row_lights; i < n_padded; ++i)
+        {
+            row_lights.x[i] = 0.f;
+            row_lights.y[i] = 0.f;
+            row_lights.z[i] = 0.f;
+            row_lights.radius2[i] = LIGHT_PADDING_RADIUS2;
+            row_lights.ids[i] = 0;
+        }
+
+        const LightLanes row_lanes = {
+            row_lights.x.data(), row_lights.y.data(), row_lights.z.data(),
+            row_lights.radius2.data(), row_lights.ids.data()
+        };
+        const std::size_t capacity = (std::size_t)m_n_x * n_row_lights + LIGHT_LANES;
+        if (row.light_indices.size() < capacity)
+        {
+            row.light_indices.resize(capacity);
+        }
+        row.n_light_indices = kernels.bin(
+            row_lanes, n_padded, &m_cluster_bounds[row_idx * m_n_x], m_n_x,
+            ranges, row.light_indices.data());
+    });
+
+    // Place the rows one after another, in cluster order
+    const uint32_t n_rows = m_n_z * m_n_y;
+    m_row_offsets[0] = 0;
+    for (uint32_t i = 0; i < n_rows; ++i)
+    {
+        m_row_offsets[i + 1] = m_row_offsets[i] + m_rows[i].n_light_indices;
+    }
+    m_light_indices.resize(m_row_offsets[n_rows]);
+
+    tbb::parallel_for(0u, n_rows, [&](uint32_t row_idx)
+    {
+        uint32_t offset = m_row_offsets[row_idx];
+        std::copy_n(m_rows[row_idx].light_indices.data(), m_rows[row_idx].n_light_indices, &m_light_indices[offset]);
+        for (uint32_t x = 0; x < m_n_x; ++x)
+        {
+            LightClusterRange& range = m_cluster_ranges[row_idx * m_n_x + x];
+            range.offset = offset;
+            offset += range.count;
+        }
+    });
+}
+
+bool LightClusterGrid::find_lights(const vec3f& world_position, const uint32_t** light_ids, uint32_t* n_lights) const
+{
+    *light_ids = nullptr;
+    *n_lights = 0;
+
+    const vec3f p = to_view(m_view, world_position);
+    if (p.z < m_near || p.z > m_far)
+    {
+        return false;
+    }
+
+    const float ndc_x = p.x / (p.z * m_tan_half_vfov * m_aspect_ratio);
+    const float ndc_y = p.y / (p.z * m_tan_half_vfov);
+    if (std::abs(ndc_x) > 1.f || std::abs(ndc_y) > 1.f)
+    {
+        return false;
+    }
+
+    const uint32_t x = std::min((uint32_t)((ndc_x + 1.f) * 0.5f * m_n_x), m_n_x - 1);
+    const uint32_t y = std::min((uint32_t)((1.f - ndc_y) * 0.5f * m_n_y), m_n_y - 1);
+    const uint32_t z = slice_of(p.z);
+
+    const LightClusterRange& range = m_cluster_ranges[(z * m_n_y + y) * m_n_x + x];
+    *light_ids = m_light_indices.data() + range.offset;
+    *n_lights = range.count;
+    return true;
+}
+
+}
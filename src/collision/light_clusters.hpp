@@ -0,0 +1,146 @@
+#pragma once
+#include "aabb.hpp"
+#include <cmath>
+#include <vector>
+
+namespace moonlight
+{
+
+// The sphere a light reaches, in world space
+struct LightBounds
+{
+    Vector3<float> center;
+    float radius;
+};
+
+inline LightBounds point_light_bounds(const Vector3<float>& position, float range)
+{
+    return { position, range };
+}
+
+// Smallest sphere around a cone of @range and half angle @half_angle, from
+// Wronski, "Cull that cone!". @direction has to be normalized.
+inline LightBounds spot_light_bounds(
+    const Vector3<float>& position,
+    const Vector3<float>& direction,
+    float range,
+    float half_angle)
+{
+    const float cos_angle = std::cos(half_angle);
+    // Wide cones are bounded by the sphere through their base circle, narrow
+    // ones by the sphere through their apex and base circle
+    if (half_angle > 3.14159265f / 4.f)
+    {
+        return { position + direction * (cos_angle * range), std::sin(half_angle) * range };
+    }
+    const float radius = range / (2.f * cos_angle);
+    return { position + direction * radius, radius };
+}
+
+// Where the lights of a cluster are in the index list, one uint2 per cluster
+// for a structured buffer
+struct LightClusterRange
+{
+    uint32_t offset;
+    uint32_t count;
+};
+
+// Clustered light assignment, after Olsson et al., "Clustered Deferred and
+// Forward Shading", 2012. The view frustum is split into a grid of froxels,
+// n_x by n_y screen tiles and n_z depth slices spaced exponentially between the
+// near and far plane, and every cluster lists the lights whose spheres touch
+// its bounding box.
+// Cluster (x, y, z) has index (z * n_y + y) * n_x + x. x and y count screen
+// tiles from the top left corner, z is floor(log(view_z / near) * slice_scale).
+// assign() works in three levels:
+// - lights are binned into the depth slices they span,
+// - every row of tiles of a slice keeps the lights of the slice touching it,
+// - every cluster of the row tests those, 4, 8 or 16 lights at a time.
+// Rows are processed in parallel and compacted into one index list in cluster
+// order, so the result does not depend on the scheduling.
+class LightClusterGrid
+{
+public:
+
+    LightClusterGrid(uint32_t n_x, uint32_t n_y, uint32_t n_z);
+
+    // Perspective projection of the clusters, left-handed with +z forward like
+    // DirectX::XMMatrixPerspectiveFovLH. Rebuilds the cluster bounds.
+    void set_projection(float vfov, float aspect_ratio, float near_distance, float far_distance);
+
+    // Bins @lights into the clusters. @view is a row major 4x4 world to view
+    // matrix applied to row vectors, as stored by DirectX::XMStoreFloat4x4.
+    void assign(const float* view, const LightBounds* lights, uint32_t n_lights);
+
+    // Points @light_ids at the lights of the cluster around @world_position,
+    // as of the last assign(). Every light whose sphere holds the point is
+    // among them. Returns false outside the view frustum, where the caller has
+    // to fall back to all lights.
+    bool find_lights(const Vector3<float>& world_position, const uint32_t** light_ids, uint32_t* n_lights) const;
+
+    const std::vector<LightClusterRange>& get_cluster_ranges() const
+    {
+        return m_cluster_ranges;
+    }
+
+    const std::vector<uint32_t>& get_light_indices() const
+    {
+        return m_light_indices;
+    }
+
+    float get_slice_scale() const
+    {
+        return m_slice_scale;
+    }
+
+private:
+
+    uint32_t slice_of(float view_z) const;
+
+    struct ViewLight
+    {
+        float x, y, z, radius2;
+        uint32_t first_slice, last_slice;
+    };
+
+    // A row of tiles of one slice. Keeps its indices across frames so that
+    // assign() stops allocating once the lights settle.
+    struct ClusterRow
+    {
+        std::vector<uint32_t> light_indices;
+        uint32_t n_light_indices = 0;
+    };
+
+    uint32_t m_n_x;
+    uint32_t m_n_y;
+    uint32_t m_n_z;
+
+    float m_near = 0.f;
+    float m_far = 0.f;
+    float m_tan_half_vfov = 0.f;
+    float m_aspect_ratio = 1.f;
+    float m_slice_scale = 0.f;
+    float m_view[4][4];
+
+    // View space bounds of the clusters and of the rows of tiles
+    std::vector<AABB> m_cluster_bounds;
+    std::vector<AABB> m_row_bounds;
+
+    std::vector<ViewLight> m_view_lights;
+    // Lights in view space sorted by slice, SoA. The lights of slice z are
+    // [m_slice_offsets[z], m_slice_offsets[z + 1]), padded to 16 lanes.
+    std::vector<uint32_t> m_slice_offsets;
+    std::vector<float> m_light_x;
+    std::vector<float> m_light_y;
+    std::vector<float> m_light_z;
+    std::vector<float> m_light_radius2;
+    std::vector<uint32_t> m_light_ids;
+
+    std::vector<ClusterRow> m_rows;
+    std::vector<uint32_t> m_row_offsets;
+
+    std::vector<LightClusterRange> m_cluster_ranges;
+    std::vector<uint32_t> m_light_indices;
+};
+
+}
@@ -0,0 +1,440 @@
+#include "occlusion_buffer.hpp"
+#include "../utility/cpu_features.hpp"
+#include "../utility/simd.hpp"
+#include <algorithm>
+#include <cmath>
+
+#include "tbb/blocked_range.h"
+#include "tbb/parallel_for.h"
+
+namespace moonlight
+{
+
+using simd::float4;
+using simd::float8;
+using simd::float16;
+
+constexpr uint32_t OCC_TILE_WIDTH = 64;
+constexpr uint32_t OCC_TILE_HEIGHT = 32;
+constexpr uint32_t OCC_BLOCK_SIZE = 8;
+constexpr uint32_t OCC_CULL_GRAIN_SIZE = 256;
+// Keeps an occluder from hiding its own bounding box, whose nearest corner
+// can round to just behind the rasterized surface
+constexpr float OCC_DEPTH_BIAS = 1e-6f;
+
+// Pixel centers of the lanes of a row
+alignas(64) static const float OCC_LANE_CENTERS[16] = {
+    0.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f,
+    8.5f, 9.5f, 10.5f, 11.5f, 12.5f, 13.5f, 14.5f, 15.5f
+};
+
+using vec3f = Vector3<float>;
+
+struct ClipVertex
+{
+    float x, y, z, w;
+};
+
+ML_SIMD_INLINE ClipVertex to_clip(const float m[4][4], const vec3f& p)
+{
+    return {
+        p.x * m[0][0] + p.y * m[1][0] + p.z * m[2][0] + m[3][0],
+        p.x * m[0][1] + p.y * m[1][1] + p.z * m[2][1] + m[3][1],
+        p.x * m[0][2] + p.y * m[1][2] + p.z * m[2][2] + m[3][2],
+        p.x * m[0][3] + p.y * m[1][3] + p.z * m[2][3] + m[3][3]
+    };
+}
+
+OcclusionBuffer::OcclusionBuffer(uint32_t width, uint32_t height)
+    : m_width((width + OCC_TILE_WIDTH - 1) / OCC_TILE_WIDTH * OCC_TILE_WIDTH)
+    , m_height((height + OCC_TILE_HEIGHT - 1) / OCC_TILE_HEIGHT * OCC_TILE_HEIGHT)
+{
+    m_depth.resize(m_width * m_height, 1.f);
+    m_block_max_depth.resize((m_width / OCC_BLOCK_SIZE) * (m_height / OCC_BLOCK_SIZE), 1.f);
+}
+
+void OcclusionBuffer::begin(const float* view_projection)
+{
+    for (int i = 0; i < 4; ++i)
+    {
+        for (int j = 0; j < 4; ++j)
+        {
+            m_view_projection[i][j] = view_projection[i * 4 + j];
+        }
+    }
+    m_triangles.clear();
+}
+
+void OcclusionBuffer::add_occluder(
+    const float* vertices,
+    uint32_t n_vertices,
+    uint32_t stride,
+    const vec3f& offset)
+{
+    const float width = (float)m_width;
+    const float height = (float)m_height;
+
+    for (uint32_t i = 0; i + 2 < n_vertices; i += 3)
+    {
+        float x[3], y[3], z[3];
+        bool clipped = false;
+        for (uint32_t k = 0; k < 3; ++k)
+        {
+            const float* p = (const float*)((const uint8_t*)vertices + (i + k) * stride);
+            const ClipVertex c = to_clip(m_view_projection, vec3f(p[0], p[1], p[2]) + offset);
+            if (c.z < 0.f || c.w <= 0.f)
+            {
+                clipped = true;
+                break;
+            }
+            const float inv_w = 1.f / c.w;
+            x[k] = (c.x * inv_w * 0.5f + 0.5f) * width;
+            y[k] = (0.5f - c.y * inv_w * 0.5f) * height;
+            z[k] = c.z * inv_w;
+        }
+        if (clipped)
+        {
+            continue;
+        }
+
+        const float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+        if (std::abs(area) < 1e-8f)
+        {
+            continue;
+        }
+
+        OccluderTriangle tri;
+        tri.min_x = std::max(0, (int32_t)std::floor(std::min({ x[0], x[1], x[2] })));
+        tri.min_y = std::max(0, (int32_t)std::floor(std::min({ y[0], y[1], y[2] })));
+        tri.max_x = std::min((int32_t)m_width - 1, (int32_t)std::ceil(std::max({ x[0], x[1], x[2] })));
+        tri.max_y = std::min((int32_t)m_height - 1, (int32_t)std::ceil(std::max({ y[0], y[1], y[2] })));
+        if (tri.min_x > tri.max_x || tri.min_y > tri.max_y)
+        {
+            continue;
+        }
+
+        // Edge i runs from vertex i to vertex i + 1, both windings are kept
+        const float sign = area > 0.f ? 1.f : -1.f;
+        for (int e = 0; e < 3; ++e)
+        {
+            const int j = (e + 1) % 3;
+            tri.edge_a[e] = -(y[j] - y[e]) * sign;
+            tri.edge_b[e] = (x[j] - x[e]) * sign;
+            tri.edge_c[e] = -(tri.edge_a[e] * x[e] + tri.edge_b[e] * y[e]);
+        }
+
+        const float inv_area = 1.f / area;
+        tri.depth_a = ((z[1] - z[0]) * (y[2] - y[0]) - (z[2] - z[0]) * (y[1] - y[0])) * inv_area;
+        tri.depth_b = ((x[1] - x[0]) * (z[2] - z[0]) - (x[2] - x[0]) * (z[1] - z[0])) * inv_area;
+        tri.depth_c = z[0] - tri.depth_a * x[0] - tri.depth_b * y[0];
+
+        m_triangles.push_back(tri);
+    }
+}
+
+// Clears the tile at @tile_x, @tile_y and rasterizes all triangles that
+// overlap it, F::width pixels of a row at a time
+template<typename F>
+ML_SIMD_INLINE void rasterize_tile(
+    const OccluderTriangle* triangles,
+    uint32_t n_triangles,
+    float* depth,
+    uint32_t pitch,
+    int32_t tile_x,
+    int32_t tile_y)
+{
+    const int32_t x0 = tile_x * OCC_TILE_WIDTH;
+    const int32_t y0 = tile_y * OCC_TILE_HEIGHT;
+    const int32_t x1 = x0 + OCC_TILE_WIDTH - 1;
+    const int32_t y1 = y0 + OCC_TILE_HEIGHT - 1;
+
+    const F far_depth = F::set1(1.f);
+    for (int32_t y = y0; y <= y1; ++y)
+    {
+        for (int32_t x = x0; x <= x1; x += F::width)
+        {
+            far_depth.storeu(&depth[y * pitch + x]);
+        }
+    }
+
+    const F lane_centers = F::loadu(OCC_LANE_CENTERS);
+    for (uint32_t t = 0; t < n_triangles; ++t)
+    {
+        const OccluderTriangle& tri = triangles[t];
+        if (tri.max_x < x0 || tri.min_x > x1 || tri.max_y < y0 || tri.min_y > y1)
+        {
+            continue;
+        }
+
+        const int32_t first_x = std::max(x0, tri.min_x) / (int32_t)F::width * (int32_t)F::width;
+        const int32_t last_x = std::min(x1, tri.max_x);
+        const int32_t first_y = std::max(y0, tri.min_y);
+        const int32_t last_y = std::min(y1, tri.max_y);
+
+        const F a0 = F::set1(tri.edge_a[0]);
+        const F a1 = F::set1(tri.edge_a[1]);
+        const F a2 = F::set1(tri.edge_a[2]);
+        const F za = F::set1(tri.depth_a);
+        const F zero = F::zero();
+
+        for (int32_t y = first_y; y <= last_y; ++y)
+        {
+            const float py = y + 0.5f;
+            const F e0_row = F::set1(tri.edge_b[0] * py + tri.edge_c[0]);
+            const F e1_row = F::set1(tri.edge_b[1] * py + tri.edge_c[1]);
+            const F e2_row = F::set1(tri.edge_b[2] * py + tri.edge_c[2]);
+            const F z_row = F::set1(tri.depth_b * py + tri.depth_c);
+
+            for (int32_t x = first_x; x <= last_x; x += F::width)
+            {
+                const F px = F::set1((float)x) + lane_centers;
+                const auto inside =
+                    (fmadd(a0, px, e0_row) >= zero) &
+                    (fmadd(a1, px, e1_row) >= zero) &
+                    (fmadd(a2, px, e2_row) >= zero);
+                if (!inside.any())
+                {
+                    continue;
+                }
+
+                float* row = &depth[y * pitch + x];
+                const F d = F::loadu(row);
+                select(inside, min(d, fmadd(za, px, z_row)), d).storeu(row);
+            }
+        }
+    }
+}
+
+static void rasterize_tile_sse(
+    const OccluderTriangle* triangles, uint32_t n_triangles,
+    float* depth, uint32_t pitch, int32_t tile_x, int32_t tile_y)
+{
+    rasterize_tile<float4>(triangles, n_triangles, depth, pitch, tile_x, tile_y);
+}
+
+ML_TARGET_AVX2 static void rasterize_tile_avx2(
+    const OccluderTriangle* triangles, uint32_t n_triangles,
+    float* depth, uint32_t pitch, int32_t tile_x, int32_t tile_y)
+{
+    rasterize_tile<float8>(triangles, n_triangles, depth, pitch, tile_x, tile_y);
+}
+
+ML_TARGET_AVX512 static void rasterize_tile_avx512(
+    const OccluderTriangle* triangles, uint32_t n_triangles,
+    float* depth, uint32_t pitch, int32_t tile_x, int32_t tile_y)
+{
+    rasterize_tile<float16>(triangles, n_triangles, depth, pitch, tile_x, tile_y);
+}
+
+using RasterizeTile = void(*)(const OccluderTriangle*, uint32_t, float*, uint32_t, int32_t, int32_t);
+
+static RasterizeTile select_rasterize_tile()
+{
+    switch (simd_level())
+    {
+    case SimdLevel::AVX512:
+        return rasterize_tile_avx512;
+    case SimdLevel::AVX2:
+        return rasterize_tile_avx2;
+    default:
+        return rasterize_tile_sse;
+    }
+}
+
+void OcclusionBuffer::rasterize()
+{
+    static const RasterizeTile rasterize_tile_simd = select_rasterize_tile();
+
+    const uint32_t n_tiles_x = m_width / OCC_TILE_WIDTH;
+    const uint32_t n_tiles = n_tiles_x * (m_height / OCC_TILE_HEIGHT);
+    const uint32_t n_blocks_x = m_width / OCC_BLOCK_SIZE;
+
+    tbb::parallel_for(0u, n_tiles, [&](uint32_t tile)
+    {
+        const uint32_t tile_x = tile % n_tiles_x;
+        const uint32_t tile_y = tile / n_tiles_x;
+        rasterize_tile_simd(m_triangles.data(), m_triangles.size(), m_depth.data(), m_width, tile_x, tile_y);
+
+        for (uint32_t by = 0; by < OCC_TILE_HEIGHT / OCC_BLOCK_SIZE; ++by)
+        {
+            for (uint32_t bx = 0; bx < OCC_TILE_WIDTH / OCC_BLOCK_SIZE; ++bx)
+            {
+                const uint32_t x = tile_x * OCC_TILE_WIDTH + bx * OCC_BLOCK_SIZE;
+                const uint32_t y = tile_y * OCC_TILE_HEIGHT + by * OCC_BLOCK_SIZE;
+
+                float4 block_max = float4::zero();
+                for (uint32_t row = 0; row < OCC_BLOCK_SIZE; ++row)
+                {
+                    const float* p = &m_depth[(y + row) * m_width + x];
+                    block_max = max(block_max, max(float4::loadu(p), float4::loadu(p + 4)));
+                }
+
+                alignas(16) float lanes[4];
+                block_max.store(lanes);
+                m_block_max_depth[(y / OCC_BLOCK_SIZE) * n_blocks_x + x / OCC_BLOCK_SIZE] =
+                    std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+            }
+        }
+    });
+}
+
+// Corners of a box as lanes, 0 for bmin and 1 for bmax
+alignas(32) static const float OCC_CORNER_X[8] = { 0.f, 1.f, 0.f, 1.f, 0.f, 1.f, 0.f, 1.f };
+alignas(32) static const float OCC_CORNER_Y[8] = { 0.f, 0.f, 1.f, 1.f, 0.f, 0.f, 1.f, 1.f };
+alignas(32) static const float OCC_CORNER_Z[8] = { 0.f, 0.f, 0.f, 0.f, 1.f, 1.f, 1.f, 1.f };
+
+struct DepthView
+{
+    const float (*view_projection)[4];
+    uint32_t width;
+    uint32_t height;
+    const float* depth;
+    const float* block_max_depth;
+};
+
+// Whether any pixel in [first_x, last_x] x [first_y, last_y] lets a box at
+// @box_depth through. Inlined like the kernels that call it, plain SSE code
+// between AVX instructions stalls on the state transition.
+ML_SIMD_INLINE bool rect_visible(
+    const DepthView& view,
+    int32_t first_x,
+    int32_t first_y,
+    int32_t last_x,
+    int32_t last_y,
+    float box_depth)
+{
+    const uint32_t n_blocks_x = view.width / OCC_BLOCK_SIZE;
+    for (int32_t by = first_y / OCC_BLOCK_SIZE; by <= last_y / (int32_t)OCC_BLOCK_SIZE; ++by)
+    {
+        for (int32_t bx = first_x / OCC_BLOCK_SIZE; bx <= last_x / (int32_t)OCC_BLOCK_SIZE; ++bx)
+        {
+            if (view.block_max_depth[by * n_blocks_x + bx] < box_depth)
+            {
+                continue;
+            }
+
+            const int32_t x0 = std::max(first_x, bx * (int32_t)OCC_BLOCK_SIZE);
+            const int32_t y0 = std::max(first_y, by * (int32_t)OCC_BLOCK_SIZE);
+            const int32_t x1 = std::min(last_x, (bx + 1) * (int32_t)OCC_BLOCK_SIZE - 1);
+            const int32_t y1 = std::min(last_y, (by + 1) * (int32_t)OCC_BLOCK_SIZE - 1);
+            for (int32_t y = y0; y <= y1; ++y)
+            {
+                for (int32_t x = x0; x <= x1; ++x)
+                {
+                    if (view.depth[y * view.width + x] >= box_depth)
+                    {
+                        return true;
+                    }
+                }
+            }
+        }
+    }
+
+    return false;
+}
+
+// Projects the corners of @bounds, F::width at a time, and tests the pixels
+// they span. F is at most 8 wide, one lane per corner.
+template<typename F>
+ML_SIMD_INLINE bool box_visible(const DepthView& view, const AABB& bounds)
+{
+    const float (*m)[4] = view.view_projection;
+    const ClipVertex base = to_clip(m, bounds.bmin);
+    const vec3f e = bounds.bmax - bounds.bmin;
+
+    F min_x = F::set1(std::numeric_limits<float>::max());
+    F min_y = min_x;
+    F min_z = min_x;
+    F max_x = F::set1(-std::numeric_limits<float>::max());
+    F max_y = max_x;
+
+    for (uint32_t c = 0; c < 8; c += F::width)
+    {
+        const F sx = F::load(&OCC_CORNER_X[c]) * F::set1(e.x);
+        const F sy = F::load(&OCC_CORNER_Y[c]) * F::set1(e.y);
+        const F sz = F::load(&OCC_CORNER_Z[c]) * F::set1(e.z);
+
+        // No lambdas here, they would not inherit the instruction set
+        const F x = fmadd(sx, F::set1(m[0][0]), fmadd(sy, F::set1(m[1][0]), fmadd(sz, F::set1(m[2][0]), F::set1(base.x))));
+        const F y = fmadd(sx, F::set1(m[0][1]), fmadd(sy, F::set1(m[1][1]), fmadd(sz, F::set1(m[2][1]), F::set1(base.y))));
+        const F z = fmadd(sx, F::set1(m[0][2]), fmadd(sy, F::set1(m[1][2]), fmadd(sz, F::set1(m[2][2]), F::set1(base.z))));
+        const F w = fmadd(sx, F::set1(m[0][3]), fmadd(sy, F::set1(m[1][3]), fmadd(sz, F::set1(m[2][3]), F::set1(base.w))));
+
+        // Boxes reaching in front of the near plane are never hidden
+        if (((z < F::zero()) | (w <= F::zero())).any())
+        {
+            return true;
+        }
+
+        const F inv_w = F::set1(1.f) / w;
+        const F ndc_x = x * inv_w;
+        const F ndc_y = y * inv_w;
+        min_x = min(min_x, ndc_x);
+        max_x = max(max_x, ndc_x);
+        min_y = min(min_y, ndc_y);
+        max_y = max(max_y, ndc_y);
+        min_z = min(min_z, z * inv_w);
+    }
+
+    // Every pixel the box touches, y points down on screen. The frustum
+    // culler has the final say on boxes that leave the screen.
+    const float width = (float)view.width;
+    const float height = (float)view.height;
+    const int32_t first_x = std::max(0, (int32_t)std::floor((hmin(min_x) * 0.5f + 0.5f) * width));
+    const int32_t last_x = std::min((int32_t)view.width - 1, (int32_t)std::floor((hmax(max_x) * 0.5f + 0.5f) * width));
+    const int32_t first_y = std::max(0, (int32_t)std::floor((0.5f - hmax(max_y) * 0.5f) * height));
+    const int32_t last_y = std::min((int32_t)view.height - 1, (int32_t)std::floor((0.5f - hmin(min_y) * 0.5f) * height));
+    if (first_x > last_x || first_y > last_y)
+    {
+        return true;
+    }
+
+    return rect_visible(view, first_x, first_y, last_x, last_y, hmin(min_z) - OCC_DEPTH_BIAS);
+}
+
+static void test_boxes_sse(
+    const DepthView& view, const AABB* bounds, const uint32_t* ids,
+    uint8_t* visible, uint32_t first, uint32_t last)
+{
+    for (uint32_t i = first; i < last; ++i)
+    {
+        visible[i] = box_visible<float4>(view, bounds[ids[i]]);
+    }
+}
+
+// Also runs on AVX-512, a box has no more than 8 corners
+ML_TARGET_AVX2 static void test_boxes_avx2(
+    const DepthView& view, const AABB* bounds, const uint32_t* ids,
+    uint8_t* visible, uint32_t first, uint32_t last)
+{
+    for (uint32_t i = first; i < last; ++i)
+    {
+        visible[i] = box_visible<float8>(view, bounds[ids[i]]);
+    }
+}
+
+using TestBoxes = void(*)(const DepthView&, const AABB*, const uint32_t*, uint8_t*, uint32_t, uint32_t);
+
+uint32_t OcclusionBuffer::cull(const AABB* bounds, uint32_t* ids, uint32_t n_ids)
+{
+    static const TestBoxes test_boxes = simd_level() >= SimdLevel::AVX2 ? test_boxes_avx2 : test_boxes_sse;
+
+    const DepthView view = { m_view_projection, m_width, m_height, m_depth.data(), m_block_max_depth.data() };
+    m_visible.resize(n_ids);
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, n_ids, OCC_CULL_GRAIN_SIZE),
+        [&](const tbb::blocked_range<uint32_t>& r)
+        {
+            test_boxes(view, bounds, ids, m_visible.data(), r.begin(), r.end());
+        }
+    );
+
+    uint32_t n_visible = 0;
+    for (uint32_t i = 0; i < n_ids; ++i)
+    {
+        ids[n_visible] = ids[i];
+        n_visible += m_visible[i];
+    }
+    return n_visible;
+}
+
+}
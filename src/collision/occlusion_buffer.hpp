@@ -0,0 +1,83 @@
+#pragma once
+#include "aabb.hpp"
+#include <vector>
+
+namespace moonlight
+{
+
+// An occluder triangle ready for rasterization. The edge functions are
+// a * x + b * y + c in pixel coordinates, positive inside, and depth is a
+// plane over the same coordinates.
+struct OccluderTriangle
+{
+    float edge_a[3];
+    float edge_b[3];
+    float edge_c[3];
+    float depth_a;
+    float depth_b;
+    float depth_c;
+    // Pixel bounds, inclusive and clamped to the buffer
+    int32_t min_x, min_y;
+    int32_t max_x, max_y;
+};
+
+// Low resolution depth buffer of a few large occluders, rasterized on the CPU,
+// that the boxes left by frustum culling are tested against before they are
+// drawn. Each frame:
+// - begin() with the view projection of the frame,
+// - add_occluder() for each occluder mesh,
+// - rasterize(),
+// - cull() the candidate boxes.
+// The buffer is split into tiles that are cleared and rasterized in parallel,
+// each with the widest SIMD kernel the host supports. Every 8x8 block keeps the
+// farthest depth it holds, which hides most boxes without reading pixels.
+// Depth follows Direct3D, z / w in [0, 1] with 1 at the far plane. Occluders
+// cover the pixels whose centers they contain, a box is culled when every
+// pixel it touches holds a nearer occluder.
+class OcclusionBuffer
+{
+public:
+
+    // The size is rounded up to whole tiles of 64x32 pixels
+    OcclusionBuffer(uint32_t width, uint32_t height);
+
+    // @view_projection is a row major 4x4 matrix applied to row vectors,
+    // clip = (x, y, z, 1) * M, as stored by DirectX::XMStoreFloat4x4
+    void begin(const float* view_projection);
+
+    // Adds the triangle list of @n_vertices positions @stride bytes apart,
+    // moved by @offset. Triangles crossing the near plane are dropped, which
+    // only ever hides less.
+    void add_occluder(
+        const float* vertices,
+        uint32_t n_vertices,
+        uint32_t stride,
+        const Vector3<float>& offset
+    );
+
+    void rasterize();
+
+    // Removes the ids of the boxes hidden by the occluders from the first
+    // @n_ids entries of @ids, keeping the order of the others, and returns how
+    // many are left. @bounds is indexed by id.
+    uint32_t cull(const AABB* bounds, uint32_t* ids, uint32_t n_ids);
+
+    uint32_t get_num_occluder_triangles() const
+    {
+        return m_triangles.size();
+    }
+
+private:
+
+    uint32_t m_width;
+    uint32_t m_height;
+    float m_view_projection[4][4];
+
+    std::vector<OccluderTriangle> m_triangles;
+    std::vector<float> m_depth;
+    // Farthest depth of every 8x8 block
+    std::vector<float> m_block_max_depth;
+    std::vector<uint8_t> m_visible;
+};
+
+}
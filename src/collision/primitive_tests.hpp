@@ -3,8 +3,8 @@
 #include "plane.hpp"
 #include "frustum.hpp"
 #include "ray.hpp"
-
-#include <immintrin.h>
+#include "../utility/cpu_features.hpp"
+#include "../utility/simd.hpp"
 
 namespace moonlight
 {
@@ -68,129 +68,103 @@ inline bool frustum_contains_aabb(const Plane* planes, const AABB& aabb, float*
     return true;
 }
 
-// Perform 8 AABB intersection tests against @frustum.
-// See description for avx2 version
-inline uint8_t frustum_contains_aabb_sse4(
-    const FrustumSIMD* frustum,
-    const FrustumSIMD* abs_frustum,
-    const AABB256& aabb,
-    float* d)
+// One row of a FrustumSIMD plane, which holds the same value in all of its 8
+// lanes. Wider registers broadcast it.
+template<typename F>
+ML_SIMD_INLINE F frustum_plane_lanes(const float* row)
 {
-    uint8_t output_mask = 0xFF;
-    for (int k = 0; k < 2; ++k)
+    if constexpr (F::width <= 8)
     {
-        __m128 r0 = _mm_set_ps1(0.5f);
-        __m128 e0 = _mm_load_ps(&aabb.bmax_x[k * 4]);
-        __m128 e1 = _mm_load_ps(&aabb.bmax_y[k * 4]);
-        __m128 e2 = _mm_load_ps(&aabb.bmax_z[k * 4]);
-        __m128 r1 = _mm_load_ps(&aabb.bmin_x[k * 4]);
-        __m128 cx = _mm_add_ps(e0, r1);
-
-        r1 = _mm_load_ps(&aabb.bmin_y[k * 4]);
-        __m128 cy = _mm_add_ps(e1, r1);
-        r1 = _mm_load_ps(&aabb.bmin_z[k * 4]);
-        __m128 cz = _mm_add_ps(e2, r1);
-
-        cx = _mm_mul_ps(cx, r0);
-        cy = _mm_mul_ps(cy, r0);
-        cz = _mm_mul_ps(cz, r0);
-
-        // Vector3 e = aabb.bmax - c;
-        e0 = _mm_sub_ps(e0, cx); // ex
-        e1 = _mm_sub_ps(e1, cy); // ey
-        e2 = _mm_sub_ps(e2, cz); // ez
-
-        for (int i = 0; i < 6; ++i)
-        {
-            // float s = dot(planes[i].normal, c) - d[i];
-            // float s = p[i].normal.x * cx + p[i].normal.y * cy + p[i].normal.z * cz
-            __m128 s = _mm_load_ps(frustum->normals[i].nx);
-            __m128 r2 = _mm_load_ps(frustum->normals[i].ny);
-            r0 = _mm_load_ps(frustum->normals[i].nz);
-            r1 = _mm_load_ps(&d[i * 8]);
-            s = _mm_fmsub_ps(s, cx, r1);
-            s = _mm_fmadd_ps(r2, cy, s);
-            s = _mm_fmadd_ps(r0, cz, s);
-
-            // float r = e.x * abs(planes[i].normal.x) + e.y * abs(planes[i].normal.y) + e.z * abs(planes[i].normal.z);
-            r0 = _mm_load_ps(abs_frustum->normals[i].nx);
-            r1 = _mm_load_ps(abs_frustum->normals[i].ny);
-            r2 = _mm_load_ps(abs_frustum->normals[i].nz);
-            r0 = _mm_mul_ps(e0, r0);
-            r0 = _mm_fmadd_ps(e1, r1, r0);
-            r0 = _mm_fmadd_ps(e2, r2, r0);
-
-            // if (s > r) return false;
-            r0 = _mm_cmp_ps(s, r0, 0x12); // 0x12 stands for _CMP_LE_OQ (LESS THAN OR EQUAL TO)
-            uint8_t sign_mask = _mm_movemask_ps(r0);
-            uint8_t lo_mask = output_mask >> (k * 4);
-            lo_mask = lo_mask & sign_mask;
-            output_mask = (lo_mask << (k * 4)) | (output_mask & (0xF << ((1-k) * 4)));
-        }
+        return F::load(row);
+    }
+    else
+    {
+        return F::set1(row[0]);
     }
-
-    return output_mask;
 }
 
-// Perform 8 AABB intersection tests against @frustum.
-// The result is returned as a uint8_t bitmask, where there
-// positive bits describe an AABB that is inside the frustum and vice versa.
-inline uint8_t frustum_contains_aabb_avx2(
+// Tests the boxes [first, first + F::width) of the AABB256 or AABB512 block
+// @aabb against @frustum, see frustum_contains_aabb_avx2. @d holds the plane
+// distances, 8 copies each.
+template<typename F, typename AABBBlock>
+ML_SIMD_INLINE uint32_t frustum_contains_aabb_lanes(
     const FrustumSIMD* frustum,
     const FrustumSIMD* abs_frustum,
-    const AABB256& aabb,
-    float* d)
+    const AABBBlock& aabb,
+    const float* d,
+    uint32_t first)
 {
-    uint8_t output_mask = 0xFF;
-    //Vector3 c = (aabb.bmax + aabb.bmin) * 0.5f;
-    __m256 r0 = _mm256_set1_ps(0.5f);
-    __m256 e0 = _mm256_load_ps(aabb.bmax_x);
-    __m256 e1 = _mm256_load_ps(aabb.bmax_y);
-    __m256 e2 = _mm256_load_ps(aabb.bmax_z);
-    __m256 r1 = _mm256_load_ps(aabb.bmin_x);
-    __m256 cx = _mm256_add_ps(e0, r1);
-    
-    r1 = _mm256_load_ps(aabb.bmin_y);
-    __m256 cy = _mm256_add_ps(e1, r1);
-    r1 = _mm256_load_ps(aabb.bmin_z);
-    __m256 cz = _mm256_add_ps(e2, r1);
-
-    cx = _mm256_mul_ps(cx, r0);
-    cy = _mm256_mul_ps(cy, r0);
-    cz = _mm256_mul_ps(cz, r0);
+    // Vector3 c = (aabb.bmax + aabb.bmin) * 0.5f;
+    const F half = F::set1(0.5f);
+    const F bmax_x = F::load(&aabb.bmax_x[first]);
+    const F bmax_y = F::load(&aabb.bmax_y[first]);
+    const F bmax_z = F::load(&aabb.bmax_z[first]);
+    const F cx = (bmax_x + F::load(&aabb.bmin_x[first])) * half;
+    const F cy = (bmax_y + F::load(&aabb.bmin_y[first])) * half;
+    const F cz = (bmax_z + F::load(&aabb.bmin_z[first])) * half;
 
     // Vector3 e = aabb.bmax - c;
-    e0 = _mm256_sub_ps(e0, cx); // ex
-    e1 = _mm256_sub_ps(e1, cy); // ey
-    e2 = _mm256_sub_ps(e2, cz); // ez
+    const F ex = bmax_x - cx;
+    const F ey = bmax_y - cy;
+    const F ez = bmax_z - cz;
 
+    uint32_t inside = (1u << F::width) - 1;
     for (int i = 0; i < 6; ++i)
     {
         // float s = dot(planes[i].normal, c) - d[i];
-        // float s = p[i].normal.x * cx + p[i].normal.y * cy + p[i].normal.z * cz
-        __m256 s = _mm256_load_ps(frustum->normals[i].nx);
-        __m256 r2 = _mm256_load_ps(frustum->normals[i].ny);
-        r0 = _mm256_load_ps(frustum->normals[i].nz);
-        r1 = _mm256_load_ps(&d[i * 8]);
-        s = _mm256_fmsub_ps(s, cx, r1);
-        s = _mm256_fmadd_ps(r2, cy, s);
-        s = _mm256_fmadd_ps(r0, cz, s);
+        F s = fmsub(frustum_plane_lanes<F>(frustum->normals[i].nx), cx, frustum_plane_lanes<F>(&d[i * 8]));
+        s = fmadd(frustum_plane_lanes<F>(frustum->normals[i].ny), cy, s);
+        s = fmadd(frustum_plane_lanes<F>(frustum->normals[i].nz), cz, s);
 
         // float r = e.x * abs(planes[i].normal.x) + e.y * abs(planes[i].normal.y) + e.z * abs(planes[i].normal.z);
-        r0 = _mm256_load_ps(abs_frustum->normals[i].nx);
-        r1 = _mm256_load_ps(abs_frustum->normals[i].ny);
-        r2 = _mm256_load_ps(abs_frustum->normals[i].nz);
-        r0 = _mm256_mul_ps(e0, r0);
-        r0 = _mm256_fmadd_ps(e1, r1, r0);
-        r0 = _mm256_fmadd_ps(e2, r2, r0);
+        F r = ex * frustum_plane_lanes<F>(abs_frustum->normals[i].nx);
+        r = fmadd(ey, frustum_plane_lanes<F>(abs_frustum->normals[i].ny), r);
+        r = fmadd(ez, frustum_plane_lanes<F>(abs_frustum->normals[i].nz), r);
 
         // if (s > r) return false;
-        r0 = _mm256_cmp_ps(s, r0, 0x12); // 0x12 stands for _CMP_LE_OQ (LESS THAN OR EQUAL TO)
-        uint8_t sign_mask = _mm256_movemask_ps(r0);
-        output_mask = output_mask & sign_mask;
+        inside &= (s <= r).bits();
     }
 
-    return output_mask;
+    return inside;
+}
+
+// Perform 8 AABB intersection tests against @frustum.
+// See description for avx2 version
+inline uint8_t frustum_contains_aabb_sse4(
+    const FrustumSIMD* frustum,
+    const FrustumSIMD* abs_frustum,
+    const AABB256& aabb,
+    float* d)
+{
+    const uint32_t lo = frustum_contains_aabb_lanes<simd::float4>(frustum, abs_frustum, aabb, d, 0);
+    const uint32_t hi = frustum_contains_aabb_lanes<simd::float4>(frustum, abs_frustum, aabb, d, 4);
+    return (uint8_t)(lo | (hi << 4));
+}
+
+// Perform 8 AABB intersection tests against @frustum.
+// The result is returned as a uint8_t bitmask, where there
+// positive bits describe an AABB that is inside the frustum and vice versa.
+// Requires AVX2, see select_frustum_contains_aabb.
+ML_TARGET_AVX2 inline uint8_t frustum_contains_aabb_avx2(
+    const FrustumSIMD* frustum,
+    const FrustumSIMD* abs_frustum,
+    const AABB256& aabb,
+    float* d)
+{
+    return (uint8_t)frustum_contains_aabb_lanes<simd::float8>(frustum, abs_frustum, aabb, d, 0);
+}
+
+using FrustumContainsAABB = uint8_t (*)(
+    const FrustumSIMD* frustum,
+    const FrustumSIMD* abs_frustum,
+    const AABB256& aabb,
+    float* d
+);
+
+// The widest of the 8 box tests above that the host supports
+inline FrustumContainsAABB select_frustum_contains_aabb()
+{
+    return simd_level() >= SimdLevel::AVX2 ? frustum_contains_aabb_avx2 : frustum_contains_aabb_sse4;
 }
 
 inline bool ray_intersects_aabb(
@@ -33,56 +33,10 @@ IntersectionParams ray_hit_triangle(
     const float* tris,
     const unsigned stride)
 {
-    using vec3f = Vector3<float>;
-
-    IntersectionParams intersect_params;
-
-    const float epsilon = 1e-4;
-    const vec3f e0(tris[stride]     - tris[0],
-                   tris[stride + 1] - tris[1],
-                   tris[stride + 2] - tris[2]
-    );
-
-    const vec3f e1(tris[stride * 2]     - tris[0],
-                   tris[stride * 2 + 1] - tris[1],
-                   tris[stride * 2 + 2] - tris[2]
-    );
-
-    const vec3f q = cross(ray.d, e1);
-    const float a = dot(e0, q);
-
-    if (a > -epsilon && a < epsilon)
-    {
-        return intersect_params;
-    }
-
-    const float f = 1.f / a;
-    const vec3f s(ray.o.x - tris[0],
-                  ray.o.y - tris[1],
-                  ray.o.z - tris[2]
-    );
-
-    intersect_params.u = f * dot(s, q);
-
-    if (intersect_params.u < 0.f)
+    return dispatch_vertex_layout(stride, [&](const auto& layout)
     {
-        return intersect_params;
-    }
-
-    const vec3f r = cross(s, e0);
-    intersect_params.v = f * dot(ray.d, r);
-
-    if (intersect_params.v < 0.f || 
-        intersect_params.u + intersect_params.v > 1.f)
-    {
-        return intersect_params;
-    }
-
-    intersect_params.t = f * dot(e1, r);
-    vec3f normal = normalize(cross(e0, e1));
-    intersect_params.set_face_normal(ray.d, normal);
-
-    return intersect_params;
+        return ray_hit_triangle(ray, tris, layout);
+    });
 }
 
 IntersectionParams ray_hit_triangle(
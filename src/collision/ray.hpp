@@ -1,8 +1,8 @@
 #pragma once
 #include "intersect.hpp"
+#include "vertex_layout.hpp"
 #include "../simple_math.hpp"
 #include <ostream>
-#include <intrin.h>
 
 namespace moonlight {
 
@@ -12,7 +12,7 @@ struct Ray {
     // Default constructed rays are meaningless. However, they are needed for intermediate steps.
     Ray()
     {
-        o4 = d4 = invd4 = _mm_set1_ps(1);
+        o = d = invd = Vector3<float>(1.f);
     }
     // Constructs a ray with origin \origin and direction \direction. Must make sure that the 
     // direction vector is normalized
@@ -29,29 +29,16 @@ struct Ray {
     // the ray travels in. The direction vector has to be normalized
     float t = std::numeric_limits<float>::max();
    
-    union {
-        struct {
-            Vector3<float> o;
-            float dummy1;
-        };
-        __m128 o4;
-    };
-
-    union {
-        struct {
-            Vector3<float> d;
-            float dummy2;
-        };
-        __m128 d4;
-    };
-
-    union {
-        struct {
-            Vector3<float> invd;
-            float dummy4;
-        };
-        __m128 invd4;
-    };
+    // Each vector is padded to 16 bytes, so that it can be read with a single
+    // float4 load
+    alignas(16) Vector3<float> o;
+    float dummy1 = 1.f;
+
+    alignas(16) Vector3<float> d;
+    float dummy2 = 1.f;
+
+    alignas(16) Vector3<float> invd;
+    float dummy4 = 1.f;
 };
 
 // Print out the parameters of the ray
@@ -61,6 +48,65 @@ IntersectionParams ray_hit_triangle(
     const Ray& ray,  const float* tris, const unsigned stride
 );
 
+// Same test for a triangle record of a known layout, see VertexLayout
+template<uint32_t Stride>
+IntersectionParams ray_hit_triangle(
+    const Ray& ray, const float* tris, const VertexLayout<Stride>& layout
+)
+{
+    using vec3f = Vector3<float>;
+
+    const uint32_t stride = layout.stride;
+    IntersectionParams intersect_params;
+
+    const float epsilon = 1e-4;
+    const vec3f e0(tris[stride]     - tris[0],
+                   tris[stride + 1] - tris[1],
+                   tris[stride + 2] - tris[2]
+    );
+
+    const vec3f e1(tris[stride * 2]     - tris[0],
+                   tris[stride * 2 + 1] - tris[1],
+                   tris[stride * 2 + 2] - tris[2]
+    );
+
+    const vec3f q = cross(ray.d, e1);
+    const float a = dot(e0, q);
+
+    if (a > -epsilon && a < epsilon)
+    {
+        return intersect_params;
+    }
+
+    const float f = 1.f / a;
+    const vec3f s(ray.o.x - tris[0],
+                  ray.o.y - tris[1],
+                  ray.o.z - tris[2]
+    );
+
+    intersect_params.u = f * dot(s, q);
+
+    if (intersect_params.u < 0.f)
+    {
+        return intersect_params;
+    }
+
+    const vec3f r = cross(s, e0);
+    intersect_params.v = f * dot(ray.d, r);
+
+    if (intersect_params.v < 0.f || 
+        intersect_params.u + intersect_params.v > 1.f)
+    {
+        return intersect_params;
+    }
+
+    intersect_params.t = f * dot(e1, r);
+    vec3f normal = normalize(cross(e0, e1));
+    intersect_params.set_face_normal(ray.d, normal);
+
+    return intersect_params;
+}
+
 IntersectionParams ray_hit_triangle(
     const Ray& ray, 
     const float* tri0, const float* tri1, const float* tri2, 
@@ -0,0 +1,66 @@
+#pragma once
+#include "ray.hpp"
+#include <cstdint>
+
+namespace moonlight {
+
+// A packet of N coherent rays stored as SoA, so that the rays can be processed
+// four at a time with SSE. The rays of a packet belong to a block of
+// block_width x block_height pixels, ray i maps to pixel
+// (i % block_width, i / block_width) of that block.
+template<uint32_t N>
+struct RayPacket {
+
+    static_assert(N == 4 || N == 8 || N == 16, "Ray packets hold 4, 8 or 16 rays");
+
+    static constexpr uint32_t size = N;
+    static constexpr uint32_t block_width = N == 8 ? 4 : (N == 16 ? 4 : 2);
+    static constexpr uint32_t block_height = N / block_width;
+
+    RayPacket()
+    {
+        for (uint32_t i = 0; i < N; ++i)
+        {
+            t[i] = std::numeric_limits<float>::max();
+        }
+    }
+
+    void set_ray(uint32_t i, const Ray& ray)
+    {
+        ox[i] = ray.o.x;
+        oy[i] = ray.o.y;
+        oz[i] = ray.o.z;
+        dx[i] = ray.d.x;
+        dy[i] = ray.d.y;
+        dz[i] = ray.d.z;
+        invdx[i] = ray.invd.x;
+        invdy[i] = ray.invd.y;
+        invdz[i] = ray.invd.z;
+        t[i] = std::numeric_limits<float>::max();
+    }
+
+    Ray ray(uint32_t i) const
+    {
+        Ray result(Vector3<float>(ox[i], oy[i], oz[i]), Vector3<float>(dx[i], dy[i], dz[i]));
+        result.t = t[i];
+        return result;
+    }
+
+    alignas(16) float ox[N];
+    alignas(16) float oy[N];
+    alignas(16) float oz[N];
+    alignas(16) float dx[N];
+    alignas(16) float dy[N];
+    alignas(16) float dz[N];
+    alignas(16) float invdx[N];
+    alignas(16) float invdy[N];
+    alignas(16) float invdz[N];
+    // Distance to the closest hit found so far
+    alignas(16) float t[N];
+};
+
+using RayPacket4 = RayPacket<4>;
+using RayPacket8 = RayPacket<8>;
+using RayPacket16 = RayPacket<16>;
+
+}
\ No newline at end of file
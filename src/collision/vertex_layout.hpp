@@ -0,0 +1,75 @@
+#pragma once
+#include <cstdint>
+
+namespace moonlight
+{
+
+// Layout of the triangle records the BVH code works on: three vertices of
+// @Stride floats each, of which the first three are the position, followed
+// by the centroid and the material index.
+// Code templated on the layout compiles with constant offsets, so fetching a
+// vertex or a centroid needs no multiplication by a runtime stride.
+template<uint32_t Stride>
+struct VertexLayout
+{
+    static constexpr uint32_t stride = Stride;
+    static constexpr uint32_t centroid_offset = Stride * 3;
+    static constexpr uint32_t triangle_size = Stride * 3 + 3 + 1;
+};
+
+// Stride 0 stands for a stride only known at runtime. Used for the rare meshes
+// that match none of the .mof layouts below.
+template<>
+struct VertexLayout<0>
+{
+    explicit VertexLayout(uint32_t s)
+        : stride(s)
+        , centroid_offset(s * 3)
+        , triangle_size(s * 3 + 3 + 1)
+    {}
+
+    uint32_t stride;
+    uint32_t centroid_offset;
+    uint32_t triangle_size;
+};
+
+// The layouts .mof files are written with, see ML_MISC_FLAG_ATTR_*
+using PositionLayout = VertexLayout<3>;
+using PositionNormalLayout = VertexLayout<6>;
+using PositionNormalUVLayout = VertexLayout<8>;
+using RuntimeVertexLayout = VertexLayout<0>;
+
+// Expands @X once per layout, for the explicit instantiations of layout
+// templates that are defined in a translation unit
+#define ML_FOR_EACH_VERTEX_LAYOUT(X) \
+    X(PositionLayout) \
+    X(PositionNormalLayout) \
+    X(PositionNormalUVLayout) \
+    X(RuntimeVertexLayout)
+
+inline bool is_known_vertex_stride(uint64_t stride)
+{
+    return stride == PositionLayout::stride ||
+        stride == PositionNormalLayout::stride ||
+        stride == PositionNormalUVLayout::stride;
+}
+
+// Calls @f with the layout of @stride. This is the only place a runtime
+// stride turns into a type, everything @f calls works on constant strides.
+template<typename F>
+decltype(auto) dispatch_vertex_layout(uint64_t stride, F&& f)
+{
+    switch (stride)
+    {
+    case PositionLayout::stride:
+        return f(PositionLayout());
+    case PositionNormalLayout::stride:
+        return f(PositionNormalLayout());
+    case PositionNormalUVLayout::stride:
+        return f(PositionNormalUVLayout());
+    default:
+        return f(RuntimeVertexLayout((uint32_t)stride));
+    }
+}
+
+}
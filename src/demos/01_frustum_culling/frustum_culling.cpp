@@ -1,5 +1,6 @@
 #include "frustum_culling.hpp"
 
+#include <algorithm>
 #include <chrono>
 
 using namespace DirectX;
@@ -7,6 +8,9 @@ using namespace Microsoft::WRL;
 
 namespace moonlight {
 
+// Occluders rasterized per frame
+constexpr uint32_t OCCLUDER_COUNT = 128;
+
 struct VertexFormat
 {
     XMFLOAT3 p; 
@@ -252,30 +256,76 @@ void FrustumCulling::update()
     FrustumSIMD frustum_avx2 = construct_frustumSIMD_from_frustum(frustum);
     FrustumSIMD abs_frustum_avx2 = construct_frustumSIMD_from_frustum(abs_frustum);
 
-    alignas(32) float d_avx2[48];
+    // Tab switches between the flat culler and the hierarchical one
+    const bool toggle_down = m_keyboard_state[KeyCode::Tab];
+    if (toggle_down && !m_toggle_was_down)
+    {
+        m_hierarchical_culling = !m_hierarchical_culling;
+    }
+    m_toggle_was_down = toggle_down;
+
     auto cull_t0 = std::chrono::high_resolution_clock::now();
-    const Plane* planes = (Plane*)&frustum;
-    for (int i = 0; i < 6; ++i)
+    if (m_hierarchical_culling)
     {
-        float_set(&d_avx2[i * 8], dot(planes[i].normal, planes[i].point), 8);
+        m_num_visible_instances = m_hierarchical_culler.cull(frustum, m_instance_ids.get());
     }
-    
-    m_num_visible_instances = 0;
-    for (int i = 0; i < m_num_instances / 8; ++i)
+    else
     {
-        uint8_t mask = frustum_contains_aabb_avx2(&frustum_avx2, &abs_frustum_avx2, m_aabbs[i], d_avx2);
-        for (int k = 0; k < 8; ++k)
+        alignas(32) float d_avx2[48];
+        const Plane* planes = (Plane*)&frustum;
+        for (int i = 0; i < 6; ++i)
         {
-            if (mask & (0x01 << k))
-            {
-                m_instance_ids[m_num_visible_instances] = i * 8 + k;
-                ++m_num_visible_instances;
-            }
+            float_set(&d_avx2[i * 8], dot(planes[i].normal, planes[i].point), 8);
         }
+
+        m_num_visible_instances = m_culler.cull(
+            &frustum_avx2, &abs_frustum_avx2,
+            m_aabbs.data(), m_num_instances,
+            d_avx2, m_instance_ids.get()
+        );
     }
 
     auto cull_t1 = std::chrono::high_resolution_clock::now();
     auto cull_time = (cull_t1 - cull_t0).count() * 1e-3;
+
+    // Occlusion culling, the nearest frustum visible cubes are the occluders
+    const uint32_t n_frustum_visible = m_num_visible_instances;
+    const uint32_t n_occluders = std::min<uint32_t>(n_frustum_visible, OCCLUDER_COUNT);
+    {
+        XMFLOAT4X4 view_projection;
+        XMStoreFloat4x4(&view_projection, m_mvp_matrix);
+        m_occlusion_buffer.begin(&view_projection.m[0][0]);
+
+        const Vector3<float> eye(m_camera_position.x, m_camera_position.y, m_camera_position.z);
+        auto distance_to_eye = [&](UINT id)
+        {
+            const Vector3<float> d = aabb_center(m_instance_bounds[id]) - eye;
+            return dot(d, d);
+        };
+        m_occluder_ids.assign(m_instance_ids.get(), m_instance_ids.get() + n_frustum_visible);
+        std::nth_element(
+            m_occluder_ids.begin(),
+            m_occluder_ids.begin() + n_occluders,
+            m_occluder_ids.end(),
+            [&](UINT a, UINT b) { return distance_to_eye(a) < distance_to_eye(b); }
+        );
+
+        const uint32_t n_vertices = sizeof(interleaved_cube_vertices) / sizeof(VertexFormat);
+        for (uint32_t i = 0; i < n_occluders; ++i)
+        {
+            const XMFLOAT4& displacement = m_instance_vertex_offsets[m_occluder_ids[i]].displacement;
+            m_occlusion_buffer.add_occluder(
+                interleaved_cube_vertices, n_vertices, sizeof(VertexFormat),
+                Vector3<float>(displacement.x, displacement.y, displacement.z)
+            );
+        }
+        m_occlusion_buffer.rasterize();
+        m_num_visible_instances = m_occlusion_buffer.cull(
+            m_instance_bounds.data(), m_instance_ids.get(), n_frustum_visible
+        );
+    }
+    auto occlusion_t1 = std::chrono::high_resolution_clock::now();
+    auto occlusion_time = (occlusion_t1 - cull_t1).count() * 1e-3;
     // Update the contents of the offset buffer
     m_instance_id_buffer->update(
         m_device.Get(), m_command_list_direct.Get(), 
@@ -284,15 +334,22 @@ void FrustumCulling::update()
         D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE
     );
 
-    m_text_output.resize(128);
+    m_text_output.resize(256);
     uint32_t n_culled_objects = m_num_instances - m_num_visible_instances;
+    const uint32_t n_tested_boxes = m_hierarchical_culling ?
+        m_hierarchical_culler.get_num_tested_boxes() : m_num_instances;
     swprintf(
         m_text_output.data(), 
-        L"Frame time: %dms\nCull time: %dus\nNumber of cubes: %d\nCulled: %d\nTriangles: %d", 
+        L"Frame time: %dms\nCull time: %dus (%ls, Tab to switch)\nOcclusion time: %dus (%d occluders)\nTested boxes: %d\nNumber of cubes: %d\nCulled: %d (occluded: %d)\nTriangles: %d", 
         static_cast<uint32_t>(elapsed_time_at_threshold * 1e3),
         static_cast<uint32_t>(cull_time),
+        m_hierarchical_culling ? L"hierarchical" : L"flat",
+        static_cast<uint32_t>(occlusion_time),
+        n_occluders,
+        n_tested_boxes,
         m_num_instances,
         n_culled_objects,
+        n_frustum_visible - static_cast<uint32_t>(m_num_visible_instances),
         n_culled_objects * 36 / 3
     );
 
@@ -330,16 +387,26 @@ void FrustumCulling::load_assets()
     load_quad_shader_assets();
     
     const uint32_t n_vertices = sizeof(interleaved_cube_vertices) / sizeof(VertexFormat);
-    m_aabbs.resize(m_num_instances / 8);
+    m_aabbs.resize(m_num_instances / 16);
     construct_instanced_aabbs(
         m_aabbs.data(), 
-        m_num_instances / 8,
+        m_num_instances / 16,
         interleaved_cube_vertices,
         sizeof(interleaved_cube_vertices) / sizeof(VertexFormat),
         sizeof(VertexFormat),
         reinterpret_cast<float*>(m_instance_vertex_offsets.get()),
         sizeof(InstanceAttributes)
     );
+
+    m_instance_bounds.resize(m_num_instances);
+    for (int i = 0; i < m_num_instances; ++i)
+    {
+        const AABB512& block = m_aabbs[i / 16];
+        const int k = i % 16;
+        m_instance_bounds[i].bmin = Vector3<float>(block.bmin_x[k], block.bmin_y[k], block.bmin_z[k]);
+        m_instance_bounds[i].bmax = Vector3<float>(block.bmax_x[k], block.bmax_y[k], block.bmax_z[k]);
+    }
+    m_hierarchical_culler.build(m_instance_bounds.data(), m_num_instances);
 }
 
 void FrustumCulling::load_scene_shader_assets()
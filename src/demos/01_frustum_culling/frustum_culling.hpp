@@ -11,6 +11,9 @@
 #include "../../core/render_texture.hpp"
 #include "../../core/swap_chain.hpp"
 #include "../../collision/aabb.hpp"
+#include "../../collision/frustum_culler.hpp"
+#include "../../collision/hierarchical_culler.hpp"
+#include "../../collision/occlusion_buffer.hpp"
 #include "../../collision/primitive_tests.hpp"
 #include "../../utility/arena_allocator.hpp"
 #include "../../utility/glyph_renderer.hpp"
@@ -58,7 +61,16 @@ private:
     D3D12_VERTEX_BUFFER_VIEW m_quad_vertex_buffer_view;
 
     std::unique_ptr<RenderTexture> m_scene_texture;
-    std::vector<AABB256> m_aabbs;
+    std::vector<AABB512> m_aabbs;
+    FrustumCuller m_culler;
+    HierarchicalFrustumCuller m_hierarchical_culler;
+    bool m_hierarchical_culling = true;
+    bool m_toggle_was_down = false;
+
+    // Boxes left by frustum culling are tested against the nearest of them
+    std::vector<AABB> m_instance_bounds;
+    std::vector<UINT> m_occluder_ids;
+    OcclusionBuffer m_occlusion_buffer{ 320, 192 };
 
     // The buffer has to be 256-byte aligned to satisfy D3D12_CONSTANT_BUFFER_DATA_PLACEMENT_ALIGNMENT.
     std::size_t m_num_instances;
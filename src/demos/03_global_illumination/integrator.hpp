@@ -2,6 +2,7 @@
 #include "light.hpp"
 #include "model.hpp"
 #include "../../collision/ray.hpp"
+#include "sampler.hpp"
 
 
 namespace moonlight
@@ -10,13 +11,37 @@ namespace moonlight
 struct Integrator
 {
 
+    virtual ~Integrator() = default;
+
+    // All random decisions of a sample are drawn from @sampler, which the
+    // caller has started at the pixel sample.
     virtual Vector3<float> integrate(
         Ray& ray, 
         const Model* model, 
         std::vector<std::shared_ptr<ILight>>& light_sources, 
+        Sampler& sampler,
         int traversal_depth = 0
     ) = 0;
 
+    // Shades @ray whose closest hit @its has already been found, e.g. by the
+    // packet traversal of the primary rays.
+    // Only called if accepts_primary_hit() returns true.
+    virtual Vector3<float> integrate_hit(
+        Ray& ray,
+        const IntersectionParams& /*its*/,
+        const Model* model,
+        std::vector<std::shared_ptr<ILight>>& light_sources,
+        Sampler& sampler,
+        int traversal_depth = 0)
+    {
+        return integrate(ray, model, light_sources, sampler, traversal_depth);
+    }
+
+    virtual bool accepts_primary_hit() const
+    {
+        return false;
+    }
+
 };
 
 }
\ No newline at end of file
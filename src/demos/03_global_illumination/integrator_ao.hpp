@@ -23,21 +23,31 @@ struct AOIntegrator : public Integrator
         Ray& ray, 
         const Model* model, 
         std::vector<std::shared_ptr<ILight>>& light_sources, 
+        Sampler& sampler,
         int traversal_depth) override
     {
         auto its = model->intersect(ray);
+        return integrate_hit(ray, its, model, light_sources, sampler, traversal_depth);
+    }
 
+    Vector3<float> integrate_hit(
+        Ray& ray,
+        const IntersectionParams& its,
+        const Model* model,
+        std::vector<std::shared_ptr<ILight>>& light_sources,
+        Sampler& sampler,
+        int traversal_depth) override
+    {
         if (!its.is_intersection())
             return Vector3<float>(0.f, 0.f, 0.f);
 
         CoordinateSystem cs(its.normal);
 
-        auto sample_dir = cs.to_local(random_cosine_direction());
+        auto sample_dir = cs.to_local(sample_cosine_direction(sampler.get_2d()));
         sample_dir = normalize(sample_dir);
         Ray random_ray(its.point + sample_dir * 1e-5, sample_dir);
 
-        IntersectionParams ao_its = model->intersect(random_ray);
-        if (ao_its.is_intersection() && ao_its.t < visibility_scale)
+        if (model->occluded(random_ray, visibility_scale))
         {
             Vector3<float> result(ambient_color);
             result *= dot(its.normal, sample_dir) / ML_PI;
@@ -47,6 +57,11 @@ struct AOIntegrator : public Integrator
         return ambient_color;
     }
 
+    bool accepts_primary_hit() const override
+    {
+        return true;
+    }
+
     Vector3<float> ambient_color;
     float visibility_scale;
 };
@@ -17,9 +17,21 @@ struct NormalIntegrator : Integrator
         Ray& ray, 
         const Model* model,
         std::vector<std::shared_ptr<ILight>>& light_sources, 
+        Sampler& sampler,
         int traversal_depth) override
     {
         IntersectionParams its = model->intersect(ray);
+        return integrate_hit(ray, its, model, light_sources, sampler, traversal_depth);
+    }
+
+    Vector3<float> integrate_hit(
+        Ray& ray,
+        const IntersectionParams& its,
+        const Model* model,
+        std::vector<std::shared_ptr<ILight>>& light_sources,
+        Sampler& sampler,
+        int traversal_depth) override
+    {
         if (its.is_intersection())
         {
             Vector3<float> normal_color = its.normal + Vector3<float>(1.f);
@@ -30,6 +42,11 @@ struct NormalIntegrator : Integrator
         return Vector3<float>(0.f);
     }
 
+    bool accepts_primary_hit() const override
+    {
+        return true;
+    }
+
 };
 
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once 
 #include "integrator.hpp"
 #include "material.hpp"
+#include "../../utility/random_number.hpp"
 
 namespace moonlight
 {
@@ -11,6 +12,7 @@ struct PathIntegrator : Integrator
         Ray& ray, 
         const Model* model, 
         std::vector<std::shared_ptr<ILight>>& light_sources, 
+        Sampler& sampler,
         int traversal_depth) override
     {
         if (traversal_depth <= 0)
@@ -19,6 +21,24 @@ struct PathIntegrator : Integrator
         }
 
         IntersectionParams its = model->intersect(ray);
+        return integrate_hit(ray, its, model, light_sources, sampler, traversal_depth);
+    }
+
+    Vector3<float> integrate_hit(
+        Ray& ray,
+        const IntersectionParams& hit,
+        const Model* model,
+        std::vector<std::shared_ptr<ILight>>& light_sources,
+        Sampler& sampler,
+        int traversal_depth) override
+    {
+        if (traversal_depth <= 0)
+        {
+            return Vector3<float>(0.f);
+        }
+
+        // IMaterial::scatter takes the hit by reference
+        IntersectionParams its = hit;
         IntersectionParams its_light;
         
         int light_idx = -1;
@@ -54,22 +74,32 @@ struct PathIntegrator : Integrator
         Ray scattered;
         float pdf = 0.f;
         
-        if (random_in_range(0.f, 1.f) < 0.5f)
+        // Both strategies draw the same dimensions, the bounces of all samples
+        // stay aligned
+        const float u_strategy = sampler.get_1d();
+        const float u_light = sampler.get_1d();
+        if (u_strategy < 0.5f)
         {
-            material->scatter(scattered, ray, pdf, its);
+            material->scatter(scattered, ray, pdf, its, sampler);
         }
         else
         {
-            auto light = light_sources[random_in_range_int(0, light_sources.size() - 1)];
-            light->sample(scattered, ray, pdf, its);
+            const int n_lights = (int)light_sources.size();
+            auto light = light_sources[std::min((int)(u_light * n_lights), n_lights - 1)];
+            light->sample(scattered, ray, pdf, its, sampler);
         }
         
         return
             attenuation *
             material->scattering_pdf(scattered, its) *
-            integrate(scattered, model, light_sources, traversal_depth - 1) /
+            integrate(scattered, model, light_sources, sampler, traversal_depth - 1) /
             pdf;
     }
+
+    bool accepts_primary_hit() const override
+    {
+        return true;
+    }
 };
 
 }
\ No newline at end of file
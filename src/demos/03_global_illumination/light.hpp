@@ -1,6 +1,7 @@
 #pragma once
 #include "../../simple_math.hpp"
-#include "../collision/ray.hpp"
+#include "../../collision/ray.hpp"
+#include "sampler.hpp"
 
 namespace moonlight
 {
@@ -27,7 +28,7 @@ public:
         return 0.f;
     }
 
-    virtual void sample(Ray& r_out, const Ray& r_in, float& pdf, const IntersectionParams& its) = 0;
+    virtual void sample(Ray& r_out, const Ray& r_in, float& pdf, const IntersectionParams& its, Sampler& sampler) = 0;
     virtual IntersectionParams intersect(const Ray& ray) = 0;
 
     Vector3<float> albedo() const
@@ -48,9 +48,10 @@ public:
         Ray& r_out, 
         const Ray& r_in, 
         float& pdf, 
-        const IntersectionParams& its) override
+        const IntersectionParams& its,
+        Sampler& sampler) override
     {
-        Vector3<float> p = m_shape->sample();
+        Vector3<float> p = m_shape->sample(sampler);
         Vector3<float> dir = p - its.point;
         Vector3<float> n_dir = normalize(dir);
         
@@ -64,9 +65,9 @@ public:
         pdf = distance_squared / (theta * m_shape->area());
     }
 
-    Vector3<float> sample(const Vector3<float>& origin)
+    Vector3<float> sample(const Vector3<float>& origin, Sampler& sampler)
     {
-        return m_shape->sample() - origin;
+        return m_shape->sample(sampler) - origin;
     }
     
     IntersectionParams intersect(const Ray& ray) override
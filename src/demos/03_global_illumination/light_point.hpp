@@ -28,7 +28,7 @@ public:
         return 1.f;
     }
 
-    virtual void sample(Ray& r_out, const Ray& r_in, float& pdf, const IntersectionParams& its) override
+    virtual void sample(Ray& r_out, const Ray& r_in, float& pdf, const IntersectionParams& its, Sampler& sampler) override
     {
 
     }
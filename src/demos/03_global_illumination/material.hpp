@@ -3,6 +3,8 @@
 #include "../../simple_math.hpp"
 #include "../../collision/intersect.hpp"
 #include "../../collision/ray.hpp"
+#include "sampler.hpp"
+#include <memory>
 
 namespace moonlight
 {
@@ -23,7 +25,9 @@ public:
     {
     }
 
-    virtual void scatter(Ray& r_out, const Ray& r_in, float& pdf, IntersectionParams& intersect) = 0;
+    virtual ~IMaterial() = default;
+
+    virtual void scatter(Ray& r_out, const Ray& r_in, float& pdf, IntersectionParams& intersect, Sampler& sampler) = 0;
 
     virtual float scattering_pdf(const Ray& scattered, IntersectionParams& intersect) = 0;
 
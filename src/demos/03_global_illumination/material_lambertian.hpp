@@ -1,6 +1,7 @@
 #pragma once
 #include "coordinate_system.hpp"
 #include "material.hpp"
+#include "samplers.hpp"
 #include "../../utility/random_number.hpp"
 
 namespace moonlight
@@ -18,10 +19,10 @@ struct LamberrtianMaterial : public IMaterial
     {
     }
 
-    void scatter(Ray& r_out, const Ray& r_in, float& pdf, IntersectionParams& intersect) override
+    void scatter(Ray& r_out, const Ray& r_in, float& pdf, IntersectionParams& intersect, Sampler& sampler) override
     {
         CoordinateSystem cs(intersect.normal);
-        auto cs_dir = cs.to_local(random_cosine_direction());
+        auto cs_dir = cs.to_local(sample_cosine_direction(sampler.get_2d()));
         cs_dir = normalize(cs_dir);
         
         pdf = dot(intersect.normal, cs_dir) / ML_PI;
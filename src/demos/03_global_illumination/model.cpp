@@ -1,4 +1,6 @@
 #include "model.hpp"
+#include "../../utility/common.hpp"
+#include <algorithm>
 #include <fstream>
 
 #include "material_lambertian.hpp"
@@ -12,12 +14,131 @@ Model::Model()
     m_bvh = std::make_unique<BVH>();
 }
 
-void Model::build_bvh()
+void Model::build_bvh(BVHBuildStrategy strategy, BVHWidth width)
 {
-    m_bvh->build_bvh(m_mesh.get(), m_stride_in_32floats, m_num_triangles);
+    if (m_mesh == nullptr)
+    {
+        OutputDebugStringA("[Moonlight] The positions of the mesh were released, the BVH can't be rebuilt\n");
+        return;
+    }
+
+    m_bvh->build_bvh(m_mesh.get(), m_stride_in_32floats, m_num_triangles, strategy);
+    m_bvh_width = width;
+    collapse_bvh();
+}
+
+void Model::refit_bvh()
+{
+    if (m_mesh == nullptr)
+    {
+        OutputDebugStringA("[Moonlight] The positions of the mesh were released, the BVH can't be refit\n");
+        return;
+    }
+
+    dispatch_vertex_layout(m_stride_in_32floats, [&](const auto& layout)
+    {
+        for (uint64_t i = 0; i < m_num_triangles; ++i)
+        {
+            float* triangle = &m_mesh[i * layout.triangle_size];
+            float* centroid = &triangle[layout.centroid_offset];
+            for (int a = 0; a < 3; ++a)
+            {
+                centroid[a] = (triangle[a] + triangle[layout.stride + a] +
+                    triangle[layout.stride * 2 + a]) / 3.f;
+            }
+        }
+    });
+
+    // The cache no longer matches the mesh
+    m_mesh_hash = 0;
+
+    m_bvh->refit(m_mesh.get(), m_stride_in_32floats);
+    collapse_bvh();
 }
 
-void Model::parse_mof(const std::string& filename)
+void Model::release_positions()
+{
+#if ML_BVH_SIMD_LEAVES
+    if (m_mesh_layout != MeshLayout::Split || m_mesh == nullptr)
+    {
+        return;
+    }
+
+    // The hash is still needed to write the cache
+    mesh_hash();
+    m_mesh.reset();
+    m_mesh_num_elements = 0;
+#endif
+}
+
+void Model::collapse_bvh()
+{
+    m_bvh4.reset();
+    m_bvh8.reset();
+
+    switch (m_bvh_width)
+    {
+    case BVHWidth::Wide4:
+        m_bvh4 = std::make_unique<BVH4>();
+        m_bvh4->collapse(*m_bvh);
+        break;
+    case BVHWidth::Wide8:
+        m_bvh8 = std::make_unique<BVH8>();
+        m_bvh8->collapse(*m_bvh);
+        break;
+    default:
+        break;
+    }
+}
+
+void Model::bvh_deserialize(const std::string& filename, MeshLayout layout)
+{
+    const std::string mof_filename = filename.substr(0, filename.rfind(".bvh"));
+    if (m_mesh == nullptr)
+    {
+        parse_mof(mof_filename, layout);
+    }
+
+    // Rebuilt in memory only, the cache may sit in a read-only asset directory.
+    // bvh_serialize rewrites it on request.
+    if (!m_bvh->deserialize(filename, mesh_hash()))
+    {
+        OutputDebugStringA("[Moonlight] BVH cache is outdated or unreadable, rebuilding the BVH without saving it\n");
+        build_bvh(BVHBuildStrategy::ParallelBinnedSAH);
+        return;
+    }
+
+#if ML_BVH_SIMD_LEAVES
+    if (!m_bvh->has_leaf_blocks())
+    {
+        m_bvh->build_leaf_blocks(m_mesh.get(), m_stride_in_32floats);
+    }
+#endif
+
+    collapse_bvh();
+}
+
+bool Model::bvh_serialize(const std::string& filename)
+{
+    // Loaded from a cache, which is rewritten in place
+    const bool written = m_bvh->serialize(filename.ends_with(".bvh") ? filename : filename + ".bvh", mesh_hash());
+
+    // A mapped tree was copied out of its mapping, which the wide BVH points into
+    collapse_bvh();
+    return written;
+}
+
+uint64_t Model::mesh_hash()
+{
+    if (m_mesh_hash == 0)
+    {
+        m_mesh_hash = hash_bytes(m_mesh.get(), m_mesh_num_elements * sizeof(float));
+    }
+
+    return m_mesh_hash;
+}
+
+void Model::parse_mof(const std::string& filename, MeshLayout layout)
 {
     uint64_t n_attr_data_bytes = 0;
 
@@ -28,11 +149,32 @@ void Model::parse_mof(const std::string& filename)
     file.read((char*)&n_attr_data_bytes, sizeof(uint64_t));
     file.read((char*)&m_mesh_flags, sizeof(uint64_t));
 
+    // Every BVH query dispatches on this stride, the supported ones compile
+    // into code with constant offsets, see dispatch_vertex_layout
+    if (!is_known_vertex_stride(m_stride_in_32floats))
+    {
+        OutputDebugStringA("[Moonlight] Unknown vertex layout in the mof file, tracing falls back to a runtime stride\n");
+    }
+
+    m_mesh_layout = layout;
     m_mesh_num_elements = n_attr_data_bytes / sizeof(float);
     m_mesh = std::make_unique<float[]>(m_mesh_num_elements);
 
     file.read((char*)m_mesh.get(), n_attr_data_bytes);
 
+    if (layout == MeshLayout::Split && m_num_triangles > 0)
+    {
+        // The material index is optional in the file, the records tell from
+        // their size whether it is there
+        const bool has_centroids = m_mesh_flags & ML_MISC_FLAG_CENTROIDS_INCLUDED;
+        const uint64_t source_triangle_size = m_mesh_num_elements / m_num_triangles;
+        const bool has_material =
+            source_triangle_size > m_stride_in_32floats * 3 + (has_centroids ? 3 : 0);
+
+        std::unique_ptr<float[]> source = std::move(m_mesh);
+        split_mesh(source.get(), m_stride_in_32floats, source_triangle_size, has_centroids, has_material);
+    }
+
     if (m_mesh_flags & ML_MISC_FLAG_MATERIALS_APPENDED)
     {
         file.read((char*)&m_num_materials, sizeof(uint64_t));
@@ -47,20 +189,22 @@ void Model::parse_mof(const std::string& filename)
             file.read((char*)&material_flags, sizeof(uint8_t));
             file.read((char*)&texture_map_flags, sizeof(uint8_t));
 
+            // Materials without a diffuse color become grey, every material
+            // needs one to be shaded and color_rgb indexes the textures by material
+            Vector3<float> diffuse_color(0.5f);
             if (material_flags & ML_MATERIAL_DIFFUSE)
             {
-                Vector3<float> diffuse_color;
                 file.read((char*)&diffuse_color.x, sizeof(float) * 3);
+            }
 
-                m_textures.emplace_back(new SingleColor(
-                    diffuse_color.x,
-                    diffuse_color.y,
-                    diffuse_color.z,
-                    1.f
-                ));
+            m_textures.emplace_back(new SingleColor(
+                diffuse_color.x,
+                diffuse_color.y,
+                diffuse_color.z,
+                1.f
+            ));
 
-                m_materials[i] = new LamberrtianMaterial(m_textures.back());
-            }
+            m_materials[i] = new LamberrtianMaterial(m_textures.back());
 
             //
             //
@@ -107,6 +251,69 @@ void Model::parse_mof(const std::string& filename)
             }
         }
     }
+
+    // Meshes without materials are shaded with a grey one, the material index
+    // of their triangles is 0
+    if (m_materials.empty())
+    {
+        m_num_materials = 1;
+        m_textures.emplace_back(new SingleColor(0.5f, 0.5f, 0.5f, 1.f));
+        m_materials.push_back(new LamberrtianMaterial(m_textures.back()));
+    }
+}
+
+void Model::split_mesh(
+    const float* source,
+    uint64_t source_stride,
+    uint64_t source_triangle_size,
+    bool has_centroids,
+    bool has_material)
+{
+    constexpr uint64_t POSITION_STRIDE = 3;
+    constexpr uint64_t TRIANGLE_SIZE = POSITION_STRIDE * 3 + 3 + 1;
+    const uint64_t attribute_size = source_stride - POSITION_STRIDE;
+    const uint64_t material_offset = source_stride * 3 + (has_centroids ? 3 : 0);
+
+    m_stride_in_32floats = POSITION_STRIDE;
+    m_mesh_num_elements = m_num_triangles * TRIANGLE_SIZE;
+    m_mesh = std::make_unique<float[]>(m_mesh_num_elements);
+
+    m_shading_stride = attribute_size * 3 + 1;
+    m_shading = std::make_unique<float[]>(m_num_triangles * m_shading_stride);
+
+    for (uint64_t i = 0; i < m_num_triangles; ++i)
+    {
+        const float* src = &source[i * source_triangle_size];
+        float* positions = &m_mesh[i * TRIANGLE_SIZE];
+        float* shading = &m_shading[i * m_shading_stride];
+
+        for (uint64_t v = 0; v < 3; ++v)
+        {
+            const float* vertex = &src[v * source_stride];
+            std::copy(vertex, vertex + POSITION_STRIDE, &positions[v * POSITION_STRIDE]);
+            std::copy(vertex + POSITION_STRIDE, vertex + source_stride, &shading[v * attribute_size]);
+        }
+
+        // Recomputed even if the file has them, as refit_bvh does
+        float* centroid = &positions[POSITION_STRIDE * 3];
+        for (int a = 0; a < 3; ++a)
+        {
+            centroid[a] = (positions[a] + positions[POSITION_STRIDE + a] +
+                positions[POSITION_STRIDE * 2 + a]) / 3.f;
+        }
+
+        // The copy in the position record keeps it a complete BVH record, but
+        // only the shading stream is read for hits
+        const float material = has_material ? src[material_offset] : 0.f;
+        positions[TRIANGLE_SIZE - 1] = material;
+        shading[m_shading_stride - 1] = material;
+    }
+}
+
+uint64_t Model::shading_offset(uint32_t triangle_idx) const
+{
+    const uint64_t triangle_size = m_stride_in_32floats * 3 + 3 + 1;
+    return (triangle_idx / triangle_size) * m_shading_stride;
 }
 
 Vector3<float> Model::color_rgb(const uint32_t material_idx) const
@@ -123,18 +330,71 @@ Vector4<float> Model::color_rgba(const uint32_t material_idx) const
 
 IntersectionParams Model::intersect(Ray& ray) const
 {
-    IntersectionParams its = m_bvh->intersect(ray, m_mesh.get(), m_stride_in_32floats);
+    IntersectionParams its;
+    switch (m_bvh_width)
+    {
+    case BVHWidth::Wide4:
+        its = m_bvh4->intersect(ray, m_mesh.get(), m_stride_in_32floats);
+        break;
+    case BVHWidth::Wide8:
+        its = m_bvh8->intersect(ray, m_mesh.get(), m_stride_in_32floats);
+        break;
+    default:
+        its = m_bvh->intersect(ray, m_mesh.get(), m_stride_in_32floats);
+        break;
+    }
+
     its.point = ray.o + its.t * ray.d;
     return its;
 }
 
-uint32_t Model::material_idx(IntersectionParams& intersect) const
+bool Model::occluded(const Ray& ray, float tmax) const
 {
+    switch (m_bvh_width)
+    {
+    case BVHWidth::Wide4:
+        return m_bvh4->occluded(ray, m_mesh.get(), m_stride_in_32floats, tmax);
+    case BVHWidth::Wide8:
+        return m_bvh8->occluded(ray, m_mesh.get(), m_stride_in_32floats, tmax);
+    default:
+        return m_bvh->occluded(ray, m_mesh.get(), m_stride_in_32floats, tmax);
+    }
+}
+
+template<uint32_t N>
+void Model::intersect_packet(RayPacket<N>& packet, IntersectionParams* its) const
+{
+    m_bvh->intersect_packet(packet, m_mesh.get(), m_stride_in_32floats, its);
+
+    for (uint32_t i = 0; i < N; ++i)
+    {
+        const Vector3<float> o(packet.ox[i], packet.oy[i], packet.oz[i]);
+        const Vector3<float> d(packet.dx[i], packet.dy[i], packet.dz[i]);
+        its[i].point = o + its[i].t * d;
+    }
+}
+
+template void Model::intersect_packet<4>(RayPacket<4>&, IntersectionParams*) const;
+template void Model::intersect_packet<8>(RayPacket<8>&, IntersectionParams*) const;
+template void Model::intersect_packet<16>(RayPacket<16>&, IntersectionParams*) const;
+
+uint32_t Model::material_idx(const IntersectionParams& intersect) const
+{
+    if (m_mesh_layout == MeshLayout::Split)
+    {
+        return m_shading[shading_offset(intersect.triangle_idx) + m_shading_stride - 1];
+    }
+
     return m_mesh[intersect.triangle_idx + m_stride_in_32floats * 3 + 3];
 }
 
 Vector3<float> Model::normal(uint32_t triangle_idx) const
 {
+    if (m_mesh_layout == MeshLayout::Split)
+    {
+        return *(Vector3<float>*)&m_shading[shading_offset(triangle_idx)];
+    }
+
     Vector3<float> result = *(Vector3<float>*)&m_mesh[triangle_idx + 3];
     return result;
 }
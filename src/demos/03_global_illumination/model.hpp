@@ -1,6 +1,8 @@
 #pragma once
 #include "material.hpp"
 #include "../../utility/bvh.hpp"
+#include "../../utility/tlas.hpp"
+#include "../../utility/wide_bvh.hpp"
 #include "../../project_defines.hpp"
 #include "../../simple_math.hpp"
 #include <cstdint>
@@ -12,17 +14,55 @@
 namespace moonlight
 {
 
+// Memory layout of the triangle data of a Model, see Model::parse_mof
+enum class MeshLayout
+{
+    // One record per triangle with the vertices, their attributes, the centroid
+    // and the material index, as stored in the .mof file.
+    Interleaved,
+    // The records only keep the vertex positions, the vertex attributes and the
+    // material index move to a shading stream that is read once per final hit.
+    // Traversal and the leaf tests then stream less than half of the memory for
+    // meshes with normals and UVs. raw_mesh() and stride() refer to the position
+    // records, which the BVH and the compute shader consume like any other mesh.
+    Split
+};
+
 struct Model
 {
     Model();
     ~Model();
 
-    void build_bvh();
-
-    void parse_mof(const std::string& filename);
+    // The binary BVH is always built, since the compute shader consumes it.
+    // For CPU tracing it is collapsed into a wide BVH unless @width is Binary.
+    void build_bvh(
+        BVHBuildStrategy strategy = BVHBuildStrategy::BinnedSAH,
+        BVHWidth width = BVHWidth::Wide8
+    );
+
+    // Brings the BVH up to date after the vertices in raw_mesh() were moved.
+    // Recomputes the centroids and refits the tree, see BVH::refit.
+    void refit_bvh();
+
+    // Also accepts meshes without centroids, which are computed on load for
+    // the Split layout.
+    void parse_mof(const std::string& filename, MeshLayout layout = MeshLayout::Interleaved);
+
+    // Frees the position records of a Split mesh once the BVH is built or
+    // loaded. With ML_BVH_SIMD_LEAVES the leaf blocks hold their own copy of
+    // the positions and tracing reads nothing else, so only the blocks and the
+    // shading stream stay resident. raw_mesh() is null afterwards, the BVH can
+    // neither be rebuilt nor refit and there is nothing to upload to the GPU.
+    // Does nothing for the Interleaved layout or without ML_BVH_SIMD_LEAVES.
+    void release_positions();
 
     // Most important functions
     IntersectionParams intersect(Ray& ray) const;
+    // True if any geometry is hit closer than @tmax
+    bool occluded(const Ray& ray, float tmax) const;
+    // Packets always traverse the binary BVH, see BVH::intersect_packet
+    template<uint32_t N>
+    void intersect_packet(RayPacket<N>& packet, IntersectionParams* its) const;
     IMaterial* get_material(uint32_t material_idx) const
     {
         return m_materials[material_idx];
@@ -48,16 +88,27 @@ struct Model
         return m_bvh->get_raw_nodes();
     }
 
-    void bvh_deserialize(const std::string& filename)
+    // Places this model in a TLAS. All instances share the mesh and the BVH of
+    // the model, which therefore has to outlive the TLAS.
+    BVHInstance make_instance(const Transform3x4& object_to_world) const
     {
-        m_bvh->deserialize(filename.c_str());
+        BVHInstance instance;
+        instance.object_to_world = object_to_world;
+        instance.blas = m_bvh.get();
+        instance.tris = m_mesh.get();
+        instance.stride = m_stride_in_32floats;
+        return instance;
     }
 
-    void bvh_serialize(const std::string& filename)
-    {
-        std::string new_filename = filename + ".bvh";
-        m_bvh->serialize(new_filename.c_str());
-    }
+    // Loads the BVH cache @filename (<asset>.mof.bvh) together with the mesh it
+    // was built from. For an outdated cache the BVH is rebuilt, but the file is
+    // left alone.
+    // A cache written for the other MeshLayout does not match the mesh hash.
+    void bvh_deserialize(const std::string& filename, MeshLayout layout = MeshLayout::Interleaved);
+
+    // Writes the BVH cache for the asset @filename, a .mof or the .mof.bvh
+    // cache itself. Returns false if the cache could not be written.
+    bool bvh_serialize(const std::string& filename);
 
     Vector3<float> color_rgb(const uint32_t material_idx) const;
     Vector4<float> color_rgba(const uint32_t material_idx) const;
@@ -67,7 +118,7 @@ struct Model
         return m_mesh_flags;
     }
 
-    uint32_t material_idx(IntersectionParams& intersect) const;
+    uint32_t material_idx(const IntersectionParams& intersect) const;
 
     Vector3<float> normal(uint32_t triangle_idx) const;
 
@@ -86,14 +137,49 @@ struct Model
         return m_mesh.get();
     }
 
+    MeshLayout mesh_layout() const
+    {
+        return m_mesh_layout;
+    }
+
+    // Bytes held by the position records and the shading stream, the BVH and
+    // its leaf blocks not included
+    std::size_t mesh_memory_size() const
+    {
+        return (m_mesh_num_elements + m_num_triangles * m_shading_stride) * sizeof(float);
+    }
+
     uint64_t stride() const
     {
         return m_stride_in_32floats;
     }
 
+private:
+
+    void collapse_bvh();
+
+    uint64_t mesh_hash();
+
+    // Moves the interleaved records in @source into position records and the
+    // shading stream. @source_stride is the stride of the file.
+    void split_mesh(
+        const float* source,
+        uint64_t source_stride,
+        uint64_t source_triangle_size,
+        bool has_centroids,
+        bool has_material
+    );
+
+    // Offset of the triangle @triangle_idx (a float offset into m_mesh, see
+    // IntersectionParams::triangle_idx) in the shading stream
+    uint64_t shading_offset(uint32_t triangle_idx) const;
+
 private:
 
     std::unique_ptr<BVH> m_bvh;
+    std::unique_ptr<BVH4> m_bvh4;
+    std::unique_ptr<BVH8> m_bvh8;
+    BVHWidth m_bvh_width = BVHWidth::Wide8;
 
     uint64_t m_num_triangles;
     uint64_t m_stride_in_32floats;
@@ -103,8 +189,15 @@ private:
     std::vector<IMaterial*> m_materials;
     std::vector<ITexture*> m_textures;
 
+    MeshLayout m_mesh_layout = MeshLayout::Interleaved;
     std::unique_ptr<float[]> m_mesh;
     size_t m_mesh_num_elements;
+    // Split layout only: the attributes of the three vertices followed by the
+    // material index, m_shading_stride floats per triangle
+    std::unique_ptr<float[]> m_shading;
+    uint64_t m_shading_stride = 0;
+    // Zero until computed
+    uint64_t m_mesh_hash = 0;
 };
 
 }
\ No newline at end of file
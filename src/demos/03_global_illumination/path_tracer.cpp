@@ -0,0 +1,513 @@
+#include "path_tracer.hpp"
+#include "integrator_ao.hpp"
+#include "integrator_normal.hpp"
+#include "integrator_path.hpp"
+#include "light_area.hpp"
+#include "light_point.hpp"
+#include "shapes/circle.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <fstream>
+
+#include "tbb/blocked_range.h"
+#include "tbb/blocked_range2d.h"
+#include "tbb/parallel_for.h"
+
+namespace moonlight
+{
+
+std::unique_ptr<Integrator> make_integrator(IntegratorType type, float visibility_scale)
+{
+    switch (type)
+    {
+    case IntegratorType::PathTracing:
+        return std::make_unique<PathIntegrator>();
+    case IntegratorType::Normal:
+        return std::make_unique<NormalIntegrator>();
+    case IntegratorType::AmbientOcclusion:
+        return std::make_unique<AOIntegrator>(visibility_scale);
+    }
+    return nullptr;
+}
+
+std::vector<std::shared_ptr<ILight>> make_cornell_box_lights(int light_choice)
+{
+    std::vector<std::shared_ptr<ILight>> light_sources;
+    switch (light_choice)
+    {
+    case 0:
+    {
+        Vector3<float> v0{ -0.884011, 5.319334, -2.517968 };
+        Vector3<float> v1{ 0.415989, 5.319334, -2.517968 };
+        Vector3<float> v2{ 0.415989, 5.319334, -3.567968 };
+        Vector3<float> v3{ -0.884011, 5.319334, -3.567968 };
+
+        std::shared_ptr<Shape> shape = std::make_shared<Rectangle>(
+            v0, v1, v2, v3
+        );
+
+        light_sources.emplace_back(new AreaLight(
+            { 15, 15, 15 },
+            shape
+        ));
+    }
+        break;
+    case 1:
+    {
+        Vector3<float> v[] =
+        {
+            // Light 1
+            { -1.884011, 5.319334, -3.517968 },
+            { -0.615989, 5.319334, -3.517968 },
+            { -0.615989, 5.319334, -4.567968 },
+            { -1.884011, 5.319334, -4.567968 },
+            // Light 2
+            { -1.884011, 5.319334, -0.517968 },
+            { -0.615989, 5.319334, -0.517968 },
+            { -0.615989, 5.319334, -1.567968 },
+            { -1.884011, 5.319334, -1.567968 },
+            // Light 3
+            { 1.884011, 5.319334, -3.517968 },
+            { 0.615989, 5.319334, -3.517968 },
+            { 0.615989, 5.319334, -4.567968 },
+            { 1.884011, 5.319334, -4.567968 },
+            // Light 4
+            { 1.884011, 5.319334, -0.517968 },
+            { 0.615989, 5.319334, -0.517968 },
+            { 0.615989, 5.319334, -1.567968 },
+            { 1.884011, 5.319334, -1.567968 }
+        };
+
+        std::shared_ptr<Shape> shape = std::make_shared<Rectangle>(
+            v[0], v[1], v[2], v[3]
+        );
+        std::shared_ptr<Shape> shape1 = std::make_shared<Rectangle>(
+            v[4], v[5], v[6], v[7]
+        );
+        std::shared_ptr<Shape> shape2 = std::make_shared<Rectangle>(
+            v[8], v[9], v[10], v[11]
+        );
+
+        Vector3<float> center{ 1.22, 5.319, -1.0f };
+        Vector3<float> normal{ 0.f, -1.f, 0.f };
+        std::shared_ptr<Shape> shape3 = std::make_shared<Circle>(
+            center, normal, 1.f
+        );
+
+        light_sources.emplace_back(new AreaLight(
+            { 15, 0, 0 },
+            shape
+        ));
+        light_sources.emplace_back(new AreaLight(
+            { 0, 15, 0 },
+            shape1
+        ));
+        light_sources.emplace_back(new AreaLight(
+            { 0, 0, 15 },
+            shape2
+        ));
+        light_sources.emplace_back(new AreaLight(
+            { 15, 15, 15 },
+            shape3
+        ));
+    }
+        break;
+    case 2:
+        light_sources.emplace_back(new PointLight
+            ({ 0.f, 2.619f, 6.f }, { 15, 15, 15 }
+        ));
+    }
+
+    return light_sources;
+}
+
+// The sampler dimensions of the position in the pixel, the integrators draw
+// from the dimensions after them
+static constexpr uint32_t camera_dimensions = 2;
+
+// Traces samples @first_sample to @first_sample + @spp - 1 of every pixel and
+// passes their sum to @store_pixel(x, y, sum). The samples depend only on the
+// pixel and sample index, so sums traced over several calls add up to the same
+// image as one call with all the samples.
+template<typename StorePixel>
+static void trace_samples(
+    const Model& model,
+    RayCamera& camera,
+    Integrator& integrator,
+    std::vector<std::shared_ptr<ILight>>& light_sources,
+    const Sampler& prototype_sampler,
+    uint32_t first_sample,
+    int spp,
+    int num_bounces,
+    bool jitter,
+    StorePixel store_pixel)
+{
+    const uint32_t width = camera.resx();
+    const uint32_t height = camera.resy();
+    const uint32_t end_sample = first_sample + spp;
+
+    if (integrator.accepts_primary_hit())
+    {
+        // Primary rays are traced as packets. Without jitter every sample of
+        // a pixel shares one primary ray, its hit is traced once and reused.
+        // With jitter each sample traces a packet of subpixel rays.
+        constexpr uint32_t packet_size = PrimaryRayPacket::size;
+        constexpr uint32_t block_width = PrimaryRayPacket::block_width;
+
+        for_each_pixel_block(width, height,
+            [&](const Vector2<uint32_t>& block, uint32_t n_cols, uint32_t n_rows)
+            {
+                std::unique_ptr<Sampler> sampler = prototype_sampler.clone();
+
+                // Packet lanes outside the image are traced but not shaded
+                auto is_inside = [&](uint32_t i)
+                {
+                    return i % block_width < n_cols && i / block_width < n_rows;
+                };
+                auto pixel = [&](uint32_t i)
+                {
+                    return Vector2<uint32_t>(block.x + i % block_width, block.y + i / block_width);
+                };
+
+                Vector3<float> albedo[packet_size];
+                IntersectionParams intersects[packet_size];
+
+                if (!jitter)
+                {
+                    auto packet = camera.getRayPacket<packet_size>(block);
+                    model.intersect_packet(packet, intersects);
+
+                    for (uint32_t i = 0; i < packet_size; ++i)
+                    {
+                        if (!is_inside(i))
+                        {
+                            continue;
+                        }
+
+                        const Ray ray = packet.ray(i);
+                        for (uint32_t s = first_sample; s < end_sample; ++s)
+                        {
+                            sampler->start_pixel_sample(pixel(i), s, camera_dimensions);
+                            Ray sample_ray = ray;
+                            albedo[i] += integrator.integrate_hit(
+                                sample_ray, intersects[i], &model, light_sources, *sampler, num_bounces
+                            );
+                        }
+                    }
+                }
+                else
+                {
+                    for (uint32_t s = first_sample; s < end_sample; ++s)
+                    {
+                        Vector2<float> offsets[packet_size];
+                        for (uint32_t i = 0; i < packet_size; ++i)
+                        {
+                            sampler->start_pixel_sample(pixel(i), s);
+                            offsets[i] = sampler->get_2d() - Vector2<float>(0.5f);
+                        }
+
+                        auto packet = camera.getRayPacket<packet_size>(block, offsets);
+                        model.intersect_packet(packet, intersects);
+
+                        for (uint32_t i = 0; i < packet_size; ++i)
+                        {
+                            if (!is_inside(i))
+                            {
+                                continue;
+                            }
+
+                            sampler->start_pixel_sample(pixel(i), s, camera_dimensions);
+                            Ray sample_ray = packet.ray(i);
+                            albedo[i] += integrator.integrate_hit(
+                                sample_ray, intersects[i], &model, light_sources, *sampler, num_bounces
+                            );
+                        }
+                    }
+                }
+
+                for (uint32_t i = 0; i < packet_size; ++i)
+                {
+                    if (is_inside(i))
+                    {
+                        store_pixel(pixel(i).x, pixel(i).y, albedo[i]);
+                    }
+                }
+            }
+        );
+        return;
+    }
+
+    tbb::parallel_for(
+        tbb::blocked_range2d<uint32_t>(0, height, 0, width),
+        [&](tbb::blocked_range2d<uint32_t> r)
+        {
+            std::unique_ptr<Sampler> sampler = prototype_sampler.clone();
+
+            for (uint32_t y = r.rows().begin(); y < r.rows().end(); ++y)
+            {
+                for (uint32_t x = r.cols().begin(); x < r.cols().end(); ++x)
+                {
+                    Vector3<float> albedo(0.f);
+                    for (uint32_t s = first_sample; s < end_sample; ++s)
+                    {
+                        // The traversal shortens the ray to its closest hit,
+                        // every sample starts from the camera ray
+                        sampler->start_pixel_sample({ x, y }, s);
+                        Ray sample_ray = jitter ?
+                            camera.getRay({ x, y }, sampler->get_2d() - Vector2<float>(0.5f)) :
+                            camera.getRay({ x, y });
+                        sampler->start_pixel_sample({ x, y }, s, camera_dimensions);
+                        albedo += integrator.integrate(sample_ray, &model, light_sources, *sampler, num_bounces);
+                    }
+                    store_pixel(x, y, albedo);
+                }
+            }
+        }
+    );
+}
+
+void render_image(
+    const Model& model,
+    RayCamera& camera,
+    Integrator& integrator,
+    std::vector<std::shared_ptr<ILight>>& light_sources,
+    const Sampler& sampler,
+    int spp,
+    int num_bounces,
+    bool jitter,
+    Vector3<float>* radiance)
+{
+    const uint32_t width = camera.resx();
+    const float scale = 1.f / (float)spp;
+
+    trace_samples(
+        model, camera, integrator, light_sources, sampler, 0, spp, num_bounces, jitter,
+        [&](uint32_t x, uint32_t y, const Vector3<float>& sum)
+        {
+            radiance[y * width + (width - 1) - x] = sum * scale;
+        }
+    );
+}
+
+void AccumulationBuffer::resize(uint32_t width, uint32_t height)
+{
+    if (width != m_width || height != m_height)
+    {
+        m_width = width;
+        m_height = height;
+        m_pixels.resize((std::size_t)width * height);
+        clear();
+    }
+}
+
+void AccumulationBuffer::accumulate(
+    const Model& model,
+    RayCamera& camera,
+    Integrator& integrator,
+    std::vector<std::shared_ptr<ILight>>& light_sources,
+    const Sampler& sampler,
+    int spp,
+    int num_bounces,
+    bool jitter)
+{
+    resize(camera.resx(), camera.resy());
+
+    // The first pass overwrites the pixels, so clear() doesn't touch them
+    const bool first_pass = m_sample_count == 0;
+    trace_samples(
+        model, camera, integrator, light_sources, sampler, m_sample_count, spp, num_bounces, jitter,
+        [&](uint32_t x, uint32_t y, const Vector3<float>& sum)
+        {
+            Vector4<float>& pixel = m_pixels[y * m_width + (m_width - 1) - x];
+            if (first_pass)
+            {
+                pixel = Vector4<float>(sum.x, sum.y, sum.z, (float)spp);
+                return;
+            }
+            pixel.x += sum.x;
+            pixel.y += sum.y;
+            pixel.z += sum.z;
+            pixel.w += (float)spp;
+        }
+    );
+    m_sample_count += spp;
+}
+
+static uint8_t encode_unorm8(float x)
+{
+    // NaN samples, e.g. of a zero pdf, encode as black
+    x = x > 0.f ? x : 0.f;
+    return (uint8_t)std::min(std::sqrt(x) * 255.f, 255.f);
+}
+
+void AccumulationBuffer::resolve_rgba8(uint8_t* rgba) const
+{
+    if (m_sample_count == 0)
+    {
+        std::fill(rgba, rgba + m_pixels.size() * 4, (uint8_t)0);
+        return;
+    }
+
+    tbb::parallel_for(
+        tbb::blocked_range<std::size_t>(0, m_pixels.size()),
+        [&](tbb::blocked_range<std::size_t> r)
+        {
+            for (std::size_t i = r.begin(); i < r.end(); ++i)
+            {
+                const Vector4<float>& pixel = m_pixels[i];
+                const float scale = 1.f / pixel.w;
+                rgba[i * 4 + 0] = encode_unorm8(pixel.x * scale);
+                rgba[i * 4 + 1] = encode_unorm8(pixel.y * scale);
+                rgba[i * 4 + 2] = encode_unorm8(pixel.z * scale);
+                rgba[i * 4 + 3] = 255;
+            }
+        }
+    );
+}
+
+void encode_rgba8(const Vector3<float>* radiance, std::size_t n_pixels, uint8_t* rgba)
+{
+    for (std::size_t i = 0; i < n_pixels; ++i)
+    {
+        rgba[i * 4 + 0] = encode_unorm8(radiance[i].x);
+        rgba[i * 4 + 1] = encode_unorm8(radiance[i].y);
+        rgba[i * 4 + 2] = encode_unorm8(radiance[i].z);
+        rgba[i * 4 + 3] = 255;
+    }
+}
+
+// CRC-32 of the PNG chunks, polynomial 0xEDB88320
+static uint32_t crc32(const uint8_t* data, std::size_t n, uint32_t crc = 0)
+{
+    static const std::array<uint32_t, 256> table = []
+    {
+        std::array<uint32_t, 256> t;
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k)
+            {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+
+    crc = ~crc;
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static void append_u32_be(std::vector<uint8_t>& out, uint32_t x)
+{
+    out.push_back((uint8_t)(x >> 24));
+    out.push_back((uint8_t)(x >> 16));
+    out.push_back((uint8_t)(x >> 8));
+    out.push_back((uint8_t)x);
+}
+
+static void write_png_chunk(std::ofstream& file, const char* type, const std::vector<uint8_t>& data)
+{
+    std::vector<uint8_t> chunk;
+    append_u32_be(chunk, (uint32_t)data.size());
+    chunk.insert(chunk.end(), type, type + 4);
+    chunk.insert(chunk.end(), data.begin(), data.end());
+    append_u32_be(chunk, crc32(&chunk[4], chunk.size() - 4));
+    file.write((const char*)chunk.data(), chunk.size());
+}
+
+bool write_png(const std::string& filename, const Vector3<float>* radiance, uint32_t width, uint32_t height)
+{
+    std::ofstream file(filename, std::ios::out | std::ios::binary);
+    if (!file)
+    {
+        return false;
+    }
+
+    // 8-bit RGB scanlines, each behind filter type 0
+    const std::size_t row_size = 1 + (std::size_t)width * 3;
+    std::vector<uint8_t> rgba((std::size_t)width * 4);
+    std::vector<uint8_t> scanlines(row_size * height);
+    for (uint32_t y = 0; y < height; ++y)
+    {
+        encode_rgba8(&radiance[(std::size_t)y * width], width, rgba.data());
+        uint8_t* row = &scanlines[y * row_size];
+        row[0] = 0;
+        for (uint32_t x = 0; x < width; ++x)
+        {
+            row[1 + x * 3 + 0] = rgba[x * 4 + 0];
+            row[1 + x * 3 + 1] = rgba[x * 4 + 1];
+            row[1 + x * 3 + 2] = rgba[x * 4 + 2];
+        }
+    }
+
+    // A zlib stream of stored deflate blocks. Renders are written once, the
+    // size is not worth a compressor.
+    constexpr std::size_t max_block_size = 65535;
+    std::vector<uint8_t> idat = { 0x78, 0x01 };
+    std::size_t offset = 0;
+    do
+    {
+        const std::size_t n = std::min(max_block_size, scanlines.size() - offset);
+        const bool last = offset + n == scanlines.size();
+        idat.push_back(last ? 1 : 0);
+        idat.push_back((uint8_t)n);
+        idat.push_back((uint8_t)(n >> 8));
+        idat.push_back((uint8_t)~n);
+        idat.push_back((uint8_t)(~n >> 8));
+        idat.insert(idat.end(), scanlines.begin() + offset, scanlines.begin() + offset + n);
+        offset += n;
+    } while (offset < scanlines.size());
+
+    uint32_t a = 1, b = 0;
+    for (uint8_t byte : scanlines)
+    {
+        a = (a + byte) % 65521;
+        b = (b + a) % 65521;
+    }
+    append_u32_be(idat, (b << 16) | a);
+
+    std::vector<uint8_t> ihdr;
+    append_u32_be(ihdr, width);
+    append_u32_be(ihdr, height);
+    ihdr.insert(ihdr.end(), { 8, 2, 0, 0, 0 });
+
+    const uint8_t signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    file.write((const char*)signature, sizeof(signature));
+    write_png_chunk(file, "IHDR", ihdr);
+    write_png_chunk(file, "IDAT", idat);
+    write_png_chunk(file, "IEND", {});
+    return (bool)file;
+}
+
+bool write_pfm(const std::string& filename, const Vector3<float>* radiance, uint32_t width, uint32_t height)
+{
+    std::ofstream file(filename, std::ios::out | std::ios::binary);
+    if (!file)
+    {
+        return false;
+    }
+
+    // Little endian, rows bottom to top
+    file << "PF\n" << width << " " << height << "\n-1.0\n";
+    std::vector<float> row((std::size_t)width * 3);
+    for (uint32_t y = height; y-- > 0;)
+    {
+        for (uint32_t x = 0; x < width; ++x)
+        {
+            const Vector3<float>& p = radiance[(std::size_t)y * width + x];
+            row[x * 3 + 0] = p.x;
+            row[x * 3 + 1] = p.y;
+            row[x * 3 + 2] = p.z;
+        }
+        file.write((const char*)row.data(), row.size() * sizeof(float));
+    }
+    return (bool)file;
+}
+
+}
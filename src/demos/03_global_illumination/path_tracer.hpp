@@ -0,0 +1,143 @@
+#pragma once
+#include "integrator.hpp"
+#include "model.hpp"
+#include "ray_camera.hpp"
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "tbb/blocked_range2d.h"
+#include "tbb/parallel_for.h"
+
+namespace moonlight
+{
+
+// The CPU rendering shared by RTX_Renderer and the headless moonlight_pt
+// target, which needs neither a window nor a device.
+
+// Primary rays are traced in packets of this type, one packet per pixel block
+using PrimaryRayPacket = RayPacket16;
+
+// Calls @trace_block(block, n_cols, n_rows) for every pixel block of a @width x
+// @height image, the blocks in parallel. @block is the top left pixel of a
+// PrimaryRayPacket, the lanes past @n_cols x @n_rows lie outside the image.
+template<typename TraceBlock>
+void for_each_pixel_block(uint32_t width, uint32_t height, TraceBlock trace_block)
+{
+    constexpr uint32_t block_width = PrimaryRayPacket::block_width;
+    constexpr uint32_t block_height = PrimaryRayPacket::block_height;
+    const uint32_t n_blocks_x = (width + block_width - 1) / block_width;
+    const uint32_t n_blocks_y = (height + block_height - 1) / block_height;
+
+    tbb::parallel_for(
+        tbb::blocked_range2d<uint32_t>(0, n_blocks_y, 0, n_blocks_x),
+        [&](tbb::blocked_range2d<uint32_t> r)
+        {
+            for (uint32_t by = r.rows().begin(); by < r.rows().end(); ++by)
+            {
+                for (uint32_t bx = r.cols().begin(); bx < r.cols().end(); ++bx)
+                {
+                    const Vector2<uint32_t> block(bx * block_width, by * block_height);
+                    trace_block(
+                        block,
+                        std::min(block_width, width - block.x),
+                        std::min(block_height, height - block.y)
+                    );
+                }
+            }
+        }
+    );
+}
+
+enum class IntegratorType
+{
+    PathTracing = 0,
+    Normal = 1,
+    AmbientOcclusion = 2
+};
+
+std::unique_ptr<Integrator> make_integrator(IntegratorType type, float visibility_scale);
+
+// The area and point lights the Cornell box assets are lit with.
+// @light_choice 0 is one white area light, 1 three colored area lights and a
+// white disk, 2 a point light.
+std::vector<std::shared_ptr<ILight>> make_cornell_box_lights(int light_choice);
+
+// Traces @spp samples of every pixel of @camera in parallel and writes their
+// mean radiance to @radiance, resx * resy pixels. Rows run top to bottom and
+// columns mirrored, the order the window shows the image in.
+// Every thread draws from a clone of @sampler. The samples depend on the pixel
+// and sample index only, the image doesn't change with the number of threads.
+// Without @jitter all samples of a pixel start with the same primary ray, for
+// integrators that accept the primary hit it's traced once per pixel. With
+// @jitter the first two dimensions of @sampler place the samples in the
+// pixel, which antialiases the edges but traces a primary ray per sample.
+void render_image(
+    const Model& model,
+    RayCamera& camera,
+    Integrator& integrator,
+    std::vector<std::shared_ptr<ILight>>& light_sources,
+    const Sampler& sampler,
+    int spp,
+    int num_bounces,
+    bool jitter,
+    Vector3<float>* radiance
+);
+
+// Radiance sums of every pixel that grow by a few samples per frame, so the
+// window stays interactive while the image converges. clear() it whenever
+// the camera, the scene or the integrator changes.
+class AccumulationBuffer
+{
+public:
+
+    // Clears the buffer if the resolution changes
+    void resize(uint32_t width, uint32_t height);
+
+    void clear()
+    {
+        m_sample_count = 0;
+    }
+
+    // Traces @spp more samples of every pixel of @camera and adds them to the
+    // sums. The sample indices continue those of the previous passes, so n
+    // passes converge to the image render_image traces with all n * @spp.
+    void accumulate(
+        const Model& model,
+        RayCamera& camera,
+        Integrator& integrator,
+        std::vector<std::shared_ptr<ILight>>& light_sources,
+        const Sampler& sampler,
+        int spp,
+        int num_bounces,
+        bool jitter
+    );
+
+    // Mean radiance of every pixel, encoded like encode_rgba8, in the order
+    // render_image writes the pixels.
+    void resolve_rgba8(uint8_t* rgba) const;
+
+    int sample_count() const
+    {
+        return m_sample_count;
+    }
+
+private:
+
+    uint32_t m_width = 0;
+    uint32_t m_height = 0;
+    int m_sample_count = 0;
+    // xyz the radiance sum, w the number of samples
+    std::vector<Vector4<float>> m_pixels;
+};
+
+// Gamma 2 encoded, clamped 8-bit RGBA of @n_pixels of @radiance
+void encode_rgba8(const Vector3<float>* radiance, std::size_t n_pixels, uint8_t* rgba);
+
+// Write @radiance of @width x @height pixels to disk. Return false if the file
+// can't be written.
+bool write_png(const std::string& filename, const Vector3<float>* radiance, uint32_t width, uint32_t height);
+bool write_pfm(const std::string& filename, const Vector3<float>* radiance, uint32_t width, uint32_t height);
+
+}
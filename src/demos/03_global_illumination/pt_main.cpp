@@ -0,0 +1,376 @@
+// moonlight_pt, the path tracer of RTX_Renderer without a window or a GPU.
+// Renders one image of a .mof asset (or its .mof.bvh cache) and writes it
+// together with the timings, for render nodes and performance regression runs.
+
+#include "path_tracer.hpp"
+#include "../../utility/cpu_features.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+
+#include "tbb/global_control.h"
+#include "tbb/info.h"
+
+using namespace moonlight;
+
+struct Options
+{
+    std::string asset_path;
+    std::string output_path = "render.png";
+    std::string timing_path;
+
+    uint32_t width = 1280;
+    uint32_t height = 720;
+    // As passed to RayCamera::initializeVariables, the defaults of RTX_Renderer
+    Vector3<float> camera_position{ 0.11f, 0.84f, 7.74f };
+    Vector3<float> camera_direction{ 0.03f, -0.07f, -1.00f };
+    float fov = 45.f;
+
+    int spp = 16;
+    int num_bounces = 4;
+    bool jitter = false;
+    SamplerType sampler = SamplerType::Sobol;
+    std::string blue_noise_path;
+    IntegratorType integrator = IntegratorType::PathTracing;
+    float visibility_scale = 0.25f;
+    int light_choice = 1;
+    int n_threads = 0;
+};
+
+static void print_usage()
+{
+    std::fputs(
+        "usage: moonlight_pt <asset.mof | asset.mof.bvh> [options]\n"
+        "  --output <file>          .png (gamma 2, 8 bit) or .pfm (linear float), default render.png\n"
+        "  --timing <file>          timing JSON, default <output>.json\n"
+        "  --resolution <w>x<h>     default 1280x720\n"
+        "  --camera <px,py,pz,dx,dy,dz>\n"
+        "                           camera position and direction as RayCamera takes them\n"
+        "  --fov <degrees>          default 45\n"
+        "  --spp <n>                samples per pixel, default 16\n"
+        "  --bounces <n>            default 4\n"
+        "  --jitter <0|1>           stratified subpixel samples, default 0 traces\n"
+        "                           the primary hit once per pixel\n"
+        "  --integrator <name>      path, normal or ao, default path\n"
+        "  --sampler <name>         independent, stratified, sobol, halton or bluenoise,\n"
+        "                           default sobol\n"
+        "  --blue-noise <file>      blue-noise mask (.pgm) of the bluenoise sampler, created\n"
+        "                           if it doesn't exist, default a mask generated at start\n"
+        "  --ao-scale <distance>    occlusion distance of the ao integrator, default 0.25\n"
+        "  --lights <0|1|2>         light setup, see make_cornell_box_lights, default 1\n"
+        "  --threads <n>            worker threads, default all cores\n",
+        stderr
+    );
+}
+
+static bool parse_floats(const char* text, float* out, int n)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        char* end = nullptr;
+        out[i] = std::strtof(text, &end);
+        if (end == text || (i + 1 < n && *end != ','))
+        {
+            return false;
+        }
+        text = end + 1;
+    }
+    return true;
+}
+
+static bool parse_options(int argc, char** argv, Options& options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg[0] != '-')
+        {
+            options.asset_path = arg;
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            std::fprintf(stderr, "moonlight_pt: %s needs a value\n", arg.c_str());
+            return false;
+        }
+
+        const char* value = argv[++i];
+        bool valid = true;
+        if (arg == "--output")
+        {
+            options.output_path = value;
+        }
+        else if (arg == "--timing")
+        {
+            options.timing_path = value;
+        }
+        else if (arg == "--resolution")
+        {
+            valid = std::sscanf(value, "%ux%u", &options.width, &options.height) == 2 &&
+                options.width > 1 && options.height > 1;
+        }
+        else if (arg == "--camera")
+        {
+            float v[6];
+            valid = parse_floats(value, v, 6);
+            options.camera_position = Vector3<float>(v[0], v[1], v[2]);
+            options.camera_direction = Vector3<float>(v[3], v[4], v[5]);
+        }
+        else if (arg == "--fov")
+        {
+            options.fov = std::strtof(value, nullptr);
+            valid = options.fov > 0.f && options.fov < 180.f;
+        }
+        else if (arg == "--spp")
+        {
+            options.spp = std::atoi(value);
+            valid = options.spp > 0;
+        }
+        else if (arg == "--bounces")
+        {
+            options.num_bounces = std::atoi(value);
+            valid = options.num_bounces > 0;
+        }
+        else if (arg == "--jitter")
+        {
+            const std::string flag = value;
+            options.jitter = flag == "1";
+            valid = flag == "0" || flag == "1";
+        }
+        else if (arg == "--sampler")
+        {
+            const std::string name = value;
+            if (name == "independent") options.sampler = SamplerType::Independent;
+            else if (name == "stratified") options.sampler = SamplerType::Stratified;
+            else if (name == "sobol") options.sampler = SamplerType::Sobol;
+            else if (name == "halton") options.sampler = SamplerType::Halton;
+            else if (name == "bluenoise") options.sampler = SamplerType::BlueNoise;
+            else valid = false;
+        }
+        else if (arg == "--blue-noise")
+        {
+            options.blue_noise_path = value;
+        }
+        else if (arg == "--integrator")
+        {
+            const std::string name = value;
+            if (name == "path") options.integrator = IntegratorType::PathTracing;
+            else if (name == "normal") options.integrator = IntegratorType::Normal;
+            else if (name == "ao") options.integrator = IntegratorType::AmbientOcclusion;
+            else valid = false;
+        }
+        else if (arg == "--ao-scale")
+        {
+            options.visibility_scale = std::strtof(value, nullptr);
+        }
+        else if (arg == "--lights")
+        {
+            options.light_choice = std::atoi(value);
+            valid = options.light_choice >= 0 && options.light_choice <= 2;
+        }
+        else if (arg == "--threads")
+        {
+            options.n_threads = std::atoi(value);
+            valid = options.n_threads > 0;
+        }
+        else
+        {
+            std::fprintf(stderr, "moonlight_pt: unknown option %s\n", arg.c_str());
+            return false;
+        }
+
+        if (!valid)
+        {
+            std::fprintf(stderr, "moonlight_pt: invalid value %s for %s\n", value, arg.c_str());
+            return false;
+        }
+    }
+
+    if (options.asset_path.empty())
+    {
+        return false;
+    }
+    if (options.timing_path.empty())
+    {
+        options.timing_path = options.output_path.substr(0, options.output_path.rfind('.')) + ".json";
+    }
+    return true;
+}
+
+static const char* integrator_name(IntegratorType type)
+{
+    switch (type)
+    {
+    case IntegratorType::PathTracing:
+        return "path";
+    case IntegratorType::Normal:
+        return "normal";
+    default:
+        return "ao";
+    }
+}
+
+static const char* sampler_name(SamplerType type)
+{
+    switch (type)
+    {
+    case SamplerType::Independent:
+        return "independent";
+    case SamplerType::Stratified:
+        return "stratified";
+    case SamplerType::Sobol:
+        return "sobol";
+    case SamplerType::Halton:
+        return "halton";
+    default:
+        return "bluenoise";
+    }
+}
+
+static std::string json_escape(const std::string& text)
+{
+    std::string escaped;
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            escaped += '\\';
+        }
+        escaped += c;
+    }
+    return escaped;
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!parse_options(argc, argv, options))
+    {
+        print_usage();
+        return 1;
+    }
+
+    if (!std::ifstream(options.asset_path, std::ios::binary))
+    {
+        std::fprintf(stderr, "moonlight_pt: can't open %s\n", options.asset_path.c_str());
+        return 1;
+    }
+
+    std::unique_ptr<tbb::global_control> thread_limit;
+    if (options.n_threads > 0)
+    {
+        thread_limit = std::make_unique<tbb::global_control>(
+            tbb::global_control::max_allowed_parallelism, options.n_threads
+        );
+    }
+    const int n_threads = options.n_threads > 0 ? options.n_threads : tbb::info::default_concurrency();
+
+    using clock = std::chrono::high_resolution_clock;
+    auto to_ms = [](clock::duration d) { return std::chrono::duration<double, std::milli>(d).count(); };
+
+    // Same as RTX_Renderer::construct_bvh
+    const auto load_t0 = clock::now();
+    Model model;
+    if (options.asset_path.ends_with(".bvh"))
+    {
+        model.bvh_deserialize(options.asset_path, MeshLayout::Split);
+    }
+    else
+    {
+        model.parse_mof(options.asset_path, MeshLayout::Split);
+        model.build_bvh(BVHBuildStrategy::ParallelBinnedSAH);
+    }
+    // Nothing is uploaded or refit here, the leaf blocks are all tracing reads
+    model.release_positions();
+    const auto load_t1 = clock::now();
+
+    RayCamera camera(Vector2<uint32_t>(options.width, options.height));
+    camera.initializeVariables(options.camera_position, normalize(options.camera_direction), options.fov, 1);
+
+    std::vector<std::shared_ptr<ILight>> light_sources = make_cornell_box_lights(options.light_choice);
+    std::unique_ptr<Integrator> integrator = make_integrator(options.integrator, options.visibility_scale);
+
+    std::unique_ptr<Sampler> sampler;
+    if (options.sampler == SamplerType::BlueNoise && !options.blue_noise_path.empty())
+    {
+        // Only a missing mask is created, a file that doesn't load is left alone
+        auto mask = std::make_shared<BlueNoiseMask>();
+        if (std::filesystem::exists(options.blue_noise_path))
+        {
+            if (!mask->load(options.blue_noise_path))
+            {
+                std::fprintf(stderr, "moonlight_pt: %s is not a blue-noise mask\n", options.blue_noise_path.c_str());
+                return 1;
+            }
+        }
+        else
+        {
+            *mask = BlueNoiseMask::generate(64);
+            if (!mask->save(options.blue_noise_path))
+            {
+                std::fprintf(stderr, "moonlight_pt: can't write %s\n", options.blue_noise_path.c_str());
+                return 1;
+            }
+        }
+        sampler = std::make_unique<BlueNoiseSampler>(mask);
+    }
+    else
+    {
+        sampler = make_sampler(options.sampler, options.spp);
+    }
+
+    std::vector<Vector3<float>> radiance((std::size_t)options.width * options.height);
+    const auto render_t0 = clock::now();
+    render_image(
+        model, camera, *integrator, light_sources, *sampler,
+        options.spp, options.num_bounces, options.jitter, radiance.data()
+    );
+    const auto render_t1 = clock::now();
+
+    const bool pfm = options.output_path.ends_with(".pfm");
+    const bool written = pfm ?
+        write_pfm(options.output_path, radiance.data(), options.width, options.height) :
+        write_png(options.output_path, radiance.data(), options.width, options.height);
+    if (!written)
+    {
+        std::fprintf(stderr, "moonlight_pt: can't write %s\n", options.output_path.c_str());
+        return 1;
+    }
+
+    const double load_ms = to_ms(load_t1 - load_t0);
+    const double render_ms = to_ms(render_t1 - render_t0);
+    const double n_samples = (double)options.width * options.height * options.spp;
+
+    std::ofstream timing(options.timing_path);
+    timing
+        << "{\n"
+        << "  \"asset\": \"" << json_escape(options.asset_path) << "\",\n"
+        << "  \"output\": \"" << json_escape(options.output_path) << "\",\n"
+        << "  \"width\": " << options.width << ",\n"
+        << "  \"height\": " << options.height << ",\n"
+        << "  \"spp\": " << options.spp << ",\n"
+        << "  \"bounces\": " << options.num_bounces << ",\n"
+        << "  \"jitter\": " << (options.jitter ? "true" : "false") << ",\n"
+        << "  \"integrator\": \"" << integrator_name(options.integrator) << "\",\n"
+        << "  \"sampler\": \"" << sampler_name(options.sampler) << "\",\n"
+        << "  \"triangles\": " << model.num_triangles() << ",\n"
+        << "  \"threads\": " << n_threads << ",\n"
+        << "  \"simd\": \"" << simd_level_name(simd_level()) << "\",\n"
+        << "  \"load_ms\": " << load_ms << ",\n"
+        << "  \"render_ms\": " << render_ms << ",\n"
+        << "  \"samples_per_second\": " << n_samples / (render_ms * 1e-3) << "\n"
+        << "}\n";
+    if (!timing)
+    {
+        std::fprintf(stderr, "moonlight_pt: can't write %s\n", options.timing_path.c_str());
+        return 1;
+    }
+
+    std::printf("%s: %ux%u, %d spp, load %.1f ms, render %.1f ms\n",
+        options.output_path.c_str(), options.width, options.height, options.spp, load_ms, render_ms);
+    return 0;
+}
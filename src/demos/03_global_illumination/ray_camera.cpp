@@ -1,7 +1,5 @@
 #include "ray_camera.hpp"
 
-using namespace DirectX;
-
 namespace moonlight {
 
 using Vector2s = Vector2<uint32_t>;
@@ -121,6 +119,55 @@ Ray RayCamera::getRay(const Vector2s& pixelLocation)
     return Ray(eyepos, normalize(direction));
 }
 
+Ray RayCamera::getRay(const Vector2s& pixelLocation, const Vector2<float>& subpixelOffset)
+{
+    Vector3f direction = 
+        topLeftPixel + 
+        (shiftx * ((float)pixelLocation.x - 1.f + subpixelOffset.x)) + 
+        (shifty * ((float)pixelLocation.y - 1.f + subpixelOffset.y));
+
+    return Ray(eyepos, normalize(direction));
+}
+
+template<uint32_t N>
+RayPacket<N> RayCamera::getRayPacket(const Vector2s& blockLocation)
+{
+    RayPacket<N> packet;
+    for (uint32_t i = 0; i < N; ++i)
+    {
+        const Vector2s pixelLocation(
+            blockLocation.x + i % RayPacket<N>::block_width,
+            blockLocation.y + i / RayPacket<N>::block_width
+        );
+        packet.set_ray(i, getRay(pixelLocation));
+    }
+
+    return packet;
+}
+
+template<uint32_t N>
+RayPacket<N> RayCamera::getRayPacket(const Vector2s& blockLocation, const Vector2<float>* subpixelOffsets)
+{
+    RayPacket<N> packet;
+    for (uint32_t i = 0; i < N; ++i)
+    {
+        const Vector2s pixelLocation(
+            blockLocation.x + i % RayPacket<N>::block_width,
+            blockLocation.y + i / RayPacket<N>::block_width
+        );
+        packet.set_ray(i, getRay(pixelLocation, subpixelOffsets[i]));
+    }
+
+    return packet;
+}
+
+template RayPacket<4> RayCamera::getRayPacket<4>(const Vector2s&);
+template RayPacket<8> RayCamera::getRayPacket<8>(const Vector2s&);
+template RayPacket<16> RayCamera::getRayPacket<16>(const Vector2s&);
+template RayPacket<4> RayCamera::getRayPacket<4>(const Vector2s&, const Vector2<float>*);
+template RayPacket<8> RayCamera::getRayPacket<8>(const Vector2s&, const Vector2<float>*);
+template RayPacket<16> RayCamera::getRayPacket<16>(const Vector2s&, const Vector2<float>*);
+
 void RayCamera::set_movement_speed(const float movement_speed)
 {
     this->movement_speed = movement_speed;
@@ -1,7 +1,7 @@
 #pragma once
 #include "../../collision/ray.hpp"
+#include "../../collision/ray_packet.hpp"
 #include "../../core/key_state.hpp"
-#include <DirectXMath.h>
 
 namespace moonlight
 {
@@ -34,6 +34,19 @@ struct RayCamera {
     // in world space.
     Ray getRay(const Vector2<uint32_t>& pixelLocation);
 
+    // Same as getRay, moved by subpixelOffset within the pixel, in [-0.5, 0.5)
+    // pixels on both axes.
+    Ray getRay(const Vector2<uint32_t>& pixelLocation, const Vector2<float>& subpixelOffset);
+
+    // Compute the rays of the block of pixels whose top-left pixel is
+    // blockLocation. See RayPacket for the layout of the block.
+    template<uint32_t N>
+    RayPacket<N> getRayPacket(const Vector2<uint32_t>& blockLocation);
+
+    // Same as getRayPacket, ray i is moved by subpixelOffsets[i]
+    template<uint32_t N>
+    RayPacket<N> getRayPacket(const Vector2<uint32_t>& blockLocation, const Vector2<float>* subpixelOffsets);
+
     void set_movement_speed(const float movement_speed);
     void setResolution(Vector2<uint32_t> newResolution);
     unsigned resx() const;
@@ -14,14 +14,6 @@ using namespace Microsoft::WRL;
 #include "texture_image.hpp"
 #include "texture_single.hpp"
 
-#include "light_point.hpp"
-
-#include "integrator_ao.hpp"
-#include "integrator_normal.hpp"
-#include "integrator_path.hpp"
-
-#include "shapes/circle.hpp"
-
 namespace moonlight {
 
 #define IMGUI_DESC_INDEX            0
@@ -166,11 +158,11 @@ void RTX_Renderer::construct_bvh(const char* asset_path)
     switch (gui.m_asset_type)
     {
     case MOF:
-        m_model->parse_mof(asset_path);
-        m_model->build_bvh();
+        m_model->parse_mof(asset_path, MeshLayout::Split);
+        m_model->build_bvh(BVHBuildStrategy::ParallelBinnedSAH);
         break;
     case BVH:
-        m_model->bvh_deserialize(asset_path);
+        m_model->bvh_deserialize(asset_path, MeshLayout::Split);
         break;
     default:
         break;
@@ -180,6 +172,7 @@ void RTX_Renderer::construct_bvh(const char* asset_path)
 Vector3<float> RTX_Renderer::trace_path(
     Ray& ray,
     ILight* light_source,
+    Sampler& sampler,
     int traversal_depth)
 {
     if (traversal_depth <= 0)
@@ -211,12 +204,12 @@ Vector3<float> RTX_Renderer::trace_path(
 
     float pdf;
     Ray scattered;
-    material->scatter(scattered, ray, pdf, its);
+    material->scatter(scattered, ray, pdf, its, sampler);
 
     return
         attenuation *
         material->scattering_pdf(scattered, its) *
-        trace_path(scattered, light_source, traversal_depth - 1) /
+        trace_path(scattered, light_source, sampler, traversal_depth - 1) /
         pdf;
 }
 
@@ -258,46 +251,54 @@ void RTX_Renderer::generate_image()
 
 void RTX_Renderer::generate_image_mt()
 {
-    tbb::parallel_for(
-        tbb::blocked_range2d<uint32_t>(0, m_window->height(), 0, m_window->width()),
-            [this](tbb::blocked_range2d<uint32_t> r)
+    const uint32_t width = m_window->width();
+    constexpr uint32_t block_width = PrimaryRayPacket::block_width;
+
+    for_each_pixel_block(width, m_window->height(),
+        [this, width](const Vector2<uint32_t>& block, uint32_t n_cols, uint32_t n_rows)
         {
-            for (uint32_t x = r.cols().begin(); x < r.cols().end(); ++x)
+            auto packet = m_ray_camera->getRayPacket<PrimaryRayPacket::size>(block);
+            IntersectionParams intersects[PrimaryRayPacket::size];
+            m_model->intersect_packet(packet, intersects);
+
+            for (uint32_t i = 0; i < PrimaryRayPacket::size; ++i)
             {
-                for (uint32_t y = r.rows().begin(); y < r.rows().end(); ++y)
+                if (i % block_width >= n_cols || i / block_width >= n_rows)
                 {
-                    std::size_t idx = y * m_window->width();
-                    idx += (m_window->width() - 1) - x;
-                    
-                    auto ray = m_ray_camera->getRay({ x, y });
-                    IntersectionParams intersect = m_model->intersect(ray);
+                    continue;
+                }
+
+                const uint32_t x = block.x + i % block_width;
+                const uint32_t y = block.y + i / block_width;
+                std::size_t idx = y * width;
+                idx += (width - 1) - x;
+
+                const IntersectionParams& intersect = intersects[i];
+                if (intersect.t < std::numeric_limits<float>::max())
+                {
+                    uint32_t material_idx = m_model->material_idx(intersect);
+
+                    Vector3<float> diffuse_color;
 
-                    if (intersect.t < std::numeric_limits<float>::max())
+                    if (m_model->material_flags() & ML_MISC_FLAG_ATTR_VERTEX_NORMAL)
                     {
-                        uint32_t material_idx = m_model->material_idx(intersect);
-
-                        Vector3<float> diffuse_color;
-                        
-                        if (m_model->material_flags() & ML_MISC_FLAG_ATTR_VERTEX_NORMAL)
-                        {
-                            Vector3<float> mat_color = m_model->normal(intersect.triangle_idx);
-                            diffuse_color = absolute(mat_color);
-                        }
-                        else
-                        {
-                            diffuse_color = m_model->color_rgb(material_idx);
-                        }
-
-                        diffuse_color *= 255.f;
-
-                        m_image[idx].r = diffuse_color.x;
-                        m_image[idx].g = diffuse_color.y;
-                        m_image[idx].b = diffuse_color.z;
-                        m_image[idx].a = 255;
-                    } else
+                        Vector3<float> mat_color = m_model->normal(intersect.triangle_idx);
+                        diffuse_color = absolute(mat_color);
+                    }
+                    else
                     {
-                        m_image[idx] = u8_four(0, 0, 0, 0);
+                        diffuse_color = m_model->color_rgb(material_idx);
                     }
+
+                    diffuse_color *= 255.f;
+
+                    m_image[idx].r = diffuse_color.x;
+                    m_image[idx].g = diffuse_color.y;
+                    m_image[idx].b = diffuse_color.z;
+                    m_image[idx].a = 255;
+                } else
+                {
+                    m_image[idx] = u8_four(0, 0, 0, 0);
                 }
             }
         }
@@ -306,139 +307,33 @@ void RTX_Renderer::generate_image_mt()
 
 void RTX_Renderer::generate_image_mt_pt()
 {
-    int light_choice = 1;
-    std::vector<std::shared_ptr<ILight>> light_sources;
-    switch (light_choice)
-    {
-    case 0:
-    {
-        Vector3<float> v0{ -0.884011, 5.319334, -2.517968 };
-        Vector3<float> v1{ 0.415989, 5.319334, -2.517968 };
-        Vector3<float> v2{ 0.415989, 5.319334, -3.567968 };
-        Vector3<float> v3{ -0.884011, 5.319334, -3.567968 };
-        
-        std::shared_ptr<Shape> shape = std::make_shared<Rectangle>(
-            v0, v1, v2, v3
-        );
-        
-        light_sources.emplace_back(new AreaLight(
-            { 15, 15, 15 },
-            shape
-        ));
-    }
-        break;
-    case 1:
-    {
-        Vector3<float> v[] =
-        {
-            // Light 1
-            { -1.884011, 5.319334, -3.517968 },
-            { -0.615989, 5.319334, -3.517968 },
-            { -0.615989, 5.319334, -4.567968 },
-            { -1.884011, 5.319334, -4.567968 },
-            // Light 2
-            { -1.884011, 5.319334, -0.517968 },
-            { -0.615989, 5.319334, -0.517968 },
-            { -0.615989, 5.319334, -1.567968 },
-            { -1.884011, 5.319334, -1.567968 },
-            // Light 3
-            { 1.884011, 5.319334, -3.517968 },
-            { 0.615989, 5.319334, -3.517968 },
-            { 0.615989, 5.319334, -4.567968 },
-            { 1.884011, 5.319334, -4.567968 },
-            // Light 4
-            { 1.884011, 5.319334, -0.517968 },
-            { 0.615989, 5.319334, -0.517968 },
-            { 0.615989, 5.319334, -1.567968 },
-            { 1.884011, 5.319334, -1.567968 }
-        };
-        
-        std::shared_ptr<Shape> shape = std::make_shared<Rectangle>(
-            v[0], v[1], v[2], v[3]
-        );
-        std::shared_ptr<Shape> shape1 = std::make_shared<Rectangle>(
-            v[4], v[5], v[6], v[7]
-        );
-        std::shared_ptr<Shape> shape2 = std::make_shared<Rectangle>(
-            v[8], v[9], v[10], v[11]
-        );
+    std::vector<std::shared_ptr<ILight>> light_sources = make_cornell_box_lights(1);
+    std::unique_ptr<Integrator> integrator = make_integrator(
+        IntegratorType(gui.m_integration_method), gui.m_visibility_scale
+    );
 
-        Vector3<float> center{ 1.22, 5.319, -1.0f };
-        Vector3<float> normal{ 0.f, -1.f, 0.f };
-        std::shared_ptr<Shape> shape3 = std::make_shared<Circle>(
-            center, normal, 1.f
-        );
-        
-        light_sources.emplace_back(new AreaLight(
-            { 15, 0, 0 },
-            shape
-        ));
-        light_sources.emplace_back(new AreaLight(
-            { 0, 15, 0 },
-            shape1
-        ));
-        light_sources.emplace_back(new AreaLight(
-            { 0, 0, 15 },
-            shape2
-        ));
-        light_sources.emplace_back(new AreaLight(
-            { 15, 15, 15 },
-            shape3
-        ));
-    }
-        break;
-    case 2:
-        light_sources.emplace_back(new PointLight
-            ({ 0.f, 2.619f, 6.f }, { 15, 15, 15 }
-        ));
-    }
+    std::unique_ptr<Sampler> sampler = make_sampler(gui.m_sampler_type, gui.m_spp);
 
-    std::unique_ptr<Integrator> integrator;
-    switch (gui.m_integration_method)
+    // Refine the image of the previous frames, the camera and scene haven't
+    // changed since the buffer was cleared
+    const int spp = std::min(gui.m_spp_per_frame, gui.m_spp - m_accumulation.sample_count());
+    if (spp > 0)
     {
-    case PathTracing:
-        integrator = std::make_unique<PathIntegrator>();
-        break;
-    case Normal:
-        integrator = std::make_unique<NormalIntegrator>();
-        break;
-    case AmbientOcclusion:
-        integrator = std::make_unique<AOIntegrator>(gui.m_visibility_scale);
-        break;
+        m_accumulation.accumulate(
+            *m_model, *m_ray_camera, *integrator, light_sources, *sampler,
+            spp, gui.m_num_bounces, gui.m_jitter
+        );
     }
+    m_accumulation.resolve_rgba8(&m_image[0].r);
+}
 
-    tbb::parallel_for(
-        tbb::blocked_range2d<uint32_t>(0, m_window->height(), 0, m_window->width()),
-        [&](tbb::blocked_range2d<uint32_t> r)
-        {
-            for (uint32_t y = r.rows().begin(); y < r.rows().end(); ++y)
-            {
-                for (uint32_t x = r.cols().begin(); x < r.cols().end(); ++x)
-                {
-                    std::size_t idx = y * m_window->width();
-                    idx += (m_window->width() - 1) - x;
-
-                    auto ray = m_ray_camera->getRay({ x, y });
-                    
-                    Vector3<float> albedo(0.f);
-                    for (int i = 0; i < gui.m_spp; ++i)
-                    {
-                        albedo += integrator->integrate(ray, m_model.get(), light_sources, gui.m_num_bounces);
-                    }
-                    auto scale = 1.f / (float)gui.m_spp;
-                    albedo.x = sqrt(scale * albedo.x);
-                    albedo.y = sqrt(scale * albedo.y);
-                    albedo.z = sqrt(scale * albedo.z);
-                    albedo *= 255.f;
-
-                    m_image[idx].r = albedo.x;
-                    m_image[idx].g = albedo.y;
-                    m_image[idx].b = albedo.z;
-                    m_image[idx].a = 255;
-                }
-            }
-        }
-    );
+bool RTX_Renderer::is_accumulating() const
+{
+    return
+        gui.m_asset_loaded &&
+        gui.m_tracing_method == TracingMethod::MultiThreaded &&
+        (gui.m_enable_path_tracing & 1) &&
+        m_accumulation.sample_count() < gui.m_spp;
 }
 
 void RTX_Renderer::generate_image_st()
@@ -455,6 +350,7 @@ void RTX_Renderer::generate_image_st()
         shape
     );
 
+    IndependentSampler sampler;
     for (uint16_t y = 0; y < m_window->height(); y += 4)
     {
         for (uint16_t x = 0; x < m_window->width(); x += 4)
@@ -474,7 +370,9 @@ void RTX_Renderer::generate_image_st()
                     Vector3<float> albedo(0.f);
                     for (int i = 0; i < gui.m_spp; ++i)
                     {
-                        albedo += trace_path(ray, light_source, gui.m_num_bounces);
+                        sampler.start_pixel_sample({ px, py }, i);
+                        Ray sample_ray = ray;
+                        albedo += trace_path(sample_ray, light_source, sampler, gui.m_num_bounces);
                     }
                     albedo /= gui.m_spp;
                     albedo.x = sqrt(albedo.x);
@@ -801,7 +699,11 @@ void RTX_Renderer::record_gui_commands(ID3D12GraphicsCommandList* command_list)
         }
 
         ImGui::DragInt("spp", &gui.m_spp, 1, 1, 1000);
-        ImGui::DragInt("bounces", &gui.m_num_bounces, 1, 1, 16);
+        ImGui::DragInt("spp per frame", &gui.m_spp_per_frame, 1, 1, 64);
+        if (ImGui::DragInt("bounces", &gui.m_num_bounces, 1, 1, 16))
+        {
+            m_accumulation.clear();
+        }
 
         ImGui::Text("Choose a threading model");
         {
@@ -842,11 +744,17 @@ void RTX_Renderer::record_gui_commands(ID3D12GraphicsCommandList* command_list)
                 if (ImGui::Selectable(integration_names[n], gui.m_integration_method == n))
                     gui.m_integration_method = IntegratorValue(n);
             }
+
+            if (prev_tracing_method != gui.m_integration_method)
+            {
+                m_accumulation.clear();
+            }
         }
 
         if (ImGui::Button("Enable path tracing"))
         {
             gui.m_enable_path_tracing++;
+            m_accumulation.clear();
         }
 
         if (gui.m_enable_path_tracing & 1)
@@ -855,11 +763,37 @@ void RTX_Renderer::record_gui_commands(ID3D12GraphicsCommandList* command_list)
             if(ImGui::Button("Generate New Image"))
             {
                 gui.m_generate_new_image = true;
+                m_accumulation.clear();
+            }
+
+            ImGui::Text("Samples: %d / %d", m_accumulation.sample_count(), gui.m_spp);
+
+            if (ImGui::Checkbox("Jitter", &gui.m_jitter))
+            {
+                m_accumulation.clear();
+            }
+
+            const char* sampler_names[] =
+            {
+                "Independent",
+                "Stratified",
+                "Sobol",
+                "Halton",
+                "Blue noise"
+            };
+            int sampler_type = (int)gui.m_sampler_type;
+            if (ImGui::Combo("Sampler", &sampler_type, sampler_names, _countof(sampler_names)))
+            {
+                gui.m_sampler_type = SamplerType(sampler_type);
+                m_accumulation.clear();
             }
 
             if (gui.m_integration_method == AmbientOcclusion)
             {
-                ImGui::DragFloat("visib_scale", &gui.m_visibility_scale, 0.01f, 0.02f, 1.f);
+                if (ImGui::DragFloat("visib_scale", &gui.m_visibility_scale, 0.01f, 0.02f, 1.f))
+                {
+                    m_accumulation.clear();
+                }
             }
         }
 
@@ -973,6 +907,7 @@ void RTX_Renderer::resize()
     );
 
     // Resizing requires retracing the scene
+    m_accumulation.clear();
     generate_image();
 }
 
@@ -992,6 +927,7 @@ void RTX_Renderer::update()
         gui.m_asset_loaded = true;
         m_asset_path = nullptr;
 
+        m_accumulation.clear();
         generate_image();
 
         return;
@@ -1011,12 +947,21 @@ void RTX_Renderer::update()
     if (m_ray_camera->camera_variables_need_updating())
     {
         m_ray_camera->reinitialize_camera_variables();
+        m_accumulation.clear();
+        generate_image();
+    }
+    else if (is_accumulating())
+    {
         generate_image();
     }
 
     if (gui.m_serialize_bvh)
     {
-        m_model->bvh_serialize(gui.m_last_asset_path.c_str());
+        if (!m_model->bvh_serialize(gui.m_last_asset_path.c_str()))
+        {
+            OutputDebugStringA("[Moonlight] Exporting the BVH failed, the cache could not be written\n");
+        }
+        gui.m_serialize_bvh = false;
     }
 }
 
@@ -2,6 +2,7 @@
 #include "coordinate_system.hpp"
 #include "light_area.hpp"
 #include "model.hpp"
+#include "path_tracer.hpp"
 #include "ray_camera.hpp"
 #include "../common/scene.hpp"
 #include "../common/shader.hpp"
@@ -31,6 +32,7 @@ namespace moonlight
 
 class RTX_Renderer : public IApplication
 {
+    // Same values as IntegratorType
     enum IntegratorValue
     {
         PathTracing = 0,
@@ -55,7 +57,12 @@ class RTX_Renderer : public IApplication
         IntegratorValue m_integration_method;
         TracingMethod m_tracing_method;
 
+        // The path tracer adds m_spp_per_frame samples per frame until it
+        // has m_spp
         int m_spp = 16;
+        int m_spp_per_frame = 1;
+        bool m_jitter = false;
+        SamplerType m_sampler_type = SamplerType::Sobol;
         int m_num_bounces = 4;
         float m_visibility_scale = 0.25f;
 
@@ -94,11 +101,13 @@ private:
     void generate_image_mt();   // multi-threaded cpu
     void generate_image_mt_pt();    // path traced multi-threaded cpu
     void generate_image_st();   // single-threaded cpu
+    bool is_accumulating() const;
     void upload_to_texture();
 
     Vector3<float> trace_path(
         Ray& ray,
         ILight* light_source,
+        Sampler& sampler,
         int traversal_depth
     );
 
@@ -130,6 +139,7 @@ private:
     // BVH related
     std::unique_ptr<Model> m_model;
     std::vector<u8_four> m_image;
+    AccumulationBuffer m_accumulation;
 
 private:
 
@@ -0,0 +1,281 @@
+#include "sampler.hpp"
+#include <algorithm>
+#include <cmath>
+
+namespace moonlight
+{
+
+// Upper 24 bits of the fixed point fraction @x, in [0, 1)
+static float to_unit_float(uint32_t x)
+{
+    return (float)(x >> 8) * 0x1p-24f;
+}
+
+static uint32_t reverse_bits(uint32_t x)
+{
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+    x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// Element @i of a random permutation of [0, @l) chosen by @p, after Kensler
+// 2013, "Correlated Multi-Jittered Sampling"
+static uint32_t permutation_element(uint32_t i, uint32_t l, uint32_t p)
+{
+    uint32_t w = l - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do
+    {
+        i ^= p;
+        i *= 0xe170893du;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8;
+        i *= 0x0929eb3fu;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | p >> 27;
+        i *= 0x6935fa69u;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303u;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3u;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3dfu;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= l);
+    // Reduced first, i + p could wrap around
+    return (i + p % l) % l;
+}
+
+// Owen scrambling of the bits of @x from the most significant one down, with
+// the hash of Burley 2020
+static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed)
+{
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+static uint32_t sobol_dimension0(uint32_t index)
+{
+    return reverse_bits(index);
+}
+
+static uint32_t sobol_dimension1(uint32_t index)
+{
+    uint32_t result = 0;
+    for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1)
+    {
+        if (index & 1)
+        {
+            result ^= v;
+        }
+    }
+    return result;
+}
+
+// Point @index of the Sobol pair of dimensions scrambled by @seed
+static Vector2<float> scrambled_sobol_2d(uint32_t index, uint32_t seed)
+{
+    index = nested_uniform_scramble(index, seed);
+    return Vector2<float>(
+        to_unit_float(nested_uniform_scramble(sobol_dimension0(index), Sampler::hash_combine(seed, 0))),
+        to_unit_float(nested_uniform_scramble(sobol_dimension1(index), Sampler::hash_combine(seed, 1)))
+    );
+}
+
+static float scrambled_sobol_1d(uint32_t index, uint32_t seed)
+{
+    index = nested_uniform_scramble(index, seed);
+    return to_unit_float(nested_uniform_scramble(sobol_dimension0(index), Sampler::hash_combine(seed, 0)));
+}
+
+std::unique_ptr<Sampler> IndependentSampler::clone() const
+{
+    return std::make_unique<IndependentSampler>(*this);
+}
+
+float IndependentSampler::get_1d()
+{
+    ++m_dimension;
+    return m_rng.next_float();
+}
+
+Vector2<float> IndependentSampler::get_2d()
+{
+    m_dimension += 2;
+    const float u = m_rng.next_float();
+    return Vector2<float>(u, m_rng.next_float());
+}
+
+StratifiedSampler::StratifiedSampler(uint32_t spp)
+    : m_spp(std::max(spp, 1u))
+    , m_grid_size((uint32_t)std::ceil(std::sqrt((float)m_spp)))
+{
+}
+
+std::unique_ptr<Sampler> StratifiedSampler::clone() const
+{
+    return std::make_unique<StratifiedSampler>(*this);
+}
+
+float StratifiedSampler::get_1d()
+{
+    const uint32_t seed = hash_combine(hash_combine(m_pixel_hash, m_dimension++), m_sample_index / m_spp);
+    const uint32_t stratum = permutation_element(m_sample_index % m_spp, m_spp, seed);
+    return std::min(((float)stratum + m_rng.next_float()) / (float)m_spp, 0x1.fffffep-1f);
+}
+
+Vector2<float> StratifiedSampler::get_2d()
+{
+    const uint32_t n_cells = m_grid_size * m_grid_size;
+    const uint32_t seed = hash_combine(hash_combine(m_pixel_hash, m_dimension), m_sample_index / m_spp);
+    m_dimension += 2;
+
+    const uint32_t cell = permutation_element(m_sample_index % m_spp, n_cells, seed);
+    const float scale = 1.f / (float)m_grid_size;
+    const float u = ((float)(cell % m_grid_size) + m_rng.next_float()) * scale;
+    const float v = ((float)(cell / m_grid_size) + m_rng.next_float()) * scale;
+    return Vector2<float>(std::min(u, 0x1.fffffep-1f), std::min(v, 0x1.fffffep-1f));
+}
+
+std::unique_ptr<Sampler> SobolSampler::clone() const
+{
+    return std::make_unique<SobolSampler>(*this);
+}
+
+float SobolSampler::get_1d()
+{
+    return scrambled_sobol_1d(m_sample_index, hash_combine(m_pixel_hash, m_dimension++));
+}
+
+Vector2<float> SobolSampler::get_2d()
+{
+    const uint32_t seed = hash_combine(m_pixel_hash, m_dimension);
+    m_dimension += 2;
+    return scrambled_sobol_2d(m_sample_index, seed);
+}
+
+static constexpr uint32_t halton_primes[] = {
+    2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+    59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131
+};
+
+std::unique_ptr<Sampler> HaltonSampler::clone() const
+{
+    return std::make_unique<HaltonSampler>(*this);
+}
+
+float HaltonSampler::get_1d()
+{
+    return sample_dimension(m_dimension++);
+}
+
+Vector2<float> HaltonSampler::get_2d()
+{
+    const float u = sample_dimension(m_dimension++);
+    return Vector2<float>(u, sample_dimension(m_dimension++));
+}
+
+float HaltonSampler::sample_dimension(uint32_t dimension)
+{
+    if (dimension >= std::size(halton_primes))
+    {
+        return m_rng.next_float();
+    }
+
+    // Radical inverse of the sample index with every digit permuted by a hash
+    // of the digits above it. The permuted zeros past the last digit of the
+    // index are uniform within the interval of the digits so far, that tail
+    // is drawn in one go instead of digit by digit down to float precision.
+    const uint32_t base = halton_primes[dimension];
+    const uint32_t hash = hash_combine(m_pixel_hash, dimension);
+    const float inv_base = 1.f / (float)base;
+    float inv_base_m = 1.f;
+    uint32_t reversed_digits = 0;
+    uint32_t n_digits = 0;
+    for (uint32_t a = m_sample_index; a != 0; ++n_digits)
+    {
+        const uint32_t next = a / base;
+        const uint32_t digit = a - next * base;
+        const uint32_t digit_hash = hash_u32(hash ^ reversed_digits);
+        reversed_digits = reversed_digits * base + permutation_element(digit, base, digit_hash);
+        inv_base_m *= inv_base;
+        a = next;
+    }
+
+    const float tail = to_unit_float(hash_combine(hash ^ reversed_digits, n_digits));
+    return std::min(inv_base_m * ((float)reversed_digits + tail), 0x1.fffffep-1f);
+}
+
+BlueNoiseSampler::BlueNoiseSampler(std::shared_ptr<const BlueNoiseMask> mask)
+    : m_mask(std::move(mask))
+{
+}
+
+std::unique_ptr<Sampler> BlueNoiseSampler::clone() const
+{
+    return std::make_unique<BlueNoiseSampler>(*this);
+}
+
+// Toroidal shift of @u by the mask value at the pixel, with the mask moved by
+// an offset of @seed so the dimensions don't share their shifts
+float BlueNoiseSampler::shift(float u, uint32_t seed) const
+{
+    const float offset = m_mask->value(m_pixel.x + (seed & 0xFFFF), m_pixel.y + (seed >> 16));
+    const float shifted = u + offset;
+    return shifted >= 1.f ? shifted - 1.f : shifted;
+}
+
+float BlueNoiseSampler::get_1d()
+{
+    // Seeded by the dimension alone, every pixel sees the same points
+    const uint32_t seed = hash_u32(m_dimension++);
+    return shift(scrambled_sobol_1d(m_sample_index, seed), hash_combine(seed, 2));
+}
+
+Vector2<float> BlueNoiseSampler::get_2d()
+{
+    const uint32_t seed = hash_u32(m_dimension);
+    m_dimension += 2;
+    const Vector2<float> u = scrambled_sobol_2d(m_sample_index, seed);
+    return Vector2<float>(shift(u.x, hash_combine(seed, 2)), shift(u.y, hash_combine(seed, 3)));
+}
+
+std::shared_ptr<const BlueNoiseMask> default_blue_noise_mask()
+{
+    static const std::shared_ptr<const BlueNoiseMask> mask =
+        std::make_shared<const BlueNoiseMask>(BlueNoiseMask::generate(64));
+    return mask;
+}
+
+std::unique_ptr<Sampler> make_sampler(SamplerType type, int spp)
+{
+    switch (type)
+    {
+    case SamplerType::Stratified:
+        return std::make_unique<StratifiedSampler>((uint32_t)std::max(spp, 1));
+    case SamplerType::Sobol:
+        return std::make_unique<SobolSampler>();
+    case SamplerType::Halton:
+        return std::make_unique<HaltonSampler>();
+    case SamplerType::BlueNoise:
+        return std::make_unique<BlueNoiseSampler>(default_blue_noise_mask());
+    default:
+        return std::make_unique<IndependentSampler>();
+    }
+}
+
+}
@@ -0,0 +1,158 @@
+#pragma once
+#include "../../simple_math.hpp"
+#include "../../utility/blue_noise.hpp"
+#include "../../utility/random_number.hpp"
+#include <memory>
+
+namespace moonlight
+{
+
+enum class SamplerType
+{
+    Independent = 0,
+    Stratified = 1,
+    Sobol = 2,
+    Halton = 3,
+    BlueNoise = 4
+};
+
+// The random numbers of one pixel sample. Every get_1d and get_2d moves on to
+// the next dimension, so the n-th decision of every sample of a pixel draws
+// from the same dimension and the low-discrepancy samplers can spread that
+// decision evenly over the samples.
+class Sampler
+{
+public:
+
+    virtual ~Sampler() = default;
+
+    // A sampler of the same type for another thread
+    virtual std::unique_ptr<Sampler> clone() const = 0;
+
+    // Start sample @sample_index of @pixel at @dimension. The numbers drawn
+    // depend on these alone, not on the samples traced before or the thread.
+    void start_pixel_sample(const Vector2<uint32_t>& pixel, uint32_t sample_index, uint32_t dimension = 0)
+    {
+        m_pixel = pixel;
+        m_pixel_hash = hash_u32(pixel.x ^ hash_u32(pixel.y));
+        m_sample_index = sample_index;
+        m_dimension = dimension;
+        // Hashed, consecutive samples don't start next to each other in the
+        // stream. The dimension is part of the seed, so restarting at the
+        // shading dimensions doesn't repeat the numbers of the camera.
+        m_rng.seed(hash_u64(hash_u64(((uint64_t)m_pixel_hash << 32) | sample_index) ^ dimension), m_pixel_hash);
+    }
+
+    // Uniform in [0, 1)
+    virtual float get_1d() = 0;
+    virtual Vector2<float> get_2d() = 0;
+
+    // Wellons' lowbias32 integer hash
+    static uint32_t hash_u32(uint32_t x)
+    {
+        x ^= x >> 16;
+        x *= 0x7feb352du;
+        x ^= x >> 15;
+        x *= 0x846ca68bu;
+        x ^= x >> 16;
+        return x;
+    }
+
+    static uint32_t hash_combine(uint32_t seed, uint32_t value)
+    {
+        return hash_u32(seed ^ (value + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+    }
+
+protected:
+
+    Vector2<uint32_t> m_pixel;
+    uint32_t m_pixel_hash = 0;
+    uint32_t m_sample_index = 0;
+    uint32_t m_dimension = 0;
+    // Independent numbers, also once a sequence runs out of dimensions
+    PCG32 m_rng;
+};
+
+// Plain Monte Carlo, every number is independent
+class IndependentSampler : public Sampler
+{
+public:
+
+    std::unique_ptr<Sampler> clone() const override;
+    float get_1d() override;
+    Vector2<float> get_2d() override;
+};
+
+// Jittered strata, @spp of them along a 1D dimension and a square grid of at
+// least @spp cells for a 2D one. Every dimension visits its strata in its own
+// random order, further runs of @spp samples start a new permutation.
+class StratifiedSampler : public Sampler
+{
+public:
+
+    StratifiedSampler(uint32_t spp);
+
+    std::unique_ptr<Sampler> clone() const override;
+    float get_1d() override;
+    Vector2<float> get_2d() override;
+
+private:
+
+    uint32_t m_spp;
+    uint32_t m_grid_size;
+};
+
+// The first two dimensions of the Sobol sequence, Owen-scrambled and with the
+// sample order shuffled per pixel and pair of dimensions (Burley 2020,
+// "Practical Hash-based Owen Scrambling"). Best at powers of two spp.
+class SobolSampler : public Sampler
+{
+public:
+
+    std::unique_ptr<Sampler> clone() const override;
+    float get_1d() override;
+    Vector2<float> get_2d() override;
+};
+
+// Halton sequence with a prime base per dimension, Owen-scrambled per pixel.
+// Dimensions past the last base are independent.
+class HaltonSampler : public Sampler
+{
+public:
+
+    std::unique_ptr<Sampler> clone() const override;
+    float get_1d() override;
+    Vector2<float> get_2d() override;
+
+private:
+
+    float sample_dimension(uint32_t dimension);
+};
+
+// The same scrambled Sobol points in every pixel, shifted per pixel and
+// dimension by a tiled blue-noise mask (Georgiev and Fajardo 2016). At low spp
+// the error is spread as high-frequency noise over the screen.
+class BlueNoiseSampler : public Sampler
+{
+public:
+
+    BlueNoiseSampler(std::shared_ptr<const BlueNoiseMask> mask);
+
+    std::unique_ptr<Sampler> clone() const override;
+    float get_1d() override;
+    Vector2<float> get_2d() override;
+
+private:
+
+    float shift(float u, uint32_t seed) const;
+
+    std::shared_ptr<const BlueNoiseMask> m_mask;
+};
+
+// A 64 x 64 void-and-cluster mask, generated on the first call
+std::shared_ptr<const BlueNoiseMask> default_blue_noise_mask();
+
+// @spp is the number of samples per pixel the stratified sampler stratifies
+std::unique_ptr<Sampler> make_sampler(SamplerType type, int spp);
+
+}
@@ -15,14 +15,13 @@ inline Vector2<float> sample_triangle(const Vector2<float>& r)
 }
 
 // The concentric disk is oriented along the z-axis
-inline bool sample_concentrid_disk(Vector2<float>& sample)
+// @u uniform in [0, 1)^2
+inline bool sample_concentrid_disk(Vector2<float>& sample, const Vector2<float>& u)
 {
     using vec2f = Vector2<float>;
     using vec3f = Vector3<float>;
 
-    float r0 = random_in_range(0.f, 1.f);
-    float r1 = random_in_range(0.f, 1.f);
-    const vec2f p(r0, r1);
+    const vec2f p(u.x, u.y);
 
     vec2f off = 2.f * p - vec2f(1.f);
     if (off.x == 0 && off.y == 0) 
@@ -43,4 +42,16 @@ inline bool sample_concentrid_disk(Vector2<float>& sample)
     return true;
 }
 
+// Cosine weighted direction around the z-axis, of @u uniform in [0, 1)^2
+inline Vector3<float> sample_cosine_direction(const Vector2<float>& u)
+{
+    float z = std::sqrt(1 - u.y);
+
+    float phi = 2 * ML_PI * u.x;
+    float x = std::cos(phi) * std::sqrt(u.y);
+    float y = std::sin(phi) * std::sqrt(u.y);
+
+    return Vector3<float>(x, y, z);
+}
+
 }
\ No newline at end of file
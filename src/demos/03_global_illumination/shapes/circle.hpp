@@ -41,10 +41,10 @@ public:
         return its;
     }
 
-    Vector3<float> sample() override
+    Vector3<float> sample(Sampler& sampler) override
     {
         Vector2<float> sample;
-        sample_concentrid_disk(sample);  
+        sample_concentrid_disk(sample, sampler.get_2d());  
         sample *= radius; // is multiplying by the radius still ensuring uniformity?
         
         Vector3<float> sample_3d(sample.x, sample.y, 0.f);
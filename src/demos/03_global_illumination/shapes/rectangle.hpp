@@ -40,10 +40,13 @@ public:
         return ray_hit_triangle(ray, v0, v2, v3);
     }
 
-    Vector3<float> sample() override
+    Vector3<float> sample(Sampler& sampler) override
     {
-        Vector2<float> r(random_in_range(0.f, 1.f), random_in_range(0.f, 1.f));
+        // r.x picks the triangle and is stretched back to [0, 1) for the
+        // point within it
+        Vector2<float> r = sampler.get_2d();
         float t = r.x;
+        r.x = t < 0.5f ? 2.f * t : 2.f * t - 1.f;
         r = sample_triangle(r);
         if (t < 0.5f)
         {
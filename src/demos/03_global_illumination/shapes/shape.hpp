@@ -1,6 +1,7 @@
 #pragma once
 #include "../../../simple_math.hpp"
 #include "../../../collision/ray.hpp"
+#include "../sampler.hpp"
 
 namespace moonlight
 {
@@ -11,7 +12,7 @@ public:
 
     virtual float area() const = 0;
     virtual IntersectionParams intersect(const Ray& ray) = 0;
-    virtual Vector3<float> sample() = 0;
+    virtual Vector3<float> sample(Sampler& sampler) = 0;
 };
 
 }
\ No newline at end of file
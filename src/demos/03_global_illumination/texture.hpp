@@ -14,6 +14,8 @@ struct ITexture
         : m_color(other)
     {}
 
+    virtual ~ITexture() = default;
+
     virtual Vector4<float> color(float u, float v) = 0;
 
 protected:
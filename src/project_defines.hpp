@@ -10,6 +10,8 @@
 
 #define ML_PI 3.1415926f
 
+#define ML_CACHE_LINE_SIZE 64
+
 #define ML_MISC_FLAGS_NONE                      0x00
 #define ML_MISC_FLAG_CENTROIDS_INCLUDED         0x01
 #define ML_MISC_FLAG_ATTR_VERTEX                0x02
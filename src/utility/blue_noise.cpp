@@ -0,0 +1,220 @@
+#include "blue_noise.hpp"
+#include "random_number.hpp"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <fstream>
+#include <limits>
+
+namespace moonlight
+{
+
+BlueNoiseMask BlueNoiseMask::generate(uint32_t size, float sigma, uint64_t seed)
+{
+    size = std::bit_ceil(std::max(size, 2u));
+    const uint32_t mask = size - 1;
+    const uint32_t n = size * size;
+
+    // Energy a pixel adds to the pixels around it, for every offset on the torus
+    std::vector<float> kernel(n);
+    for (uint32_t y = 0; y < size; ++y)
+    {
+        for (uint32_t x = 0; x < size; ++x)
+        {
+            const float dx = (float)std::min(x, size - x);
+            const float dy = (float)std::min(y, size - y);
+            kernel[y * size + x] = std::exp(-(dx * dx + dy * dy) / (2.f * sigma * sigma));
+        }
+    }
+
+    std::vector<uint8_t> pattern(n, 0);
+    std::vector<float> energy(n, 0.f);
+
+    auto set_pixel = [&](uint32_t p, bool value)
+    {
+        pattern[p] = value;
+        const float sign = value ? 1.f : -1.f;
+        const uint32_t px = p & mask;
+        const uint32_t py = p / size;
+        for (uint32_t y = 0; y < size; ++y)
+        {
+            const float* kernel_row = &kernel[((y - py) & mask) * size];
+            float* energy_row = &energy[y * size];
+            for (uint32_t x = 0; x < size; ++x)
+            {
+                energy_row[x] += sign * kernel_row[(x - px) & mask];
+            }
+        }
+    };
+
+    // The set pixel with the most energy
+    auto tightest_cluster = [&]()
+    {
+        uint32_t best = 0;
+        float best_energy = -1.f;
+        for (uint32_t p = 0; p < n; ++p)
+        {
+            if (pattern[p] && energy[p] > best_energy)
+            {
+                best = p;
+                best_energy = energy[p];
+            }
+        }
+        return best;
+    };
+
+    // The unset pixel with the least energy
+    auto largest_void = [&]()
+    {
+        uint32_t best = 0;
+        float best_energy = std::numeric_limits<float>::max();
+        for (uint32_t p = 0; p < n; ++p)
+        {
+            if (!pattern[p] && energy[p] < best_energy)
+            {
+                best = p;
+                best_energy = energy[p];
+            }
+        }
+        return best;
+    };
+
+    // Initial binary pattern, a tenth of the pixels at random
+    const uint32_t n_initial = std::max(n / 10, 1u);
+    PCG32 rng(seed, 0);
+    for (uint32_t n_set = 0; n_set < n_initial;)
+    {
+        const uint32_t p = (uint32_t)rng.in_range_int(0, n - 1);
+        if (!pattern[p])
+        {
+            set_pixel(p, true);
+            ++n_set;
+        }
+    }
+
+    // Spread it evenly by moving the tightest cluster into the largest void,
+    // until the pixel that was removed is the largest void itself
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        const uint32_t cluster = tightest_cluster();
+        set_pixel(cluster, false);
+        const uint32_t void_pixel = largest_void();
+        set_pixel(void_pixel, true);
+        if (void_pixel == cluster)
+        {
+            break;
+        }
+    }
+
+    const std::vector<uint8_t> initial_pattern = pattern;
+    const std::vector<float> initial_energy = energy;
+    std::vector<uint32_t> ranks(n);
+
+    // Phase 1, the pixels of the initial pattern rank below it in the order
+    // their removal leaves the pattern evenly spread
+    for (uint32_t rank = n_initial; rank-- > 0;)
+    {
+        const uint32_t cluster = tightest_cluster();
+        set_pixel(cluster, false);
+        ranks[cluster] = rank;
+    }
+
+    // Phase 2 and 3, the others rank above it in the order they fill the
+    // largest voids. The energy is linear, the tightest cluster of the unset
+    // pixels that phase 3 looks for is the largest void of the set ones.
+    pattern = initial_pattern;
+    energy = initial_energy;
+    for (uint32_t rank = n_initial; rank < n; ++rank)
+    {
+        const uint32_t void_pixel = largest_void();
+        set_pixel(void_pixel, true);
+        ranks[void_pixel] = rank;
+    }
+
+    BlueNoiseMask result;
+    result.set_ranks(size, ranks);
+    return result;
+}
+
+bool BlueNoiseMask::save(const std::string& filename) const
+{
+    // Ranks of larger masks don't fit the 16 bits of a PGM sample
+    if (m_size == 0 || m_size > 256)
+    {
+        return false;
+    }
+
+    std::ofstream file(filename, std::ios::out | std::ios::binary);
+    if (!file)
+    {
+        return false;
+    }
+
+    // Big-endian samples, of two bytes if the largest rank needs them
+    const uint32_t max_value = m_size * m_size - 1;
+    const std::streamsize sample_size = max_value > 0xFF ? 2 : 1;
+    file << "P5\n" << m_size << " " << m_size << "\n" << max_value << "\n";
+    for (uint32_t rank : m_ranks)
+    {
+        const char be[2] = { (char)(rank >> 8), (char)rank };
+        file.write(&be[2 - sample_size], sample_size);
+    }
+
+    return (bool)file;
+}
+
+bool BlueNoiseMask::load(const std::string& filename)
+{
+    std::ifstream file(filename, std::ios::in | std::ios::binary);
+    std::string magic;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t max_value = 0;
+    if (!(file >> magic >> width >> height >> max_value) || magic != "P5")
+    {
+        return false;
+    }
+    file.get();
+
+    const uint32_t n = width * height;
+    if (width != height || !std::has_single_bit(width) || max_value != n - 1 || max_value > 0xFFFF)
+    {
+        return false;
+    }
+
+    const std::streamsize sample_size = max_value > 0xFF ? 2 : 1;
+    std::vector<uint32_t> ranks(n);
+    for (uint32_t& rank : ranks)
+    {
+        uint8_t be[2] = {};
+        file.read((char*)&be[2 - sample_size], sample_size);
+        rank = ((uint32_t)be[0] << 8) | be[1];
+        if (rank > max_value)
+        {
+            return false;
+        }
+    }
+    if (!file)
+    {
+        return false;
+    }
+
+    set_ranks(width, ranks);
+    return true;
+}
+
+void BlueNoiseMask::set_ranks(uint32_t size, const std::vector<uint32_t>& ranks)
+{
+    m_size = size;
+    m_mask = size - 1;
+    m_ranks = ranks;
+
+    const float scale = 1.f / (float)ranks.size();
+    m_values.resize(ranks.size());
+    for (std::size_t i = 0; i < ranks.size(); ++i)
+    {
+        m_values[i] = ((float)ranks[i] + 0.5f) * scale;
+    }
+}
+
+}
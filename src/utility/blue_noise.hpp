@@ -0,0 +1,52 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace moonlight
+{
+
+// Tileable blue-noise threshold mask: every value in [0, 1) appears once, and
+// the pixels below any threshold are spread evenly over the torus without
+// low-frequency clumps.
+class BlueNoiseMask
+{
+public:
+
+    BlueNoiseMask() = default;
+
+    // Ranks the @size x @size pixels with Ulichney's void-and-cluster method,
+    // a Gaussian energy of @sigma pixels and an initial pattern seeded by @seed.
+    // @size is rounded up to a power of two, at most 256 for save().
+    // Quadratic in the number of pixels, generate it once and save() it.
+    static BlueNoiseMask generate(uint32_t size, float sigma = 1.5f, uint64_t seed = 1);
+
+    // As a 16-bit binary PGM of the ranks. Return false if the file can't be
+    // written, or read as a square mask with every rank within the maximum value
+    // of the file. save() fails for masks above 256 x 256.
+    bool save(const std::string& filename) const;
+    bool load(const std::string& filename);
+
+    // The value of pixel (@x, @y) modulo the size of the mask
+    float value(uint32_t x, uint32_t y) const
+    {
+        return m_values[(y & m_mask) * m_size + (x & m_mask)];
+    }
+
+    uint32_t size() const
+    {
+        return m_size;
+    }
+
+private:
+
+    void set_ranks(uint32_t size, const std::vector<uint32_t>& ranks);
+
+    uint32_t m_size = 0;
+    // The size is a power of two, the coordinates wrap with a mask
+    uint32_t m_mask = 0;
+    std::vector<uint32_t> m_ranks;
+    std::vector<float> m_values;
+};
+
+}
@@ -1,35 +1,70 @@
 #include "bvh.hpp"
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
-#include <Windows.h>
 
+#include "tbb/blocked_range.h"
+#include "tbb/parallel_for.h"
+#include "tbb/parallel_invoke.h"
+#include "tbb/parallel_reduce.h"
+#include "tbb/parallel_scan.h"
+
+#include "common.hpp"
+#include "simd.hpp"
+#include "../project_defines.hpp"
 #include "../logging_file.hpp"
 
 namespace moonlight
 {
 
-constexpr unsigned VERT_PER_TRIANGLE = 3;
-constexpr unsigned MATERIAL_INDEX_SIZE = 1;
+constexpr unsigned SAH_BIN_COUNT = 16;
+// Nodes with more triangles than this hand their two subtrees to TBB tasks
+constexpr unsigned PARALLEL_TASK_THRESHOLD = 1024;
+// Nodes with more triangles than this also parallelize the binning, bounds
+// and partition passes. Only the top few levels of the tree are that large.
+constexpr unsigned PARALLEL_PASS_THRESHOLD = 1 << 16;
+constexpr unsigned PARALLEL_GRAIN_SIZE = 4096;
+// Refits spawn tasks for the subtrees of the top levels only
+constexpr unsigned REFIT_TASK_DEPTH = 8;
+// Upper bound for the share of triangles touched by a partial rebuild. Larger
+// degraded subtrees are split into smaller ones, and if they cover more than
+// this in total the whole tree is rebuilt instead.
+constexpr float PARTIAL_REBUILD_MAX_SHARE = 0.5f;
+// Sibling pairs per treelet of BVHNodeOrder::Treelet, 64 pairs fill a 4 KiB page
+constexpr uint32_t NODE_TREELET_PAIRS = 64;
 
 using vec3f = Vector3<float>;
-
-// It is assumed that the triangle also contains a vec3f centroid at the
-// end of the three vertices
-unsigned BVH::compute_triangle_pos(
-    unsigned triangle_pos, unsigned stride)
-{
-    return m_tri_idx[triangle_pos] 
-        * (stride * VERT_PER_TRIANGLE + VERT_PER_TRIANGLE + MATERIAL_INDEX_SIZE);
-}
+using simd::float4;
+using simd::mask4;
 
 void BVH::build_bvh(
     const float* tris, 
     const uint64_t stride_in_bytes,
-    uint32_t n_triangles)
+    uint32_t n_triangles,
+    BVHBuildStrategy strategy)
 {
-    m_num_nodes = n_triangles * 2 - 1;
+    // Spatial splits reference some triangles more than once, the arrays are
+    // sized for the worst case the budget allows.
+    const uint32_t max_references = strategy == BVHBuildStrategy::SBVH
+        ? n_triangles + (uint32_t)(n_triangles * std::max(m_spatial_split_budget, 0.f))
+        : n_triangles;
 
-    m_bvh_nodes = std::make_unique<BVHNode[]>(m_num_nodes);
-    m_tri_idx   = std::make_unique<uint32_t[]>(n_triangles);
+    m_build_strategy = strategy;
+    m_num_nodes = max_references * 2 - 1;
+    m_nodes_used = 1;
+
+    m_num_triangles = n_triangles;
+    m_num_references = n_triangles;
+
+    m_mapped_file.close();
+    m_bvh_nodes = allocate_nodes(m_bvh_node_storage, m_num_nodes);
+    m_tri_idx_storage  = std::make_unique<uint32_t[]>(max_references);
+    m_tri_idx   = m_tri_idx_storage.get();
+    m_leaf_blocks = nullptr;
+    m_leaf_block_idx = nullptr;
+    m_num_leaf_blocks = 0;
+    m_reference_area.reset();
 
     for (uint32_t i = 0; i < n_triangles; ++i)
     {
@@ -40,53 +75,588 @@ void BVH::build_bvh(
     root.left_first = 0;
     root.tri_count  = n_triangles;
 
-    update_node_bounds(0, tris, stride_in_bytes);
-    sub_divide(0, tris, stride_in_bytes);
+    dispatch_vertex_layout(stride_in_bytes, [&](const auto& layout)
+    {
+        update_node_bounds(0, tris, layout);
+
+        if (strategy == BVHBuildStrategy::LBVH || strategy == BVHBuildStrategy::LBVHTreelet)
+        {
+            build_lbvh(tris, layout);
+        }
+        else if (strategy == BVHBuildStrategy::SBVH)
+        {
+            build_sbvh(tris, layout);
+        }
+        else
+        {
+            sub_divide(0, tris, layout);
+        }
+    });
+
+#if ML_BVH_SIMD_LEAVES
+    build_leaf_blocks(tris, stride_in_bytes);
+#endif
+}
+
+void BVH::build_leaf_blocks(const float* tris, const uint64_t stride)
+{
+    m_leaf_block_storage.clear();
+    m_leaf_block_idx_storage = std::make_unique<uint32_t[]>(m_nodes_used);
+
+    // Depth first, so that the blocks of neighbouring leaves end up close
+    // to each other in memory.
+    uint32_t stack[BVH_STACK_SIZE];
+    unsigned stack_ptr = 0;
+    stack[stack_ptr++] = 0;
+
+    while (stack_ptr > 0)
+    {
+        const uint32_t node_idx = stack[--stack_ptr];
+        const BVHNode& node = m_bvh_nodes[node_idx];
+
+        if (node.is_leaf())
+        {
+            m_leaf_block_idx_storage[node_idx] = append_triangle_blocks(
+                m_leaf_block_storage, m_tri_idx, node.left_first, node.tri_count, tris, stride
+            );
+        }
+        else
+        {
+            stack[stack_ptr++] = node.left_first + 1;
+            stack[stack_ptr++] = node.left_first;
+        }
+    }
+
+    m_leaf_blocks = m_leaf_block_storage.data();
+    m_num_leaf_blocks = m_leaf_block_storage.size();
+    m_leaf_block_idx = m_leaf_block_idx_storage.get();
+}
+
+static float node_area(const BVHNode& node)
+{
+    const vec3f e = node.aabbmax - node.aabbmin;
+    return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+// SAH cost of the tree relative to the cost of its leaves alone. Unlike the
+// cost normalized by the root, this stays meaningful when a deformation grows
+// the root, and it increases as refitted inner nodes start to overlap.
+static float relative_sah_cost(const BVHNode* nodes)
+{
+    float inner_cost = 0.f;
+    float leaf_cost = 0.f;
+
+    uint32_t stack[BVH_STACK_SIZE];
+    unsigned stack_ptr = 0;
+    stack[stack_ptr++] = 0;
+
+    while (stack_ptr > 0)
+    {
+        const BVHNode& node = nodes[stack[--stack_ptr]];
+        if (node.is_leaf())
+        {
+            leaf_cost += node_area(node) * node.tri_count;
+        }
+        else
+        {
+            inner_cost += node_area(node);
+            stack[stack_ptr++] = node.left_first + 1;
+            stack[stack_ptr++] = node.left_first;
+        }
+    }
+
+    return leaf_cost > 0.f ? (inner_cost + leaf_cost) / leaf_cost : 1.f;
+}
+
+bool BVH::refit(const float* tris, const uint64_t stride, float max_sah_growth)
+{
+    make_writable();
+
+    // The bounds before the first refit are the reference the monitor compares
+    // against. Rebuilds reset them for the nodes they create.
+    if (!m_reference_area)
+    {
+        const unsigned nodes_used = m_nodes_used;
+        m_reference_area = std::make_unique<float[]>(m_num_nodes);
+        for (unsigned i = 0; i < nodes_used; ++i)
+        {
+            m_reference_area[i] = node_area(m_bvh_nodes[i]);
+        }
+        m_reference_sah = relative_sah_cost(m_bvh_nodes);
+    }
+
+    // False if the tree degraded and no partial rebuild could repair it
+    bool rebuilt = false;
+    const bool usable = dispatch_vertex_layout(stride, [&](const auto& layout)
+    {
+        refit_node(0, tris, layout, 0);
+
+        if (relative_sah_cost(m_bvh_nodes) <= m_reference_sah * max_sah_growth)
+        {
+            return true;
+        }
+
+        // A partial rebuild that doesn't bring the cost back under the limit
+        // would only be repeated by every later refit
+        rebuilt = true;
+        return rebuild_degraded_subtrees(tris, layout, max_sah_growth) &&
+            relative_sah_cost(m_bvh_nodes) <= m_reference_sah * max_sah_growth;
+    });
+
+    if (!usable)
+    {
+        OutputDebugStringA("[Moonlight] BVH degraded too much during refits, rebuilding it\n");
+        build_bvh(tris, stride, m_num_triangles, m_build_strategy);
+        return true;
+    }
+
+#if ML_BVH_SIMD_LEAVES
+    build_leaf_blocks(tris, stride);
+#endif
+
+    return rebuilt;
+}
+
+template<typename Layout>
+void BVH::refit_node(uint32_t node_idx, const float* tris, const Layout& layout, uint32_t depth)
+{
+    BVHNode& node = m_bvh_nodes[node_idx];
+    node.aabbmin = vec3f(std::numeric_limits<float>::max());
+    node.aabbmax = vec3f(-std::numeric_limits<float>::max());
+
+    if (node.is_leaf())
+    {
+        update_node_bounds(node_idx, tris, layout);
+        return;
+    }
+
+    const uint32_t left_child_idx = node.left_first;
+    const uint32_t right_child_idx = left_child_idx + 1;
+    if (depth < REFIT_TASK_DEPTH)
+    {
+        tbb::parallel_invoke(
+            [&]() { refit_node(left_child_idx, tris, layout, depth + 1); },
+            [&]() { refit_node(right_child_idx, tris, layout, depth + 1); }
+        );
+    }
+    else
+    {
+        refit_node(left_child_idx, tris, layout, depth + 1);
+        refit_node(right_child_idx, tris, layout, depth + 1);
+    }
+
+    const BVHNode& left = m_bvh_nodes[left_child_idx];
+    const BVHNode& right = m_bvh_nodes[right_child_idx];
+    node.aabbmin = cwise_min(&left.aabbmin, &right.aabbmin);
+    node.aabbmax = cwise_max(&left.aabbmax, &right.aabbmax);
+}
+
+template<typename Layout>
+bool BVH::rebuild_degraded_subtrees(const float* tris, const Layout& layout, float max_sah_growth)
+{
+    // A node has degraded if its surface area grew more than the root's did.
+    // Growth shared by the whole mesh, such as a uniform scale, does not
+    // change the SAH cost and is ignored this way.
+    auto growth = [&](uint32_t node_idx)
+    {
+        const float reference = std::max(m_reference_area[node_idx], std::numeric_limits<float>::min());
+        return node_area(m_bvh_nodes[node_idx]) / reference;
+    };
+
+    const float root_growth = growth(0);
+    auto degraded = [&](uint32_t node_idx)
+    {
+        return growth(node_idx) > root_growth * max_sah_growth;
+    };
+
+    // Collect the topmost degraded subtrees that are small enough for a partial
+    // rebuild, together with their triangle ranges. Every subtree covers a
+    // contiguous range of m_tri_idx.
+    struct Subtree
+    {
+        uint32_t node_idx;
+        uint32_t first;
+        uint32_t count;
+    };
+
+    std::vector<Subtree> subtrees;
+    uint64_t rebuilt_triangles = 0;
+    const uint32_t max_subtree_size = m_num_references * PARTIAL_REBUILD_MAX_SHARE;
+
+    uint32_t stack[BVH_STACK_SIZE];
+    unsigned stack_ptr = 0;
+    stack[stack_ptr++] = 0;
+
+    while (stack_ptr > 0)
+    {
+        const uint32_t node_idx = stack[--stack_ptr];
+        const BVHNode& node = m_bvh_nodes[node_idx];
+        if (node.is_leaf())
+        {
+            continue;
+        }
+
+        if (node_idx != 0 && degraded(node_idx))
+        {
+            Subtree subtree = { node_idx, std::numeric_limits<uint32_t>::max(), 0 };
+            uint32_t leaf_stack[BVH_STACK_SIZE];
+            unsigned leaf_stack_ptr = 0;
+            leaf_stack[leaf_stack_ptr++] = node_idx;
+            while (leaf_stack_ptr > 0)
+            {
+                const BVHNode& n = m_bvh_nodes[leaf_stack[--leaf_stack_ptr]];
+                if (n.is_leaf())
+                {
+                    subtree.first = std::min(subtree.first, n.left_first);
+                    subtree.count += n.tri_count;
+                }
+                else
+                {
+                    leaf_stack[leaf_stack_ptr++] = n.left_first + 1;
+                    leaf_stack[leaf_stack_ptr++] = n.left_first;
+                }
+            }
+
+            if (subtree.count <= max_subtree_size)
+            {
+                subtrees.push_back(subtree);
+                rebuilt_triangles += subtree.count;
+                continue;
+            }
+        }
+
+        stack[stack_ptr++] = node.left_first + 1;
+        stack[stack_ptr++] = node.left_first;
+    }
+
+    // Past this point a full rebuild is about as fast and gives a better tree
+    if (subtrees.empty() || rebuilt_triangles > max_subtree_size)
+    {
+        return false;
+    }
+
+    // Turn the subtrees into leaves and compact the remaining tree depth first.
+    // This frees the nodes of the old subtrees, so the rebuilt ones always fit.
+    for (const Subtree& subtree : subtrees)
+    {
+        BVHNode& node = m_bvh_nodes[subtree.node_idx];
+        node.left_first = subtree.first;
+        node.tri_count = subtree.count;
+    }
+
+    std::unique_ptr<BVHNodePair[]> node_storage;
+    BVHNode* nodes = allocate_nodes(node_storage, m_num_nodes);
+    auto reference_area = std::make_unique<float[]>(m_num_nodes);
+    std::vector<uint32_t> new_index(m_nodes_used);
+
+    struct Item
+    {
+        uint32_t old_idx;
+        uint32_t new_idx;
+    };
+
+    Item compact_stack[BVH_STACK_SIZE];
+    stack_ptr = 0;
+    compact_stack[stack_ptr++] = { 0, 0 };
+    uint32_t nodes_used = 1;
+
+    while (stack_ptr > 0)
+    {
+        const Item item = compact_stack[--stack_ptr];
+        BVHNode& node = nodes[item.new_idx];
+        node = m_bvh_nodes[item.old_idx];
+        reference_area[item.new_idx] = m_reference_area[item.old_idx];
+        new_index[item.old_idx] = item.new_idx;
+
+        if (!node.is_leaf())
+        {
+            const uint32_t old_left = node.left_first;
+            node.left_first = nodes_used;
+            nodes_used += 2;
+            compact_stack[stack_ptr++] = { old_left + 1, node.left_first + 1 };
+            compact_stack[stack_ptr++] = { old_left, node.left_first };
+        }
+    }
+
+    m_bvh_node_storage = std::move(node_storage);
+    m_reference_area = std::move(reference_area);
+    m_bvh_nodes = nodes;
+    m_nodes_used = nodes_used;
+
+    tbb::parallel_for(size_t(0), subtrees.size(), [&](size_t i)
+    {
+        const uint32_t node_idx = new_index[subtrees[i].node_idx];
+        sub_divide(node_idx, tris, layout);
+        m_reference_area[node_idx] = node_area(m_bvh_nodes[node_idx]);
+    });
+
+    const unsigned total_nodes_used = m_nodes_used;
+    for (unsigned i = nodes_used; i < total_nodes_used; ++i)
+    {
+        m_reference_area[i] = node_area(m_bvh_nodes[i]);
+    }
+
+    return true;
+}
+
+void BVH::make_writable()
+{
+    if (!is_mapped())
+    {
+        return;
+    }
+
+    // The callers change the tree or the vertices, the leaf blocks are rebuilt
+    // afterwards
+    copy_mapped_tree(false);
+    m_leaf_blocks = nullptr;
+    m_leaf_block_idx = nullptr;
+    m_num_leaf_blocks = 0;
+}
+
+void BVH::copy_mapped_tree(bool with_leaf_blocks)
+{
+    // Room for a full tree, partial rebuilds allocate their nodes at the end
+    const unsigned nodes_used = m_nodes_used;
+    m_num_nodes = m_num_references * 2 - 1;
+    BVHNode* nodes = allocate_nodes(m_bvh_node_storage, m_num_nodes);
+    m_tri_idx_storage = std::make_unique<uint32_t[]>(m_num_references);
+    std::copy(m_bvh_nodes, m_bvh_nodes + nodes_used, nodes);
+    std::memcpy(m_tri_idx_storage.get(), m_tri_idx, sizeof(uint32_t) * m_num_references);
+
+    m_bvh_nodes = nodes;
+    m_tri_idx = m_tri_idx_storage.get();
+
+    if (with_leaf_blocks && m_leaf_blocks != nullptr)
+    {
+        m_leaf_block_storage.assign(m_leaf_blocks, m_leaf_blocks + m_num_leaf_blocks);
+        m_leaf_block_idx_storage = std::make_unique<uint32_t[]>(nodes_used);
+        std::memcpy(m_leaf_block_idx_storage.get(), m_leaf_block_idx, sizeof(uint32_t) * nodes_used);
+        m_leaf_blocks = m_leaf_block_storage.data();
+        m_leaf_block_idx = m_leaf_block_idx_storage.get();
+    }
+
+    m_mapped_file.close();
+}
+
+BVHNode* BVH::allocate_nodes(std::unique_ptr<BVHNodePair[]>& storage, uint32_t count)
+{
+    storage = std::make_unique<BVHNodePair[]>(count / 2 + 1);
+    return &storage[0].nodes[1];
+}
+
+void BVH::reorder_nodes(BVHNodeOrder order)
+{
+    make_writable();
+
+    const unsigned nodes_used = m_nodes_used;
+    std::unique_ptr<BVHNodePair[]> node_storage;
+    BVHNode* nodes = allocate_nodes(node_storage, m_num_nodes);
+    std::vector<uint32_t> new_index(nodes_used);
+
+    // Sibling pairs are moved as a whole, @new_first receives the new index
+    // of the left sibling. The root stays in place.
+    uint32_t next_pair = 1;
+    nodes[0] = m_bvh_nodes[0];
+    new_index[0] = 0;
+
+    auto move_children = [&](uint32_t new_parent_idx)
+    {
+        BVHNode& parent = nodes[new_parent_idx];
+        const uint32_t old_left = parent.left_first;
+        nodes[next_pair] = m_bvh_nodes[old_left];
+        nodes[next_pair + 1] = m_bvh_nodes[old_left + 1];
+        new_index[old_left] = next_pair;
+        new_index[old_left + 1] = next_pair + 1;
+        parent.left_first = next_pair;
+        next_pair += 2;
+    };
+
+    if (order == BVHNodeOrder::DepthFirst)
+    {
+        uint32_t stack[BVH_STACK_SIZE];
+        unsigned stack_ptr = 0;
+        stack[stack_ptr++] = 0;
+
+        while (stack_ptr > 0)
+        {
+            const uint32_t node_idx = stack[--stack_ptr];
+            if (nodes[node_idx].is_leaf())
+            {
+                continue;
+            }
+
+            move_children(node_idx);
+            stack[stack_ptr++] = nodes[node_idx].left_first + 1;
+            stack[stack_ptr++] = nodes[node_idx].left_first;
+        }
+    }
+    else
+    {
+        // Each treelet takes its nodes breadth first until it holds
+        // NODE_TREELET_PAIRS sibling pairs. The inner nodes left on its
+        // frontier become the roots of the next treelets.
+        std::vector<uint32_t> treelet_roots = { 0 };
+        std::vector<uint32_t> frontier;
+
+        while (!treelet_roots.empty())
+        {
+            const uint32_t root_idx = treelet_roots.back();
+            treelet_roots.pop_back();
+
+            frontier.clear();
+            frontier.push_back(root_idx);
+            std::size_t head = 0;
+            for (uint32_t pairs = 0; pairs < NODE_TREELET_PAIRS && head < frontier.size(); ++head)
+            {
+                const uint32_t node_idx = frontier[head];
+                if (nodes[node_idx].is_leaf())
+                {
+                    continue;
+                }
+
+                move_children(node_idx);
+                frontier.push_back(nodes[node_idx].left_first);
+                frontier.push_back(nodes[node_idx].left_first + 1);
+                ++pairs;
+            }
+
+            // Reversed, so that the leftmost treelet is laid out next
+            for (std::size_t i = frontier.size(); i > head; --i)
+            {
+                if (!nodes[frontier[i - 1]].is_leaf())
+                {
+                    treelet_roots.push_back(frontier[i - 1]);
+                }
+            }
+        }
+    }
+
+    if (m_leaf_blocks != nullptr)
+    {
+        auto leaf_block_idx = std::make_unique<uint32_t[]>(nodes_used);
+        for (uint32_t i = 0; i < nodes_used; ++i)
+        {
+            leaf_block_idx[new_index[i]] = m_leaf_block_idx[i];
+        }
+        m_leaf_block_idx_storage = std::move(leaf_block_idx);
+        m_leaf_block_idx = m_leaf_block_idx_storage.get();
+    }
+
+    if (m_reference_area != nullptr)
+    {
+        auto reference_area = std::make_unique<float[]>(m_num_nodes);
+        for (uint32_t i = 0; i < nodes_used; ++i)
+        {
+            reference_area[new_index[i]] = m_reference_area[i];
+        }
+        m_reference_area = std::move(reference_area);
+    }
+
+    m_bvh_node_storage = std::move(node_storage);
+    m_bvh_nodes = nodes;
+}
+
+template<typename Layout>
+AABB BVH::compute_triangle_bounds(
+    uint32_t first, uint32_t last,
+    const float* tris,
+    const Layout& layout)
+{
+    AABB bounds;
+    for (uint32_t i = first; i < last; ++i)
+    {
+        unsigned idx = compute_triangle_pos(i, layout);
+        const float* leaf_tri = &tris[idx];
+        bounds.bmin = cwise_min(&bounds.bmin, (vec3f*)&leaf_tri[0]);
+        bounds.bmin = cwise_min(&bounds.bmin, (vec3f*)&leaf_tri[layout.stride]);
+        bounds.bmin = cwise_min(&bounds.bmin, (vec3f*)&leaf_tri[layout.stride * 2]);
+        bounds.bmax = cwise_max(&bounds.bmax, (vec3f*)&leaf_tri[0]);
+        bounds.bmax = cwise_max(&bounds.bmax, (vec3f*)&leaf_tri[layout.stride]);
+        bounds.bmax = cwise_max(&bounds.bmax, (vec3f*)&leaf_tri[layout.stride * 2]);
+    }
+
+    return bounds;
 }
 
+template<typename Layout>
 void BVH::update_node_bounds(
     uint32_t node_idx, 
     const float* tris,
-    const uint64_t stride)
+    const Layout& layout)
 {
     BVHNode& node = m_bvh_nodes[node_idx];
-    
-    for (unsigned int i = 0; i < node.tri_count; ++i)
+    const uint32_t first = node.left_first;
+    const uint32_t last = node.left_first + node.tri_count;
+
+    AABB bounds;
+    if (m_build_strategy == BVHBuildStrategy::ParallelBinnedSAH &&
+        node.tri_count >= PARALLEL_PASS_THRESHOLD)
     {
-        unsigned idx = compute_triangle_pos(i + node.left_first, stride);
-        const float* leaf_tri = &tris[idx];
-        node.aabbmin = cwise_min(&node.aabbmin, (vec3f*)&leaf_tri[0]);
-        node.aabbmin = cwise_min(&node.aabbmin, (vec3f*)&leaf_tri[stride]);
-        node.aabbmin = cwise_min(&node.aabbmin, (vec3f*)&leaf_tri[stride * 2]);
-        node.aabbmax = cwise_max(&node.aabbmax, (vec3f*)&leaf_tri[0]);
-        node.aabbmax = cwise_max(&node.aabbmax, (vec3f*)&leaf_tri[stride]);
-        node.aabbmax = cwise_max(&node.aabbmax, (vec3f*)&leaf_tri[stride * 2]);
+        bounds = tbb::parallel_reduce(
+            tbb::blocked_range<uint32_t>(first, last, PARALLEL_GRAIN_SIZE),
+            AABB(),
+            [&](const tbb::blocked_range<uint32_t>& r, AABB box)
+            {
+                AABB partial = compute_triangle_bounds(r.begin(), r.end(), tris, layout);
+                aabb_extend(&box, &partial);
+                return box;
+            },
+            [](AABB a, const AABB& b)
+            {
+                aabb_extend(&a, &b);
+                return a;
+            }
+        );
     }
+    else
+    {
+        bounds = compute_triangle_bounds(first, last, tris, layout);
+    }
+
+    node.aabbmin = cwise_min(&node.aabbmin, &bounds.bmin);
+    node.aabbmax = cwise_max(&node.aabbmax, &bounds.bmax);
 }
 
-void BVH::sub_divide(uint32_t node_idx, const float* tris, const uint64_t stride)
+template<typename Layout>
+void BVH::sub_divide(uint32_t node_idx, const float* tris, const Layout& layout)
 {
     BVHNode& node = m_bvh_nodes[node_idx];
     int axis;
     float split_pos;
-    if (!compute_optimal_split(node, tris, stride, axis, split_pos))
+    bool split_found = m_build_strategy == BVHBuildStrategy::Exhaustive
+        ? compute_optimal_split(node, tris, layout, axis, split_pos)
+        : compute_optimal_split_binned(node, tris, layout, axis, split_pos);
+    
+    if (!split_found)
         return;
 
-    unsigned centroid_off = stride * VERT_PER_TRIANGLE;
-    // Sort the primitives, such that primitives belonging to
-    // group A are all in consecutive order.
-    int i = node.left_first;
-    int j = node.left_first + node.tri_count - 1;
-    while (i <= j)
+    const bool parallel = m_build_strategy == BVHBuildStrategy::ParallelBinnedSAH;
+    const unsigned tri_count = node.tri_count;
+
+    int i;
+    if (parallel && tri_count >= PARALLEL_PASS_THRESHOLD)
     {
-        unsigned centroid_pos = compute_triangle_pos(i, stride) + centroid_off;
-        if (tris[centroid_pos + axis] < split_pos)
-        {
-            ++i;
-        } 
-        else
+        i = node.left_first + partition_parallel(node, tris, layout, axis, split_pos);
+    }
+    else
+    {
+        unsigned centroid_off = layout.centroid_offset;
+        // Sort the primitives, such that primitives belonging to
+        // group A are all in consecutive order.
+        i = node.left_first;
+        int j = node.left_first + node.tri_count - 1;
+        while (i <= j)
         {
-            std::swap(m_tri_idx[i], m_tri_idx[j--]);
+            unsigned centroid_pos = compute_triangle_pos(i, layout) + centroid_off;
+            if (tris[centroid_pos + axis] < split_pos)
+            {
+                ++i;
+            } 
+            else
+            {
+                std::swap(m_tri_idx[i], m_tri_idx[j--]);
+            }
         }
     }
 
@@ -96,8 +666,10 @@ void BVH::sub_divide(uint32_t node_idx, const float* tris, const uint64_t stride
         return;
     }
 
-    int left_child_idx = m_nodes_used++;
-    int right_child_idx = m_nodes_used++;
+    // Both children are taken in one step, so that they stay adjacent even
+    // when several subtrees are built concurrently.
+    int left_child_idx = m_nodes_used.fetch_add(2);
+    int right_child_idx = left_child_idx + 1;
     m_bvh_nodes[left_child_idx].left_first = node.left_first;
     m_bvh_nodes[left_child_idx].tri_count = left_count;
     m_bvh_nodes[right_child_idx].left_first = i;
@@ -105,203 +677,957 @@ void BVH::sub_divide(uint32_t node_idx, const float* tris, const uint64_t stride
     node.left_first = left_child_idx;
     node.tri_count = 0;
 
-    update_node_bounds(left_child_idx, tris, stride);
-    update_node_bounds(right_child_idx, tris, stride);
+    update_node_bounds(left_child_idx, tris, layout);
+    update_node_bounds(right_child_idx, tris, layout);
+
+    if (parallel && tri_count >= PARALLEL_TASK_THRESHOLD)
+    {
+        tbb::parallel_invoke(
+            [&]() { sub_divide(left_child_idx, tris, layout); },
+            [&]() { sub_divide(right_child_idx, tris, layout); }
+        );
+    }
+    else
+    {
+        sub_divide(left_child_idx, tris, layout);
+        sub_divide(right_child_idx, tris, layout);
+    }
+}
+
+// Stable partition of the node's triangle indices into a scratch buffer. 
+// Returns the number of triangles that go into the left child.
+template<typename Layout>
+unsigned BVH::partition_parallel(
+    const BVHNode& node,
+    const float* tris,
+    const Layout& layout,
+    int axis,
+    float split_pos)
+{
+    const unsigned centroid_off = layout.centroid_offset;
+    const uint32_t first = node.left_first;
+    const uint32_t last = node.left_first + node.tri_count;
+
+    auto goes_left = [&](uint32_t i)
+    {
+        unsigned centroid_pos = compute_triangle_pos(i, layout) + centroid_off;
+        return tris[centroid_pos + axis] < split_pos;
+    };
+
+    const unsigned left_total = tbb::parallel_reduce(
+        tbb::blocked_range<uint32_t>(first, last, PARALLEL_GRAIN_SIZE),
+        0u,
+        [&](const tbb::blocked_range<uint32_t>& r, unsigned count)
+        {
+            for (uint32_t i = r.begin(); i < r.end(); ++i)
+            {
+                count += goes_left(i);
+            }
+            return count;
+        },
+        std::plus<unsigned>()
+    );
+
+    std::unique_ptr<uint32_t[]> scratch = std::make_unique<uint32_t[]>(node.tri_count);
+
+    tbb::parallel_scan(
+        tbb::blocked_range<uint32_t>(first, last, PARALLEL_GRAIN_SIZE),
+        0u,
+        [&](const tbb::blocked_range<uint32_t>& r, unsigned left_prefix, bool is_final_scan)
+        {
+            for (uint32_t i = r.begin(); i < r.end(); ++i)
+            {
+                bool left = goes_left(i);
+                if (is_final_scan)
+                {
+                    unsigned right_prefix = (i - first) - left_prefix;
+                    unsigned dst = left ? left_prefix : left_total + right_prefix;
+                    scratch[dst] = m_tri_idx[i];
+                }
+                left_prefix += left;
+            }
+            return left_prefix;
+        },
+        std::plus<unsigned>()
+    );
+
+    tbb::parallel_for(
+        tbb::blocked_range<uint32_t>(0, node.tri_count, PARALLEL_GRAIN_SIZE),
+        [&](const tbb::blocked_range<uint32_t>& r)
+        {
+            std::copy(&scratch[r.begin()], &scratch[0] + r.end(), &m_tri_idx[first + r.begin()]);
+        }
+    );
 
-    sub_divide(left_child_idx, tris, stride);
-    sub_divide(right_child_idx, tris, stride);
+    return left_total;
 }
 
+template<typename Layout>
 bool BVH::compute_optimal_split(
     const BVHNode& node, 
     const float* tris, 
-    const uint64_t stride,
+    const Layout& layout,
     int& axis, 
     float& split_pos)
 {
-    const unsigned centroid_off = stride * VERT_PER_TRIANGLE;
+    const unsigned centroid_off = layout.centroid_offset;
+
+    Vector3<float> e = node.aabbmax - node.aabbmin; // extent of parent
+    float parent_area = e.x * e.y + e.y * e.z + e.z * e.x;
+    float parent_cost = node.tri_count * parent_area;
+
+    int best_axis = -1;
+    float best_pos = 0.f;
+    float best_cost = std::numeric_limits<float>::max();
+
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        for (unsigned i = 0; i < node.tri_count; ++i)
+        {
+            unsigned centroid_pos = 
+                compute_triangle_pos(i + node.left_first, layout) + centroid_off;
+
+            float candidate_pos = tris[centroid_pos + axis];
+            float cost = compute_sah(node, tris, layout, axis, candidate_pos);
+            if (cost < best_cost)
+            {
+                best_pos = candidate_pos;
+                best_axis = axis;
+                best_cost = cost;
+            }
+        }
+    }
+
+    if (best_cost >= parent_cost) return false;
+    
+    axis = best_axis;
+    split_pos = best_pos;
+    return true;
+}
+
+struct SAHBin
+{
+    AABB bounds;
+    unsigned tri_count = 0;
+};
+
+struct SAHBinGrid
+{
+    SAHBin bins[3][SAH_BIN_COUNT];
+
+    void merge(const SAHBinGrid& other)
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            for (unsigned i = 0; i < SAH_BIN_COUNT; ++i)
+            {
+                bins[a][i].tri_count += other.bins[a][i].tri_count;
+                aabb_extend(&bins[a][i].bounds, &other.bins[a][i].bounds);
+            }
+        }
+    }
+};
+
+template<typename Layout>
+AABB BVH::compute_centroid_bounds(
+    uint32_t first, uint32_t last,
+    const float* tris,
+    const Layout& layout)
+{
+    const unsigned centroid_off = layout.centroid_offset;
+
+    AABB centroid_bounds;
+    for (uint32_t i = first; i < last; ++i)
+    {
+        unsigned centroid_pos = compute_triangle_pos(i, layout) + centroid_off;
+        const vec3f* centroid = (vec3f*)&tris[centroid_pos];
+        centroid_bounds.bmin = cwise_min(&centroid_bounds.bmin, centroid);
+        centroid_bounds.bmax = cwise_max(&centroid_bounds.bmax, centroid);
+    }
+
+    return centroid_bounds;
+}
+
+// The LBVH builder uses it as well
+#define ML_INSTANTIATE_CENTROID_BOUNDS(Layout) \
+    template AABB BVH::compute_centroid_bounds<Layout>(uint32_t, uint32_t, const float*, const Layout&);
+ML_FOR_EACH_VERTEX_LAYOUT(ML_INSTANTIATE_CENTROID_BOUNDS)
+#undef ML_INSTANTIATE_CENTROID_BOUNDS
+
+// Counts and bounds of all three axes are accumulated in a single pass
+template<typename Layout>
+static void bin_triangles(
+    SAHBinGrid& grid,
+    const uint32_t* tri_idx,
+    uint32_t first, uint32_t last,
+    const float* tris,
+    const Layout& layout,
+    const AABB& centroid_bounds,
+    const Vector3<float>& bin_scale)
+{
+    const unsigned centroid_off = layout.centroid_offset;
+    const unsigned triangle_size = 
+        layout.triangle_size;
+
+    for (uint32_t i = first; i < last; ++i)
+    {
+        const float* triangle = &tris[tri_idx[i] * triangle_size];
+
+        AABB tri_bounds;
+        tri_bounds.bmin = cwise_min((vec3f*)&triangle[0], (vec3f*)&triangle[layout.stride]);
+        tri_bounds.bmin = cwise_min(&tri_bounds.bmin, (vec3f*)&triangle[layout.stride * 2]);
+        tri_bounds.bmax = cwise_max((vec3f*)&triangle[0], (vec3f*)&triangle[layout.stride]);
+        tri_bounds.bmax = cwise_max(&tri_bounds.bmax, (vec3f*)&triangle[layout.stride * 2]);
+
+        for (int a = 0; a < 3; ++a)
+        {
+            float c = triangle[centroid_off + a];
+            unsigned bin_idx = std::min(
+                SAH_BIN_COUNT - 1,
+                (unsigned)((c - centroid_bounds.bmin[a]) * bin_scale[a])
+            );
+
+            SAHBin& bin = grid.bins[a][bin_idx];
+            bin.tri_count++;
+            bin.bounds.bmin = cwise_min(&bin.bounds.bmin, &tri_bounds.bmin);
+            bin.bounds.bmax = cwise_max(&bin.bounds.bmax, &tri_bounds.bmax);
+        }
+    }
+}
+
+template<typename Layout>
+bool BVH::compute_optimal_split_binned(
+    const BVHNode& node,
+    const float* tris,
+    const Layout& layout,
+    int& axis,
+    float& split_pos)
+{
+    const uint32_t first = node.left_first;
+    const uint32_t last = node.left_first + node.tri_count;
+    const bool parallel = 
+        m_build_strategy == BVHBuildStrategy::ParallelBinnedSAH &&
+        node.tri_count >= PARALLEL_PASS_THRESHOLD;
+
+    Vector3<float> e = node.aabbmax - node.aabbmin; // extent of parent
+    float parent_area = e.x * e.y + e.y * e.z + e.z * e.x;
+    float parent_cost = node.tri_count * parent_area;
+
+    // The bins are spread over the bounds of the centroids, not the triangles.
+    // Otherwise large triangles would push most centroids into a few bins.
+    AABB centroid_bounds;
+    if (parallel)
+    {
+        centroid_bounds = tbb::parallel_reduce(
+            tbb::blocked_range<uint32_t>(first, last, PARALLEL_GRAIN_SIZE),
+            AABB(),
+            [&](const tbb::blocked_range<uint32_t>& r, AABB box)
+            {
+                AABB partial = compute_centroid_bounds(r.begin(), r.end(), tris, layout);
+                aabb_extend(&box, &partial);
+                return box;
+            },
+            [](AABB a, const AABB& b)
+            {
+                aabb_extend(&a, &b);
+                return a;
+            }
+        );
+    }
+    else
+    {
+        centroid_bounds = compute_centroid_bounds(first, last, tris, layout);
+    }
+
+    Vector3<float> bin_scale;
+    for (int a = 0; a < 3; ++a)
+    {
+        float extent = centroid_bounds.bmax[a] - centroid_bounds.bmin[a];
+        bin_scale[a] = extent > 0.f ? SAH_BIN_COUNT / extent : 0.f;
+    }
+
+    SAHBinGrid grid;
+    if (parallel)
+    {
+        grid = tbb::parallel_reduce(
+            tbb::blocked_range<uint32_t>(first, last, PARALLEL_GRAIN_SIZE),
+            SAHBinGrid(),
+            [&](const tbb::blocked_range<uint32_t>& r, SAHBinGrid partial)
+            {
+                bin_triangles(
+                    partial, m_tri_idx, r.begin(), r.end(),
+                    tris, layout, centroid_bounds, bin_scale
+                );
+                return partial;
+            },
+            [](SAHBinGrid a, const SAHBinGrid& b)
+            {
+                a.merge(b);
+                return a;
+            }
+        );
+    }
+    else
+    {
+        bin_triangles(
+            grid, m_tri_idx, first, last, 
+            tris, layout, centroid_bounds, bin_scale
+        );
+    }
+
+    int best_axis = -1;
+    float best_pos = 0.f;
+    float best_cost = std::numeric_limits<float>::max();
+
+    for (int a = 0; a < 3; ++a)
+    {
+        if (bin_scale[a] == 0.f) continue;
+
+        // Sweep from both sides to get the cost of every bin boundary in O(bins)
+        float left_area[SAH_BIN_COUNT - 1], right_area[SAH_BIN_COUNT - 1];
+        unsigned left_count[SAH_BIN_COUNT - 1], right_count[SAH_BIN_COUNT - 1];
+        
+        AABB left_box, right_box;
+        unsigned left_sum = 0, right_sum = 0;
+        for (unsigned i = 0; i < SAH_BIN_COUNT - 1; ++i)
+        {
+            const SAHBin& lbin = grid.bins[a][i];
+            left_sum += lbin.tri_count;
+            left_count[i] = left_sum;
+            aabb_extend(&left_box, &lbin.bounds);
+            left_area[i] = aabb_area(left_box);
+            
+            const SAHBin& rbin = grid.bins[a][SAH_BIN_COUNT - 1 - i];
+            right_sum += rbin.tri_count;
+            right_count[SAH_BIN_COUNT - 2 - i] = right_sum;
+            aabb_extend(&right_box, &rbin.bounds);
+            right_area[SAH_BIN_COUNT - 2 - i] = aabb_area(right_box);
+        }
+
+        for (unsigned i = 0; i < SAH_BIN_COUNT - 1; ++i)
+        {
+            if (left_count[i] == 0 || right_count[i] == 0) continue;
+
+            float cost = left_count[i] * left_area[i] + right_count[i] * right_area[i];
+            if (cost < best_cost)
+            {
+                best_axis = a;
+                best_pos = centroid_bounds.bmin[a] + (i + 1) / bin_scale[a];
+                best_cost = cost;
+            }
+        }
+    }
+
+    if (best_axis == -1 || best_cost >= parent_cost) return false;
+
+    axis = best_axis;
+    split_pos = best_pos;
+    return true;
+}
+
+// This test suffers from precision problems.
+// 
+static float IntersectAABB(const Vector3<float> bmin, const Vector3<float> bmax, const Ray& ray)
+{
+    float tx1 = (bmin.x - ray.o.x) * ray.invd.x;
+    float tx2 = (bmax.x - ray.o.x) * ray.invd.x;
+    float tmin = std::min(tx1, tx2);
+    float tmax = std::max(tx1, tx2);
+    float ty1 = (bmin.y - ray.o.y) * ray.invd.y;
+    float ty2 = (bmax.y - ray.o.y) * ray.invd.y;
+    tmin = std::max(tmin, std::min(ty1, ty2));
+    tmax = std::min(tmax, std::max(ty1, ty2));
+    float tz1 = (bmin.z - ray.o.z) * ray.invd.z;
+    float tz2 = (bmax.z - ray.o.z) * ray.invd.z;
+    tmin = std::max(tmin, std::min(tz1, tz2));
+    tmax = std::min(tmax, std::max(tz1, tz2));
+    
+    if (tmax >= tmin && tmin < ray.t && tmax > 0.f)
+    {
+        return tmin;
+    }
+    else
+    {
+        return std::numeric_limits<float>::max();
+    }
+}
+
+static float IntersectAABB_SSE(const float4 bmin4, const float4 bmax4, const Ray& ray)
+{
+    const float4 o4 = float4::loadu(&ray.o.x);
+    const float4 invd4 = float4::loadu(&ray.invd.x);
+    const float4 t1 = (bmin4 - o4) * invd4;
+    const float4 t2 = (bmax4 - o4) * invd4;
+
+    // The fourth lane holds the padding of the vectors and is ignored
+    alignas(16) float vmax4[4], vmin4[4];
+    max(t1, t2).store(vmax4);
+    min(t1, t2).store(vmin4);
+    float tmax = std::min(vmax4[0], std::min(vmax4[1], vmax4[2]));
+    float tmin = std::max(vmin4[0], std::max(vmin4[1], vmin4[2]));
+    
+    if (tmax >= tmin && tmin < ray.t && tmax > 0) 
+        return tmin; 
+    else 
+        return std::numeric_limits<float>::max();
+}
+
+IntersectionParams BVH::intersect(
+    Ray& ray,
+    const float* tris,
+    const uint64_t stride) const
+{
+#if ML_BVH_SIMD_LEAVES
+    // The leaf blocks hold their own copy of the positions, the layout is unused
+    return intersect(ray, tris, RuntimeVertexLayout((uint32_t)stride));
+#else
+    return dispatch_vertex_layout(stride, [&](const auto& layout)
+    {
+        return intersect(ray, tris, layout);
+    });
+#endif
+}
+
+template<uint32_t Stride>
+IntersectionParams BVH::intersect(
+    Ray& ray, 
+    [[maybe_unused]] const float* tris, 
+    [[maybe_unused]] const VertexLayout<Stride>& layout) const
+{
+    IntersectionParams intersect;
+
+    const BVHNode* node = &m_bvh_nodes[0];
+    BVHNode* stack[BVH_STACK_SIZE];
+    unsigned stack_ptr = 0;
+
+    while (true)
+    {
+        if (node->is_leaf())
+        {
+#if ML_BVH_SIMD_LEAVES
+            const uint32_t block_idx = m_leaf_block_idx[node - m_bvh_nodes];
+            intersect_triangle_blocks(
+                &m_leaf_blocks[block_idx], node->tri_count, ray, intersect
+            );
+#else
+            for (unsigned i = 0; i < node->tri_count; ++i)
+            {
+                unsigned triangle_pos =
+                    compute_triangle_pos(i + node->left_first, layout);
+
+                IntersectionParams new_intersect = ray_hit_triangle(
+                    ray, &tris[triangle_pos], layout
+                );
+
+                if (new_intersect.t < intersect.t && new_intersect.t > 0.f)
+                {
+                    intersect = new_intersect;
+                    intersect.triangle_idx = triangle_pos;
+                    ray.t = new_intersect.t;
+                }
+            }
+#endif
+
+            if (stack_ptr == 0)
+            {
+                break;
+            }
+            else
+            {
+                node = stack[--stack_ptr];
+            }
+            
+            continue;
+        }
+
+        BVHNode* child1 = &m_bvh_nodes[node->left_first];
+        BVHNode* child2 = &m_bvh_nodes[node->left_first + 1];
+
+        // TODO: There is a strange performance degradation when both distances 
+        // are computed via the ray_intersects_aabb method. When only one of the
+        // distances is computed with that function, the performance improves
+        // over the IntersectAABB method. 
+        // How can this behavior be explained? 
+        //      - The number of loop iterations is not the culprit.
+        float dist1 = ray_intersects_aabb(child1->aabbmin, child1->aabbmax, ray);
+        //float dist2 = IntersectAABB(child2->aabbmin, child2->aabbmax, ray);
+        float dist2 = ray_intersects_aabb(child2->aabbmin, child2->aabbmax, ray);
+
+        if (dist1 > dist2)
+        {
+            std::swap(dist1, dist2);
+            std::swap(child1, child2);
+            // After this, child1 is always the nearest node and child2 is always the farthest node
+            // child1 : child_near
+            // child2 : child_far
+        }
+
+        // If the near child has not been hit, then neither node has been hit
+        if (dist1 == std::numeric_limits<float>::max())
+        {
+            if (stack_ptr == 0)
+            {
+                // Since there are no more nodes to process, and the ray has missed
+                // both bvs, we finish.
+                break;
+            }
+            else
+            {
+                node = stack[--stack_ptr];
+            }
+        }
+        else
+        {
+            // The near node has been hit, we will process it in the next
+            // loop iteration
+            node = child1;
+            if (dist2 != std::numeric_limits<float>::max())
+            {
+                // The far node has been hit as well, we will store it in the stack
+                // for later processing.
+                stack[stack_ptr++] = child2;
+            }
+        }
+    }
+
+    return intersect;
+}
+
+bool BVH::occluded(
+    const Ray& ray,
+    const float* tris,
+    const uint64_t stride,
+    float tmax) const
+{
+#if ML_BVH_SIMD_LEAVES
+    return occluded(ray, tris, RuntimeVertexLayout((uint32_t)stride), tmax);
+#else
+    return dispatch_vertex_layout(stride, [&](const auto& layout)
+    {
+        return occluded(ray, tris, layout, tmax);
+    });
+#endif
+}
+
+template<uint32_t Stride>
+bool BVH::occluded(
+    const Ray& ray,
+    [[maybe_unused]] const float* tris,
+    [[maybe_unused]] const VertexLayout<Stride>& layout,
+    float tmax) const
+{
+    // Any hit will do, so the children are neither sorted nor is their
+    // distance remembered.
+    uint32_t stack[BVH_STACK_SIZE];
+    unsigned stack_ptr = 0;
+    stack[stack_ptr++] = 0;
+
+    while (stack_ptr > 0)
+    {
+        const BVHNode& node = m_bvh_nodes[stack[--stack_ptr]];
+
+        if (ray_intersects_aabb(node.aabbmin, node.aabbmax, ray) >= tmax)
+        {
+            continue;
+        }
+
+        if (!node.is_leaf())
+        {
+            stack[stack_ptr++] = node.left_first + 1;
+            stack[stack_ptr++] = node.left_first;
+            continue;
+        }
+
+#if ML_BVH_SIMD_LEAVES
+        const uint32_t block_idx = m_leaf_block_idx[&node - m_bvh_nodes];
+        if (occluded_triangle_blocks(&m_leaf_blocks[block_idx], node.tri_count, ray, tmax))
+        {
+            return true;
+        }
+#else
+        const unsigned triangle_size =
+            layout.triangle_size;
+
+        for (unsigned i = 0; i < node.tri_count; ++i)
+        {
+            const unsigned triangle_pos = m_tri_idx[node.left_first + i] * triangle_size;
+
+            IntersectionParams its = ray_hit_triangle(ray, &tris[triangle_pos], layout);
+            if (its.t > 0.f && its.t < tmax)
+            {
+                return true;
+            }
+        }
+#endif
+    }
+
+    return false;
+}
+
+// Conservative bounds of the origins and inverse directions of a ray packet.
+// With interval arithmetic they give a range of entry/exit distances that
+// contains the one of every ray, so a node can be rejected for the whole
+// packet with a single test. Only usable if the directions of all rays have
+// the same sign on every axis.
+template<uint32_t N>
+struct PacketInterval
+{
+    PacketInterval(const RayPacket<N>& packet)
+    {
+        const float* o[3] = { packet.ox, packet.oy, packet.oz };
+        const float* invd[3] = { packet.invdx, packet.invdy, packet.invdz };
+
+        for (int a = 0; a < 3; ++a)
+        {
+            omin[a] = omax[a] = o[a][0];
+            imin[a] = imax[a] = invd[a][0];
+            for (uint32_t i = 1; i < N; ++i)
+            {
+                omin[a] = std::min(omin[a], o[a][i]);
+                omax[a] = std::max(omax[a], o[a][i]);
+                imin[a] = std::min(imin[a], invd[a][i]);
+                imax[a] = std::max(imax[a], invd[a][i]);
+            }
+
+            if ((imin[a] < 0.f && imax[a] > 0.f) ||
+                !std::isfinite(imin[a]) || !std::isfinite(imax[a]))
+            {
+                valid = false;
+            }
+        }
+    }
+
+    // Returns false if no ray of the packet can hit the box before @tmax
+    bool intersect(const Vector3<float>& bmin, const Vector3<float>& bmax, float tmax) const
+    {
+        if (!valid)
+        {
+            return true;
+        }
+
+        float tnear = 0.f;
+        float tfar = tmax;
+        for (int a = 0; a < 3; ++a)
+        {
+            const bool negative = imax[a] < 0.f;
+            const float near_plane = negative ? bmax[a] : bmin[a];
+            const float far_plane = negative ? bmin[a] : bmax[a];
+
+            const float n0 = (near_plane - omax[a]) * imin[a];
+            const float n1 = (near_plane - omax[a]) * imax[a];
+            const float n2 = (near_plane - omin[a]) * imin[a];
+            const float n3 = (near_plane - omin[a]) * imax[a];
+            tnear = std::max(tnear, std::min(std::min(n0, n1), std::min(n2, n3)));
+
+            const float f0 = (far_plane - omax[a]) * imin[a];
+            const float f1 = (far_plane - omax[a]) * imax[a];
+            const float f2 = (far_plane - omin[a]) * imin[a];
+            const float f3 = (far_plane - omin[a]) * imax[a];
+            tfar = std::min(tfar, std::max(std::max(f0, f1), std::max(f2, f3)));
+        }
+
+        return tnear <= tfar;
+    }
+
+    float omin[3], omax[3];
+    float imin[3], imax[3];
+    bool valid = true;
+};
+
+// Slab test of the four rays starting at @first against a box.
+// Returns a bit mask of the rays that hit it before their closest hit so far.
+template<uint32_t N>
+static int intersect_aabb_4(
+    const RayPacket<N>& packet, uint32_t first, const BVHNode& node)
+{
+    const float4 ox = float4::load(&packet.ox[first]);
+    const float4 oy = float4::load(&packet.oy[first]);
+    const float4 oz = float4::load(&packet.oz[first]);
+    const float4 invdx = float4::load(&packet.invdx[first]);
+    const float4 invdy = float4::load(&packet.invdy[first]);
+    const float4 invdz = float4::load(&packet.invdz[first]);
+
+    const float4 tx0 = (float4::set1(node.aabbmin.x) - ox) * invdx;
+    const float4 tx1 = (float4::set1(node.aabbmax.x) - ox) * invdx;
+    const float4 ty0 = (float4::set1(node.aabbmin.y) - oy) * invdy;
+    const float4 ty1 = (float4::set1(node.aabbmax.y) - oy) * invdy;
+    const float4 tz0 = (float4::set1(node.aabbmin.z) - oz) * invdz;
+    const float4 tz1 = (float4::set1(node.aabbmax.z) - oz) * invdz;
+
+    float4 tnear = float4::zero();
+    float4 tfar = float4::load(&packet.t[first]);
+    tnear = max(min(tx0, tx1), tnear);
+    tnear = max(min(ty0, ty1), tnear);
+    tnear = max(min(tz0, tz1), tnear);
+    tfar = min(max(tx0, tx1), tfar);
+    tfar = min(max(ty0, ty1), tfar);
+    tfar = min(max(tz0, tz1), tfar);
+
+    return (tnear <= tfar).bits();
+}
+
+// Moeller-Trumbore test of the four rays starting at @first against the triangle
+// with vertex @v0 and edges @edge0 and @edge1.
+// Rays that find a closer hit get their t, barycentrics, triangle and geometric
+// normal updated. Uses the same epsilon and acceptance rules as ray_hit_triangle.
+template<uint32_t N>
+static void intersect_triangle_4(
+    RayPacket<N>& packet, uint32_t first,
+    const vec3f& v0, const vec3f& edge0, const vec3f& edge1, const uint32_t triangle_pos,
+    uint32_t* hit_tri, float* hit_u, float* hit_v, vec3f* hit_normal)
+{
+    const float4 v0x = float4::set1(v0.x);
+    const float4 v0y = float4::set1(v0.y);
+    const float4 v0z = float4::set1(v0.z);
+    const float4 e0x = float4::set1(edge0.x);
+    const float4 e0y = float4::set1(edge0.y);
+    const float4 e0z = float4::set1(edge0.z);
+    const float4 e1x = float4::set1(edge1.x);
+    const float4 e1y = float4::set1(edge1.y);
+    const float4 e1z = float4::set1(edge1.z);
+
+    const float4 dx = float4::load(&packet.dx[first]);
+    const float4 dy = float4::load(&packet.dy[first]);
+    const float4 dz = float4::load(&packet.dz[first]);
+
+    // q = d x e1
+    const float4 qx = dy * e1z - dz * e1y;
+    const float4 qy = dz * e1x - dx * e1z;
+    const float4 qz = dx * e1y - dy * e1x;
+
+    const float4 a = e0x * qx + e0y * qy + e0z * qz;
+    mask4 mask = abs(a) >= float4::set1(1e-4f);
+    if (!mask.any())
+    {
+        return;
+    }
+
+    const float4 f = float4::set1(1.f) / a;
+
+    const float4 sx = float4::load(&packet.ox[first]) - v0x;
+    const float4 sy = float4::load(&packet.oy[first]) - v0y;
+    const float4 sz = float4::load(&packet.oz[first]) - v0z;
 
-    Vector3<float> e = node.aabbmax - node.aabbmin; // extent of parent
-    float parent_area = e.x * e.y + e.y * e.z + e.z * e.x;
-    float parent_cost = node.tri_count * parent_area;
+    const float4 u = f * (sx * qx + sy * qy + sz * qz);
 
-    int best_axis = -1;
-    float best_pos = 0.f;
-    float best_cost = std::numeric_limits<float>::max();
+    // r = s x e0
+    const float4 rx = sy * e0z - sz * e0y;
+    const float4 ry = sz * e0x - sx * e0z;
+    const float4 rz = sx * e0y - sy * e0x;
 
-    for (int axis = 0; axis < 3; ++axis)
+    const float4 v = f * (dx * rx + dy * ry + dz * rz);
+    const float4 t = f * (e1x * rx + e1y * ry + e1z * rz);
+
+    const float4 zero = float4::zero();
+    const float4 t_old = float4::load(&packet.t[first]);
+    mask = mask & (u >= zero) & (v >= zero) & (u + v <= float4::set1(1.f));
+    mask = mask & (t > zero) & (t < t_old);
+
+    const uint32_t hit_mask = mask.bits();
+    if (hit_mask == 0)
     {
-        for (unsigned i = 0; i < node.tri_count; ++i)
-        {
-            unsigned centroid_pos = 
-                compute_triangle_pos(i + node.left_first, stride) + centroid_off;
+        return;
+    }
 
-            float candidate_pos = tris[centroid_pos + axis];
-            float cost = compute_sah(node, tris, stride, axis, candidate_pos);
-            if (cost < best_cost)
-            {
-                best_pos = candidate_pos;
-                best_axis = axis;
-                best_cost = cost;
-            }
+    select(mask, t, t_old).store(&packet.t[first]);
+    select(mask, u, float4::load(&hit_u[first])).store(&hit_u[first]);
+    select(mask, v, float4::load(&hit_v[first])).store(&hit_v[first]);
+    const vec3f normal = cross(edge0, edge1);
+    for (uint32_t i = 0; i < 4; ++i)
+    {
+        if (hit_mask & (1 << i))
+        {
+            hit_tri[first + i] = triangle_pos;
+            hit_normal[first + i] = normal;
         }
     }
-
-    if (best_cost >= parent_cost) return false;
-    
-    axis = best_axis;
-    split_pos = best_pos;
-    return true;
 }
 
-// This test suffers from precision problems.
-// 
-static float IntersectAABB(const Vector3<float> bmin, const Vector3<float> bmax, const Ray& ray)
+// The groups of four rays in @group_mask against triangle @lane of @block
+template<uint32_t N>
+static void intersect_block_lane_4(
+    RayPacket<N>& packet, uint32_t group_mask, const LeafTriangleBlock& block, uint32_t lane,
+    uint32_t* hit_tri, float* hit_u, float* hit_v, vec3f* hit_normal)
 {
-    float tx1 = (bmin.x - ray.o.x) * ray.invd.x;
-    float tx2 = (bmax.x - ray.o.x) * ray.invd.x;
-    float tmin = std::min(tx1, tx2);
-    float tmax = std::max(tx1, tx2);
-    float ty1 = (bmin.y - ray.o.y) * ray.invd.y;
-    float ty2 = (bmax.y - ray.o.y) * ray.invd.y;
-    tmin = std::max(tmin, std::min(ty1, ty2));
-    tmax = std::min(tmax, std::max(ty1, ty2));
-    float tz1 = (bmin.z - ray.o.z) * ray.invd.z;
-    float tz2 = (bmax.z - ray.o.z) * ray.invd.z;
-    tmin = std::max(tmin, std::min(tz1, tz2));
-    tmax = std::min(tmax, std::max(tz1, tz2));
-    
-    if (tmax >= tmin && tmin < ray.t && tmax > 0.f)
-    {
-        return tmin;
-    }
-    else
+    const vec3f v0(block.v0x[lane], block.v0y[lane], block.v0z[lane]);
+    const vec3f e0(block.e1x[lane], block.e1y[lane], block.e1z[lane]);
+    const vec3f e1(block.e2x[lane], block.e2y[lane], block.e2z[lane]);
+    for (uint32_t first = 0; first < N; first += 4)
     {
-        return std::numeric_limits<float>::max();
+        if (group_mask & (1 << (first / 4)))
+        {
+            intersect_triangle_4(
+                packet, first, v0, e0, e1, block.triangle_pos[lane],
+                hit_tri, hit_u, hit_v, hit_normal
+            );
+        }
     }
 }
 
-static float IntersectAABB_SSE(const __m128 bmin4, const __m128 bmax4, const Ray& ray)
+template<uint32_t N>
+void BVH::intersect_packet(
+    RayPacket<N>& packet,
+    const float* tris,
+    const uint64_t stride,
+    IntersectionParams* intersect) const
 {
-    static __m128 mask4 = _mm_cmpeq_ps(_mm_setzero_ps(), _mm_set_ps(1, 0, 0, 0));
-    __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_and_ps(bmin4, mask4), ray.o4), ray.invd4);
-    __m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_and_ps(bmax4, mask4), ray.o4), ray.invd4);
-    __m128 vmax4 = _mm_max_ps(t1, t2), vmin4 = _mm_min_ps(t1, t2);
-    float tmax = std::min(vmax4.m128_f32[0], std::min(vmax4.m128_f32[1], vmax4.m128_f32[2]));
-    float tmin = std::max(vmin4.m128_f32[0], std::max(vmin4.m128_f32[1], vmin4.m128_f32[2]));
-    
-    if (tmax >= tmin && tmin < ray.t && tmax > 0) 
-        return tmin; 
-    else 
-        return std::numeric_limits<float>::max();
+#if ML_BVH_SIMD_LEAVES
+    intersect_packet(packet, tris, RuntimeVertexLayout((uint32_t)stride), intersect);
+#else
+    dispatch_vertex_layout(stride, [&](const auto& layout)
+    {
+        intersect_packet(packet, tris, layout, intersect);
+    });
+#endif
 }
 
-IntersectionParams BVH::intersect(
-    Ray& ray, 
-    const float* tris, 
-    const uint64_t stride)
+template<uint32_t N, uint32_t Stride>
+void BVH::intersect_packet(
+    RayPacket<N>& packet,
+    [[maybe_unused]] const float* tris,
+    [[maybe_unused]] const VertexLayout<Stride>& layout,
+    IntersectionParams* intersect) const
 {
-    IntersectionParams intersect;
+    const PacketInterval<N> interval(packet);
 
-    const BVHNode* node = &m_bvh_nodes[0];
-    BVHNode* stack[64];
-    unsigned stack_ptr = 0;
+    alignas(16) uint32_t hit_tri[N];
+    alignas(16) float hit_u[N];
+    alignas(16) float hit_v[N];
+    vec3f hit_normal[N];
 
-    const unsigned triangle_size = stride * VERT_PER_TRIANGLE + VERT_PER_TRIANGLE;
+    uint32_t stack[BVH_STACK_SIZE];
+    unsigned stack_ptr = 0;
+    stack[stack_ptr++] = 0;
 
-    while (true)
+    while (stack_ptr > 0)
     {
-        if (node->is_leaf())
+        const BVHNode& node = m_bvh_nodes[stack[--stack_ptr]];
+
+        float packet_tmax = packet.t[0];
+        for (uint32_t i = 1; i < N; ++i)
         {
-            for (unsigned i = 0; i < node->tri_count; ++i)
-            {
-                unsigned triangle_pos =
-                    compute_triangle_pos(i + node->left_first, stride);
+            packet_tmax = std::max(packet_tmax, packet.t[i]);
+        }
 
-                IntersectionParams new_intersect = ray_hit_triangle(
-                    ray, &tris[triangle_pos], stride
-                );
+        if (!interval.intersect(node.aabbmin, node.aabbmax, packet_tmax))
+        {
+            continue;
+        }
 
-                if (new_intersect.t < intersect.t && new_intersect.t > 0.f)
-                {
-                    intersect = new_intersect;
-                    intersect.triangle_idx = triangle_pos;
-                    ray.t = new_intersect.t;
-                }
+        if (!node.is_leaf())
+        {
+            // A single ray hitting the node is enough to descend into it
+            bool hit = false;
+            for (uint32_t first = 0; first < N && !hit; first += 4)
+            {
+                hit = intersect_aabb_4(packet, first, node) != 0;
             }
 
-            if (stack_ptr == 0)
+            if (!hit)
             {
-                break;
+                continue;
+            }
+
+            // Visit the child that lies closer along the direction of the first
+            // ray first. The rays are coherent, so this order is right for most
+            // rays of the packet.
+            const BVHNode& left = m_bvh_nodes[node.left_first];
+            const BVHNode& right = m_bvh_nodes[node.left_first + 1];
+            const Vector3<float> d(packet.dx[0], packet.dy[0], packet.dz[0]);
+            const float left_dist = dot(left.aabbmin + left.aabbmax, d);
+            const float right_dist = dot(right.aabbmin + right.aabbmax, d);
+
+            if (left_dist < right_dist)
+            {
+                stack[stack_ptr++] = node.left_first + 1;
+                stack[stack_ptr++] = node.left_first;
             }
             else
             {
-                node = stack[--stack_ptr];
+                stack[stack_ptr++] = node.left_first;
+                stack[stack_ptr++] = node.left_first + 1;
             }
-            
+
             continue;
         }
 
-        BVHNode* child1 = &m_bvh_nodes[node->left_first];
-        BVHNode* child2 = &m_bvh_nodes[node->left_first + 1];
-
-        // TODO: There is a strange performance degradation when both distances 
-        // are computed via the ray_intersects_aabb method. When only one of the
-        // distances is computed with that function, the performance improves
-        // over the IntersectAABB method. 
-        // How can this behavior be explained? 
-        //      - The number of loop iterations is not the culprit.
-        float dist1 = ray_intersects_aabb(child1->aabbmin, child1->aabbmax, ray);
-        //float dist2 = IntersectAABB(child2->aabbmin, child2->aabbmax, ray);
-        float dist2 = ray_intersects_aabb(child2->aabbmin, child2->aabbmax, ray);
+        // Only the groups of four rays that hit the leaf are tested against its triangles
+        uint32_t group_mask = 0;
+        for (uint32_t first = 0; first < N; first += 4)
+        {
+            if (intersect_aabb_4(packet, first, node))
+            {
+                group_mask |= 1 << (first / 4);
+            }
+        }
 
-        if (dist1 > dist2)
+        if (group_mask == 0)
         {
-            std::swap(dist1, dist2);
-            std::swap(child1, child2);
-            // After this, child1 is always the nearest node and child2 is always the farthest node
-            // child1 : child_near
-            // child2 : child_far
+            continue;
         }
 
-        // If the near child has not been hit, then neither node has been hit
-        if (dist1 == std::numeric_limits<float>::max())
+#if ML_BVH_SIMD_LEAVES
+        // The blocks hold the same vertex and edges as the records, the hits
+        // match the per-triangle path bit for bit
+        const LeafTriangleBlock* blocks = &m_leaf_blocks[m_leaf_block_idx[&node - m_bvh_nodes]];
+        for (uint32_t i = 0; i < node.tri_count; ++i)
         {
-            if (stack_ptr == 0)
-            {
-                // Since there are no more nodes to process, and the ray has missed
-                // both bvs, we finish.
-                break;
-            }
-            else
-            {
-                node = stack[--stack_ptr];
-            }
+            intersect_block_lane_4(
+                packet, group_mask, blocks[i / ML_BVH_LEAF_BLOCK_WIDTH], i % ML_BVH_LEAF_BLOCK_WIDTH,
+                hit_tri, hit_u, hit_v, hit_normal
+            );
         }
-        else
+#else
+        for (uint32_t i = 0; i < node.tri_count; ++i)
         {
-            // The near node has been hit, we will process it in the next
-            // loop iteration
-            node = child1;
-            if (dist2 != std::numeric_limits<float>::max())
+            const uint32_t triangle_pos = m_tri_idx[node.left_first + i] * layout.triangle_size;
+            const float* tri = &tris[triangle_pos];
+            const vec3f v0(tri[0], tri[1], tri[2]);
+            const vec3f e0(tri[layout.stride] - tri[0], tri[layout.stride + 1] - tri[1], tri[layout.stride + 2] - tri[2]);
+            const vec3f e1(tri[layout.stride * 2] - tri[0], tri[layout.stride * 2 + 1] - tri[1], tri[layout.stride * 2 + 2] - tri[2]);
+            for (uint32_t first = 0; first < N; first += 4)
             {
-                // The far node has been hit as well, we will store it in the stack
-                // for later processing.
-                stack[stack_ptr++] = child2;
+                if (group_mask & (1 << (first / 4)))
+                {
+                    intersect_triangle_4(
+                        packet, first, v0, e0, e1, triangle_pos,
+                        hit_tri, hit_u, hit_v, hit_normal
+                    );
+                }
             }
         }
+#endif
     }
 
-    return intersect;
+    for (uint32_t i = 0; i < N; ++i)
+    {
+        intersect[i] = IntersectionParams();
+        if (packet.t[i] == std::numeric_limits<float>::max())
+        {
+            continue;
+        }
+
+        intersect[i].t = packet.t[i];
+        intersect[i].u = hit_u[i];
+        intersect[i].v = hit_v[i];
+        intersect[i].triangle_idx = hit_tri[i];
+        intersect[i].set_face_normal(
+            vec3f(packet.dx[i], packet.dy[i], packet.dz[i]), normalize(hit_normal[i])
+        );
+    }
 }
 
+template void BVH::intersect_packet<4>(RayPacket<4>&, const float*, const uint64_t, IntersectionParams*) const;
+template void BVH::intersect_packet<8>(RayPacket<8>&, const float*, const uint64_t, IntersectionParams*) const;
+template void BVH::intersect_packet<16>(RayPacket<16>&, const float*, const uint64_t, IntersectionParams*) const;
 
+template<typename Layout>
 float BVH::compute_sah(
     const BVHNode& node, const float* tris, 
-    const uint64_t stride,
+    const Layout& layout,
     int axis, float pos)
 {
-    const unsigned centroid_offset = stride * VERT_PER_TRIANGLE;
+    const unsigned centroid_offset = layout.centroid_offset;
 
     AABB left_box;
     AABB right_box;
@@ -311,21 +1637,21 @@ float BVH::compute_sah(
     for (unsigned i = 0; i < node.tri_count; ++i)
     {
         unsigned triangle_pos =
-            compute_triangle_pos(i + node.left_first, stride);
+            compute_triangle_pos(i + node.left_first, layout);
         const float* triangle = &tris[triangle_pos];
         if (triangle[centroid_offset + axis] < pos)
         {
             left_count++;
             aabb_extend(&left_box, (Vector3<float>*)&triangle[0]);
-            aabb_extend(&left_box, (Vector3<float>*)&triangle[stride]);
-            aabb_extend(&left_box, (Vector3<float>*)&triangle[stride * 2]);
+            aabb_extend(&left_box, (Vector3<float>*)&triangle[layout.stride]);
+            aabb_extend(&left_box, (Vector3<float>*)&triangle[layout.stride * 2]);
         }
         else
         {
             right_count++;
             aabb_extend(&right_box, (Vector3<float>*)&triangle[0]);
-            aabb_extend(&right_box, (Vector3<float>*)&triangle[stride]);
-            aabb_extend(&right_box, (Vector3<float>*)&triangle[stride * 2]);
+            aabb_extend(&right_box, (Vector3<float>*)&triangle[layout.stride]);
+            aabb_extend(&right_box, (Vector3<float>*)&triangle[layout.stride * 2]);
         }
     }
 
@@ -333,6 +1659,44 @@ float BVH::compute_sah(
     return cost > 0 ? cost : std::numeric_limits<float>::max();
 }
 
+float BVH::sah_cost() const
+{
+    // Traversal and intersection are weighted equally, which matches the
+    // termination criterion used during the build.
+    const BVHNode& root = m_bvh_nodes[0];
+    Vector3<float> e = root.aabbmax - root.aabbmin;
+    float root_area = e.x * e.y + e.y * e.z + e.z * e.x;
+    if (root_area <= 0.f)
+    {
+        return 0.f;
+    }
+
+    float cost = 0.f;
+    BVHNode* stack[BVH_STACK_SIZE];
+    unsigned stack_ptr = 0;
+    const BVHNode* node = &m_bvh_nodes[0];
+    while (true)
+    {
+        e = node->aabbmax - node->aabbmin;
+        float area = e.x * e.y + e.y * e.z + e.z * e.x;
+
+        if (node->is_leaf())
+        {
+            cost += area * node->tri_count;
+            if (stack_ptr == 0) break;
+            node = stack[--stack_ptr];
+        }
+        else
+        {
+            cost += area;
+            stack[stack_ptr++] = &m_bvh_nodes[node->left_first + 1];
+            node = &m_bvh_nodes[node->left_first];
+        }
+    }
+
+    return cost / root_area;
+}
+
 bool BVH::validate_parent_bigger_than_child()
 {
     for (int i = 0; i < m_nodes_used; ++i)
@@ -356,6 +1720,7 @@ bool BVH::validate_parent_bigger_than_child()
             }
         }
     }
+    return true;
 }
 
 bool BVH::validate_all_bvs_well_defined()
@@ -372,32 +1737,310 @@ bool BVH::validate_all_bvs_well_defined()
             }
         }
     }
+    return true;
+}
+
+// On-disk layout of a BVH cache, version 4:
+//
+//   BVHFileHeader
+//   BVHNode[num_nodes]                     at nodes_offset
+//   uint32_t[num_references]               at indices_offset
+//   LeafTriangleBlock[num_leaf_blocks]     at leaf_blocks_offset      (optional)
+//   uint32_t[num_nodes]                    at leaf_block_idx_offset   (optional)
+//
+// Every section starts on a cache line, so that the arrays can be used in place
+// from a mapping of the file. The node section is the exception, it starts half
+// a line in so that sibling pairs do not straddle lines (see BVHNodePair).
+struct BVHFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    // BVH_FILE_ENDIAN_TAG as written by the producing machine
+    uint32_t endian_tag;
+    uint32_t node_layout;
+    uint32_t node_size;
+    // Zero if the file carries no leaf blocks
+    uint32_t leaf_block_width;
+    uint32_t leaf_block_size;
+    uint32_t num_nodes;
+    uint32_t num_triangles;
+    // Length of the index section, see BVH::get_num_references
+    uint32_t num_references;
+    uint32_t num_leaf_blocks;
+    uint32_t build_strategy;
+    uint64_t mesh_hash;
+    uint64_t nodes_offset;
+    uint64_t indices_offset;
+    uint64_t leaf_blocks_offset;
+    uint64_t leaf_block_idx_offset;
+    uint8_t reserved[32];
+};
+
+static_assert(sizeof(BVHFileHeader) == 2 * ML_CACHE_LINE_SIZE, "BVH file header must fill two cache lines");
+
+constexpr char BVH_FILE_MAGIC[8] = { 'M', 'L', 'B', 'V', 'H', '\0', '\0', '\0' };
+constexpr uint32_t BVH_FILE_VERSION = 4;
+constexpr uint32_t BVH_FILE_ENDIAN_TAG = 0x01020304;
+// BVHNode: aabbmin, left_first, aabbmax, tri_count
+constexpr uint32_t BVH_NODE_LAYOUT_AABB32 = 1;
+
+static BVHFileHeader make_file_header(
+    uint32_t num_nodes, uint32_t num_triangles, uint32_t num_references,
+    uint32_t num_leaf_blocks, uint32_t build_strategy, uint64_t mesh_hash)
+{
+    BVHFileHeader header = {};
+    std::memcpy(header.magic, BVH_FILE_MAGIC, sizeof(header.magic));
+    header.version = BVH_FILE_VERSION;
+    header.endian_tag = BVH_FILE_ENDIAN_TAG;
+    header.node_layout = BVH_NODE_LAYOUT_AABB32;
+    header.node_size = sizeof(BVHNode);
+    header.leaf_block_width = num_leaf_blocks > 0 ? ML_BVH_LEAF_BLOCK_WIDTH : 0;
+    header.leaf_block_size = num_leaf_blocks > 0 ? sizeof(LeafTriangleBlock) : 0;
+    header.num_nodes = num_nodes;
+    header.num_triangles = num_triangles;
+    header.num_references = num_references;
+    header.num_leaf_blocks = num_leaf_blocks;
+    header.build_strategy = build_strategy;
+    header.mesh_hash = mesh_hash;
+
+    // The node section starts half a cache line in, see BVHNodePair
+    uint64_t offset = sizeof(BVHFileHeader) + ML_CACHE_LINE_SIZE / 2;
+    header.nodes_offset = offset;
+    offset = Align(offset + sizeof(BVHNode) * num_nodes, ML_CACHE_LINE_SIZE);
+    header.indices_offset = offset;
+    offset = Align(offset + sizeof(uint32_t) * num_references, ML_CACHE_LINE_SIZE);
+
+    if (num_leaf_blocks > 0)
+    {
+        header.leaf_blocks_offset = offset;
+        offset = Align(offset + sizeof(LeafTriangleBlock) * num_leaf_blocks, ML_CACHE_LINE_SIZE);
+        header.leaf_block_idx_offset = offset;
+    }
+
+    return header;
+}
+
+// One pass over the sections of a mapped cache and one over the tree. Traversal
+// indexes the arrays with the values stored in the file, so any node, reference
+// or leaf block index out of range fails the load instead of reading past the
+// mapping, as does a tree deeper than the traversal stacks.
+static bool file_indices_in_range(
+    const BVHFileHeader& header, const BVHNode* nodes, const uint32_t* tri_idx,
+    const uint32_t* leaf_block_idx)
+{
+    if (header.num_nodes == 0)
+    {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < header.num_references; ++i)
+    {
+        if (tri_idx[i] >= header.num_triangles)
+        {
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < header.num_nodes; ++i)
+    {
+        const BVHNode& node = nodes[i];
+        if (node.is_leaf())
+        {
+            if ((uint64_t)node.left_first + node.tri_count > header.num_references)
+            {
+                return false;
+            }
+            if (leaf_block_idx != nullptr)
+            {
+                const uint64_t n_blocks =
+                    ((uint64_t)node.tri_count + ML_BVH_LEAF_BLOCK_WIDTH - 1) / ML_BVH_LEAF_BLOCK_WIDTH;
+                if (leaf_block_idx[i] + n_blocks > header.num_leaf_blocks)
+                {
+                    return false;
+                }
+            }
+        }
+        else if ((uint64_t)node.left_first + 1 >= header.num_nodes)
+        {
+            return false;
+        }
+    }
+
+    // The traversal stacks bound the depth. A tree visits every node once at
+    // most, more visits mean the children form cycles or are shared.
+    struct Item
+    {
+        uint32_t node;
+        uint32_t depth;
+    };
+    std::vector<Item> stack;
+    stack.push_back({ 0, 0 });
+    uint32_t visited = 0;
+
+    while (!stack.empty())
+    {
+        const Item item = stack.back();
+        stack.pop_back();
+
+        if (item.depth >= BVH_STACK_SIZE || ++visited > header.num_nodes)
+        {
+            return false;
+        }
+
+        const BVHNode& node = nodes[item.node];
+        if (!node.is_leaf())
+        {
+            stack.push_back({ node.left_first + 1, item.depth + 1 });
+            stack.push_back({ node.left_first, item.depth + 1 });
+        }
+    }
+
+    return true;
 }
 
-void BVH::deserialize(const std::string& filename)
+bool BVH::deserialize(const std::string& filename, uint64_t mesh_hash)
 {
-    std::ifstream file(filename, std::ios::binary);
+    // Map the file before touching the current tree, a failed load leaves it intact
+    MappedFile mapped_file;
+    if (!mapped_file.open(filename, true) || mapped_file.size() < sizeof(BVHFileHeader))
+    {
+        return false;
+    }
+
+    const char* data = static_cast<const char*>(mapped_file.data());
+    const BVHFileHeader& header = *reinterpret_cast<const BVHFileHeader*>(data);
+
+    if (std::memcmp(header.magic, BVH_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != BVH_FILE_VERSION ||
+        header.endian_tag != BVH_FILE_ENDIAN_TAG ||
+        header.node_layout != BVH_NODE_LAYOUT_AABB32 ||
+        header.node_size != sizeof(BVHNode) ||
+        header.mesh_hash != mesh_hash)
+    {
+        return false;
+    }
+
+    // Leaf blocks written with a different block width are ignored, the caller
+    // rebuilds them.
+    const bool leaf_blocks_usable =
+        header.num_leaf_blocks > 0 &&
+        header.leaf_block_width == ML_BVH_LEAF_BLOCK_WIDTH &&
+        header.leaf_block_size == sizeof(LeafTriangleBlock);
+
+    const BVHFileHeader expected = make_file_header(
+        header.num_nodes, header.num_triangles, header.num_references,
+        header.num_leaf_blocks, header.build_strategy, mesh_hash
+    );
+    const uint64_t expected_size = header.num_leaf_blocks > 0
+        ? expected.leaf_block_idx_offset + sizeof(uint32_t) * header.num_nodes
+        : expected.indices_offset + sizeof(uint32_t) * header.num_references;
+
+    if (header.nodes_offset != expected.nodes_offset ||
+        header.indices_offset != expected.indices_offset ||
+        header.leaf_blocks_offset != expected.leaf_blocks_offset ||
+        header.leaf_block_idx_offset != expected.leaf_block_idx_offset ||
+        mapped_file.size() < expected_size)
+    {
+        return false;
+    }
+
+    const BVHNode* nodes = reinterpret_cast<const BVHNode*>(data + header.nodes_offset);
+    const uint32_t* tri_idx = reinterpret_cast<const uint32_t*>(data + header.indices_offset);
+    const uint32_t* leaf_block_idx = leaf_blocks_usable
+        ? reinterpret_cast<const uint32_t*>(data + header.leaf_block_idx_offset)
+        : nullptr;
+    if (!file_indices_in_range(header, nodes, tri_idx, leaf_block_idx))
+    {
+        return false;
+    }
 
-    file.read((char*)&m_num_nodes, sizeof(unsigned));
-    const unsigned n_triangles = (m_num_nodes + 1) / 2;
+    // The mapping is read-only. The arrays are exposed through non-const pointers
+    // for the existing accessors, but a mapped tree is never written to.
+    m_bvh_nodes = reinterpret_cast<BVHNode*>(const_cast<char*>(data + header.nodes_offset));
+    m_tri_idx = reinterpret_cast<uint32_t*>(const_cast<char*>(data + header.indices_offset));
+    m_num_nodes = header.num_nodes;
+    m_nodes_used = header.num_nodes;
+    m_num_triangles = header.num_triangles;
+    m_num_references = header.num_references;
+    m_build_strategy = static_cast<BVHBuildStrategy>(header.build_strategy);
+
+    if (leaf_blocks_usable)
+    {
+        m_leaf_blocks = reinterpret_cast<const LeafTriangleBlock*>(data + header.leaf_blocks_offset);
+        m_leaf_block_idx = reinterpret_cast<const uint32_t*>(data + header.leaf_block_idx_offset);
+        m_num_leaf_blocks = header.num_leaf_blocks;
+    }
+    else
+    {
+        m_leaf_blocks = nullptr;
+        m_leaf_block_idx = nullptr;
+        m_num_leaf_blocks = 0;
+    }
 
-    m_tri_idx = std::make_unique<unsigned[]>(n_triangles);
-    m_bvh_nodes = std::make_unique<BVHNode[]>(m_num_nodes);
+    m_bvh_node_storage.reset();
+    m_tri_idx_storage.reset();
+    m_leaf_block_storage.clear();
+    m_leaf_block_idx_storage.reset();
+    m_reference_area.reset();
 
-    file.read((char*)m_tri_idx.get(), sizeof(unsigned) * n_triangles);
-    file.read((char*)m_bvh_nodes.get(), sizeof(BVHNode) * m_num_nodes);
-    file.read((char*)&m_nodes_used, sizeof(unsigned));
+    m_mapped_file = std::move(mapped_file);
+    return true;
 }
 
-void BVH::serialize(const std::string& filename)
+bool BVH::serialize(const std::string& filename, uint64_t mesh_hash)
 {
-    const unsigned n_triangles = (m_num_nodes + 1) / 2;
+    // A mapped tree may come from @filename itself. It is copied out and the
+    // mapping released first, a mapped file can't be replaced on every platform.
+    if (is_mapped())
+    {
+        copy_mapped_tree(true);
+    }
+
+    const unsigned nodes_used = m_nodes_used;
+    const BVHFileHeader header = make_file_header(
+        nodes_used, m_num_triangles, m_num_references,
+        m_leaf_blocks != nullptr ? m_num_leaf_blocks : 0,
+        static_cast<uint32_t>(m_build_strategy), mesh_hash
+    );
+
+    // Written next to the cache and renamed over it once complete, so that a
+    // failed write never leaves a truncated cache behind
+    const std::string temp_filename = filename + ".tmp";
+    std::ofstream file(temp_filename, std::ios::binary);
+
+    auto write_section = [&file](uint64_t offset, const void* section, std::size_t n_bytes)
+    {
+        // Zero pad up to the start of the section
+        static const char padding[ML_CACHE_LINE_SIZE] = {};
+        const uint64_t pos = file.tellp();
+        file.write(padding, offset - pos);
+        file.write(static_cast<const char*>(section), n_bytes);
+        return (bool)file;
+    };
+
+    bool written = file.write(reinterpret_cast<const char*>(&header), sizeof(BVHFileHeader)) &&
+        write_section(header.nodes_offset, m_bvh_nodes, sizeof(BVHNode) * nodes_used) &&
+        write_section(header.indices_offset, m_tri_idx, sizeof(uint32_t) * m_num_references);
+
+    if (written && header.num_leaf_blocks > 0)
+    {
+        written = write_section(header.leaf_blocks_offset, m_leaf_blocks, sizeof(LeafTriangleBlock) * m_num_leaf_blocks) &&
+            write_section(header.leaf_block_idx_offset, m_leaf_block_idx, sizeof(uint32_t) * nodes_used);
+    }
+
+    file.close();
+    std::error_code error;
+    if (written && file)
+    {
+        std::filesystem::rename(temp_filename, filename, error);
+        if (!error)
+        {
+            return true;
+        }
+    }
 
-    std::ofstream file(filename, std::ios::binary);
-    file.write((char*)&m_num_nodes, sizeof(unsigned));
-    file.write((char*)m_tri_idx.get(), sizeof(unsigned) * n_triangles);
-    file.write((char*)m_bvh_nodes.get(), sizeof(BVHNode) * m_num_nodes);
-    file.write((char*)&m_nodes_used, sizeof(unsigned));
+    std::filesystem::remove(temp_filename, error);
+    return false;
 }
 
 void BVH::to_file_ascii(const std::string& filename)
@@ -1,17 +1,24 @@
 #pragma once
+#include "../project_defines.hpp"
 #include "../simple_math.hpp"
+#include "../collision/aabb.hpp"
 #include "../collision/primitive_tests.hpp"
 #include "../collision/ray.hpp"
+#include "../collision/ray_packet.hpp"
+#include "triangle_block.hpp"
+#include "mapped_file.hpp"
+#include <atomic>
+#include <memory>
 
 namespace moonlight
 {
 
-struct BVHNode
+struct alignas(16) BVHNode
 {
     BVHNode()
         : aabbmin(std::numeric_limits<float>::max())
-        , aabbmax(-std::numeric_limits<float>::max())
         , left_first(0)
+        , aabbmax(-std::numeric_limits<float>::max())
         , tri_count(0)
     {}
 
@@ -20,17 +27,65 @@ struct BVHNode
         return tri_count > 0;
     }
 
-    union
-    {
-        struct { Vector3<float> aabbmin; unsigned int left_first; };
-        __m128 aabbMin4;
-    };
+    Vector3<float> aabbmin;
+    unsigned int left_first;
 
-    union
-    {
-        struct { Vector3<float> aabbmax; unsigned int tri_count; };
-        __m128 aabbMax4;
-    };
+    Vector3<float> aabbmax;
+    unsigned int tri_count;
+};
+
+// Storage unit of the node arrays. Trees are indexed from the second slot of
+// the first pair: the root fills half a cache line and every sibling pair,
+// which always starts at an odd index, shares a line of its own.
+struct alignas(ML_CACHE_LINE_SIZE) BVHNodePair
+{
+    BVHNode nodes[2];
+};
+
+static_assert(sizeof(BVHNodePair) == ML_CACHE_LINE_SIZE, "A sibling pair must fill one cache line");
+
+// Entries of the fixed traversal stacks. A depth-first traversal of a binary
+// tree holds at most one pending node per level, plus the one it starts from.
+constexpr uint32_t BVH_STACK_SIZE = 64;
+// Deepest level the LBVH and SBVH builders create, deeper nodes are turned into
+// leaves. Well below the stack size, so that loaded trees get some headroom.
+constexpr uint32_t BVH_MAX_DEPTH = 48;
+
+// Memory order of the nodes, see BVH::reorder_nodes
+enum class BVHNodeOrder
+{
+    // Every sibling pair is followed by the subtree of the left sibling and then
+    // by the one of the right sibling.
+    DepthFirst,
+    // The tree is cut into treelets of a few levels that are stored breadth
+    // first in consecutive memory, so that the nodes a ray visits in the top
+    // levels come from a handful of pages (a van Emde Boas style layout).
+    Treelet
+};
+
+enum class BVHBuildStrategy
+{
+    // Tests every triangle centroid as a split candidate. This is O(n^2) per node
+    // and only kept around as a reference for tree quality comparisons.
+    Exhaustive,
+    // Bins the centroids into a fixed number of buckets per axis and only evaluates
+    // the SAH at the bucket boundaries.
+    BinnedSAH,
+    // Same splits as BinnedSAH, but subtrees are built as TBB tasks and the
+    // binning/partition passes of the top levels run in parallel.
+    ParallelBinnedSAH,
+    // Linear BVH: sorts the triangles along a Morton curve of their centroids and
+    // derives the hierarchy from the sorted codes. Much faster to build than the
+    // SAH builders, at the price of a noticeably worse tree.
+    LBVH,
+    // LBVH followed by treelet restructuring, which brings most of the SAH
+    // quality back for a fraction of the SAH build time.
+    LBVHTreelet,
+    // Binned SAH that also considers spatial splits, which clip triangles at the
+    // split plane and reference them from both children (Stich et al. 2009).
+    // Slow to build, but large overlapping triangles no longer blow up the
+    // child bounds. See set_spatial_split_budget.
+    SBVH
 };
 
 class BVH
@@ -40,31 +95,131 @@ public:
     void build_bvh(
         const float* tris,
         const uint64_t stride_in_bytes,
-        uint32_t n_triangles
+        uint32_t n_triangles,
+        BVHBuildStrategy strategy = BVHBuildStrategy::BinnedSAH
+    );
+
+    // Upper bound on the triangle references the SBVH build may add through
+    // spatial splits, as a fraction of the triangle count.
+    void set_spatial_split_budget(float budget)
+    {
+        m_spatial_split_budget = budget;
+    }
+
+    // Recomputes the bounds of all nodes for the current vertex positions in @tris
+    // while keeping the topology, which is far cheaper than a rebuild for animated
+    // or deformed meshes. The centroids stored in @tris have to be current.
+    // If the SAH cost has grown by more than @max_sah_growth since the tree was
+    // built, the subtrees that degraded the most are rebuilt, or the whole tree
+    // if no partial rebuild is possible or it leaves the cost above the limit.
+    // Returns true if anything was rebuilt.
+    bool refit(
+        const float* tris,
+        const uint64_t stride_in_bytes,
+        float max_sah_growth = 1.25f
     );
 
     IntersectionParams intersect(
         Ray& ray, 
         const float* tris,
         const uint64_t stride_in_bytes
-    );
+    ) const;
+
+    // Returns true as soon as any triangle is hit closer than @tmax. Meant for
+    // shadow and AO rays, which only need to know whether something is in the way.
+    bool occluded(
+        const Ray& ray,
+        const float* tris,
+        const uint64_t stride_in_bytes,
+        float tmax
+    ) const;
+
+    // Finds the closest hit of every ray in @packet. The packet is culled against
+    // each node as a whole before the rays are tested four at a time, which pays
+    // off for coherent rays such as the primary rays of a pixel block.
+    // @intersect has to hold N entries.
+    template<uint32_t N>
+    void intersect_packet(
+        RayPacket<N>& packet,
+        const float* tris,
+        const uint64_t stride_in_bytes,
+        IntersectionParams* intersect
+    ) const;
+
+    // Moves the nodes into @order. Parallel builds allocate the nodes in task
+    // completion order, which scatters the subtrees over the whole array.
+    // The topology and the triangle order are left untouched.
+    void reorder_nodes(BVHNodeOrder order);
+
+    // Packs the triangles of every leaf into SoA blocks for the SIMD leaf kernel.
+    // build_bvh does this on its own, a deserialized BVH needs it called explicitly.
+    void build_leaf_blocks(const float* tris, const uint64_t stride_in_bytes);
 
     void to_file_ascii(const std::string& filename);
 
-    void deserialize(const std::string& filename);
-    void serialize(const std::string& filename);
+    // Maps a BVH cache written by serialize. Nodes, indices and leaf blocks are
+    // used in place from the read-only mapping, nothing is copied.
+    // Returns false if the file is missing, was written in an older or foreign
+    // format, or was built from a mesh whose hash differs from @mesh_hash.
+    bool deserialize(const std::string& filename, uint64_t mesh_hash);
+    // Returns false if the file could not be written, an existing cache is
+    // left untouched then. A tree mapped from @filename is copied into memory
+    // first.
+    bool serialize(const std::string& filename, uint64_t mesh_hash);
+
+    // True if the tree lives in a mapped cache file and must not be modified
+    bool is_mapped() const
+    {
+        return m_mapped_file.is_open();
+    }
+
+    bool has_leaf_blocks() const
+    {
+        return m_leaf_blocks != nullptr;
+    }
+
+    // SAH cost of the whole tree, normalized by the surface area of the root node.
+    float sah_cost() const;
 
     bool validate_parent_bigger_than_child();
     bool validate_all_bvs_well_defined();
 
     BVHNode* get_raw_nodes()
     {
-        return m_bvh_nodes.get();
+        return m_bvh_nodes;
+    }
+
+    const BVHNode* get_raw_nodes() const
+    {
+        return m_bvh_nodes;
     }
 
     uint32_t* get_raw_indices()
     {
-        return m_tri_idx.get();
+        return m_tri_idx;
+    }
+
+    const uint32_t* get_raw_indices() const
+    {
+        return m_tri_idx;
+    }
+
+    const LeafTriangleBlock* get_leaf_blocks() const
+    {
+        return m_leaf_blocks;
+    }
+
+    // Index of the first triangle block of the leaf @node_idx
+    uint32_t get_leaf_block_index(uint32_t node_idx) const
+    {
+        return m_leaf_block_idx[node_idx];
+    }
+
+    // Length of the triangle index array. Larger than the triangle count if
+    // spatial splits referenced triangles from several leaves.
+    uint32_t get_num_references() const
+    {
+        return m_num_references;
     }
 
     unsigned get_nodes_used() const
@@ -79,30 +234,148 @@ public:
 
 private:
 
-    void update_node_bounds(uint32_t node_idx, const float* tris, const uint64_t stride);
+    // The build, refit and leaf test internals are templated on the vertex
+    // layout. The public functions above dispatch on their stride argument once,
+    // see dispatch_vertex_layout.
+
+    template<typename Layout>
+    void update_node_bounds(uint32_t node_idx, const float* tris, const Layout& layout);
+
+    template<typename Layout>
+    AABB compute_triangle_bounds(
+        uint32_t first, uint32_t last,
+        const float* tris, const Layout& layout
+    );
+
+    template<typename Layout>
+    AABB compute_centroid_bounds(
+        uint32_t first, uint32_t last,
+        const float* tris, const Layout& layout
+    );
+
+    template<typename Layout>
+    unsigned partition_parallel(
+        const BVHNode& node, const float* tris,
+        const Layout& layout, int axis, float split_pos
+    );
 
-    void sub_divide(uint32_t node_idx, const float* tris, const uint64_t stride);
+    template<typename Layout>
+    void sub_divide(uint32_t node_idx, const float* tris, const Layout& layout);
 
+    template<typename Layout>
     float compute_sah(
         const BVHNode& node, const float* tris, 
-        const uint64_t stride, int axis, float pos
+        const Layout& layout, int axis, float pos
     );
 
+    template<typename Layout>
     bool compute_optimal_split(
         const BVHNode& node, const float* tris, 
-        const uint64_t stride, int& axis, float& split_pos
+        const Layout& layout, int& axis, float& split_pos
     );
 
-    unsigned compute_triangle_pos(
-        unsigned triangle_pos, unsigned stride
+    template<typename Layout>
+    bool compute_optimal_split_binned(
+        const BVHNode& node, const float* tris,
+        const Layout& layout, int& axis, float& split_pos
     );
 
+    template<typename Layout>
+    void refit_node(uint32_t node_idx, const float* tris, const Layout& layout, uint32_t depth);
+
+    // Rebuilds the subtrees that degraded the most during refits. Returns false
+    // if there is no sensible partial rebuild and the tree has to be rebuilt.
+    template<typename Layout>
+    bool rebuild_degraded_subtrees(const float* tris, const Layout& layout, float max_sah_growth);
+
+    // Queries for a known layout, the leaf tests of the scalar and packet
+    // paths read the mesh with constant offsets
+    template<uint32_t Stride>
+    IntersectionParams intersect(
+        Ray& ray,
+        const float* tris,
+        const VertexLayout<Stride>& layout
+    ) const;
+
+    template<uint32_t Stride>
+    bool occluded(
+        const Ray& ray,
+        const float* tris,
+        const VertexLayout<Stride>& layout,
+        float tmax
+    ) const;
+
+    template<uint32_t N, uint32_t Stride>
+    void intersect_packet(
+        RayPacket<N>& packet,
+        const float* tris,
+        const VertexLayout<Stride>& layout,
+        IntersectionParams* intersect
+    ) const;
+
+    // Copies a mapped tree into owned storage, so that it can be modified
+    void make_writable();
+
+    // Copies the arrays of a mapped tree, the leaf blocks only if
+    // @with_leaf_blocks, and releases the mapping
+    void copy_mapped_tree(bool with_leaf_blocks);
+
+    // Allocates room for @count nodes in @storage and returns the node array,
+    // see BVHNodePair
+    static BVHNode* allocate_nodes(std::unique_ptr<BVHNodePair[]>& storage, uint32_t count);
+
+    // Spatial split BVH construction, see bvh_sbvh.cpp
+    template<typename Layout>
+    void build_sbvh(const float* tris, const Layout& layout);
+
+    // Karras style LBVH construction, see bvh_lbvh.cpp
+    template<typename Layout>
+    void build_lbvh(const float* tris, const Layout& layout);
+
+    // Post-order pass that replaces the topology of small treelets with the
+    // cheapest one in terms of SAH. @cost receives the SAH cost of every node
+    // and @height the levels below it, new topologies that would reach past
+    // BVH_MAX_DEPTH from the @depth of their root are rejected.
+    float optimize_treelets(uint32_t node_idx, float* cost, uint32_t* height, uint32_t depth);
+    void restructure_treelet(uint32_t root_idx, float* cost, uint32_t* height, uint32_t depth);
+
+    // Offset of the @i-th referenced triangle in the mesh
+    template<typename Layout>
+    uint32_t compute_triangle_pos(uint32_t i, const Layout& layout) const
+    {
+        return m_tri_idx[i] * layout.triangle_size;
+    }
+
 private:
 
-    std::unique_ptr<uint32_t[]> m_tri_idx;
-    std::unique_ptr<BVHNode[]> m_bvh_nodes;
-    unsigned m_num_nodes;
-    unsigned m_nodes_used = 1;
+    // The arrays below either point into the storage of a built tree or into
+    // m_mapped_file for a tree loaded from a cache.
+    uint32_t* m_tri_idx = nullptr;
+    BVHNode* m_bvh_nodes = nullptr;
+    unsigned m_num_nodes = 0;
+    std::atomic<unsigned> m_nodes_used = 1;
+    uint32_t m_num_triangles = 0;
+    uint32_t m_num_references = 0;
+    float m_spatial_split_budget = 0.3f;
+
+    const LeafTriangleBlock* m_leaf_blocks = nullptr;
+    uint32_t m_num_leaf_blocks = 0;
+    // Maps a leaf node to its first block in m_leaf_blocks, unused for inner nodes
+    const uint32_t* m_leaf_block_idx = nullptr;
+
+    std::unique_ptr<uint32_t[]> m_tri_idx_storage;
+    std::unique_ptr<BVHNodePair[]> m_bvh_node_storage;
+    std::vector<LeafTriangleBlock> m_leaf_block_storage;
+    std::unique_ptr<uint32_t[]> m_leaf_block_idx_storage;
+    MappedFile m_mapped_file;
+
+    // Surface area of every node and the SAH cost of the tree relative to its
+    // leaves before the first refit. Refits compare against these to detect
+    // degraded subtrees.
+    std::unique_ptr<float[]> m_reference_area;
+    float m_reference_sah = 0.f;
+
+    BVHBuildStrategy m_build_strategy = BVHBuildStrategy::BinnedSAH;
 };
 
 }
\ No newline at end of file
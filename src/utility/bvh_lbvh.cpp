@@ -0,0 +1,641 @@
+#include "bvh.hpp"
+#include <bit>
+#include <vector>
+
+#include "tbb/blocked_range.h"
+#include "tbb/parallel_for.h"
+#include "tbb/parallel_invoke.h"
+#include "tbb/parallel_reduce.h"
+
+// Linear BVH builder (Karras 2012, "Maximizing Parallelism in the Construction
+// of BVHs, Octrees, and k-d Trees") with the treelet restructuring of
+// Karras & Aila 2013 as an optional second pass.
+
+namespace moonlight
+{
+
+constexpr unsigned VERT_PER_TRIANGLE = 3;
+constexpr unsigned LBVH_GRAIN_SIZE = 4096;
+// Meshes with more triangles than this use 63 bit Morton codes. Below it the
+// 30 bit codes are fine grained enough and sort in half the passes.
+constexpr uint32_t LBVH_WIDE_CODE_THRESHOLD = 1 << 20;
+// Subtrees with at most this many triangles may be collapsed into a leaf
+constexpr uint32_t LBVH_MAX_LEAF_SIZE = 8;
+constexpr uint32_t TREELET_MAX_LEAVES = 7;
+// Treelets below this depth are restructured as parallel tasks
+constexpr uint32_t TREELET_TASK_DEPTH = 10;
+
+// Karras node references use the top bit to tell leaves from internal nodes
+constexpr uint32_t LBVH_LEAF_BIT = 0x80000000u;
+
+using vec3f = Vector3<float>;
+
+static float half_area(const vec3f& bmin, const vec3f& bmax)
+{
+    vec3f e = bmax - bmin;
+    return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+// Spreads the lower 10 bits of v so that there are two zero bits between each
+static uint32_t expand_bits_10(uint32_t v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// Spreads the lower 21 bits of v so that there are two zero bits between each
+static uint64_t expand_bits_21(uint64_t v)
+{
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffull;
+    v = (v | v << 16) & 0x1f0000ff0000ffull;
+    v = (v | v << 8) & 0x100f00f00f00f00full;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+}
+
+// Morton code of a point inside the unit cube
+template<typename Key>
+static Key morton_code(float x, float y, float z);
+
+template<>
+uint32_t morton_code<uint32_t>(float x, float y, float z)
+{
+    auto quantize = [](float v) { return (uint32_t)std::min(std::max(v * 1024.f, 0.f), 1023.f); };
+    return (expand_bits_10(quantize(x)) << 2) | (expand_bits_10(quantize(y)) << 1) | expand_bits_10(quantize(z));
+}
+
+template<>
+uint64_t morton_code<uint64_t>(float x, float y, float z)
+{
+    auto quantize = [](float v) { return (uint64_t)std::min(std::max(v * 2097152.f, 0.f), 2097151.f); };
+    return (expand_bits_21(quantize(x)) << 2) | (expand_bits_21(quantize(y)) << 1) | expand_bits_21(quantize(z));
+}
+
+// Parallel LSD radix sort of key/value pairs, eight bits per pass. Each block
+// of the input histograms its digits, an exclusive scan over (digit, block)
+// turns the histograms into scatter offsets and the blocks scatter in parallel,
+// which keeps the sort stable.
+template<typename Key>
+static void radix_sort(std::vector<Key>& keys, std::vector<uint32_t>& values, unsigned key_bits)
+{
+    constexpr unsigned RADIX = 256;
+
+    const uint32_t n = keys.size();
+    const uint32_t n_blocks = (n + LBVH_GRAIN_SIZE - 1) / LBVH_GRAIN_SIZE;
+
+    std::vector<Key> keys_tmp(n);
+    std::vector<uint32_t> values_tmp(n);
+    std::vector<uint32_t> offsets(n_blocks * RADIX);
+
+    Key* src_keys = keys.data();
+    Key* dst_keys = keys_tmp.data();
+    uint32_t* src_values = values.data();
+    uint32_t* dst_values = values_tmp.data();
+
+    const unsigned n_passes = (key_bits + 7) / 8;
+    for (unsigned pass = 0; pass < n_passes; ++pass)
+    {
+        const unsigned shift = pass * 8;
+
+        tbb::parallel_for(0u, n_blocks, [&](uint32_t block)
+        {
+            uint32_t* histogram = &offsets[block * RADIX];
+            std::fill(histogram, histogram + RADIX, 0u);
+
+            const uint32_t last = std::min(n, (block + 1) * LBVH_GRAIN_SIZE);
+            for (uint32_t i = block * LBVH_GRAIN_SIZE; i < last; ++i)
+            {
+                histogram[(src_keys[i] >> shift) & (RADIX - 1)]++;
+            }
+        });
+
+        uint32_t offset = 0;
+        for (unsigned digit = 0; digit < RADIX; ++digit)
+        {
+            for (uint32_t block = 0; block < n_blocks; ++block)
+            {
+                const uint32_t count = offsets[block * RADIX + digit];
+                offsets[block * RADIX + digit] = offset;
+                offset += count;
+            }
+        }
+
+        tbb::parallel_for(0u, n_blocks, [&](uint32_t block)
+        {
+            uint32_t* block_offsets = &offsets[block * RADIX];
+
+            const uint32_t last = std::min(n, (block + 1) * LBVH_GRAIN_SIZE);
+            for (uint32_t i = block * LBVH_GRAIN_SIZE; i < last; ++i)
+            {
+                const uint32_t dst = block_offsets[(src_keys[i] >> shift) & (RADIX - 1)]++;
+                dst_keys[dst] = src_keys[i];
+                dst_values[dst] = src_values[i];
+            }
+        });
+
+        std::swap(src_keys, dst_keys);
+        std::swap(src_values, dst_values);
+    }
+
+    if (src_keys != keys.data())
+    {
+        keys.swap(keys_tmp);
+        values.swap(values_tmp);
+    }
+}
+
+// Binary radix tree over n sorted keys: internal node i has its children in
+// left[i] and right[i], either internal nodes or leaves (LBVH_LEAF_BIT set).
+// Leaf j is the j-th triangle in sorted order.
+struct RadixTree
+{
+    std::vector<uint32_t> left;
+    std::vector<uint32_t> right;
+    std::vector<uint32_t> first;
+    std::vector<uint32_t> last;
+    std::vector<uint32_t> parent;       // of internal nodes, parent[0] is unused
+    std::vector<uint32_t> leaf_parent;
+};
+
+template<typename Key>
+static void build_radix_tree(const std::vector<Key>& codes, RadixTree& tree)
+{
+    const int64_t n = codes.size();
+
+    tree.left.resize(n - 1);
+    tree.right.resize(n - 1);
+    tree.first.resize(n - 1);
+    tree.last.resize(n - 1);
+    tree.parent.resize(n - 1);
+    tree.leaf_parent.resize(n);
+
+    // Length of the common prefix of the keys i and j. Duplicate keys are made
+    // unique by appending the index.
+    auto delta = [&](int64_t i, int64_t j) -> int
+    {
+        if (j < 0 || j >= n)
+        {
+            return -1;
+        }
+
+        if (codes[i] == codes[j])
+        {
+            return (int)sizeof(Key) * 8 + std::countl_zero((uint32_t)(i ^ j));
+        }
+
+        return std::countl_zero(codes[i] ^ codes[j]);
+    };
+
+    tbb::parallel_for(tbb::blocked_range<int64_t>(0, n - 1, LBVH_GRAIN_SIZE),
+        [&](const tbb::blocked_range<int64_t>& r)
+        {
+            for (int64_t i = r.begin(); i < r.end(); ++i)
+            {
+                // Direction of the range covered by node i
+                const int64_t d = delta(i, i + 1) > delta(i, i - 1) ? 1 : -1;
+
+                // Upper bound of the range length, then binary search the other end
+                const int delta_min = delta(i, i - d);
+                int64_t l_max = 2;
+                while (delta(i, i + l_max * d) > delta_min)
+                {
+                    l_max *= 2;
+                }
+
+                int64_t l = 0;
+                for (int64_t t = l_max / 2; t >= 1; t /= 2)
+                {
+                    if (delta(i, i + (l + t) * d) > delta_min)
+                    {
+                        l += t;
+                    }
+                }
+                const int64_t j = i + l * d;
+
+                // Binary search the split position, the last key that shares
+                // more than the node's common prefix with key i
+                const int delta_node = delta(i, j);
+                int64_t s = 0;
+                for (int64_t div = 2; ; div *= 2)
+                {
+                    const int64_t t = (l + div - 1) / div;
+                    if (delta(i, i + (s + t) * d) > delta_node)
+                    {
+                        s += t;
+                    }
+                    if (t == 1)
+                    {
+                        break;
+                    }
+                }
+                const int64_t gamma = i + s * d + std::min<int64_t>(d, 0);
+
+                const uint32_t first = std::min(i, j);
+                const uint32_t last = std::max(i, j);
+                tree.first[i] = first;
+                tree.last[i] = last;
+
+                if (first == gamma)
+                {
+                    tree.left[i] = gamma | LBVH_LEAF_BIT;
+                    tree.leaf_parent[gamma] = i;
+                }
+                else
+                {
+                    tree.left[i] = gamma;
+                    tree.parent[gamma] = i;
+                }
+
+                if (last == gamma + 1)
+                {
+                    tree.right[i] = (gamma + 1) | LBVH_LEAF_BIT;
+                    tree.leaf_parent[gamma + 1] = i;
+                }
+                else
+                {
+                    tree.right[i] = gamma + 1;
+                    tree.parent[gamma + 1] = i;
+                }
+            }
+        }
+    );
+}
+
+template<typename Layout>
+void BVH::build_lbvh(const float* tris, const Layout& layout)
+{
+    const uint32_t n = m_num_triangles;
+    const unsigned triangle_size = layout.triangle_size;
+    const unsigned centroid_offset = layout.centroid_offset;
+
+    // The root and its bounds are set up by build_bvh
+    if (n < 2)
+    {
+        return;
+    }
+
+    const AABB centroid_bounds = compute_centroid_bounds(0, n, tris, layout);
+    const vec3f extent = centroid_bounds.bmax - centroid_bounds.bmin;
+    const vec3f scale(
+        extent.x > 0.f ? 1.f / extent.x : 0.f,
+        extent.y > 0.f ? 1.f / extent.y : 0.f,
+        extent.z > 0.f ? 1.f / extent.z : 0.f
+    );
+
+    std::vector<uint32_t> sorted_idx(n);
+    RadixTree tree;
+
+    auto sort_and_build = [&]<typename Key>(unsigned key_bits)
+    {
+        std::vector<Key> codes(n);
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0, n, LBVH_GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t>& r)
+            {
+                for (uint32_t i = r.begin(); i < r.end(); ++i)
+                {
+                    const float* centroid = &tris[i * triangle_size + centroid_offset];
+                    codes[i] = morton_code<Key>(
+                        (centroid[0] - centroid_bounds.bmin.x) * scale.x,
+                        (centroid[1] - centroid_bounds.bmin.y) * scale.y,
+                        (centroid[2] - centroid_bounds.bmin.z) * scale.z
+                    );
+                    sorted_idx[i] = i;
+                }
+            }
+        );
+
+        radix_sort(codes, sorted_idx, key_bits);
+        build_radix_tree(codes, tree);
+    };
+
+    if (n > LBVH_WIDE_CODE_THRESHOLD)
+    {
+        sort_and_build.template operator()<uint64_t>(63);
+    }
+    else
+    {
+        sort_and_build.template operator()<uint32_t>(30);
+    }
+
+    // Bottom up pass over the radix tree. The second thread to arrive at a node
+    // computes its bounds and decides whether the subtree is cheaper as a leaf.
+    std::vector<AABB> internal_bounds(n - 1);
+    std::vector<AABB> leaf_bounds(n);
+    std::vector<float> internal_cost(n - 1);
+    std::vector<uint8_t> collapse(n - 1, 0);
+    std::unique_ptr<std::atomic<uint32_t>[]> arrivals = std::make_unique<std::atomic<uint32_t>[]>(n - 1);
+
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, n, LBVH_GRAIN_SIZE),
+        [&](const tbb::blocked_range<uint32_t>& r)
+        {
+            for (uint32_t leaf = r.begin(); leaf < r.end(); ++leaf)
+            {
+                const float* tri = &tris[sorted_idx[leaf] * triangle_size];
+                AABB bounds;
+                for (unsigned v = 0; v < VERT_PER_TRIANGLE; ++v)
+                {
+                    bounds.bmin = cwise_min(&bounds.bmin, (vec3f*)&tri[v * layout.stride]);
+                    bounds.bmax = cwise_max(&bounds.bmax, (vec3f*)&tri[v * layout.stride]);
+                }
+                leaf_bounds[leaf] = bounds;
+
+                uint32_t node = tree.leaf_parent[leaf];
+                while (arrivals[node].fetch_add(1, std::memory_order_acq_rel) == 1)
+                {
+                    auto child_bounds = [&](uint32_t ref) -> const AABB&
+                    {
+                        return ref & LBVH_LEAF_BIT
+                            ? leaf_bounds[ref & ~LBVH_LEAF_BIT] : internal_bounds[ref];
+                    };
+                    auto child_cost = [&](uint32_t ref)
+                    {
+                        const AABB& b = child_bounds(ref);
+                        return ref & LBVH_LEAF_BIT ? half_area(b.bmin, b.bmax) : internal_cost[ref];
+                    };
+
+                    const AABB& l = child_bounds(tree.left[node]);
+                    const AABB& r = child_bounds(tree.right[node]);
+                    AABB& b = internal_bounds[node];
+                    b.bmin = cwise_min(&l.bmin, &r.bmin);
+                    b.bmax = cwise_max(&l.bmax, &r.bmax);
+
+                    // Same cost model as sah_cost: traversal and intersection weigh one
+                    const uint32_t count = tree.last[node] - tree.first[node] + 1;
+                    const float area = half_area(b.bmin, b.bmax);
+                    const float split_cost = area + child_cost(tree.left[node]) + child_cost(tree.right[node]);
+                    const float leaf_cost = area * count;
+
+                    if (count <= LBVH_MAX_LEAF_SIZE && leaf_cost <= split_cost)
+                    {
+                        collapse[node] = 1;
+                        internal_cost[node] = leaf_cost;
+                    }
+                    else
+                    {
+                        internal_cost[node] = split_cost;
+                    }
+
+                    if (node == 0)
+                    {
+                        break;
+                    }
+                    node = tree.parent[node];
+                }
+            }
+        }
+    );
+
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        m_tri_idx[i] = sorted_idx[i];
+    }
+
+    // Emit the final nodes depth first, which puts sibling pairs and whole
+    // subtrees next to each other in memory. The radix tree is as deep as the
+    // codes have bits, subtrees below BVH_MAX_DEPTH become leaves.
+    struct Item
+    {
+        uint32_t ref;
+        uint32_t slot;
+        uint32_t depth;
+    };
+
+    std::vector<Item> stack;
+    stack.push_back({ 0, 0, 0 });
+    uint32_t nodes_used = 1;
+
+    while (!stack.empty())
+    {
+        const Item item = stack.back();
+        stack.pop_back();
+
+        BVHNode& node = m_bvh_nodes[item.slot];
+        if (item.ref & LBVH_LEAF_BIT)
+        {
+            const uint32_t leaf = item.ref & ~LBVH_LEAF_BIT;
+            node.aabbmin = leaf_bounds[leaf].bmin;
+            node.aabbmax = leaf_bounds[leaf].bmax;
+            node.left_first = leaf;
+            node.tri_count = 1;
+            continue;
+        }
+
+        node.aabbmin = internal_bounds[item.ref].bmin;
+        node.aabbmax = internal_bounds[item.ref].bmax;
+
+        if (collapse[item.ref] || item.depth >= BVH_MAX_DEPTH)
+        {
+            node.left_first = tree.first[item.ref];
+            node.tri_count = tree.last[item.ref] - tree.first[item.ref] + 1;
+            continue;
+        }
+
+        node.left_first = nodes_used;
+        node.tri_count = 0;
+        nodes_used += 2;
+
+        stack.push_back({ tree.right[item.ref], node.left_first + 1, item.depth + 1 });
+        stack.push_back({ tree.left[item.ref], node.left_first, item.depth + 1 });
+    }
+
+    m_nodes_used = nodes_used;
+
+    if (m_build_strategy == BVHBuildStrategy::LBVHTreelet)
+    {
+        std::vector<float> cost(nodes_used);
+        std::vector<uint32_t> height(nodes_used);
+        optimize_treelets(0, cost.data(), height.data(), 0);
+    }
+}
+
+#define ML_INSTANTIATE_BUILD_LBVH(Layout) \
+    template void BVH::build_lbvh<Layout>(const float*, const Layout&);
+ML_FOR_EACH_VERTEX_LAYOUT(ML_INSTANTIATE_BUILD_LBVH)
+#undef ML_INSTANTIATE_BUILD_LBVH
+
+float BVH::optimize_treelets(uint32_t node_idx, float* cost, uint32_t* height, uint32_t depth)
+{
+    const BVHNode& node = m_bvh_nodes[node_idx];
+    const float area = half_area(node.aabbmin, node.aabbmax);
+
+    if (node.is_leaf())
+    {
+        cost[node_idx] = area * node.tri_count;
+        height[node_idx] = 0;
+        return cost[node_idx];
+    }
+
+    // Children first, so every treelet is formed from already optimized subtrees
+    const uint32_t left = node.left_first;
+    if (depth < TREELET_TASK_DEPTH)
+    {
+        tbb::parallel_invoke(
+            [&]() { optimize_treelets(left, cost, height, depth + 1); },
+            [&]() { optimize_treelets(left + 1, cost, height, depth + 1); }
+        );
+    }
+    else
+    {
+        optimize_treelets(left, cost, height, depth + 1);
+        optimize_treelets(left + 1, cost, height, depth + 1);
+    }
+
+    cost[node_idx] = area + cost[left] + cost[left + 1];
+    height[node_idx] = 1 + std::max(height[left], height[left + 1]);
+    restructure_treelet(node_idx, cost, height, depth);
+    return cost[node_idx];
+}
+
+void BVH::restructure_treelet(uint32_t root_idx, float* cost, uint32_t* height, uint32_t depth)
+{
+    // Grow the treelet by opening the leaf with the largest surface area
+    uint32_t leaves[TREELET_MAX_LEAVES];
+    uint32_t n_leaves = 2;
+    leaves[0] = m_bvh_nodes[root_idx].left_first;
+    leaves[1] = m_bvh_nodes[root_idx].left_first + 1;
+
+    // Child pairs owned by the internal nodes of the treelet, they are reused
+    // for the new topology
+    uint32_t pairs[TREELET_MAX_LEAVES - 1];
+    uint32_t n_pairs = 1;
+    pairs[0] = m_bvh_nodes[root_idx].left_first;
+
+    while (n_leaves < TREELET_MAX_LEAVES)
+    {
+        int best = -1;
+        float best_area = -1.f;
+        for (uint32_t i = 0; i < n_leaves; ++i)
+        {
+            const BVHNode& candidate = m_bvh_nodes[leaves[i]];
+            const float area = half_area(candidate.aabbmin, candidate.aabbmax);
+            if (!candidate.is_leaf() && area > best_area)
+            {
+                best = i;
+                best_area = area;
+            }
+        }
+
+        if (best == -1)
+        {
+            break;
+        }
+
+        const uint32_t opened = m_bvh_nodes[leaves[best]].left_first;
+        pairs[n_pairs++] = opened;
+        leaves[best] = opened;
+        leaves[n_leaves++] = opened + 1;
+    }
+
+    // Two or three leaves leave no room for a better topology worth the effort
+    if (n_leaves < 4)
+    {
+        return;
+    }
+
+    // Optimal topology over all subsets of the treelet leaves. Every proper
+    // subset of s is numerically smaller than s, so one ascending sweep
+    // sees the subproblems first.
+    constexpr uint32_t MAX_SUBSETS = 1 << TREELET_MAX_LEAVES;
+    const uint32_t full = (1u << n_leaves) - 1;
+
+    vec3f subset_min[MAX_SUBSETS];
+    vec3f subset_max[MAX_SUBSETS];
+    float subset_cost[MAX_SUBSETS];
+    uint32_t subset_height[MAX_SUBSETS];
+    uint8_t subset_split[MAX_SUBSETS];
+
+    for (uint32_t s = 1; s <= full; ++s)
+    {
+        const uint32_t low = s & (~s + 1);
+        const uint32_t leaf = std::countr_zero(s);
+        const BVHNode& leaf_node = m_bvh_nodes[leaves[leaf]];
+
+        if (s == low)
+        {
+            subset_min[s] = leaf_node.aabbmin;
+            subset_max[s] = leaf_node.aabbmax;
+            subset_cost[s] = cost[leaves[leaf]];
+            subset_height[s] = height[leaves[leaf]];
+            continue;
+        }
+
+        subset_min[s] = cwise_min(&subset_min[s ^ low], &leaf_node.aabbmin);
+        subset_max[s] = cwise_max(&subset_max[s ^ low], &leaf_node.aabbmax);
+
+        // Only partitions that keep the lowest leaf on the left, the mirrored
+        // ones cost the same
+        const uint32_t rest = s ^ low;
+        float best_cost = std::numeric_limits<float>::max();
+        uint32_t best_split = low;
+        for (uint32_t q = (rest - 1) & rest; ; q = (q - 1) & rest)
+        {
+            const uint32_t p = q | low;
+            const float c = subset_cost[p] + subset_cost[s ^ p];
+            if (c < best_cost)
+            {
+                best_cost = c;
+                best_split = p;
+            }
+
+            if (q == 0)
+            {
+                break;
+            }
+        }
+
+        subset_cost[s] = half_area(subset_min[s], subset_max[s]) + best_cost;
+        subset_height[s] = 1 + std::max(subset_height[best_split], subset_height[s ^ best_split]);
+        subset_split[s] = best_split;
+    }
+
+    // A chain of treelet nodes adds levels, every node has to stay above
+    // BVH_MAX_DEPTH however often its ancestors are restructured
+    if (subset_cost[full] >= cost[root_idx] * 0.999f ||
+        depth + subset_height[full] > BVH_MAX_DEPTH)
+    {
+        return;
+    }
+
+    BVHNode leaf_nodes[TREELET_MAX_LEAVES];
+    float leaf_costs[TREELET_MAX_LEAVES];
+    uint32_t leaf_heights[TREELET_MAX_LEAVES];
+    for (uint32_t i = 0; i < n_leaves; ++i)
+    {
+        leaf_nodes[i] = m_bvh_nodes[leaves[i]];
+        leaf_costs[i] = cost[leaves[i]];
+        leaf_heights[i] = height[leaves[i]];
+    }
+
+    uint32_t next_pair = 0;
+    auto emit = [&](auto& self, uint32_t s, uint32_t slot) -> void
+    {
+        if (std::has_single_bit(s))
+        {
+            m_bvh_nodes[slot] = leaf_nodes[std::countr_zero(s)];
+            cost[slot] = leaf_costs[std::countr_zero(s)];
+            height[slot] = leaf_heights[std::countr_zero(s)];
+            return;
+        }
+
+        const uint32_t pair = pairs[next_pair++];
+        BVHNode& node = m_bvh_nodes[slot];
+        node.aabbmin = subset_min[s];
+        node.aabbmax = subset_max[s];
+        node.left_first = pair;
+        node.tri_count = 0;
+        cost[slot] = subset_cost[s];
+        height[slot] = subset_height[s];
+
+        self(self, subset_split[s], pair);
+        self(self, s ^ subset_split[s], pair + 1);
+    };
+
+    emit(emit, full, root_idx);
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,543 @@
+#include "bvh.hpp"
+#include <atomic>
+#include <cstring>
+#include <vector>
+
+#include "tbb/parallel_invoke.h"
+
+// Spatial split BVH builder (Stich, Friedrich & Dietrich 2009, "Spatial Splits
+// in Bounding Volume Hierarchies"). Nodes choose between a binned object split
+// and a spatial split, which clips the triangles that straddle the split plane
+// and references them from both children.
+
+namespace moonlight
+{
+
+constexpr unsigned VERT_PER_TRIANGLE = 3;
+constexpr unsigned SBVH_OBJECT_BIN_COUNT = 16;
+constexpr unsigned SBVH_SPATIAL_BIN_COUNT = 32;
+// Spatial splits are only evaluated if the children of the best object split
+// overlap by more than this share of the root surface area (alpha in the paper)
+constexpr float SBVH_OVERLAP_THRESHOLD = 1e-5f;
+// Nodes with at least this many references build their children as parallel tasks
+constexpr uint32_t SBVH_TASK_THRESHOLD = 4096;
+
+using vec3f = Vector3<float>;
+
+// Part of a triangle that belongs to a node. Spatial splits clip the bounds,
+// so the same triangle can appear in several nodes with disjoint bounds.
+struct SBVHRef
+{
+    AABB bounds;
+    uint32_t tri;
+};
+
+struct SBVHSplit
+{
+    float cost = std::numeric_limits<float>::max();
+    int axis = -1;
+    float pos = 0.f;
+    // Object splits only: the binning of the centroids and the first bin on
+    // the right side, so that the partition bins exactly like the sweep did
+    float bin_origin = 0.f;
+    float bin_scale = 0.f;
+    unsigned bin = 0;
+    AABB left_bounds, right_bounds;
+};
+
+struct SBVHObjectBin
+{
+    AABB bounds;
+    uint32_t count = 0;
+};
+
+struct SBVHSpatialBin
+{
+    AABB bounds;
+    uint32_t entry = 0;
+    uint32_t exit = 0;
+};
+
+static AABB aabb_intersection(const AABB& a, const AABB& b)
+{
+    AABB result;
+    result.bmin = cwise_max(&a.bmin, &b.bmin);
+    result.bmax = cwise_min(&a.bmax, &b.bmax);
+    return result;
+}
+
+// Surface area of the intersection, zero if the boxes are disjoint
+static float overlap_area(const AABB& a, const AABB& b)
+{
+    const AABB overlap = aabb_intersection(a, b);
+    vec3f e = overlap.bmax - overlap.bmin;
+    e.x = std::max(e.x, 0.f);
+    e.y = std::max(e.y, 0.f);
+    e.z = std::max(e.z, 0.f);
+    return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+static vec3f ref_centroid(const SBVHRef& ref)
+{
+    return (ref.bounds.bmin + ref.bounds.bmax) * 0.5f;
+}
+
+template<typename Layout>
+struct SBVHBuilder
+{
+    BVHNode* nodes;
+    std::atomic<unsigned>& nodes_used;
+    const float* tris;
+    Layout layout;
+    float root_area = 0.f;
+
+    // Remaining references the spatial splits may add
+    std::atomic<int64_t> budget = 0;
+
+    // Leaves append their triangles here, the final pass reorders them
+    uint32_t* leaf_refs = nullptr;
+    std::atomic<uint32_t> leaf_refs_used = 0;
+
+    const vec3f& vertex(uint32_t tri, unsigned v) const
+    {
+        return *(const vec3f*)&tris[tri * layout.triangle_size + v * layout.stride];
+    }
+
+    // Clips the part of the triangle inside @ref at the plane @pos on @axis
+    void split_reference(
+        const SBVHRef& ref, int axis, float pos,
+        SBVHRef& left, SBVHRef& right) const
+    {
+        left.tri = right.tri = ref.tri;
+        left.bounds = right.bounds = AABB();
+
+        for (unsigned v = 0; v < VERT_PER_TRIANGLE; ++v)
+        {
+            const vec3f& v0 = vertex(ref.tri, v);
+            const vec3f& v1 = vertex(ref.tri, (v + 1) % VERT_PER_TRIANGLE);
+            const float p0 = v0[axis], p1 = v1[axis];
+
+            if (p0 <= pos) aabb_extend(&left.bounds, &v0);
+            if (p0 >= pos) aabb_extend(&right.bounds, &v0);
+
+            // The edge crosses the plane
+            if ((p0 < pos && p1 > pos) || (p0 > pos && p1 < pos))
+            {
+                const float t = (pos - p0) / (p1 - p0);
+                vec3f p = v0 + (v1 - v0) * t;
+                p[axis] = pos;
+                aabb_extend(&left.bounds, &p);
+                aabb_extend(&right.bounds, &p);
+            }
+        }
+
+        left.bounds.bmax[axis] = pos;
+        right.bounds.bmin[axis] = pos;
+        left.bounds = aabb_intersection(left.bounds, ref.bounds);
+        right.bounds = aabb_intersection(right.bounds, ref.bounds);
+    }
+
+    SBVHSplit find_object_split(const std::vector<SBVHRef>& refs) const
+    {
+        AABB centroid_bounds;
+        for (const SBVHRef& ref : refs)
+        {
+            const vec3f c = ref_centroid(ref);
+            aabb_extend(&centroid_bounds, &c);
+        }
+
+        SBVHSplit best;
+        for (int a = 0; a < 3; ++a)
+        {
+            const float extent = centroid_bounds.bmax[a] - centroid_bounds.bmin[a];
+            if (extent <= 0.f) continue;
+            const float scale = SBVH_OBJECT_BIN_COUNT / extent;
+
+            SBVHObjectBin bins[SBVH_OBJECT_BIN_COUNT];
+            for (const SBVHRef& ref : refs)
+            {
+                const unsigned b = std::min(
+                    SBVH_OBJECT_BIN_COUNT - 1,
+                    (unsigned)((ref_centroid(ref)[a] - centroid_bounds.bmin[a]) * scale)
+                );
+                bins[b].count++;
+                aabb_extend(&bins[b].bounds, &ref.bounds);
+            }
+
+            // Sweep from the right, then evaluate every boundary from the left
+            AABB right_bounds[SBVH_OBJECT_BIN_COUNT];
+            uint32_t right_count[SBVH_OBJECT_BIN_COUNT];
+            AABB box;
+            uint32_t sum = 0;
+            for (unsigned i = SBVH_OBJECT_BIN_COUNT - 1; i > 0; --i)
+            {
+                aabb_extend(&box, &bins[i].bounds);
+                sum += bins[i].count;
+                right_bounds[i] = box;
+                right_count[i] = sum;
+            }
+
+            AABB left_box;
+            uint32_t left_count = 0;
+            for (unsigned i = 1; i < SBVH_OBJECT_BIN_COUNT; ++i)
+            {
+                aabb_extend(&left_box, &bins[i - 1].bounds);
+                left_count += bins[i - 1].count;
+                if (left_count == 0 || right_count[i] == 0) continue;
+
+                const float cost =
+                    left_count * aabb_area(left_box) + right_count[i] * aabb_area(right_bounds[i]);
+                if (cost < best.cost)
+                {
+                    best.cost = cost;
+                    best.axis = a;
+                    best.pos = centroid_bounds.bmin[a] + i / scale;
+                    best.bin_origin = centroid_bounds.bmin[a];
+                    best.bin_scale = scale;
+                    best.bin = i;
+                    best.left_bounds = left_box;
+                    best.right_bounds = right_bounds[i];
+                }
+            }
+        }
+
+        return best;
+    }
+
+    SBVHSplit find_spatial_split(const AABB& node_bounds, const std::vector<SBVHRef>& refs) const
+    {
+        SBVHSplit best;
+        for (int a = 0; a < 3; ++a)
+        {
+            const float origin = node_bounds.bmin[a];
+            const float extent = node_bounds.bmax[a] - origin;
+            if (extent <= 0.f) continue;
+            const float bin_width = extent / SBVH_SPATIAL_BIN_COUNT;
+            const float scale = 1.f / bin_width;
+
+            auto bin_of = [&](float p)
+            {
+                return std::min(SBVH_SPATIAL_BIN_COUNT - 1, (unsigned)std::max((p - origin) * scale, 0.f));
+            };
+
+            SBVHSpatialBin bins[SBVH_SPATIAL_BIN_COUNT];
+            for (const SBVHRef& ref : refs)
+            {
+                const unsigned first = bin_of(ref.bounds.bmin[a]);
+                const unsigned last = bin_of(ref.bounds.bmax[a]);
+                bins[first].entry++;
+                bins[last].exit++;
+
+                // Chop the reference into one piece per covered bin
+                SBVHRef rest = ref;
+                for (unsigned b = first; b < last; ++b)
+                {
+                    SBVHRef left, right;
+                    split_reference(rest, a, origin + (b + 1) * bin_width, left, right);
+                    aabb_extend(&bins[b].bounds, &left.bounds);
+                    rest = right;
+                }
+                aabb_extend(&bins[last].bounds, &rest.bounds);
+            }
+
+            AABB right_bounds[SBVH_SPATIAL_BIN_COUNT];
+            uint32_t right_count[SBVH_SPATIAL_BIN_COUNT];
+            AABB box;
+            uint32_t sum = 0;
+            for (unsigned i = SBVH_SPATIAL_BIN_COUNT - 1; i > 0; --i)
+            {
+                aabb_extend(&box, &bins[i].bounds);
+                sum += bins[i].exit;
+                right_bounds[i] = box;
+                right_count[i] = sum;
+            }
+
+            AABB left_box;
+            uint32_t left_count = 0;
+            for (unsigned i = 1; i < SBVH_SPATIAL_BIN_COUNT; ++i)
+            {
+                aabb_extend(&left_box, &bins[i - 1].bounds);
+                left_count += bins[i - 1].entry;
+                if (left_count == 0 || right_count[i] == 0) continue;
+
+                const float cost =
+                    left_count * aabb_area(left_box) + right_count[i] * aabb_area(right_bounds[i]);
+                if (cost < best.cost)
+                {
+                    best.cost = cost;
+                    best.axis = a;
+                    best.pos = origin + i * bin_width;
+                    best.left_bounds = left_box;
+                    best.right_bounds = right_bounds[i];
+                }
+            }
+        }
+
+        return best;
+    }
+
+    // Moves every reference to the side of the plane it lies on. References that
+    // straddle it are either clipped into both children or, if that is cheaper
+    // or the budget is exhausted, kept whole on one side (reference unsplitting).
+    void partition_spatial(
+        const SBVHSplit& split, const std::vector<SBVHRef>& refs,
+        std::vector<SBVHRef>& left, std::vector<SBVHRef>& right)
+    {
+        const int a = split.axis;
+        std::vector<SBVHRef> straddling;
+
+        for (const SBVHRef& ref : refs)
+        {
+            if (ref.bounds.bmax[a] <= split.pos)
+            {
+                left.push_back(ref);
+            }
+            else if (ref.bounds.bmin[a] >= split.pos)
+            {
+                right.push_back(ref);
+            }
+            else
+            {
+                straddling.push_back(ref);
+            }
+        }
+
+        // Reserve the worst case up front, the unused part is handed back below
+        const int64_t reserved = straddling.size();
+        const bool may_duplicate = budget.fetch_sub(reserved) >= reserved;
+        if (!may_duplicate)
+        {
+            budget.fetch_add(reserved);
+        }
+
+        // The costs are evaluated against the bounds of the spatial bins, which
+        // already contain the clipped pieces of all straddling references.
+        AABB split_left = split.left_bounds, split_right = split.right_bounds;
+        uint32_t left_count = left.size() + straddling.size();
+        uint32_t right_count = right.size() + straddling.size();
+        int64_t duplicated = 0;
+
+        for (const SBVHRef& ref : straddling)
+        {
+            AABB left_union = split_left, right_union = split_right;
+            aabb_extend(&left_union, &ref.bounds);
+            aabb_extend(&right_union, &ref.bounds);
+
+            const float area_left = aabb_area(split_left), area_right = aabb_area(split_right);
+            const float cost_split = left_count * area_left + right_count * area_right;
+            const float cost_left = left_count * aabb_area(left_union) + (right_count - 1) * area_right;
+            const float cost_right = (left_count - 1) * area_left + right_count * aabb_area(right_union);
+
+            if (may_duplicate && cost_split < cost_left && cost_split < cost_right)
+            {
+                SBVHRef l, r;
+                split_reference(ref, a, split.pos, l, r);
+                left.push_back(l);
+                right.push_back(r);
+                ++duplicated;
+            }
+            else if (cost_left <= cost_right)
+            {
+                left.push_back(ref);
+                split_left = left_union;
+                --right_count;
+            }
+            else
+            {
+                right.push_back(ref);
+                split_right = right_union;
+                --left_count;
+            }
+        }
+
+        if (may_duplicate)
+        {
+            budget.fetch_add(reserved - duplicated);
+        }
+    }
+
+    void partition_object(
+        const SBVHSplit& split, const std::vector<SBVHRef>& refs,
+        std::vector<SBVHRef>& left, std::vector<SBVHRef>& right) const
+    {
+        for (const SBVHRef& ref : refs)
+        {
+            const unsigned b = std::min(
+                SBVH_OBJECT_BIN_COUNT - 1,
+                (unsigned)((ref_centroid(ref)[split.axis] - split.bin_origin) * split.bin_scale)
+            );
+            (b < split.bin ? left : right).push_back(ref);
+        }
+    }
+
+    void make_leaf(uint32_t node_idx, const std::vector<SBVHRef>& refs)
+    {
+        const uint32_t first = leaf_refs_used.fetch_add(refs.size());
+        for (uint32_t i = 0; i < refs.size(); ++i)
+        {
+            leaf_refs[first + i] = refs[i].tri;
+        }
+
+        BVHNode& node = nodes[node_idx];
+        node.left_first = first;
+        node.tri_count = refs.size();
+    }
+
+    void sub_divide(uint32_t node_idx, std::vector<SBVHRef>& refs, uint32_t depth)
+    {
+        BVHNode& node = nodes[node_idx];
+        const uint32_t n = refs.size();
+
+        AABB node_bounds;
+        node_bounds.bmin = node.aabbmin;
+        node_bounds.bmax = node.aabbmax;
+        // Unlike object splits, spatial splits can keep shrinking the pieces
+        // around a shared vertex, so the traversal step has to be paid for.
+        // Traversal and intersection are weighted equally, as in sah_cost.
+        const float node_area = aabb_area(node_bounds);
+        const float leaf_cost = n * node_area;
+
+        if (n <= 1 || depth >= BVH_MAX_DEPTH)
+        {
+            make_leaf(node_idx, refs);
+            return;
+        }
+
+        SBVHSplit object_split = find_object_split(refs);
+
+        // Spatial splits only pay off where the object split leaves the children
+        // overlapping, which also keeps the expensive search off most nodes.
+        SBVHSplit spatial_split;
+        const bool overlapping = object_split.axis == -1 ||
+            overlap_area(object_split.left_bounds, object_split.right_bounds) > SBVH_OVERLAP_THRESHOLD * root_area;
+        if (overlapping && budget > 0)
+        {
+            spatial_split = find_spatial_split(node_bounds, refs);
+        }
+
+        if (node_area + std::min(object_split.cost, spatial_split.cost) >= leaf_cost)
+        {
+            make_leaf(node_idx, refs);
+            return;
+        }
+
+        std::vector<SBVHRef> left, right;
+        if (spatial_split.cost < object_split.cost)
+        {
+            partition_spatial(spatial_split, refs, left, right);
+        }
+
+        // Unsplitting can move every reference to one side, the object split
+        // is the fallback then.
+        if (left.empty() || right.empty())
+        {
+            left.clear();
+            right.clear();
+            if (object_split.axis == -1)
+            {
+                make_leaf(node_idx, refs);
+                return;
+            }
+            partition_object(object_split, refs, left, right);
+        }
+
+        refs.clear();
+        refs.shrink_to_fit();
+
+        const uint32_t left_child_idx = nodes_used.fetch_add(2);
+        const uint32_t right_child_idx = left_child_idx + 1;
+        set_bounds(left_child_idx, left);
+        set_bounds(right_child_idx, right);
+        node.left_first = left_child_idx;
+        node.tri_count = 0;
+
+        if (n >= SBVH_TASK_THRESHOLD)
+        {
+            tbb::parallel_invoke(
+                [&]() { sub_divide(left_child_idx, left, depth + 1); },
+                [&]() { sub_divide(right_child_idx, right, depth + 1); }
+            );
+        }
+        else
+        {
+            sub_divide(left_child_idx, left, depth + 1);
+            sub_divide(right_child_idx, right, depth + 1);
+        }
+    }
+
+    void set_bounds(uint32_t node_idx, const std::vector<SBVHRef>& refs) const
+    {
+        AABB bounds;
+        for (const SBVHRef& ref : refs)
+        {
+            aabb_extend(&bounds, &ref.bounds);
+        }
+
+        nodes[node_idx].aabbmin = bounds.bmin;
+        nodes[node_idx].aabbmax = bounds.bmax;
+    }
+};
+
+template<typename Layout>
+void BVH::build_sbvh(const float* tris, const Layout& layout)
+{
+    const uint32_t n = m_num_triangles;
+    const BVHNode& root = m_bvh_nodes[0];
+
+    // build_bvh sized the arrays for the references the budget allows
+    const uint32_t max_references = (m_num_nodes + 1) / 2;
+
+    std::unique_ptr<uint32_t[]> leaf_refs = std::make_unique<uint32_t[]>(max_references);
+
+    SBVHBuilder<Layout> builder{ m_bvh_nodes, m_nodes_used, tris, layout };
+    AABB root_bounds;
+    root_bounds.bmin = root.aabbmin;
+    root_bounds.bmax = root.aabbmax;
+    builder.root_area = aabb_area(root_bounds);
+    builder.budget = (int64_t)max_references - n;
+    builder.leaf_refs = leaf_refs.get();
+
+    std::vector<SBVHRef> refs(n);
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        refs[i].tri = i;
+        for (unsigned v = 0; v < VERT_PER_TRIANGLE; ++v)
+        {
+            aabb_extend(&refs[i].bounds, &builder.vertex(i, v));
+        }
+    }
+
+    builder.sub_divide(0, refs, 0);
+
+    // Leaves were written in completion order. Lay them out depth first, so
+    // that every subtree covers a contiguous range of m_tri_idx, as refit
+    // expects for partial rebuilds.
+    uint32_t stack[BVH_STACK_SIZE];
+    unsigned stack_ptr = 0;
+    stack[stack_ptr++] = 0;
+    uint32_t num_references = 0;
+
+    while (stack_ptr > 0)
+    {
+        BVHNode& node = m_bvh_nodes[stack[--stack_ptr]];
+        if (node.is_leaf())
+        {
+            std::memcpy(&m_tri_idx[num_references], &leaf_refs[node.left_first], sizeof(uint32_t) * node.tri_count);
+            node.left_first = num_references;
+            num_references += node.tri_count;
+            continue;
+        }
+
+        stack[stack_ptr++] = node.left_first + 1;
+        stack[stack_ptr++] = node.left_first;
+    }
+
+    m_num_references = num_references;
+}
+
+#define ML_INSTANTIATE_BUILD_SBVH(Layout) \
+    template void BVH::build_sbvh<Layout>(const float*, const Layout&);
+ML_FOR_EACH_VERTEX_LAYOUT(ML_INSTANTIATE_BUILD_SBVH)
+#undef ML_INSTANTIATE_BUILD_SBVH
+
+}
@@ -1,4 +1,5 @@
 #include "common.hpp"
+#include <cstring>
 
 namespace moonlight
 {
@@ -24,4 +25,31 @@ void compute_delta_time(float& elapsed_time)
     t0 = t1;
 }
 
+uint64_t hash_bytes(const void* data, std::size_t n_bytes)
+{
+    constexpr uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ull;
+    constexpr uint64_t FNV_PRIME = 0x100000001b3ull;
+
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    uint64_t hash = FNV_OFFSET_BASIS ^ n_bytes;
+
+    std::size_t i = 0;
+    for (; i + sizeof(uint64_t) <= n_bytes; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        std::memcpy(&word, &bytes[i], sizeof(uint64_t));
+        hash = (hash ^ word) * FNV_PRIME;
+        // The multiplication only carries bits upwards, fold the top half back
+        // so that the high bits of every word reach the whole hash.
+        hash ^= hash >> 32;
+    }
+
+    for (; i < n_bytes; ++i)
+    {
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+
+    return hash;
+}
+
 }
\ No newline at end of file
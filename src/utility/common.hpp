@@ -1,8 +1,20 @@
 #pragma once
 #include <chrono>
 #include <cstddef>
+#include <cstdint>
 #include <stdexcept>
+
+#ifdef _WIN32
 #include <Windows.h>
+#else
+#include <cstdio>
+
+// Without a debugger to receive it, debug output goes to stderr
+inline void OutputDebugStringA(const char* message)
+{
+    std::fputs(message, stderr);
+}
+#endif
 
 namespace moonlight
 {
@@ -11,4 +23,8 @@ std::size_t Align(std::size_t uLocation, std::size_t uAlign);
 
 void compute_delta_time(float& elapsed_time);
 
+// 64 bit FNV-1a style hash that consumes eight bytes per step. Used to detect
+// stale caches, not suited for anything security related.
+uint64_t hash_bytes(const void* data, std::size_t n_bytes);
+
 }
\ No newline at end of file
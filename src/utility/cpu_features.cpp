@@ -0,0 +1,129 @@
+#include "cpu_features.hpp"
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+namespace moonlight
+{
+
+static void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+{
+#ifdef _MSC_VER
+    int r[4];
+    __cpuidex(r, (int)leaf, (int)subleaf);
+    for (int i = 0; i < 4; ++i)
+    {
+        regs[i] = (uint32_t)r[i];
+    }
+#else
+    if (!__get_cpuid_count(leaf, subleaf, &regs[0], &regs[1], &regs[2], &regs[3]))
+    {
+        regs[0] = regs[1] = regs[2] = regs[3] = 0;
+    }
+#endif
+}
+
+// Register state the OS saves on context switches, see XCR0
+static uint64_t xgetbv0()
+{
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    uint32_t lo, hi;
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return ((uint64_t)hi << 32) | lo;
+#endif
+}
+
+static SimdLevel detect_simd_level()
+{
+    uint32_t regs[4];
+    cpuid(0, 0, regs);
+    const uint32_t max_leaf = regs[0];
+
+    cpuid(1, 0, regs);
+    const bool osxsave = regs[2] & (1u << 27);
+    const bool avx = regs[2] & (1u << 28);
+    const bool fma = regs[2] & (1u << 12);
+
+    // The CPU supporting AVX is not enough, the OS has to save the YMM (and for
+    // AVX-512 the opmask and ZMM) registers as well
+    if (!osxsave || !avx || max_leaf < 7)
+    {
+        return SimdLevel::SSE;
+    }
+
+    const uint64_t xcr0 = xgetbv0();
+    const bool os_ymm = (xcr0 & 0x6) == 0x6;
+    const bool os_zmm = (xcr0 & 0xE6) == 0xE6;
+
+    cpuid(7, 0, regs);
+    const bool avx2 = regs[1] & (1u << 5);
+    const bool avx512f = regs[1] & (1u << 16);
+    const bool avx512dq = regs[1] & (1u << 17);
+    const bool avx512bw = regs[1] & (1u << 30);
+    const bool avx512vl = regs[1] & (1u << 31);
+
+    if (!os_ymm || !avx2 || !fma)
+    {
+        return SimdLevel::SSE;
+    }
+
+    if (os_zmm && avx512f && avx512dq && avx512bw && avx512vl)
+    {
+        return SimdLevel::AVX512;
+    }
+
+    return SimdLevel::AVX2;
+}
+
+static SimdLevel apply_level_override(SimdLevel detected)
+{
+    const char* value = std::getenv("MOONLIGHT_SIMD");
+    if (value == nullptr)
+    {
+        return detected;
+    }
+
+    SimdLevel requested = detected;
+    if (std::strcmp(value, "sse") == 0)
+    {
+        requested = SimdLevel::SSE;
+    }
+    else if (std::strcmp(value, "avx2") == 0)
+    {
+        requested = SimdLevel::AVX2;
+    }
+
+    // Never raise the level beyond what the host can run
+    return requested < detected ? requested : detected;
+}
+
+SimdLevel simd_level()
+{
+    static const SimdLevel level = apply_level_override(detect_simd_level());
+    return level;
+}
+
+const char* simd_level_name(SimdLevel level)
+{
+    switch (level)
+    {
+    case SimdLevel::SSE:
+        return "SSE4.2";
+    case SimdLevel::AVX2:
+        return "AVX2";
+    case SimdLevel::AVX512:
+        return "AVX-512";
+    }
+
+    return "unknown";
+}
+
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+namespace moonlight
+{
+
+// Instruction sets the SIMD kernels are written for, from narrowest to widest
+enum class SimdLevel
+{
+    // SSE up to SSE4.2. Every x86-64 host we run on has it, and it is what the
+    // code outside of the ML_TARGET_* kernels is compiled for.
+    SSE,
+    // AVX2 and FMA
+    AVX2,
+    // AVX-512 F, VL, DQ and BW (Skylake-SP and later)
+    AVX512
+};
+
+// Widest instruction set the CPU and the OS both support. Detected on the first
+// call and cached, the kernels call this to pick their widest implementation.
+// The environment variable MOONLIGHT_SIMD ("sse", "avx2" or "avx512") lowers
+// the level, which is how the narrower kernels are compared on a wide host.
+SimdLevel simd_level();
+
+const char* simd_level_name(SimdLevel level);
+
+}
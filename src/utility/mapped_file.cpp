@@ -0,0 +1,156 @@
+#include "mapped_file.hpp"
+#include <utility>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace moonlight
+{
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept
+{
+    *this = std::move(other);
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept
+{
+    if (this != &other)
+    {
+        close();
+        std::swap(m_data, other.m_data);
+        std::swap(m_size, other.m_size);
+#ifdef _WIN32
+        std::swap(m_file, other.m_file);
+        std::swap(m_mapping, other.m_mapping);
+#endif
+    }
+
+    return *this;
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open(const std::string& filename, bool hugepage_advice)
+{
+    close();
+
+    // Large pages are only available for pagefile backed sections on Windows,
+    // so the advice has no equivalent here.
+    HANDLE file = CreateFileA(
+        filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr
+    );
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping == nullptr)
+    {
+        CloseHandle(file);
+        return false;
+    }
+
+    const void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (data == nullptr)
+    {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+
+    m_file = file;
+    m_mapping = mapping;
+    m_data = data;
+    m_size = static_cast<std::size_t>(file_size.QuadPart);
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (m_data != nullptr)
+    {
+        UnmapViewOfFile(m_data);
+        CloseHandle(m_mapping);
+        CloseHandle(m_file);
+    }
+
+    m_data = nullptr;
+    m_mapping = nullptr;
+    m_file = nullptr;
+    m_size = 0;
+}
+
+#else
+
+bool MappedFile::open(const std::string& filename, bool hugepage_advice)
+{
+    close();
+
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    void* data = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping keeps its own reference to the file
+    ::close(fd);
+
+    if (data == MAP_FAILED)
+    {
+        return false;
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (hugepage_advice)
+    {
+        madvise(data, file_stat.st_size, MADV_HUGEPAGE);
+    }
+#endif
+
+    m_data = data;
+    m_size = static_cast<std::size_t>(file_stat.st_size);
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (m_data != nullptr)
+    {
+        munmap(const_cast<void*>(m_data), m_size);
+    }
+
+    m_data = nullptr;
+    m_size = 0;
+}
+
+#endif
+
+}
\ No newline at end of file
@@ -0,0 +1,56 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+namespace moonlight
+{
+
+// Read-only memory mapping of a whole file. The pages are backed by the page
+// cache, so several processes mapping the same file share them.
+class MappedFile
+{
+public:
+
+    MappedFile() = default;
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    MappedFile(MappedFile&& other) noexcept;
+    MappedFile& operator=(MappedFile&& other) noexcept;
+
+    // Maps @filename, replacing any previous mapping. With @hugepage_advice the
+    // kernel is asked to back the mapping with huge pages where it supports that
+    // for file mappings (Linux only, ignored elsewhere).
+    // Returns false if the file could not be opened or mapped.
+    bool open(const std::string& filename, bool hugepage_advice = false);
+    void close();
+
+    bool is_open() const
+    {
+        return m_data != nullptr;
+    }
+
+    const void* data() const
+    {
+        return m_data;
+    }
+
+    std::size_t size() const
+    {
+        return m_size;
+    }
+
+private:
+
+    const void* m_data = nullptr;
+    std::size_t m_size = 0;
+
+#ifdef _WIN32
+    void* m_file = nullptr;
+    void* m_mapping = nullptr;
+#endif
+};
+
+}
\ No newline at end of file
@@ -0,0 +1,419 @@
+#include "quantized_bvh.hpp"
+#include <cmath>
+
+namespace moonlight
+{
+
+// The grid is stretched a little, so that the last grid line lies beyond the
+// upper bound despite rounding errors in the step size.
+constexpr float QUANTIZATION_SLACK = 1.f + 1.f / 4096.f;
+
+// Grid of a node. Encoding and traversal decode through the same function,
+// so the encoder can check that the decoded bounds are conservative.
+template<typename Q>
+struct QuantizationGrid
+{
+    static constexpr uint32_t QMAX = std::numeric_limits<Q>::max();
+
+    QuantizationGrid(const AABB& bounds)
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            origin[a] = bounds.bmin[a];
+            step[a] = (bounds.bmax[a] - bounds.bmin[a]) * (QUANTIZATION_SLACK / QMAX);
+        }
+    }
+
+    float decode(int axis, uint32_t q) const
+    {
+        return origin[axis] + (float)q * step[axis];
+    }
+
+    // Largest grid line that is not above @v
+    Q encode_lower(int axis, float v) const
+    {
+        if (step[axis] <= 0.f)
+        {
+            return 0;
+        }
+
+        // Two ulps of slack, a decode contracted into an FMA may round differently
+        v = std::nextafter(std::nextafter(v, -INFINITY), -INFINITY);
+        float q = std::floor((v - origin[axis]) / step[axis]);
+        uint32_t qi = (uint32_t)std::min(std::max(q, 0.f), (float)QMAX);
+        while (qi > 0 && decode(axis, qi) > v)
+        {
+            --qi;
+        }
+        return (Q)qi;
+    }
+
+    // Smallest grid line that is not below @v
+    Q encode_upper(int axis, float v) const
+    {
+        if (step[axis] <= 0.f)
+        {
+            return 0;
+        }
+
+        v = std::nextafter(std::nextafter(v, INFINITY), INFINITY);
+        float q = std::ceil((v - origin[axis]) / step[axis]);
+        uint32_t qi = (uint32_t)std::min(std::max(q, 0.f), (float)QMAX);
+        while (qi < QMAX && decode(axis, qi) < v)
+        {
+            ++qi;
+        }
+        return (Q)qi;
+    }
+
+    float origin[3];
+    float step[3];
+};
+
+template<typename Q>
+void QuantizedBVH<Q>::compress(const BVH& bvh)
+{
+    const BVHNode* binary_nodes = bvh.get_raw_nodes();
+    m_tri_idx = bvh.get_raw_indices();
+    m_leaf_blocks = bvh.get_leaf_blocks();
+
+    m_root_bounds.bmin = binary_nodes[0].aabbmin;
+    m_root_bounds.bmax = binary_nodes[0].aabbmax;
+
+    m_nodes.clear();
+    m_nodes.reserve(bvh.get_nodes_used() / 2 + 1);
+    m_nodes.emplace_back();
+
+    if (binary_nodes[0].is_leaf())
+    {
+        // Degenerate case, the whole mesh sits in one leaf. The root becomes
+        // a node whose first slot spans its own bounds, the second slot is
+        // left empty.
+        QuantizedBVHNode<Q>& root = m_nodes[0];
+        for (int a = 0; a < 3; ++a)
+        {
+            root.bmin[0][a] = 0;
+            root.bmax[0][a] = QuantizationGrid<Q>::QMAX;
+            root.bmin[1][a] = QuantizationGrid<Q>::QMAX;
+            root.bmax[1][a] = 0;
+        }
+        root.child[0] = root.child[1] = leaf_first(bvh, 0);
+        // A mesh shrunk to a point has no room for inverted bounds, the second
+        // slot then tests the leaf again instead of pointing at a node.
+        root.tri_count[0] = root.tri_count[1] = binary_nodes[0].tri_count;
+        return;
+    }
+
+    compress_node(bvh, 0, 0, m_root_bounds);
+}
+
+template<typename Q>
+uint32_t QuantizedBVH<Q>::leaf_first(const BVH& bvh, uint32_t binary_idx)
+{
+#if ML_BVH_SIMD_LEAVES
+    return bvh.get_leaf_block_index(binary_idx);
+#else
+    return bvh.get_raw_nodes()[binary_idx].left_first;
+#endif
+}
+
+template<typename Q>
+void QuantizedBVH<Q>::compress_node(
+    const BVH& bvh,
+    uint32_t binary_idx,
+    uint32_t quantized_idx,
+    const AABB& decoded_bounds)
+{
+    const BVHNode* binary_nodes = bvh.get_raw_nodes();
+    const QuantizationGrid<Q> grid(decoded_bounds);
+
+    AABB decoded_child[2];
+    for (uint32_t c = 0; c < 2; ++c)
+    {
+        const BVHNode& child = binary_nodes[binary_nodes[binary_idx].left_first + c];
+
+        // m_nodes might reallocate during the recursion, don't hold a reference
+        QuantizedBVHNode<Q>& node = m_nodes[quantized_idx];
+        for (int a = 0; a < 3; ++a)
+        {
+            node.bmin[c][a] = grid.encode_lower(a, child.aabbmin[a]);
+            node.bmax[c][a] = grid.encode_upper(a, child.aabbmax[a]);
+            decoded_child[c].bmin[a] = grid.decode(a, node.bmin[c][a]);
+            decoded_child[c].bmax[a] = grid.decode(a, node.bmax[c][a]);
+        }
+    }
+
+    for (uint32_t c = 0; c < 2; ++c)
+    {
+        const uint32_t child_idx = binary_nodes[binary_idx].left_first + c;
+        const BVHNode& child = binary_nodes[child_idx];
+
+        if (child.is_leaf())
+        {
+            m_nodes[quantized_idx].child[c] = leaf_first(bvh, child_idx);
+            m_nodes[quantized_idx].tri_count[c] = child.tri_count;
+        }
+        else
+        {
+            const uint32_t child_quantized_idx = m_nodes.size();
+            m_nodes.emplace_back();
+            m_nodes[quantized_idx].child[c] = child_quantized_idx;
+            m_nodes[quantized_idx].tri_count[c] = 0;
+            compress_node(bvh, child_idx, child_quantized_idx, decoded_child[c]);
+        }
+    }
+}
+
+// Sign based slab test, see WideRay. Inverted bounds (the empty slots) miss.
+struct QuantizedRay
+{
+    QuantizedRay(const Ray& ray)
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            o[a] = ray.o[a];
+            invd[a] = ray.invd[a];
+            negative[a] = ray.invd[a] < 0.f;
+        }
+    }
+
+    float o[3];
+    float invd[3];
+    bool negative[3];
+};
+
+// Decodes the bounds of both children of @node and tests them against the ray.
+// Returns a bit per child that was hit before @tmax.
+template<typename Q>
+static inline uint32_t intersect_children(
+    const QuantizedBVHNode<Q>& node,
+    const QuantizationGrid<Q>& grid,
+    const QuantizedRay& ray,
+    float tmax,
+    AABB* child_bounds,
+    float* dist)
+{
+    uint32_t hit_mask = 0;
+    for (uint32_t c = 0; c < 2; ++c)
+    {
+        float tnear = 0.f;
+        float tfar = tmax;
+        for (int a = 0; a < 3; ++a)
+        {
+            const float bmin = grid.decode(a, node.bmin[c][a]);
+            const float bmax = grid.decode(a, node.bmax[c][a]);
+            child_bounds[c].bmin[a] = bmin;
+            child_bounds[c].bmax[a] = bmax;
+
+            const float near_plane = ray.negative[a] ? bmax : bmin;
+            const float far_plane = ray.negative[a] ? bmin : bmax;
+            // NaNs from 0 * inf keep the previous value
+            tnear = std::max(tnear, (near_plane - ray.o[a]) * ray.invd[a]);
+            tfar = std::min(tfar, (far_plane - ray.o[a]) * ray.invd[a]);
+        }
+
+        dist[c] = tnear;
+        hit_mask |= (tnear <= tfar) << c;
+    }
+
+    return hit_mask;
+}
+
+template<typename Q>
+IntersectionParams QuantizedBVH<Q>::intersect(
+    Ray& ray,
+    const float* tris,
+    const uint64_t stride) const
+{
+#if ML_BVH_SIMD_LEAVES
+    // The leaf blocks hold their own copy of the positions, the layout is unused
+    return intersect(ray, tris, RuntimeVertexLayout((uint32_t)stride));
+#else
+    return dispatch_vertex_layout(stride, [&](const auto& layout)
+    {
+        return intersect(ray, tris, layout);
+    });
+#endif
+}
+
+template<typename Q>
+template<uint32_t Stride>
+IntersectionParams QuantizedBVH<Q>::intersect(
+    Ray& ray,
+    [[maybe_unused]] const float* tris,
+    [[maybe_unused]] const VertexLayout<Stride>& layout) const
+{
+    // Inner entries carry their decoded bounds, the grid of their children
+    // is spanned over them.
+    struct StackEntry
+    {
+        uint32_t index;
+        uint32_t tri_count;
+        float dist;
+        AABB bounds;
+    };
+
+    IntersectionParams intersect;
+
+    const QuantizedRay quantized_ray(ray);
+
+    StackEntry stack[BVH_STACK_SIZE];
+    unsigned stack_ptr = 0;
+    stack[stack_ptr++] = { 0, 0, 0.f, m_root_bounds };
+
+    while (stack_ptr > 0)
+    {
+        const StackEntry entry = stack[--stack_ptr];
+
+        // The entry was pushed before a closer hit was found
+        if (entry.dist > ray.t)
+        {
+            continue;
+        }
+
+        if (entry.tri_count > 0)
+        {
+#if ML_BVH_SIMD_LEAVES
+            intersect_triangle_blocks(
+                &m_leaf_blocks[entry.index], entry.tri_count, ray, intersect
+            );
+#else
+            const unsigned triangle_size = layout.triangle_size;
+
+            for (uint32_t i = 0; i < entry.tri_count; ++i)
+            {
+                unsigned triangle_pos = m_tri_idx[entry.index + i] * triangle_size;
+
+                IntersectionParams new_intersect = ray_hit_triangle(
+                    ray, &tris[triangle_pos], layout
+                );
+
+                if (new_intersect.t < intersect.t && new_intersect.t > 0.f)
+                {
+                    intersect = new_intersect;
+                    intersect.triangle_idx = triangle_pos;
+                    ray.t = new_intersect.t;
+                }
+            }
+#endif
+            continue;
+        }
+
+        const QuantizedBVHNode<Q>& node = m_nodes[entry.index];
+        const QuantizationGrid<Q> grid(entry.bounds);
+
+        AABB child_bounds[2];
+        float dist[2];
+        const uint32_t hit_mask = intersect_children(
+            node, grid, quantized_ray, ray.t, child_bounds, dist
+        );
+
+        // Push the far child first, so that the near one is popped next
+        const uint32_t near = dist[1] < dist[0] ? 1 : 0;
+        const uint32_t far = 1 - near;
+        if (hit_mask & (1 << far))
+        {
+            stack[stack_ptr++] = { node.child[far], node.tri_count[far], dist[far], child_bounds[far] };
+        }
+        if (hit_mask & (1 << near))
+        {
+            stack[stack_ptr++] = { node.child[near], node.tri_count[near], dist[near], child_bounds[near] };
+        }
+    }
+
+    return intersect;
+}
+
+template<typename Q>
+bool QuantizedBVH<Q>::occluded(
+    const Ray& ray,
+    const float* tris,
+    const uint64_t stride,
+    float tmax) const
+{
+#if ML_BVH_SIMD_LEAVES
+    return occluded(ray, tris, RuntimeVertexLayout((uint32_t)stride), tmax);
+#else
+    return dispatch_vertex_layout(stride, [&](const auto& layout)
+    {
+        return occluded(ray, tris, layout, tmax);
+    });
+#endif
+}
+
+template<typename Q>
+template<uint32_t Stride>
+bool QuantizedBVH<Q>::occluded(
+    const Ray& ray,
+    [[maybe_unused]] const float* tris,
+    [[maybe_unused]] const VertexLayout<Stride>& layout,
+    float tmax) const
+{
+    struct StackEntry
+    {
+        uint32_t index;
+        uint32_t tri_count;
+        AABB bounds;
+    };
+
+    const QuantizedRay quantized_ray(ray);
+
+    StackEntry stack[BVH_STACK_SIZE];
+    unsigned stack_ptr = 0;
+    stack[stack_ptr++] = { 0, 0, m_root_bounds };
+
+    while (stack_ptr > 0)
+    {
+        const StackEntry entry = stack[--stack_ptr];
+
+        if (entry.tri_count > 0)
+        {
+#if ML_BVH_SIMD_LEAVES
+            if (occluded_triangle_blocks(&m_leaf_blocks[entry.index], entry.tri_count, ray, tmax))
+            {
+                return true;
+            }
+#else
+            const unsigned triangle_size = layout.triangle_size;
+
+            for (uint32_t i = 0; i < entry.tri_count; ++i)
+            {
+                unsigned triangle_pos = m_tri_idx[entry.index + i] * triangle_size;
+
+                IntersectionParams its = ray_hit_triangle(ray, &tris[triangle_pos], layout);
+                if (its.t > 0.f && its.t < tmax)
+                {
+                    return true;
+                }
+            }
+#endif
+            continue;
+        }
+
+        const QuantizedBVHNode<Q>& node = m_nodes[entry.index];
+        const QuantizationGrid<Q> grid(entry.bounds);
+
+        AABB child_bounds[2];
+        float dist[2];
+        const uint32_t hit_mask = intersect_children(
+            node, grid, quantized_ray, tmax, child_bounds, dist
+        );
+
+        for (uint32_t c = 0; c < 2; ++c)
+        {
+            if (hit_mask & (1 << c))
+            {
+                stack[stack_ptr++] = { node.child[c], node.tri_count[c], child_bounds[c] };
+            }
+        }
+    }
+
+    return false;
+}
+
+static_assert(sizeof(QuantizedBVHNode<uint8_t>) == 32, "8 bit quantized nodes must take 32 bytes");
+
+template class QuantizedBVH<uint8_t>;
+template class QuantizedBVH<uint16_t>;
+
+}
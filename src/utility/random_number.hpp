@@ -1,4 +1,6 @@
 #pragma once
+#include <cmath>
+#include <cstdint>
 #include <random>
 
 #include "../project_defines.hpp"
@@ -39,6 +41,96 @@ struct RandomFloatEngine
     std::uniform_real_distribution<float> dist_unit;
 };
 
+// PCG32 (O'Neill, pcg-random.org), 64 bits of state and 32 bit output.
+// Small and cheap enough to construct one generator per pixel sample, which
+// makes the path tracer lock-free and its images independent of the number
+// of threads: every sample draws from its own (@state, @stream) sequence.
+struct PCG32
+{
+    PCG32() = default;
+
+    PCG32(uint64_t state, uint64_t stream)
+    {
+        seed(state, stream);
+    }
+
+    void seed(uint64_t state, uint64_t stream)
+    {
+        m_state = 0u;
+        m_inc = (stream << 1u) | 1u;
+        next_u32();
+        m_state += state;
+        next_u32();
+    }
+
+    uint32_t next_u32()
+    {
+        uint64_t old_state = m_state;
+        m_state = old_state * 6364136223846793005ull + m_inc;
+        uint32_t xor_shifted = (uint32_t)(((old_state >> 18u) ^ old_state) >> 27u);
+        uint32_t rot = (uint32_t)(old_state >> 59u);
+        return (xor_shifted >> rot) | (xor_shifted << ((0u - rot) & 31u));
+    }
+
+    // [0, 1), the upper 24 bits scaled so 1 is never returned
+    float next_float()
+    {
+        return (float)(next_u32() >> 8) * 0x1p-24f;
+    }
+
+    float in_range(float r0, float r1)
+    {
+        return r0 + (r1 - r0) * next_float();
+    }
+
+    // [@r0, @r1], inclusive like random_in_range_int
+    int in_range_int(int r0, int r1)
+    {
+        uint64_t range = (uint64_t)(r1 - r0) + 1u;
+        return r0 + (int)((next_u32() * range) >> 32u);
+    }
+
+    uint64_t m_state = 0x853c49e6748fea9bull;
+    uint64_t m_inc = 0xda3e39cb94b95bdbull;
+};
+
+// The SplitMix64 finalizer. Seeds that differ in a few low bits, like
+// consecutive sample indices, map to unrelated PCG32 states.
+inline uint64_t hash_u64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+// Draw from @rng instead of the shared generators below, which are neither
+// thread-safe nor reproducible.
+inline Vector3<float> random_cosine_direction(PCG32& rng)
+{
+    float r1 = rng.next_float();
+    float r2 = rng.next_float();
+    float z = std::sqrt(1 - r2);
+
+    float phi = 2 * ML_PI * r1;
+    float x = std::cos(phi) * std::sqrt(r2);
+    float y = std::sin(phi) * std::sqrt(r2);
+
+    return Vector3<float>(x, y, z);
+}
+
+inline Vector3<float> random_unit_vector(PCG32& rng)
+{
+    while (true)
+    {
+        Vector3<float> p(rng.in_range(-1.f, 1.f), rng.in_range(-1.f, 1.f), rng.in_range(-1.f, 1.f));
+        if (dot(p, p) >= 1) continue;
+        return p;
+    }
+}
+
 Vector3<float> random_cosine_direction();
 float random_in_range(float r0, float r1);
 float random_normalized_float();
@@ -0,0 +1,351 @@
+#pragma once
+#include <cstdint>
+#include <immintrin.h>
+
+// Marks a function that uses AVX2 or AVX-512 while the rest of the translation
+// unit is compiled for the SSE baseline. Such a function must only be called
+// once simd_level() reported the instruction set, see cpu_features.hpp.
+// MSVC accepts every intrinsic regardless of /arch and needs no attribute.
+#if defined(__GNUC__) || defined(__clang__)
+#define ML_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define ML_TARGET_AVX512 __attribute__((target("avx512f,avx512vl,avx512dq,avx512bw,avx2,fma")))
+#else
+#define ML_TARGET_AVX2
+#define ML_TARGET_AVX512
+#endif
+
+// Kernels written once for any register type are templates with this attribute,
+// called from small per instruction set entry points marked ML_TARGET_*.
+// Inlined into the entry point, the kernel compiles for its instruction set.
+#if defined(__GNUC__) || defined(__clang__)
+#define ML_SIMD_INLINE inline __attribute__((always_inline))
+#else
+#define ML_SIMD_INLINE __forceinline
+#endif
+
+namespace moonlight::simd
+{
+
+// Thin wrappers around the SSE, AVX2 and AVX-512 registers, so that kernels of
+// different widths read the same. Comparisons return masks with one bit per
+// lane in bits(), lane i in bit i.
+// float4 only uses SSE2 and is safe everywhere. Everything taking a float8
+// or float16 carries ML_TARGET_AVX2 / ML_TARGET_AVX512 and has to follow the
+// same rule as the kernels calling it.
+
+struct mask4
+{
+    __m128 v;
+
+    uint32_t bits() const { return (uint32_t)_mm_movemask_ps(v); }
+    bool any() const { return bits() != 0; }
+};
+
+inline mask4 operator&(mask4 a, mask4 b) { return { _mm_and_ps(a.v, b.v) }; }
+inline mask4 operator|(mask4 a, mask4 b) { return { _mm_or_ps(a.v, b.v) }; }
+
+struct float4
+{
+    static constexpr uint32_t width = 4;
+
+    __m128 v;
+
+    static float4 load(const float* p) { return { _mm_load_ps(p) }; }
+    static float4 loadu(const float* p) { return { _mm_loadu_ps(p) }; }
+    static float4 set1(float x) { return { _mm_set1_ps(x) }; }
+    static float4 zero() { return { _mm_setzero_ps() }; }
+
+    void store(float* p) const { _mm_store_ps(p, v); }
+    void storeu(float* p) const { _mm_storeu_ps(p, v); }
+};
+
+inline float4 operator+(float4 a, float4 b) { return { _mm_add_ps(a.v, b.v) }; }
+inline float4 operator-(float4 a, float4 b) { return { _mm_sub_ps(a.v, b.v) }; }
+inline float4 operator*(float4 a, float4 b) { return { _mm_mul_ps(a.v, b.v) }; }
+inline float4 operator/(float4 a, float4 b) { return { _mm_div_ps(a.v, b.v) }; }
+
+inline mask4 operator<(float4 a, float4 b) { return { _mm_cmplt_ps(a.v, b.v) }; }
+inline mask4 operator<=(float4 a, float4 b) { return { _mm_cmple_ps(a.v, b.v) }; }
+inline mask4 operator>(float4 a, float4 b) { return { _mm_cmpgt_ps(a.v, b.v) }; }
+inline mask4 operator>=(float4 a, float4 b) { return { _mm_cmpge_ps(a.v, b.v) }; }
+
+inline float4 min(float4 a, float4 b) { return { _mm_min_ps(a.v, b.v) }; }
+inline float4 max(float4 a, float4 b) { return { _mm_max_ps(a.v, b.v) }; }
+inline float4 abs(float4 a) { return { _mm_andnot_ps(_mm_set1_ps(-0.f), a.v) }; }
+
+// a * b + c and a * b - c. Fused only where the translation unit is built with
+// FMA, so the SSE kernels round the same on every host.
+inline float4 fmadd(float4 a, float4 b, float4 c)
+{
+#ifdef __FMA__
+    return { _mm_fmadd_ps(a.v, b.v, c.v) };
+#else
+    return a * b + c;
+#endif
+}
+
+inline float4 fmsub(float4 a, float4 b, float4 c)
+{
+#ifdef __FMA__
+    return { _mm_fmsub_ps(a.v, b.v, c.v) };
+#else
+    return a * b - c;
+#endif
+}
+
+// Lanes of @a where @m is set, of @b elsewhere
+inline float4 select(mask4 m, float4 a, float4 b)
+{
+    return { _mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v)) };
+}
+
+// Smallest and largest lane
+inline float hmin(float4 a)
+{
+    const __m128 m = _mm_min_ps(a.v, _mm_movehl_ps(a.v, a.v));
+    return _mm_cvtss_f32(_mm_min_ss(m, _mm_shuffle_ps(m, m, 1)));
+}
+
+inline float hmax(float4 a)
+{
+    const __m128 m = _mm_max_ps(a.v, _mm_movehl_ps(a.v, a.v));
+    return _mm_cvtss_f32(_mm_max_ss(m, _mm_shuffle_ps(m, m, 1)));
+}
+
+struct mask8
+{
+    __m256 v;
+
+    ML_TARGET_AVX2 uint32_t bits() const { return (uint32_t)_mm256_movemask_ps(v); }
+    ML_TARGET_AVX2 bool any() const { return bits() != 0; }
+};
+
+ML_TARGET_AVX2 inline mask8 operator&(mask8 a, mask8 b) { return { _mm256_and_ps(a.v, b.v) }; }
+ML_TARGET_AVX2 inline mask8 operator|(mask8 a, mask8 b) { return { _mm256_or_ps(a.v, b.v) }; }
+
+struct float8
+{
+    static constexpr uint32_t width = 8;
+
+    __m256 v;
+
+    ML_TARGET_AVX2 static float8 load(const float* p) { return { _mm256_load_ps(p) }; }
+    ML_TARGET_AVX2 static float8 loadu(const float* p) { return { _mm256_loadu_ps(p) }; }
+    ML_TARGET_AVX2 static float8 set1(float x) { return { _mm256_set1_ps(x) }; }
+    ML_TARGET_AVX2 static float8 zero() { return { _mm256_setzero_ps() }; }
+
+    ML_TARGET_AVX2 void store(float* p) const { _mm256_store_ps(p, v); }
+    ML_TARGET_AVX2 void storeu(float* p) const { _mm256_storeu_ps(p, v); }
+};
+
+ML_TARGET_AVX2 inline float8 operator+(float8 a, float8 b) { return { _mm256_add_ps(a.v, b.v) }; }
+ML_TARGET_AVX2 inline float8 operator-(float8 a, float8 b) { return { _mm256_sub_ps(a.v, b.v) }; }
+ML_TARGET_AVX2 inline float8 operator*(float8 a, float8 b) { return { _mm256_mul_ps(a.v, b.v) }; }
+ML_TARGET_AVX2 inline float8 operator/(float8 a, float8 b) { return { _mm256_div_ps(a.v, b.v) }; }
+
+ML_TARGET_AVX2 inline mask8 operator<(float8 a, float8 b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) }; }
+ML_TARGET_AVX2 inline mask8 operator<=(float8 a, float8 b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ) }; }
+ML_TARGET_AVX2 inline mask8 operator>(float8 a, float8 b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ) }; }
+ML_TARGET_AVX2 inline mask8 operator>=(float8 a, float8 b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ) }; }
+
+ML_TARGET_AVX2 inline float8 min(float8 a, float8 b) { return { _mm256_min_ps(a.v, b.v) }; }
+ML_TARGET_AVX2 inline float8 max(float8 a, float8 b) { return { _mm256_max_ps(a.v, b.v) }; }
+ML_TARGET_AVX2 inline float8 abs(float8 a) { return { _mm256_andnot_ps(_mm256_set1_ps(-0.f), a.v) }; }
+
+ML_TARGET_AVX2 inline float8 fmadd(float8 a, float8 b, float8 c) { return { _mm256_fmadd_ps(a.v, b.v, c.v) }; }
+ML_TARGET_AVX2 inline float8 fmsub(float8 a, float8 b, float8 c) { return { _mm256_fmsub_ps(a.v, b.v, c.v) }; }
+
+ML_TARGET_AVX2 inline float8 select(mask8 m, float8 a, float8 b)
+{
+    return { _mm256_blendv_ps(b.v, a.v, m.v) };
+}
+
+ML_TARGET_AVX2 inline float hmin(float8 a)
+{
+    return hmin(float4{ _mm_min_ps(_mm256_castps256_ps128(a.v), _mm256_extractf128_ps(a.v, 1)) });
+}
+
+ML_TARGET_AVX2 inline float hmax(float8 a)
+{
+    return hmax(float4{ _mm_max_ps(_mm256_castps256_ps128(a.v), _mm256_extractf128_ps(a.v, 1)) });
+}
+
+struct mask16
+{
+    __mmask16 v;
+
+    uint32_t bits() const { return (uint32_t)v; }
+    bool any() const { return v != 0; }
+};
+
+inline mask16 operator&(mask16 a, mask16 b) { return { (__mmask16)(a.v & b.v) }; }
+inline mask16 operator|(mask16 a, mask16 b) { return { (__mmask16)(a.v | b.v) }; }
+
+struct float16
+{
+    static constexpr uint32_t width = 16;
+
+    __m512 v;
+
+    ML_TARGET_AVX512 static float16 load(const float* p) { return { _mm512_load_ps(p) }; }
+    ML_TARGET_AVX512 static float16 loadu(const float* p) { return { _mm512_loadu_ps(p) }; }
+    ML_TARGET_AVX512 static float16 set1(float x) { return { _mm512_set1_ps(x) }; }
+    ML_TARGET_AVX512 static float16 zero() { return { _mm512_setzero_ps() }; }
+
+    ML_TARGET_AVX512 void store(float* p) const { _mm512_store_ps(p, v); }
+    ML_TARGET_AVX512 void storeu(float* p) const { _mm512_storeu_ps(p, v); }
+};
+
+ML_TARGET_AVX512 inline float16 operator+(float16 a, float16 b) { return { _mm512_add_ps(a.v, b.v) }; }
+ML_TARGET_AVX512 inline float16 operator-(float16 a, float16 b) { return { _mm512_sub_ps(a.v, b.v) }; }
+ML_TARGET_AVX512 inline float16 operator*(float16 a, float16 b) { return { _mm512_mul_ps(a.v, b.v) }; }
+ML_TARGET_AVX512 inline float16 operator/(float16 a, float16 b) { return { _mm512_div_ps(a.v, b.v) }; }
+
+ML_TARGET_AVX512 inline mask16 operator<(float16 a, float16 b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ) }; }
+ML_TARGET_AVX512 inline mask16 operator<=(float16 a, float16 b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_LE_OQ) }; }
+ML_TARGET_AVX512 inline mask16 operator>(float16 a, float16 b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_GT_OQ) }; }
+ML_TARGET_AVX512 inline mask16 operator>=(float16 a, float16 b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_GE_OQ) }; }
+
+ML_TARGET_AVX512 inline float16 min(float16 a, float16 b) { return { _mm512_min_ps(a.v, b.v) }; }
+ML_TARGET_AVX512 inline float16 max(float16 a, float16 b) { return { _mm512_max_ps(a.v, b.v) }; }
+ML_TARGET_AVX512 inline float16 abs(float16 a) { return { _mm512_abs_ps(a.v) }; }
+
+ML_TARGET_AVX512 inline float16 fmadd(float16 a, float16 b, float16 c) { return { _mm512_fmadd_ps(a.v, b.v, c.v) }; }
+ML_TARGET_AVX512 inline float16 fmsub(float16 a, float16 b, float16 c) { return { _mm512_fmsub_ps(a.v, b.v, c.v) }; }
+
+ML_TARGET_AVX512 inline float16 select(mask16 m, float16 a, float16 b)
+{
+    return { _mm512_mask_blend_ps(m.v, b.v, a.v) };
+}
+
+ML_TARGET_AVX512 inline float hmin(float16 a) { return _mm512_reduce_min_ps(a.v); }
+ML_TARGET_AVX512 inline float hmax(float16 a) { return _mm512_reduce_max_ps(a.v); }
+
+// Lanes of 32 bit integers, enough to compact lane indices (the ids of the
+// boxes inside a frustum, say). compress_store(out, bits, a) writes the lanes
+// of @a whose bit is set in @bits to out[0], out[1], ... in lane order and
+// returns how many it wrote. The int4 and int8 versions store all of their
+// lanes, so out[count, width) is overwritten with garbage; int16 writes
+// exactly count entries.
+
+// Shuffles that move the selected lanes to the front, indexed by the lane bits
+struct CompressTables
+{
+    // pshufb controls for 4 lanes, unused bytes are zeroed
+    alignas(16) uint8_t lanes4[16][16];
+    // Lane indices for vpermd, one byte each
+    uint64_t lanes8[256];
+};
+
+constexpr CompressTables make_compress_tables()
+{
+    CompressTables t = {};
+    for (uint32_t m = 0; m < 16; ++m)
+    {
+        uint32_t n = 0;
+        for (uint32_t lane = 0; lane < 4; ++lane)
+        {
+            if (m & (1u << lane))
+            {
+                for (uint32_t byte = 0; byte < 4; ++byte)
+                {
+                    t.lanes4[m][n * 4 + byte] = (uint8_t)(lane * 4 + byte);
+                }
+                ++n;
+            }
+        }
+        for (; n < 4; ++n)
+        {
+            for (uint32_t byte = 0; byte < 4; ++byte)
+            {
+                t.lanes4[m][n * 4 + byte] = 0x80;
+            }
+        }
+    }
+    for (uint32_t m = 0; m < 256; ++m)
+    {
+        uint32_t n = 0;
+        for (uint32_t lane = 0; lane < 8; ++lane)
+        {
+            if (m & (1u << lane))
+            {
+                t.lanes8[m] |= (uint64_t)lane << (n++ * 8);
+            }
+        }
+    }
+    return t;
+}
+
+inline constexpr CompressTables compress_tables = make_compress_tables();
+
+struct int4
+{
+    static constexpr uint32_t width = 4;
+
+    __m128i v;
+
+    static int4 loadu(const uint32_t* p) { return { _mm_loadu_si128((const __m128i*)p) }; }
+    static int4 set1(int32_t x) { return { _mm_set1_epi32(x) }; }
+    // first, first + 1, first + 2, first + 3
+    static int4 ramp(int32_t first) { return { _mm_add_epi32(_mm_set1_epi32(first), _mm_setr_epi32(0, 1, 2, 3)) }; }
+};
+
+inline int4 operator+(int4 a, int4 b) { return { _mm_add_epi32(a.v, b.v) }; }
+
+// pshufb needs SSSE3, part of the SSE4.2 baseline
+inline uint32_t compress_store(uint32_t* out, uint32_t bits, int4 a)
+{
+    const __m128i shuffle = _mm_load_si128((const __m128i*)compress_tables.lanes4[bits & 0xF]);
+    _mm_storeu_si128((__m128i*)out, _mm_shuffle_epi8(a.v, shuffle));
+    return (uint32_t)_mm_popcnt_u32(bits & 0xF);
+}
+
+struct int8
+{
+    static constexpr uint32_t width = 8;
+
+    __m256i v;
+
+    ML_TARGET_AVX2 static int8 loadu(const uint32_t* p) { return { _mm256_loadu_si256((const __m256i*)p) }; }
+    ML_TARGET_AVX2 static int8 set1(int32_t x) { return { _mm256_set1_epi32(x) }; }
+    // first, first + 1, ..., first + 7
+    ML_TARGET_AVX2 static int8 ramp(int32_t first)
+    {
+        return { _mm256_add_epi32(_mm256_set1_epi32(first), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)) };
+    }
+};
+
+ML_TARGET_AVX2 inline int8 operator+(int8 a, int8 b) { return { _mm256_add_epi32(a.v, b.v) }; }
+
+ML_TARGET_AVX2 inline uint32_t compress_store(uint32_t* out, uint32_t bits, int8 a)
+{
+    const __m256i permutation = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)&compress_tables.lanes8[bits & 0xFF]));
+    _mm256_storeu_si256((__m256i*)out, _mm256_permutevar8x32_epi32(a.v, permutation));
+    return (uint32_t)_mm_popcnt_u32(bits & 0xFF);
+}
+
+struct int16
+{
+    static constexpr uint32_t width = 16;
+
+    __m512i v;
+
+    ML_TARGET_AVX512 static int16 loadu(const uint32_t* p) { return { _mm512_loadu_si512(p) }; }
+    ML_TARGET_AVX512 static int16 set1(int32_t x) { return { _mm512_set1_epi32(x) }; }
+    // first, first + 1, ..., first + 15
+    ML_TARGET_AVX512 static int16 ramp(int32_t first)
+    {
+        return { _mm512_add_epi32(_mm512_set1_epi32(first),
+            _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15)) };
+    }
+};
+
+ML_TARGET_AVX512 inline int16 operator+(int16 a, int16 b) { return { _mm512_add_epi32(a.v, b.v) }; }
+
+ML_TARGET_AVX512 inline uint32_t compress_store(uint32_t* out, uint32_t bits, int16 a)
+{
+    _mm512_mask_compressstoreu_epi32(out, (__mmask16)bits, a.v);
+    return (uint32_t)_mm_popcnt_u32(bits & 0xFFFF);
+}
+
+}
@@ -0,0 +1,498 @@
+#include "tlas.hpp"
+#include <algorithm>
+#include <bit>
+
+#include "tbb/blocked_range.h"
+#include "tbb/parallel_for.h"
+#include "tbb/parallel_invoke.h"
+
+namespace moonlight
+{
+
+constexpr unsigned TLAS_BIN_COUNT = 16;
+// Subtrees with at least this many instances are built as TBB tasks
+constexpr unsigned TLAS_PARALLEL_THRESHOLD = 1024;
+constexpr unsigned TLAS_GRAIN_SIZE = 4096;
+
+using vec3f = Vector3<float>;
+
+Transform3x4 Transform3x4::identity()
+{
+    return translation(vec3f(0.f));
+}
+
+Transform3x4 Transform3x4::translation(const vec3f& t)
+{
+    Transform3x4 result = {{
+        { 1.f, 0.f, 0.f, t.x },
+        { 0.f, 1.f, 0.f, t.y },
+        { 0.f, 0.f, 1.f, t.z }
+    }};
+    return result;
+}
+
+vec3f Transform3x4::transform_point(const vec3f& p) const
+{
+    return vec3f(
+        m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+        m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+        m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]
+    );
+}
+
+vec3f Transform3x4::transform_vector(const vec3f& v) const
+{
+    return vec3f(
+        m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+        m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+        m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z
+    );
+}
+
+vec3f Transform3x4::transform_normal(const vec3f& n) const
+{
+    return vec3f(
+        m[0][0] * n.x + m[1][0] * n.y + m[2][0] * n.z,
+        m[0][1] * n.x + m[1][1] * n.y + m[2][1] * n.z,
+        m[0][2] * n.x + m[1][2] * n.y + m[2][2] * n.z
+    );
+}
+
+Transform3x4 Transform3x4::inverse() const
+{
+    // Inverse of the linear part via cofactors, the translation follows as -A^-1 * t
+    Transform3x4 inv;
+    inv.m[0][0] = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+    inv.m[0][1] = m[0][2] * m[2][1] - m[0][1] * m[2][2];
+    inv.m[0][2] = m[0][1] * m[1][2] - m[0][2] * m[1][1];
+    inv.m[1][0] = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+    inv.m[1][1] = m[0][0] * m[2][2] - m[0][2] * m[2][0];
+    inv.m[1][2] = m[0][2] * m[1][0] - m[0][0] * m[1][2];
+    inv.m[2][0] = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+    inv.m[2][1] = m[0][1] * m[2][0] - m[0][0] * m[2][1];
+    inv.m[2][2] = m[0][0] * m[1][1] - m[0][1] * m[1][0];
+
+    const float det = m[0][0] * inv.m[0][0] + m[0][1] * inv.m[1][0] + m[0][2] * inv.m[2][0];
+    const float inv_det = 1.f / det;
+
+    for (int i = 0; i < 3; ++i)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            inv.m[i][j] *= inv_det;
+        }
+    }
+
+    for (int i = 0; i < 3; ++i)
+    {
+        inv.m[i][3] = -(inv.m[i][0] * m[0][3] + inv.m[i][1] * m[1][3] + inv.m[i][2] * m[2][3]);
+    }
+
+    return inv;
+}
+
+// World space bounds of the box @bmin, @bmax under @t, see Arvo,
+// "Transforming Axis-Aligned Bounding Boxes", Graphics Gems 1990
+static AABB transform_aabb(const Transform3x4& t, const vec3f& bmin, const vec3f& bmax)
+{
+    const vec3f center = (bmin + bmax) * 0.5f;
+    const vec3f extent = (bmax - bmin) * 0.5f;
+
+    const vec3f world_center = t.transform_point(center);
+    vec3f world_extent;
+    for (int i = 0; i < 3; ++i)
+    {
+        world_extent[i] =
+            std::abs(t.m[i][0]) * extent.x +
+            std::abs(t.m[i][1]) * extent.y +
+            std::abs(t.m[i][2]) * extent.z;
+    }
+
+    AABB result;
+    result.bmin = world_center - world_extent;
+    result.bmax = world_center + world_extent;
+    return result;
+}
+
+void TLAS::build(const std::vector<BVHInstance>& instances)
+{
+    const uint32_t n_instances = instances.size();
+
+    m_instances = instances;
+    m_world_to_object.resize(n_instances);
+    m_instance_bounds.resize(n_instances);
+    m_instance_centers.resize(n_instances);
+    m_instance_idx.resize(n_instances);
+
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, n_instances, TLAS_GRAIN_SIZE),
+        [&](const tbb::blocked_range<uint32_t>& r)
+        {
+            for (uint32_t i = r.begin(); i < r.end(); ++i)
+            {
+                const BVHInstance& instance = m_instances[i];
+                const BVHNode& blas_root = instance.blas->get_raw_nodes()[0];
+
+                m_world_to_object[i] = instance.object_to_world.inverse();
+                m_instance_bounds[i] = transform_aabb(
+                    instance.object_to_world, blas_root.aabbmin, blas_root.aabbmax
+                );
+                m_instance_centers[i] = aabb_center(m_instance_bounds[i]);
+                m_instance_idx[i] = i;
+            }
+        }
+    );
+
+    m_nodes.assign(n_instances > 0 ? n_instances * 2 - 1 : 0, BVHNode());
+    m_nodes_used = 0;
+    if (n_instances == 0)
+    {
+        return;
+    }
+
+    BVHNode& root = m_nodes[0];
+    root.left_first = 0;
+    root.tri_count = n_instances;
+    m_nodes_used = 1;
+
+    update_node_bounds(0);
+    sub_divide(0, 0);
+}
+
+void TLAS::update_node_bounds(uint32_t node_idx)
+{
+    BVHNode& node = m_nodes[node_idx];
+    for (uint32_t i = 0; i < node.tri_count; ++i)
+    {
+        const AABB& bounds = m_instance_bounds[m_instance_idx[node.left_first + i]];
+        node.aabbmin = cwise_min(&node.aabbmin, &bounds.bmin);
+        node.aabbmax = cwise_max(&node.aabbmax, &bounds.bmax);
+    }
+}
+
+void TLAS::sub_divide(uint32_t node_idx, uint32_t depth)
+{
+    BVHNode& node = m_nodes[node_idx];
+    if (node.tri_count <= 1)
+    {
+        return;
+    }
+
+    const uint32_t first = node.left_first;
+    const uint32_t last = node.left_first + node.tri_count;
+
+    AABB centroid_bounds;
+    for (uint32_t i = first; i < last; ++i)
+    {
+        const vec3f& center = m_instance_centers[m_instance_idx[i]];
+        centroid_bounds.bmin = cwise_min(&centroid_bounds.bmin, &center);
+        centroid_bounds.bmax = cwise_max(&centroid_bounds.bmax, &center);
+    }
+
+    // Binned SAH along the axis with the largest spread of instance centers.
+    // Binning one axis instead of three keeps per frame rebuilds cheap, and the
+    // child bounds fall out of the bins without another pass.
+    const vec3f extent = centroid_bounds.bmax - centroid_bounds.bmin;
+    int axis = 0;
+    if (extent.y > extent[axis]) axis = 1;
+    if (extent.z > extent[axis]) axis = 2;
+
+    // All centers coincide, there is nothing to split
+    if (extent[axis] <= 0.f)
+    {
+        return;
+    }
+
+    // SAH splits may cut off one instance at a time, say from a cluster with a
+    // few distant outliers. Once the levels left until BVH_MAX_DEPTH only just
+    // suffice for a balanced tree, the instances are split at their median.
+    if (depth + (uint32_t)std::bit_width(node.tri_count - 1) >= BVH_MAX_DEPTH)
+    {
+        const uint32_t mid = first + node.tri_count / 2;
+        std::nth_element(
+            m_instance_idx.begin() + first, m_instance_idx.begin() + mid, m_instance_idx.begin() + last,
+            [&](uint32_t a, uint32_t b) { return m_instance_centers[a][axis] < m_instance_centers[b][axis]; }
+        );
+
+        const uint32_t left_child_idx = m_nodes_used.fetch_add(2);
+        m_nodes[left_child_idx].left_first = first;
+        m_nodes[left_child_idx].tri_count = mid - first;
+        m_nodes[left_child_idx + 1].left_first = mid;
+        m_nodes[left_child_idx + 1].tri_count = last - mid;
+        update_node_bounds(left_child_idx);
+        update_node_bounds(left_child_idx + 1);
+
+        node.left_first = left_child_idx;
+        node.tri_count = 0;
+        sub_divide(left_child_idx, depth + 1);
+        sub_divide(left_child_idx + 1, depth + 1);
+        return;
+    }
+
+    struct Bin
+    {
+        AABB bounds;
+        uint32_t count = 0;
+    };
+
+    Bin bins[TLAS_BIN_COUNT];
+    const float axis_min = centroid_bounds.bmin[axis];
+    const float scale = TLAS_BIN_COUNT / extent[axis];
+    auto bin_index = [&](uint32_t instance_idx)
+    {
+        return std::min(
+            TLAS_BIN_COUNT - 1,
+            (unsigned)((m_instance_centers[instance_idx][axis] - axis_min) * scale)
+        );
+    };
+
+    for (uint32_t i = first; i < last; ++i)
+    {
+        const uint32_t instance_idx = m_instance_idx[i];
+        const AABB& bounds = m_instance_bounds[instance_idx];
+        Bin& bin = bins[bin_index(instance_idx)];
+        bin.count++;
+        bin.bounds.bmin = cwise_min(&bin.bounds.bmin, &bounds.bmin);
+        bin.bounds.bmax = cwise_max(&bin.bounds.bmax, &bounds.bmax);
+    }
+
+    // Sweep from both sides to get the cost of all bin boundaries
+    AABB left_boxes[TLAS_BIN_COUNT - 1];
+    uint32_t left_counts[TLAS_BIN_COUNT - 1];
+    AABB box;
+    uint32_t count = 0;
+    for (unsigned i = 0; i < TLAS_BIN_COUNT - 1; ++i)
+    {
+        count += bins[i].count;
+        aabb_extend(&box, &bins[i].bounds);
+        left_counts[i] = count;
+        left_boxes[i] = box;
+    }
+
+    float best_cost = std::numeric_limits<float>::max();
+    unsigned best_split = 0;
+    AABB best_right_box;
+    box = AABB();
+    count = 0;
+    for (unsigned i = TLAS_BIN_COUNT - 1; i > 0; --i)
+    {
+        count += bins[i].count;
+        aabb_extend(&box, &bins[i].bounds);
+        if (left_counts[i - 1] == 0 || count == 0)
+        {
+            continue;
+        }
+
+        const float cost = left_counts[i - 1] * aabb_area(left_boxes[i - 1]) + count * aabb_area(box);
+        if (cost < best_cost)
+        {
+            best_cost = cost;
+            best_split = i;
+            best_right_box = box;
+        }
+    }
+
+    // Instances are split as far as possible, entering one costs a transform
+    // on top of the traversal of its BVH.
+    if (best_split == 0)
+    {
+        return;
+    }
+
+    uint32_t i = first;
+    uint32_t j = last;
+    while (i < j)
+    {
+        if (bin_index(m_instance_idx[i]) < best_split)
+        {
+            ++i;
+        }
+        else
+        {
+            std::swap(m_instance_idx[i], m_instance_idx[--j]);
+        }
+    }
+
+    const uint32_t left_child_idx = m_nodes_used.fetch_add(2);
+    const uint32_t right_child_idx = left_child_idx + 1;
+
+    BVHNode& left = m_nodes[left_child_idx];
+    left.left_first = first;
+    left.tri_count = i - first;
+    left.aabbmin = left_boxes[best_split - 1].bmin;
+    left.aabbmax = left_boxes[best_split - 1].bmax;
+
+    BVHNode& right = m_nodes[right_child_idx];
+    right.left_first = i;
+    right.tri_count = last - i;
+    right.aabbmin = best_right_box.bmin;
+    right.aabbmax = best_right_box.bmax;
+
+    const uint32_t instance_count = node.tri_count;
+    node.left_first = left_child_idx;
+    node.tri_count = 0;
+
+    if (instance_count >= TLAS_PARALLEL_THRESHOLD)
+    {
+        tbb::parallel_invoke(
+            [&]() { sub_divide(left_child_idx, depth + 1); },
+            [&]() { sub_divide(right_child_idx, depth + 1); }
+        );
+    }
+    else
+    {
+        sub_divide(left_child_idx, depth + 1);
+        sub_divide(right_child_idx, depth + 1);
+    }
+}
+
+Ray TLAS::to_object_space(const Ray& ray, uint32_t instance_idx) const
+{
+    // The direction is deliberately not normalized, that way distances along
+    // the ray are the same in world and object space.
+    const Transform3x4& world_to_object = m_world_to_object[instance_idx];
+    return Ray(world_to_object.transform_point(ray.o), world_to_object.transform_vector(ray.d));
+}
+
+IntersectionParams TLAS::intersect(Ray& ray) const
+{
+    IntersectionParams intersect;
+    if (m_nodes_used == 0 ||
+        ray_intersects_aabb(m_nodes[0].aabbmin, m_nodes[0].aabbmax, ray) == std::numeric_limits<float>::max())
+    {
+        return intersect;
+    }
+
+    const BVHNode* node = &m_nodes[0];
+    const BVHNode* stack[BVH_STACK_SIZE];
+    float stack_dist[BVH_STACK_SIZE];
+    unsigned stack_ptr = 0;
+
+    // Skips stack entries that lie behind the closest hit found so far
+    auto pop = [&]() -> const BVHNode*
+    {
+        while (stack_ptr > 0)
+        {
+            --stack_ptr;
+            if (stack_dist[stack_ptr] < intersect.t)
+            {
+                return stack[stack_ptr];
+            }
+        }
+
+        return nullptr;
+    };
+
+    while (true)
+    {
+        if (node->is_leaf())
+        {
+            for (uint32_t i = 0; i < node->tri_count; ++i)
+            {
+                const uint32_t instance_idx = m_instance_idx[node->left_first + i];
+                const BVHInstance& instance = m_instances[instance_idx];
+
+                Ray object_ray = to_object_space(ray, instance_idx);
+                const IntersectionParams instance_intersect =
+                    instance.blas->intersect(object_ray, instance.tris, instance.stride);
+
+                if (instance_intersect.t < intersect.t && instance_intersect.t > 0.f)
+                {
+                    intersect = instance_intersect;
+                    intersect.instance_idx = instance_idx;
+                    ray.t = instance_intersect.t;
+                }
+            }
+
+            node = pop();
+            if (node == nullptr)
+            {
+                break;
+            }
+
+            continue;
+        }
+
+        const BVHNode* child1 = &m_nodes[node->left_first];
+        const BVHNode* child2 = &m_nodes[node->left_first + 1];
+        float dist1 = ray_intersects_aabb(child1->aabbmin, child1->aabbmax, ray);
+        float dist2 = ray_intersects_aabb(child2->aabbmin, child2->aabbmax, ray);
+
+        if (dist1 > dist2)
+        {
+            std::swap(dist1, dist2);
+            std::swap(child1, child2);
+        }
+
+        if (dist1 >= intersect.t)
+        {
+            node = pop();
+            if (node == nullptr)
+            {
+                break;
+            }
+        }
+        else
+        {
+            node = child1;
+            if (dist2 < intersect.t)
+            {
+                stack[stack_ptr] = child2;
+                stack_dist[stack_ptr++] = dist2;
+            }
+        }
+    }
+
+    if (intersect.is_intersection())
+    {
+        // The bottom level computed the normal in object space
+        const Transform3x4& world_to_object = m_world_to_object[intersect.instance_idx];
+        intersect.normal = normalize(world_to_object.transform_normal(intersect.normal));
+    }
+
+    return intersect;
+}
+
+bool TLAS::occluded(const Ray& ray, float tmax) const
+{
+    if (m_nodes_used == 0)
+    {
+        return false;
+    }
+
+    const BVHNode* stack[BVH_STACK_SIZE];
+    unsigned stack_ptr = 0;
+    stack[stack_ptr++] = &m_nodes[0];
+
+    while (stack_ptr > 0)
+    {
+        const BVHNode* node = stack[--stack_ptr];
+        if (ray_intersects_aabb(node->aabbmin, node->aabbmax, ray) >= tmax)
+        {
+            continue;
+        }
+
+        if (node->is_leaf())
+        {
+            for (uint32_t i = 0; i < node->tri_count; ++i)
+            {
+                const uint32_t instance_idx = m_instance_idx[node->left_first + i];
+                const BVHInstance& instance = m_instances[instance_idx];
+
+                const Ray object_ray = to_object_space(ray, instance_idx);
+                if (instance.blas->occluded(object_ray, instance.tris, instance.stride, tmax))
+                {
+                    return true;
+                }
+            }
+        }
+        else
+        {
+            stack[stack_ptr++] = &m_nodes[node->left_first + 1];
+            stack[stack_ptr++] = &m_nodes[node->left_first];
+        }
+    }
+
+    return false;
+}
+
+}
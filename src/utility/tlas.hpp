@@ -0,0 +1,94 @@
+#pragma once
+#include "bvh.hpp"
+#include <atomic>
+#include <vector>
+
+namespace moonlight
+{
+
+// Affine transform stored as the upper three rows of a 4x4 row-major matrix.
+// Points are transformed as M * (x, y, z, 1), directions as M * (x, y, z, 0).
+struct Transform3x4
+{
+    static Transform3x4 identity();
+    static Transform3x4 translation(const Vector3<float>& t);
+
+    Vector3<float> transform_point(const Vector3<float>& p) const;
+    Vector3<float> transform_vector(const Vector3<float>& v) const;
+    // Transforms a normal by the inverse transpose of the linear part, this
+    // has to be called on the inverse transform.
+    Vector3<float> transform_normal(const Vector3<float>& n) const;
+
+    Transform3x4 inverse() const;
+
+    float m[3][4];
+};
+
+// One placement of a shared bottom-level BVH. The BVH and the mesh it was built
+// over are only referenced, so any number of instances can share them.
+struct BVHInstance
+{
+    Transform3x4 object_to_world;
+    const BVH* blas = nullptr;
+    const float* tris = nullptr;
+    uint64_t stride = 0;
+};
+
+// Top-level acceleration structure over instances of bottom-level BVHs. Rays
+// are transformed into object space when they enter an instance, so memory
+// scales with the unique geometry rather than with the instance count.
+// The tree only stores one box per instance and is meant to be rebuilt
+// whenever instances move, typically every frame.
+class TLAS
+{
+public:
+
+    // Builds the top level over @instances, which are copied
+    void build(const std::vector<BVHInstance>& instances);
+
+    // Finds the closest hit over all instances. The normal is returned in world
+    // space and IntersectionParams::instance_idx identifies the instance, whose
+    // mesh triangle_idx refers to.
+    IntersectionParams intersect(Ray& ray) const;
+
+    // Any hit query, see BVH::occluded
+    bool occluded(const Ray& ray, float tmax) const;
+
+    const BVHInstance& get_instance(uint32_t instance_idx) const
+    {
+        return m_instances[instance_idx];
+    }
+
+    uint32_t get_num_instances() const
+    {
+        return m_instances.size();
+    }
+
+    uint32_t get_nodes_used() const
+    {
+        return m_nodes_used;
+    }
+
+private:
+
+    // @depth of the node, the tree stays within BVH_MAX_DEPTH levels
+    void sub_divide(uint32_t node_idx, uint32_t depth);
+
+    void update_node_bounds(uint32_t node_idx);
+
+    Ray to_object_space(const Ray& ray, uint32_t instance_idx) const;
+
+private:
+
+    std::vector<BVHInstance> m_instances;
+    std::vector<Transform3x4> m_world_to_object;
+    // World space bounds and centroids of the instances
+    std::vector<AABB> m_instance_bounds;
+    std::vector<Vector3<float>> m_instance_centers;
+
+    std::vector<BVHNode> m_nodes;
+    std::vector<uint32_t> m_instance_idx;
+    std::atomic<uint32_t> m_nodes_used = 0;
+};
+
+}
@@ -0,0 +1,332 @@
+#include "triangle_block.hpp"
+#include "cpu_features.hpp"
+#include "simd.hpp"
+#include <bit>
+
+namespace moonlight
+{
+
+using simd::float4;
+using simd::float8;
+using simd::float16;
+
+constexpr unsigned VERT_PER_TRIANGLE = 3;
+constexpr unsigned MATERIAL_INDEX_SIZE = 1;
+// Same epsilon as ray_hit_triangle, so both paths accept the same hits
+constexpr float PARALLEL_EPSILON = 1e-4f;
+
+template<uint32_t N>
+uint32_t append_triangle_blocks(
+    std::vector<TriangleBlock<N>>& blocks,
+    const uint32_t* tri_idx, uint32_t first, uint32_t count,
+    const float* tris, const uint64_t stride)
+{
+    const unsigned triangle_size =
+        stride * VERT_PER_TRIANGLE + VERT_PER_TRIANGLE + MATERIAL_INDEX_SIZE;
+
+    const uint32_t first_block = blocks.size();
+    const uint32_t n_blocks = (count + N - 1) / N;
+    blocks.resize(blocks.size() + n_blocks, TriangleBlock<N>{});
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        TriangleBlock<N>& block = blocks[first_block + i / N];
+        const uint32_t lane = i % N;
+
+        const uint32_t triangle_pos = tri_idx[first + i] * triangle_size;
+        const float* v0 = &tris[triangle_pos];
+        const float* v1 = &tris[triangle_pos + stride];
+        const float* v2 = &tris[triangle_pos + stride * 2];
+
+        block.v0x[lane] = v0[0];
+        block.v0y[lane] = v0[1];
+        block.v0z[lane] = v0[2];
+        block.e1x[lane] = v1[0] - v0[0];
+        block.e1y[lane] = v1[1] - v0[1];
+        block.e1z[lane] = v1[2] - v0[2];
+        block.e2x[lane] = v2[0] - v0[0];
+        block.e2y[lane] = v2[1] - v0[1];
+        block.e2z[lane] = v2[2] - v0[2];
+        block.triangle_pos[lane] = triangle_pos;
+    }
+
+    return first_block;
+}
+
+// Moeller-Trumbore test of one ray against the lanes [first, first + F::width)
+// of a block. Returns a bit mask of the triangles hit in (0, tmax), their
+// distances and barycentrics are written to @t, @u and @v.
+template<typename F, uint32_t N>
+ML_SIMD_INLINE uint32_t intersect_lanes(
+    const TriangleBlock<N>& block, uint32_t first, const Ray& ray, float tmax,
+    float* t_out, float* u_out, float* v_out)
+{
+    const F dx = F::set1(ray.d.x);
+    const F dy = F::set1(ray.d.y);
+    const F dz = F::set1(ray.d.z);
+
+    const F e1x = F::load(&block.e1x[first]);
+    const F e1y = F::load(&block.e1y[first]);
+    const F e1z = F::load(&block.e1z[first]);
+    const F e2x = F::load(&block.e2x[first]);
+    const F e2y = F::load(&block.e2y[first]);
+    const F e2z = F::load(&block.e2z[first]);
+
+    // q = d x e2
+    const F qx = dy * e2z - dz * e2y;
+    const F qy = dz * e2x - dx * e2z;
+    const F qz = dx * e2y - dy * e2x;
+
+    const F a = e1x * qx + e1y * qy + e1z * qz;
+    auto mask = abs(a) >= F::set1(PARALLEL_EPSILON);
+    if (!mask.any())
+    {
+        return 0;
+    }
+
+    const F f = F::set1(1.f) / a;
+
+    const F sx = F::set1(ray.o.x) - F::load(&block.v0x[first]);
+    const F sy = F::set1(ray.o.y) - F::load(&block.v0y[first]);
+    const F sz = F::set1(ray.o.z) - F::load(&block.v0z[first]);
+
+    const F u = f * (sx * qx + sy * qy + sz * qz);
+
+    // r = s x e1
+    const F rx = sy * e1z - sz * e1y;
+    const F ry = sz * e1x - sx * e1z;
+    const F rz = sx * e1y - sy * e1x;
+
+    const F v = f * (dx * rx + dy * ry + dz * rz);
+    const F t = f * (e2x * rx + e2y * ry + e2z * rz);
+
+    const F zero = F::zero();
+    mask = mask & (u >= zero) & (v >= zero) & (u + v <= F::set1(1.f));
+    mask = mask & (t > zero) & (t < F::set1(tmax));
+
+    t.store(t_out);
+    u.store(u_out);
+    v.store(v_out);
+    return mask.bits();
+}
+
+// Tests a whole block, in chunks if it is wider than F
+template<typename F, uint32_t N>
+ML_SIMD_INLINE uint32_t intersect_block(
+    const TriangleBlock<N>& block, const Ray& ray, float tmax,
+    float* t, float* u, float* v)
+{
+    uint32_t hit_mask = 0;
+    for (uint32_t first = 0; first < N; first += F::width)
+    {
+        hit_mask |= intersect_lanes<F>(
+            block, first, ray, tmax, &t[first], &u[first], &v[first]
+        ) << first;
+    }
+
+    return hit_mask;
+}
+
+template<typename F, uint32_t N>
+ML_SIMD_INLINE bool closest_hit(
+    const TriangleBlock<N>* blocks, uint32_t n_triangles,
+    Ray& ray, IntersectionParams& intersect)
+{
+    const uint32_t n_blocks = (n_triangles + N - 1) / N;
+
+    const TriangleBlock<N>* best_block = nullptr;
+    uint32_t best_lane = 0;
+    float best_t = intersect.t;
+    float best_u = 0.f;
+    float best_v = 0.f;
+
+    for (uint32_t b = 0; b < n_blocks; ++b)
+    {
+        alignas(64) float t[N];
+        alignas(64) float u[N];
+        alignas(64) float v[N];
+        uint32_t hit_mask = intersect_block<F>(blocks[b], ray, best_t, t, u, v);
+
+        while (hit_mask)
+        {
+            const uint32_t lane = std::countr_zero(hit_mask);
+            hit_mask &= hit_mask - 1;
+
+            if (t[lane] < best_t)
+            {
+                best_block = &blocks[b];
+                best_lane = lane;
+                best_t = t[lane];
+                best_u = u[lane];
+                best_v = v[lane];
+            }
+        }
+    }
+
+    if (best_block == nullptr)
+    {
+        return false;
+    }
+
+    const Vector3<float> e1(
+        best_block->e1x[best_lane], best_block->e1y[best_lane], best_block->e1z[best_lane]);
+    const Vector3<float> e2(
+        best_block->e2x[best_lane], best_block->e2y[best_lane], best_block->e2z[best_lane]);
+
+    intersect = IntersectionParams();
+    intersect.t = best_t;
+    intersect.u = best_u;
+    intersect.v = best_v;
+    intersect.triangle_idx = best_block->triangle_pos[best_lane];
+    intersect.set_face_normal(ray.d, normalize(cross(e1, e2)));
+    ray.t = best_t;
+
+    return true;
+}
+
+template<typename F, uint32_t N>
+ML_SIMD_INLINE bool any_hit(
+    const TriangleBlock<N>* blocks, uint32_t n_triangles,
+    const Ray& ray, float tmax)
+{
+    const uint32_t n_blocks = (n_triangles + N - 1) / N;
+
+    for (uint32_t b = 0; b < n_blocks; ++b)
+    {
+        alignas(64) float t[N];
+        alignas(64) float u[N];
+        alignas(64) float v[N];
+        if (intersect_block<F>(blocks[b], ray, tmax, t, u, v))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Entry points per instruction set, see ML_SIMD_INLINE
+
+template<uint32_t N>
+static bool closest_hit_sse(
+    const TriangleBlock<N>* blocks, uint32_t n_triangles, Ray& ray, IntersectionParams& intersect)
+{
+    return closest_hit<float4>(blocks, n_triangles, ray, intersect);
+}
+
+template<uint32_t N>
+ML_TARGET_AVX2 static bool closest_hit_avx2(
+    const TriangleBlock<N>* blocks, uint32_t n_triangles, Ray& ray, IntersectionParams& intersect)
+{
+    return closest_hit<float8>(blocks, n_triangles, ray, intersect);
+}
+
+template<uint32_t N>
+ML_TARGET_AVX512 static bool closest_hit_avx512(
+    const TriangleBlock<N>* blocks, uint32_t n_triangles, Ray& ray, IntersectionParams& intersect)
+{
+    return closest_hit<float16>(blocks, n_triangles, ray, intersect);
+}
+
+template<uint32_t N>
+static bool any_hit_sse(
+    const TriangleBlock<N>* blocks, uint32_t n_triangles, const Ray& ray, float tmax)
+{
+    return any_hit<float4>(blocks, n_triangles, ray, tmax);
+}
+
+template<uint32_t N>
+ML_TARGET_AVX2 static bool any_hit_avx2(
+    const TriangleBlock<N>* blocks, uint32_t n_triangles, const Ray& ray, float tmax)
+{
+    return any_hit<float8>(blocks, n_triangles, ray, tmax);
+}
+
+template<uint32_t N>
+ML_TARGET_AVX512 static bool any_hit_avx512(
+    const TriangleBlock<N>* blocks, uint32_t n_triangles, const Ray& ray, float tmax)
+{
+    return any_hit<float16>(blocks, n_triangles, ray, tmax);
+}
+
+// Widest instruction set the host supports whose registers are not wider
+// than a block of N triangles
+template<uint32_t N>
+static SimdLevel block_simd_level()
+{
+    const SimdLevel level = simd_level();
+    if (N % float16::width == 0 && level >= SimdLevel::AVX512)
+    {
+        return SimdLevel::AVX512;
+    }
+    if (N % float8::width == 0 && level >= SimdLevel::AVX2)
+    {
+        return SimdLevel::AVX2;
+    }
+    return SimdLevel::SSE;
+}
+
+template<uint32_t N>
+bool intersect_triangle_blocks(
+    const TriangleBlock<N>* blocks, uint32_t n_triangles,
+    Ray& ray, IntersectionParams& intersect)
+{
+    static const SimdLevel level = block_simd_level<N>();
+
+    if constexpr (N % float16::width == 0)
+    {
+        if (level == SimdLevel::AVX512)
+        {
+            return closest_hit_avx512(blocks, n_triangles, ray, intersect);
+        }
+    }
+    if constexpr (N % float8::width == 0)
+    {
+        if (level == SimdLevel::AVX2)
+        {
+            return closest_hit_avx2(blocks, n_triangles, ray, intersect);
+        }
+    }
+    return closest_hit_sse(blocks, n_triangles, ray, intersect);
+}
+
+template<uint32_t N>
+bool occluded_triangle_blocks(
+    const TriangleBlock<N>* blocks, uint32_t n_triangles,
+    const Ray& ray, float tmax)
+{
+    static const SimdLevel level = block_simd_level<N>();
+
+    if constexpr (N % float16::width == 0)
+    {
+        if (level == SimdLevel::AVX512)
+        {
+            return any_hit_avx512(blocks, n_triangles, ray, tmax);
+        }
+    }
+    if constexpr (N % float8::width == 0)
+    {
+        if (level == SimdLevel::AVX2)
+        {
+            return any_hit_avx2(blocks, n_triangles, ray, tmax);
+        }
+    }
+    return any_hit_sse(blocks, n_triangles, ray, tmax);
+}
+
+template uint32_t append_triangle_blocks<4>(
+    std::vector<TriangleBlock<4>>&, const uint32_t*, uint32_t, uint32_t, const float*, const uint64_t);
+template uint32_t append_triangle_blocks<8>(
+    std::vector<TriangleBlock<8>>&, const uint32_t*, uint32_t, uint32_t, const float*, const uint64_t);
+template uint32_t append_triangle_blocks<16>(
+    std::vector<TriangleBlock<16>>&, const uint32_t*, uint32_t, uint32_t, const float*, const uint64_t);
+
+template bool intersect_triangle_blocks<4>(const TriangleBlock<4>*, uint32_t, Ray&, IntersectionParams&);
+template bool intersect_triangle_blocks<8>(const TriangleBlock<8>*, uint32_t, Ray&, IntersectionParams&);
+template bool intersect_triangle_blocks<16>(const TriangleBlock<16>*, uint32_t, Ray&, IntersectionParams&);
+
+template bool occluded_triangle_blocks<4>(const TriangleBlock<4>*, uint32_t, const Ray&, float);
+template bool occluded_triangle_blocks<8>(const TriangleBlock<8>*, uint32_t, const Ray&, float);
+template bool occluded_triangle_blocks<16>(const TriangleBlock<16>*, uint32_t, const Ray&, float);
+
+}
\ No newline at end of file
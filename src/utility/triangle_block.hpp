@@ -0,0 +1,63 @@
+#pragma once
+#include "../collision/ray.hpp"
+#include <cstdint>
+#include <vector>
+
+// Leaves are intersected with the SIMD triangle block kernel. Define as 0 to
+// fall back to testing one triangle at a time with ray_hit_triangle.
+#ifndef ML_BVH_SIMD_LEAVES
+#define ML_BVH_SIMD_LEAVES 1
+#endif
+
+// Triangles per leaf block: 4, 8 or 16. The kernel runs with the widest
+// registers the host offers up to the block width (see simd_level), narrower
+// hosts test a block in several steps.
+#ifndef ML_BVH_LEAF_BLOCK_WIDTH
+#define ML_BVH_LEAF_BLOCK_WIDTH 8
+#endif
+
+namespace moonlight
+{
+
+// N triangles of a BVH leaf in SoA form, with the edges precomputed so that the
+// intersection kernel does not have to touch the strided mesh at all.
+// Unused lanes are zero, a degenerate triangle that never hits.
+template<uint32_t N>
+struct alignas(N >= 16 ? 64 : 32) TriangleBlock
+{
+    float v0x[N], v0y[N], v0z[N];
+    // e1 = v1 - v0, e2 = v2 - v0
+    float e1x[N], e1y[N], e1z[N];
+    float e2x[N], e2y[N], e2z[N];
+    // Offset of the triangle in the mesh, this ends up in IntersectionParams::triangle_idx
+    uint32_t triangle_pos[N];
+};
+
+using LeafTriangleBlock = TriangleBlock<ML_BVH_LEAF_BLOCK_WIDTH>;
+
+// Packs the @count triangles referenced by tri_idx[first..first + count) into
+// consecutive blocks appended to @blocks. Returns the index of the first block.
+template<uint32_t N>
+uint32_t append_triangle_blocks(
+    std::vector<TriangleBlock<N>>& blocks,
+    const uint32_t* tri_idx, uint32_t first, uint32_t count,
+    const float* tris, const uint64_t stride
+);
+
+// Finds the closest hit among the @n_triangles triangles stored in @blocks that
+// lies in front of intersect.t. On a hit @intersect and ray.t are updated; the
+// normal is only computed for the triangle that wins.
+template<uint32_t N>
+bool intersect_triangle_blocks(
+    const TriangleBlock<N>* blocks, uint32_t n_triangles,
+    Ray& ray, IntersectionParams& intersect
+);
+
+// Returns true if any of the @n_triangles triangles in @blocks is hit closer than @tmax
+template<uint32_t N>
+bool occluded_triangle_blocks(
+    const TriangleBlock<N>* blocks, uint32_t n_triangles,
+    const Ray& ray, float tmax
+);
+
+}
\ No newline at end of file
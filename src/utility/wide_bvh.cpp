@@ -0,0 +1,442 @@
+#include "wide_bvh.hpp"
+#include "cpu_features.hpp"
+#include "simd.hpp"
+#include <bit>
+
+namespace moonlight
+{
+
+using simd::float4;
+using simd::float8;
+
+static float node_area(const BVHNode& node)
+{
+    Vector3<float> e = node.aabbmax - node.aabbmin;
+    return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+template<uint32_t N>
+void WideBVH<N>::collapse(const BVH& bvh)
+{
+    const BVHNode* binary_nodes = bvh.get_raw_nodes();
+    m_tri_idx = bvh.get_raw_indices();
+    m_leaf_blocks = bvh.get_leaf_blocks();
+
+    m_nodes.clear();
+    m_nodes.reserve(bvh.get_nodes_used() / (N - 1) + 1);
+    m_nodes.emplace_back();
+
+    if (binary_nodes[0].is_leaf())
+    {
+        // Degenerate case, the whole mesh sits in one leaf. Wrap it in a
+        // wide node with a single occupied slot.
+        WideBVHNode<N>& root = m_nodes[0];
+        for (uint32_t i = 0; i < N; ++i)
+        {
+            root.bmin_x[i] = root.bmin_y[i] = root.bmin_z[i] = std::numeric_limits<float>::infinity();
+            root.bmax_x[i] = root.bmax_y[i] = root.bmax_z[i] = -std::numeric_limits<float>::infinity();
+            root.child[i] = 0;
+            root.tri_count[i] = 0;
+        }
+
+        root.bmin_x[0] = binary_nodes[0].aabbmin.x;
+        root.bmin_y[0] = binary_nodes[0].aabbmin.y;
+        root.bmin_z[0] = binary_nodes[0].aabbmin.z;
+        root.bmax_x[0] = binary_nodes[0].aabbmax.x;
+        root.bmax_y[0] = binary_nodes[0].aabbmax.y;
+        root.bmax_z[0] = binary_nodes[0].aabbmax.z;
+        root.child[0] = leaf_first(bvh, 0);
+        root.tri_count[0] = binary_nodes[0].tri_count;
+        return;
+    }
+
+    collapse_node(bvh, 0, 0);
+}
+
+template<uint32_t N>
+uint32_t WideBVH<N>::leaf_first(const BVH& bvh, uint32_t binary_idx)
+{
+#if ML_BVH_SIMD_LEAVES
+    return bvh.get_leaf_block_index(binary_idx);
+#else
+    return bvh.get_raw_nodes()[binary_idx].left_first;
+#endif
+}
+
+template<uint32_t N>
+void WideBVH<N>::collapse_node(
+    const BVH& bvh,
+    uint32_t binary_idx,
+    uint32_t wide_idx)
+{
+    const BVHNode* binary_nodes = bvh.get_raw_nodes();
+
+    // Gather up to N descendants of the binary node. We keep opening the inner
+    // child with the largest surface area, since it is the most likely one
+    // to be visited by a ray.
+    uint32_t children[N];
+    uint32_t n_children = 2;
+    children[0] = binary_nodes[binary_idx].left_first;
+    children[1] = binary_nodes[binary_idx].left_first + 1;
+
+    while (n_children < N)
+    {
+        int best_child = -1;
+        float best_area = -1.f;
+        for (uint32_t i = 0; i < n_children; ++i)
+        {
+            const BVHNode& candidate = binary_nodes[children[i]];
+            if (!candidate.is_leaf() && node_area(candidate) > best_area)
+            {
+                best_child = i;
+                best_area = node_area(candidate);
+            }
+        }
+
+        if (best_child == -1)
+        {
+            break;
+        }
+
+        const uint32_t opened = children[best_child];
+        children[best_child] = binary_nodes[opened].left_first;
+        children[n_children++] = binary_nodes[opened].left_first + 1;
+    }
+
+    for (uint32_t i = 0; i < N; ++i)
+    {
+        // m_nodes might reallocate during the recursion, don't hold a reference
+        if (i >= n_children)
+        {
+            WideBVHNode<N>& node = m_nodes[wide_idx];
+            node.bmin_x[i] = node.bmin_y[i] = node.bmin_z[i] = std::numeric_limits<float>::infinity();
+            node.bmax_x[i] = node.bmax_y[i] = node.bmax_z[i] = -std::numeric_limits<float>::infinity();
+            node.child[i] = 0;
+            node.tri_count[i] = 0;
+            continue;
+        }
+
+        const BVHNode& child = binary_nodes[children[i]];
+        {
+            WideBVHNode<N>& node = m_nodes[wide_idx];
+            node.bmin_x[i] = child.aabbmin.x;
+            node.bmin_y[i] = child.aabbmin.y;
+            node.bmin_z[i] = child.aabbmin.z;
+            node.bmax_x[i] = child.aabbmax.x;
+            node.bmax_y[i] = child.aabbmax.y;
+            node.bmax_z[i] = child.aabbmax.z;
+        }
+
+        if (child.is_leaf())
+        {
+            m_nodes[wide_idx].child[i] = leaf_first(bvh, children[i]);
+            m_nodes[wide_idx].tri_count[i] = child.tri_count;
+        }
+        else
+        {
+            const uint32_t child_wide_idx = m_nodes.size();
+            m_nodes.emplace_back();
+            m_nodes[wide_idx].child[i] = child_wide_idx;
+            m_nodes[wide_idx].tri_count[i] = 0;
+            collapse_node(bvh, children[i], child_wide_idx);
+        }
+    }
+}
+
+// Sign based slab test. Picking the near/far plane by the sign of the ray direction
+// instead of using min/max makes boxes with inverted bounds (the empty slots) miss.
+struct WideRay
+{
+    WideRay(const Ray& ray)
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            o[a] = ray.o[a];
+            invd[a] = ray.invd[a];
+            negative[a] = ray.invd[a] < 0.f;
+        }
+    }
+
+    float o[3];
+    float invd[3];
+    bool negative[3];
+};
+
+// Slab test of the children [first, first + F::width) of a node. Returns a bit
+// mask of the children hit in [0, tmax] and writes their entry distances to @dist.
+template<typename F, uint32_t N>
+ML_SIMD_INLINE uint32_t intersect_children(
+    const WideBVHNode<N>& node, uint32_t first, const WideRay& ray, float tmax, float* dist)
+{
+    const float* bmin[3] = { node.bmin_x, node.bmin_y, node.bmin_z };
+    const float* bmax[3] = { node.bmax_x, node.bmax_y, node.bmax_z };
+
+    F tnear = F::zero();
+    F tfar = F::set1(tmax);
+    for (int a = 0; a < 3; ++a)
+    {
+        const float* near_plane = ray.negative[a] ? bmax[a] : bmin[a];
+        const float* far_plane = ray.negative[a] ? bmin[a] : bmax[a];
+        const F o = F::set1(ray.o[a]);
+        const F invd = F::set1(ray.invd[a]);
+
+        const F t0 = (F::load(&near_plane[first]) - o) * invd;
+        const F t1 = (F::load(&far_plane[first]) - o) * invd;
+        tnear = max(t0, tnear);
+        tfar = min(t1, tfar);
+    }
+
+    tnear.storeu(&dist[first]);
+    return (tnear <= tfar).bits();
+}
+
+template<typename F, uint32_t N>
+ML_SIMD_INLINE uint32_t intersect_children(
+    const WideBVHNode<N>& node, const WideRay& ray, float tmax, float* dist)
+{
+    uint32_t hit_mask = 0;
+    for (uint32_t first = 0; first < N; first += F::width)
+    {
+        hit_mask |= intersect_children<F>(node, first, ray, tmax, dist) << first;
+    }
+
+    return hit_mask;
+}
+
+template<uint32_t N>
+static uint32_t intersect_children_sse(
+    const WideBVHNode<N>& node, const WideRay& ray, float tmax, float* dist)
+{
+    return intersect_children<float4>(node, ray, tmax, dist);
+}
+
+template<uint32_t N>
+ML_TARGET_AVX2 static uint32_t intersect_children_avx2(
+    const WideBVHNode<N>& node, const WideRay& ray, float tmax, float* dist)
+{
+    return intersect_children<float8>(node, ray, tmax, dist);
+}
+
+template<uint32_t N>
+using ChildrenTest = uint32_t (*)(const WideBVHNode<N>&, const WideRay&, float, float*);
+
+// Node test with the widest registers the host supports, up to the node width.
+// Picked once per query, 4-wide nodes always use the SSE test, which then
+// inlines into the traversal.
+template<uint32_t N>
+static ChildrenTest<N> select_children_test()
+{
+    if constexpr (N % float8::width == 0)
+    {
+        static const bool avx2 = simd_level() >= SimdLevel::AVX2;
+        if (avx2)
+        {
+            return intersect_children_avx2<N>;
+        }
+    }
+    return intersect_children_sse<N>;
+}
+
+template<uint32_t N>
+IntersectionParams WideBVH<N>::intersect(
+    Ray& ray,
+    const float* tris,
+    const uint64_t stride) const
+{
+#if ML_BVH_SIMD_LEAVES
+    // The leaf blocks hold their own copy of the positions, the layout is unused
+    return intersect(ray, tris, RuntimeVertexLayout((uint32_t)stride));
+#else
+    return dispatch_vertex_layout(stride, [&](const auto& layout)
+    {
+        return intersect(ray, tris, layout);
+    });
+#endif
+}
+
+template<uint32_t N>
+template<uint32_t Stride>
+IntersectionParams WideBVH<N>::intersect(
+    Ray& ray,
+    [[maybe_unused]] const float* tris,
+    [[maybe_unused]] const VertexLayout<Stride>& layout) const
+{
+    struct StackEntry
+    {
+        uint32_t index;
+        uint32_t tri_count;
+        float dist;
+    };
+
+    IntersectionParams intersect;
+
+    const WideRay wide_ray(ray);
+    const ChildrenTest<N> children_test = select_children_test<N>();
+
+    // Every visited node pops one entry and pushes at most N
+    StackEntry stack[BVH_STACK_SIZE * N];
+    unsigned stack_ptr = 0;
+    stack[stack_ptr++] = { 0, 0, 0.f };
+
+    while (stack_ptr > 0)
+    {
+        const StackEntry entry = stack[--stack_ptr];
+
+        // The entry was pushed before a closer hit was found
+        if (entry.dist > ray.t)
+        {
+            continue;
+        }
+
+        if (entry.tri_count > 0)
+        {
+#if ML_BVH_SIMD_LEAVES
+            intersect_triangle_blocks(
+                &m_leaf_blocks[entry.index], entry.tri_count, ray, intersect
+            );
+#else
+            const unsigned triangle_size = layout.triangle_size;
+
+            for (uint32_t i = 0; i < entry.tri_count; ++i)
+            {
+                unsigned triangle_pos = m_tri_idx[entry.index + i] * triangle_size;
+
+                IntersectionParams new_intersect = ray_hit_triangle(
+                    ray, &tris[triangle_pos], layout
+                );
+
+                if (new_intersect.t < intersect.t && new_intersect.t > 0.f)
+                {
+                    intersect = new_intersect;
+                    intersect.triangle_idx = triangle_pos;
+                    ray.t = new_intersect.t;
+                }
+            }
+#endif
+            continue;
+        }
+
+        const WideBVHNode<N>& node = m_nodes[entry.index];
+
+        alignas(32) float dist[N];
+        uint32_t hit_mask = children_test(node, wide_ray, ray.t, dist);
+        if (hit_mask == 0)
+        {
+            continue;
+        }
+
+        // Insertion sort the hit children by distance, far to near. Pushing them in
+        // that order leaves the nearest child on top of the stack.
+        StackEntry hits[N];
+        uint32_t n_hits = 0;
+        while (hit_mask)
+        {
+            const uint32_t i = std::countr_zero(hit_mask);
+            hit_mask &= hit_mask - 1;
+
+            StackEntry hit = { node.child[i], node.tri_count[i], dist[i] };
+            uint32_t k = n_hits++;
+            while (k > 0 && hits[k - 1].dist < hit.dist)
+            {
+                hits[k] = hits[k - 1];
+                --k;
+            }
+            hits[k] = hit;
+        }
+
+        for (uint32_t i = 0; i < n_hits; ++i)
+        {
+            stack[stack_ptr++] = hits[i];
+        }
+    }
+
+    return intersect;
+}
+
+template<uint32_t N>
+bool WideBVH<N>::occluded(
+    const Ray& ray,
+    const float* tris,
+    const uint64_t stride,
+    float tmax) const
+{
+#if ML_BVH_SIMD_LEAVES
+    return occluded(ray, tris, RuntimeVertexLayout((uint32_t)stride), tmax);
+#else
+    return dispatch_vertex_layout(stride, [&](const auto& layout)
+    {
+        return occluded(ray, tris, layout, tmax);
+    });
+#endif
+}
+
+template<uint32_t N>
+template<uint32_t Stride>
+bool WideBVH<N>::occluded(
+    const Ray& ray,
+    [[maybe_unused]] const float* tris,
+    [[maybe_unused]] const VertexLayout<Stride>& layout,
+    float tmax) const
+{
+    struct StackEntry
+    {
+        uint32_t index;
+        uint32_t tri_count;
+    };
+
+    const WideRay wide_ray(ray);
+    const ChildrenTest<N> children_test = select_children_test<N>();
+
+    StackEntry stack[BVH_STACK_SIZE * N];
+    unsigned stack_ptr = 0;
+    stack[stack_ptr++] = { 0, 0 };
+
+    while (stack_ptr > 0)
+    {
+        const StackEntry entry = stack[--stack_ptr];
+
+        if (entry.tri_count > 0)
+        {
+#if ML_BVH_SIMD_LEAVES
+            if (occluded_triangle_blocks(&m_leaf_blocks[entry.index], entry.tri_count, ray, tmax))
+            {
+                return true;
+            }
+#else
+            const unsigned triangle_size = layout.triangle_size;
+
+            for (uint32_t i = 0; i < entry.tri_count; ++i)
+            {
+                unsigned triangle_pos = m_tri_idx[entry.index + i] * triangle_size;
+
+                IntersectionParams its = ray_hit_triangle(ray, &tris[triangle_pos], layout);
+                if (its.t > 0.f && its.t < tmax)
+                {
+                    return true;
+                }
+            }
+#endif
+            continue;
+        }
+
+        const WideBVHNode<N>& node = m_nodes[entry.index];
+
+        // The children are pushed in slot order, sorting them buys nothing
+        // when the traversal stops at the first hit.
+        alignas(32) float dist[N];
+        uint32_t hit_mask = children_test(node, wide_ray, tmax, dist);
+        while (hit_mask)
+        {
+            const uint32_t i = std::countr_zero(hit_mask);
+            hit_mask &= hit_mask - 1;
+            stack[stack_ptr++] = { node.child[i], node.tri_count[i] };
+        }
+    }
+
+    return false;
+}
+
+template class WideBVH<4>;
+template class WideBVH<8>;
+
+}
\ No newline at end of file
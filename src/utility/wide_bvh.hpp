@@ -0,0 +1,101 @@
+#pragma once
+#include "bvh.hpp"
+#include <vector>
+
+namespace moonlight
+{
+
+enum class BVHWidth
+{
+    Binary,
+    Wide4,  // SSE node tests
+    Wide8   // AVX2 node tests, two SSE steps on hosts without AVX2
+};
+
+// A node of an N-wide BVH. The child bounds are stored as SoA, so that all
+// children can be tested against a ray in one SIMD slab test.
+// Empty slots have inverted bounds (bmin = +inf, bmax = -inf) and never hit.
+template<uint32_t N>
+struct alignas(32) WideBVHNode
+{
+    float bmin_x[N];
+    float bmax_x[N];
+    float bmin_y[N];
+    float bmax_y[N];
+    float bmin_z[N];
+    float bmax_z[N];
+
+    // For inner children: index of the child node.
+    // For leaf children: index of the first triangle in the triangle index array,
+    // or of the first triangle block with ML_BVH_SIMD_LEAVES.
+    uint32_t child[N];
+    // Zero for inner children and empty slots.
+    uint32_t tri_count[N];
+};
+
+// Wide BVH that is constructed by collapsing an existing binary BVH.
+// Leaves reference the triangle index array or the leaf blocks of that BVH,
+// which therefore has to outlive this structure.
+template<uint32_t N>
+class WideBVH
+{
+public:
+
+    void collapse(const BVH& bvh);
+
+    IntersectionParams intersect(
+        Ray& ray,
+        const float* tris,
+        const uint64_t stride
+    ) const;
+
+    // Any hit query, see BVH::occluded
+    bool occluded(
+        const Ray& ray,
+        const float* tris,
+        const uint64_t stride,
+        float tmax
+    ) const;
+
+    std::size_t get_num_nodes() const
+    {
+        return m_nodes.size();
+    }
+
+private:
+
+    // Queries for a known layout, see BVH::intersect
+    template<uint32_t Stride>
+    IntersectionParams intersect(
+        Ray& ray,
+        const float* tris,
+        const VertexLayout<Stride>& layout
+    ) const;
+
+    template<uint32_t Stride>
+    bool occluded(
+        const Ray& ray,
+        const float* tris,
+        const VertexLayout<Stride>& layout,
+        float tmax
+    ) const;
+
+    void collapse_node(
+        const BVH& bvh,
+        uint32_t binary_idx,
+        uint32_t wide_idx
+    );
+
+    static uint32_t leaf_first(const BVH& bvh, uint32_t binary_idx);
+
+private:
+
+    std::vector<WideBVHNode<N>> m_nodes;
+    const uint32_t* m_tri_idx = nullptr;
+    const LeafTriangleBlock* m_leaf_blocks = nullptr;
+};
+
+using BVH4 = WideBVH<4>;
+using BVH8 = WideBVH<8>;
+
+}
\ No newline at end of file